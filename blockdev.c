@@ -0,0 +1,486 @@
+#define _GNU_SOURCE
+#include "blockdev.h"
+#include "s.h"
+#include <libudev.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/socket.h>
+#include <sys/sysmacros.h>
+#include <linux/netlink.h>
+
+/* The kernel's multicast group for uevents. udevd sends its own, processed,
+ * on the next one. */
+#define KERNEL_GROUP 1
+
+/* Bursts of events (a hub with a dozen disks) mustn't overflow the socket
+ * before the monitor thread gets to them. */
+#define RCVBUF_SIZE (1 << 20)
+
+#define SCSI_CDROM_MAJOR 11
+
+struct blockdev_source {
+	/* NULL when from the kernel. */
+	struct udev *udev;
+	struct udev_monitor *monitor;
+	int fd;
+};
+
+struct sysattr {
+	struct sysattr *next;
+	char *name, *value;
+};
+
+struct blockdev {
+	unsigned refs;
+	struct blockdev_source *s;
+	struct blockdev *disk;
+	unsigned disk_looked;
+
+	/* From udev, or else from the kernel: */
+	struct udev_device *udev;
+
+	/* Its uevent variables, KEY=VALUE, each null-terminated. */
+	char *env;
+	size_t env_len;
+	char *syspath, *devnode;
+	const char *devtype, *action;
+	dev_t devnum;
+	struct sysattr *sysattrs;
+};
+
+/*
+ * Sources
+ */
+
+static void dont_log(struct udev *udev, int prio, const char *file, int line, const char *fn, const char *frm, va_list args) {}
+
+static int open_udev(struct blockdev_source *s)
+{
+	s->udev = udev_new();
+	if(!s->udev) goto err0;
+	udev_set_log_fn(s->udev, dont_log);
+	s->monitor = udev_monitor_new_from_netlink(s->udev, "udev");
+	if(!s->monitor) goto err1;
+
+	/* Only block devices are interesting. The filter runs in the kernel,
+	 * so we aren't woken up for anything else. */
+	if(udev_monitor_filter_add_match_subsystem_devtype(s->monitor, "block", NULL) < 0) goto err2;
+	if(udev_monitor_enable_receiving(s->monitor) < 0) goto err2;
+	s->fd = udev_monitor_get_fd(s->monitor);
+	return 0;
+
+	err2: udev_monitor_unref(s->monitor);
+	err1: udev_unref(s->udev);
+	s->udev = NULL;
+	err0: return -1;
+}
+
+static int open_kernel(struct blockdev_source *s)
+{
+	struct sockaddr_nl addr = { AF_NETLINK };
+	int size = RCVBUF_SIZE;
+
+	s->fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+	if(s->fd < 0) goto err0;
+	/* Past rmem_max only with CAP_NET_ADMIN. */
+	if(setsockopt(s->fd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof size) < 0) setsockopt(s->fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof size);
+	addr.nl_groups = KERNEL_GROUP;
+	if(bind(s->fd, (struct sockaddr *)&addr, sizeof addr) < 0) goto err1;
+	return 0;
+
+	err1: close(s->fd);
+	err0: return -1;
+}
+
+static int blockdev_source_newfree(struct blockdev_source *s, struct blockdev_source **out, unsigned udev)
+{
+	if(s) goto freeing;
+
+	s = malloc(sizeof *s);
+	if(!s) goto err0;
+	s->udev = NULL;
+	s->monitor = NULL;
+	if((udev ? open_udev : open_kernel)(s) < 0) goto err1;
+
+	*out = s;
+	return 0;
+
+	freeing: if(s->udev) {
+		udev_monitor_unref(s->monitor);
+		udev_unref(s->udev);
+	}
+	else close(s->fd);
+	err1: free(s);
+	err0: return -1;
+}
+
+int blockdev_source_new(struct blockdev_source **out, unsigned udev)
+{
+	return blockdev_source_newfree(NULL, out, udev);
+}
+
+void blockdev_source_free(struct blockdev_source *s)
+{
+	blockdev_source_newfree(s, NULL, 0);
+}
+
+/* udevd's control socket is there while it runs, and libudev's monitor
+ * gets nothing without it. */
+unsigned blockdev_udev_running(void)
+{
+	return access("/run/udev/control", F_OK) == 0;
+}
+
+int blockdev_source_get_fd(struct blockdev_source *s)
+{
+	return s->fd;
+}
+
+/*
+ * Devices
+ */
+
+static struct blockdev *new_device(struct blockdev_source *s)
+{
+	struct blockdev *d;
+	d = malloc(sizeof *d);
+	if(!d) return NULL;
+	d->refs = 1;
+	d->s = s;
+	d->disk = NULL;
+	d->disk_looked = 0;
+	d->udev = NULL;
+	d->env = NULL;
+	d->env_len = 0;
+	d->syspath = d->devnode = NULL;
+	d->devtype = d->action = NULL;
+	d->devnum = 0;
+	d->sysattrs = NULL;
+	return d;
+}
+
+/* Takes the reference to @ud. */
+static struct blockdev *from_udev(struct blockdev_source *s, struct udev_device *ud)
+{
+	struct blockdev *d;
+	if(!ud) return NULL;
+	d = new_device(s);
+	if(!d) {
+		udev_device_unref(ud);
+		return NULL;
+	}
+	d->udev = ud;
+	return d;
+}
+
+static const char *env_get(const char *env, size_t env_len, const char *key)
+{
+	const char *p, *end;
+	size_t len;
+	len = strlen(key);
+	end = env + env_len;
+	for(p = env; p < end; p += strlen(p) + 1) {
+		if(!strncmp(p, key, len) && p[len] == '=') return p + len + 1;
+	}
+	return NULL;
+}
+
+/* Takes @env, @len bytes of null-terminated variables followed by one more
+ * null, and @syspath. */
+static struct blockdev *from_env(struct blockdev_source *s, char *env, size_t len, char *syspath)
+{
+	struct blockdev *d;
+	const char *name, *maj, *min;
+
+	d = new_device(s);
+	if(!d) goto err0;
+	d->env = env;
+	d->env_len = len;
+	d->syspath = syspath;
+	name = env_get(env, len, "DEVNAME");
+	if(name) {
+		d->devnode = name[0] == '/' ? s_dup(name) : s_concat("/dev/", name, NULL);
+		if(!d->devnode) goto err1;
+	}
+	d->devtype = env_get(env, len, "DEVTYPE");
+	d->action = env_get(env, len, "ACTION");
+	maj = env_get(env, len, "MAJOR");
+	min = env_get(env, len, "MINOR");
+	if(maj && min) d->devnum = makedev(strtoul(maj, NULL, 10), strtoul(min, NULL, 10));
+	return d;
+
+	err1: free(d);
+	err0: free(env);
+	free(syspath);
+	return NULL;
+}
+
+/* From what sysfs has. Takes @syspath. */
+static struct blockdev *from_syspath(struct blockdev_source *s, char *syspath)
+{
+	char *path, *env;
+	size_t len, i;
+
+	path = s_concat(syspath, "/uevent", NULL);
+	if(!path) goto err0;
+	env = s_read_file(path, &len);
+	free(path);
+	if(!env) goto err0;
+	for(i = 0; i < len; ++i) if(env[i] == '\n') env[i] = 0;
+	return from_env(s, env, len, syspath);
+
+	err0: free(syspath);
+	return NULL;
+}
+
+static struct blockdev *from_link(struct blockdev_source *s, const char *link)
+{
+	char *syspath;
+	syspath = realpath(link, NULL);
+	if(!syspath) return NULL;
+	return from_syspath(s, syspath);
+}
+
+struct blockdev *blockdev_from_devnum(struct blockdev_source *s, dev_t devnum)
+{
+	char link[64];
+	if(s->udev) return from_udev(s, udev_device_new_from_devnum(s->udev, 'b', devnum));
+	snprintf(link, sizeof link, "/sys/dev/block/%u:%u", major(devnum), minor(devnum));
+	return from_link(s, link);
+}
+
+struct blockdev *blockdev_ref(struct blockdev *d)
+{
+	++d->refs;
+	return d;
+}
+
+void blockdev_unref(struct blockdev *d)
+{
+	if(--d->refs) return;
+	if(d->disk) blockdev_unref(d->disk);
+	if(d->udev) udev_device_unref(d->udev);
+	while(d->sysattrs) {
+		struct sysattr *a;
+		a = d->sysattrs;
+		d->sysattrs = a->next;
+		free(a->name);
+		free(a->value);
+		free(a);
+	}
+	free(d->env);
+	free(d->syspath);
+	free(d->devnode);
+	free(d);
+}
+
+const char *blockdev_get_syspath(struct blockdev *d)
+{
+	return d->udev ? udev_device_get_syspath(d->udev) : d->syspath;
+}
+
+const char *blockdev_get_devnode(struct blockdev *d)
+{
+	return d->udev ? udev_device_get_devnode(d->udev) : d->devnode;
+}
+
+const char *blockdev_get_devtype(struct blockdev *d)
+{
+	return d->udev ? udev_device_get_devtype(d->udev) : d->devtype;
+}
+
+const char *blockdev_get_action(struct blockdev *d)
+{
+	return d->udev ? udev_device_get_action(d->udev) : d->action;
+}
+
+dev_t blockdev_get_devnum(struct blockdev *d)
+{
+	return d->udev ? udev_device_get_devnum(d->udev) : d->devnum;
+}
+
+/* A partition's directory is in its disk's. */
+struct blockdev *blockdev_get_disk(struct blockdev *d)
+{
+	if(d->disk_looked) return d->disk;
+	d->disk_looked = 1;
+	if(d->udev) {
+		struct udev_device *disk;
+		disk = udev_device_get_parent_with_subsystem_devtype(d->udev, "block", "disk");
+		if(disk) d->disk = from_udev(d->s, udev_device_ref(disk));
+	}
+	else if(d->devtype && !strcmp(d->devtype, "partition")) {
+		char *syspath, *slash;
+		syspath = s_dup(d->syspath);
+		if(!syspath) return NULL;
+		slash = strrchr(syspath, '/');
+		if(slash) *slash = 0;
+		d->disk = from_syspath(d->s, syspath);
+	}
+	return d->disk;
+}
+
+/* The kernel doesn't say what udev would for these, but sysfs does. */
+const char *blockdev_get_property(struct blockdev *d, const char *key)
+{
+	const char *value;
+	if(d->udev) return udev_device_get_property_value(d->udev, key);
+	value = env_get(d->env, d->env_len, key);
+	if(value) return value;
+	if(!strcmp(key, "ID_CDROM")) return major(d->devnum) == SCSI_CDROM_MAJOR ? "1" : NULL;
+	if(!strcmp(key, "ID_BUS")) return strstr(d->syspath, "/usb") ? "usb" : NULL;
+	return NULL;
+}
+
+const char *blockdev_get_sysattr(struct blockdev *d, const char *name)
+{
+	struct sysattr *a;
+	char *path;
+	size_t len;
+
+	if(d->udev) return udev_device_get_sysattr_value(d->udev, name);
+	for(a = d->sysattrs; a; a = a->next) if(!strcmp(a->name, name)) return a->value;
+
+	a = malloc(sizeof *a);
+	if(!a) goto err0;
+	a->name = s_dup(name);
+	if(!a->name) goto err1;
+	path = s_concat(d->syspath, "/", name, NULL);
+	if(!path) goto err2;
+	a->value = s_read_file(path, &len);
+	free(path);
+	if(!a->value) goto err2;
+	if(len && a->value[len - 1] == '\n') a->value[len - 1] = 0;
+	a->next = d->sysattrs;
+	d->sysattrs = a;
+	return a->value;
+
+	err2: free(a->name);
+	err1: free(a);
+	err0: return NULL;
+}
+
+/*
+ * Listing
+ */
+
+static int list_udev(struct blockdev_source *s, struct blockdev *disk, blockdev_f *f, void *user)
+{
+	struct udev_enumerate *enr;
+	struct udev_list_entry *i;
+	int retv = -1;
+
+	enr = udev_enumerate_new(s->udev);
+	if(!enr) return -1;
+	if(disk) {
+		if(udev_enumerate_add_match_parent(enr, disk->udev) < 0) goto out;
+		if(udev_enumerate_add_match_property(enr, "DEVTYPE", "partition") < 0) goto out;
+	}
+	else if(udev_enumerate_add_match_subsystem(enr, "block") < 0) goto out;
+	if(udev_enumerate_scan_devices(enr) < 0) goto out;
+	for(i = udev_enumerate_get_list_entry(enr); i; i = udev_list_entry_get_next(i)) {
+		struct blockdev *d;
+		d = from_udev(s, udev_device_new_from_syspath(s->udev, udev_list_entry_get_name(i)));
+		if(!d) continue;
+		f(user, d);
+		blockdev_unref(d);
+	}
+	retv = 0;
+
+	out: udev_enumerate_unref(enr);
+	return retv;
+}
+
+/* Partitions of @disk are in its directory, and only them. */
+static unsigned is_partition_of(struct blockdev *d, struct blockdev *disk)
+{
+	size_t len;
+	len = strlen(disk->syspath);
+	return d->devtype && !strcmp(d->devtype, "partition") && !strncmp(d->syspath, disk->syspath, len) && d->syspath[len] == '/' && !strchr(d->syspath + len + 1, '/');
+}
+
+static int list_kernel(struct blockdev_source *s, struct blockdev *disk, blockdev_f *f, void *user)
+{
+	DIR *dir;
+	struct dirent *ent;
+
+	dir = opendir("/sys/class/block");
+	if(!dir) return -1;
+	while(ent = readdir(dir)) {
+		struct blockdev *d;
+		char *link;
+		if(ent->d_name[0] == '.') continue;
+		link = s_concat("/sys/class/block/", ent->d_name, NULL);
+		if(!link) continue;
+		d = from_link(s, link);
+		free(link);
+		if(!d) continue;
+		if(!disk || is_partition_of(d, disk)) f(user, d);
+		blockdev_unref(d);
+	}
+	closedir(dir);
+	return 0;
+}
+
+int blockdev_list(struct blockdev_source *s, struct blockdev *disk, blockdev_f *f, void *user)
+{
+	return (s->udev ? list_udev : list_kernel)(s, disk, f, user);
+}
+
+/*
+ * Events
+ */
+
+/* A uevent is "ACTION@DEVPATH" followed by the variables, which include both
+ * again. */
+static struct blockdev *receive_kernel(struct blockdev_source *s)
+{
+	char buf[8192];
+	struct sockaddr_nl addr;
+	struct iovec iov = { buf, sizeof buf - 1 };
+	struct msghdr msg = { &addr, sizeof addr, &iov, 1 };
+
+	for(;;) {
+		ssize_t n;
+		size_t header, len;
+		const char *env, *devpath, *subsystem;
+		char *copy, *syspath;
+		struct blockdev *d;
+
+		msg.msg_namelen = sizeof addr;
+		n = recvmsg(s->fd, &msg, 0);
+		if(n < 0) return NULL;
+		/* Only the kernel's, anyone can send to the group. */
+		if(msg.msg_namelen != sizeof addr || addr.nl_pid != 0) continue;
+		buf[n] = 0;
+		header = strlen(buf) + 1;
+		if(header >= (size_t)n || !strchr(buf, '@')) continue;
+
+		env = buf + header;
+		len = n - header;
+		subsystem = env_get(env, len, "SUBSYSTEM");
+		if(!subsystem || strcmp(subsystem, "block")) continue;
+		devpath = env_get(env, len, "DEVPATH");
+		if(!devpath) continue;
+		syspath = s_concat("/sys", devpath, NULL);
+		if(!syspath) continue;
+		copy = malloc(len + 1);
+		if(!copy) {
+			free(syspath);
+			continue;
+		}
+		memcpy(copy, env, len + 1);
+		d = from_env(s, copy, len, syspath);
+		if(d) return d;
+	}
+}
+
+struct blockdev *blockdev_receive(struct blockdev_source *s)
+{
+	struct udev_device *ud;
+	if(!s->udev) return receive_kernel(s);
+	ud = udev_monitor_receive_device(s->monitor);
+	return ud ? from_udev(s, ud) : NULL;
+}
@@ -0,0 +1,57 @@
+/* Block devices and their events, from udev or straight from the kernel.
+ *
+ * Udev knows more about a device (what filesystem it has, what bus it's on),
+ * but needs udevd running, which it isn't in an initramfs before it's
+ * started, or in a minimal rescue system. The kernel has the devices in sysfs
+ * and sends their events over netlink, with only what the kernel knows: a
+ * device looks the same, but most ID_* properties are missing. A couple that
+ * can be told from sysfs (ID_CDROM, ID_BUS=usb) are filled in.
+ *
+ * Not thread-safe. */
+#include <sys/types.h>
+
+struct blockdev_source;
+struct blockdev;
+
+/* With @udev from udev, otherwise from the kernel. Events are received from
+ * the start, so none are missed between listing the devices and listening. */
+int blockdev_source_new(struct blockdev_source **out, unsigned udev);
+void blockdev_source_free(struct blockdev_source *s);
+
+/* Whether udevd is running, so that the devices can come from it. */
+unsigned blockdev_udev_running(void);
+
+/* Readable when there are events for blockdev_receive(). */
+int blockdev_source_get_fd(struct blockdev_source *s);
+
+/* The device of the next event, with its action, or NULL when there are none
+ * left. */
+struct blockdev *blockdev_receive(struct blockdev_source *s);
+
+/* Call @f for each block device, or for each partition of @disk if it isn't
+ * NULL. The device is only valid during the call, unless referenced. */
+typedef void blockdev_f(void *user, struct blockdev *d);
+int blockdev_list(struct blockdev_source *s, struct blockdev *disk, blockdev_f *f, void *user);
+
+/* NULL if there is no such device. */
+struct blockdev *blockdev_from_devnum(struct blockdev_source *s, dev_t devnum);
+
+struct blockdev *blockdev_ref(struct blockdev *d);
+void blockdev_unref(struct blockdev *d);
+
+/* The strings are valid as long as the device. devnode and devtype ("disk"
+ * or "partition") may be NULL, action is NULL unless it's from an event. */
+const char *blockdev_get_syspath(struct blockdev *d);
+const char *blockdev_get_devnode(struct blockdev *d);
+const char *blockdev_get_devtype(struct blockdev *d);
+const char *blockdev_get_action(struct blockdev *d);
+dev_t blockdev_get_devnum(struct blockdev *d);
+
+/* The disk a partition is on, as long as the partition is valid. NULL for a
+ * disk. */
+struct blockdev *blockdev_get_disk(struct blockdev *d);
+
+/* A udev property, like ID_FS_TYPE, or the contents of a file in the
+ * device's sysfs directory, without the newline. NULL if not known. */
+const char *blockdev_get_property(struct blockdev *d, const char *key);
+const char *blockdev_get_sysattr(struct blockdev *d, const char *name);
@@ -0,0 +1,335 @@
+#define _GNU_SOURCE
+#include "bls.h"
+#include "config.h"
+#include "fs.h"
+#include "s.h"
+#include <stdlib.h>
+
+/*
+ * Boot Loader Specification entries: each file is one entry made up of
+ * "key value" lines. They are shown in the order the specification gives,
+ * which puts the newest kernel first.
+ *
+ * The files are usually left alone once written, and a kernel update only
+ * adds one and removes another, so what was read from each file is kept
+ * between scans of the filesystem (see config_keep()), and only the files
+ * whose size or mtime changed are read again.
+ */
+
+/* An entry file, as read. The values point into buf. */
+struct entry {
+	struct entry *next;
+	char *path;
+	struct fs_stat st;
+	char *buf;
+
+	/* The file name without .conf. */
+	char *name;
+	const char *title, *version, *machine_id, *sort_key, *kernel;
+	/* All the options lines, joined. */
+	char *options;
+	const char **initrds;
+	size_t n_initrds;
+};
+
+static void entry_free(struct entry *e)
+{
+	free(e->path);
+	free(e->buf);
+	free(e->name);
+	free(e->options);
+	free(e->initrds);
+	free(e);
+}
+
+static void skip_blanks(char **p)
+{
+	while(**p == ' ' || **p == '\t') ++*p;
+}
+
+/* Split @line into its key and value, both null-terminated in place. */
+static unsigned split(char *line, char **key_out, char **value_out)
+{
+	char *end;
+	skip_blanks(&line);
+	if(!*line || *line == '#') return 0;
+	*key_out = line;
+	line += strcspn(line, " \t");
+	if(*line) *line++ = '\0';
+	skip_blanks(&line);
+	*value_out = line;
+	end = line + strlen(line);
+	while(end > line && strchr(" \t\r", end[-1])) --end;
+	*end = '\0';
+	return 1;
+}
+
+static int add_initrds(struct entry *e, char *value)
+{
+	while(*value) {
+		const char **initrds;
+		size_t len;
+		len = strcspn(value, " \t");
+		initrds = realloc(e->initrds, (e->n_initrds + 1) * sizeof *initrds);
+		if(!initrds) return -1;
+		e->initrds = initrds;
+		e->initrds[e->n_initrds++] = value;
+		value += len;
+		if(*value) *value++ = '\0';
+		skip_blanks(&value);
+	}
+	return 0;
+}
+
+/* Takes @buf. */
+static struct entry *entry_new(const char *path, const struct fs_stat *st, char *buf)
+{
+	struct entry *e;
+	const char *base;
+	char *line, *next;
+
+	e = malloc(sizeof *e);
+	if(!e) goto err0;
+	e->next = NULL;
+	e->buf = buf;
+	e->st = *st;
+	e->title = e->version = e->machine_id = e->sort_key = e->kernel = NULL;
+	e->options = NULL;
+	e->initrds = NULL;
+	e->n_initrds = 0;
+	e->path = s_dup(path);
+	if(!e->path) goto err1;
+	base = strrchr(path, '/') + 1;
+	e->name = s_ndup(base, strlen(base) - 5);
+	if(!e->name) goto err2;
+
+	for(line = buf; line; line = next) {
+		char *key, *value;
+		next = strchr(line, '\n');
+		if(next) *next++ = '\0';
+		if(!split(line, &key, &value)) continue;
+
+		if(!strcmp(key, "title")) e->title = value;
+		else if(!strcmp(key, "version")) e->version = value;
+		else if(!strcmp(key, "machine-id")) e->machine_id = value;
+		else if(!strcmp(key, "sort-key")) e->sort_key = value;
+		else if(!strcmp(key, "linux")) e->kernel = value;
+		else if(!strcmp(key, "initrd")) {
+			if(add_initrds(e, value) < 0) goto err3;
+		}
+		else if(!strcmp(key, "options") && *value) {
+			char *options;
+			options = s_concat(e->options ? e->options : "", e->options ? " " : "", value, NULL);
+			if(!options) goto err3;
+			free(e->options);
+			e->options = options;
+		}
+	}
+	return e;
+
+	err3: free(e->options);
+	free(e->initrds);
+	free(e->name);
+	err2: free(e->path);
+	err1: free(e);
+	err0: free(buf);
+	return NULL;
+}
+
+static void free_entries(struct entry *entries)
+{
+	while(entries) {
+		struct entry *e;
+		e = entries;
+		entries = e->next;
+		entry_free(e);
+	}
+}
+
+struct scan {
+	struct config_scan *c;
+	/* From the last scan. */
+	struct entry *old;
+	struct entry *entries;
+	size_t n;
+
+	/* GRUB's environment block, read if an entry uses it. */
+	unsigned env_read;
+	char *env;
+	struct s_arena arena;
+};
+
+static void add_file(void *user, const char *path, const struct fs_stat *st)
+{
+	struct scan *x;
+	struct entry *e, **p;
+	char *buf;
+
+	x = user;
+	for(p = &x->old; *p; p = &(*p)->next) {
+		e = *p;
+		if(strcmp(e->path, path) || e->st.size != st->size || e->st.mtime != st->mtime || e->st.mtime_nsec != st->mtime_nsec) continue;
+		*p = e->next;
+		goto add;
+	}
+
+	buf = config_read(x->c, path);
+	if(!buf) return;
+	e = entry_new(path, st, buf);
+	if(!e) return;
+
+	add: e->next = x->entries;
+	x->entries = e;
+	++x->n;
+}
+
+/* The order of the specification: entries with a sort key first, by it, then
+ * by machine id, then newest version first. The others by file name, newest
+ * version first. */
+static int compare(const void *a, const void *b)
+{
+	const struct entry *x = *(const struct entry *const *)a, *y = *(const struct entry *const *)b;
+	int r;
+	if(!x->sort_key != !y->sort_key) return x->sort_key ? -1 : 1;
+	if(x->sort_key) {
+		if((r = strcmp(x->sort_key, y->sort_key))) return r;
+		if((r = strcmp(x->machine_id ? x->machine_id : "", y->machine_id ? y->machine_id : ""))) return r;
+		if((r = strverscmp(y->version ? y->version : "", x->version ? x->version : ""))) return r;
+	}
+	return strverscmp(y->name, x->name);
+}
+
+/* The value of a variable in GRUB's environment block, "" if it isn't
+ * there. */
+static const char *env_get(struct scan *x, const char *name, size_t len)
+{
+	static const char *const files[] = {"/boot/grub2/grubenv", "/grub2/grubenv", "/boot/grub/grubenv", "/grub/grubenv"};
+	struct s_view rest, line;
+	size_t i;
+
+	if(!x->env_read) {
+		x->env_read = 1;
+		for(i = 0; i < sizeof files / sizeof files[0] && !x->env; ++i) x->env = config_read(x->c, files[i]);
+	}
+	if(!x->env) return "";
+	rest.p = x->env;
+	rest.len = strlen(x->env);
+	while(s_view_line(&rest, &line)) {
+		if(line.len > len && line.p[len] == '=' && !memcmp(line.p, name, len)) {
+			line.p += len + 1;
+			line.len -= len + 1;
+			return s_arena_view(&x->arena, line);
+		}
+	}
+	return "";
+}
+
+/* GRUB lets the options and initrds use the variables of its environment
+ * block: Fedora had all the options in $kernelopts for a while. Variables that
+ * aren't set are empty, and so are the blanks they leave at the end. */
+static const char *expand(struct scan *x, const char *options)
+{
+	const char *out = "", *p;
+	size_t n;
+	for(p = options; out && *p; ) {
+		const char *value, *name;
+		char *text;
+		size_t len, skip;
+		len = strcspn(p, "$");
+		text = s_arena_ndup(&x->arena, p, len);
+		out = text ? s_arena_concat(&x->arena, out, text, NULL) : NULL;
+		p += len;
+		if(!out || !*p) break;
+		if(p[1] == '{') {
+			name = p + 2;
+			len = strcspn(name, "}");
+			skip = 3 + len - !name[len];
+		}
+		else {
+			name = p + 1;
+			for(len = 0; (name[len] >= 'a' && name[len] <= 'z') || (name[len] >= 'A' && name[len] <= 'Z') || (name[len] >= '0' && name[len] <= '9') || name[len] == '_'; ++len);
+			skip = 1 + len;
+		}
+		value = len ? env_get(x, name, len) : "$";
+		out = value ? s_arena_concat(&x->arena, out, value, NULL) : NULL;
+		p += skip;
+	}
+	if(!out) return NULL;
+	for(n = strlen(out); n && (out[n - 1] == ' ' || out[n - 1] == '\t'); --n);
+	return s_arena_ndup(&x->arena, out, n);
+}
+
+static void report(struct scan *x, struct entry *e)
+{
+	struct config_entry g;
+	const char *args;
+	char **initrds;
+	size_t i, n = 0;
+
+	if(!e->kernel) return;
+	args = e->options ? e->options : "";
+	if(strchr(args, '$')) args = expand(x, args);
+	if(!args) return;
+	/* The paths are from the root of the filesystem, with or without the
+	 * slash. */
+	initrds = s_arena_alloc(&x->arena, (e->n_initrds + 1) * sizeof *initrds);
+	if(!initrds) return;
+	for(i = 0; i < e->n_initrds; ++i) {
+		const char *initrd;
+		initrd = strchr(e->initrds[i], '$') ? expand(x, e->initrds[i]) : e->initrds[i];
+		if(!initrd) return;
+		if(!*initrd) continue;
+		initrds[n] = s_arena_concat(&x->arena, initrd[0] == '/' ? "" : "/", initrd, NULL);
+		if(!initrds[n++]) return;
+	}
+
+	g.title = e->title ? e->title : e->name;
+	g.device = NULL;
+	g.kernel = s_arena_concat(&x->arena, e->kernel[0] == '/' ? "" : "/", e->kernel, NULL);
+	g.args = args;
+	g.initrds = initrds;
+	g.n_initrds = n;
+	if(g.kernel) config_add(x->c, &g);
+}
+
+/* For a pattern there is no one file, see config_files(). */
+static void scan(struct config_scan *c, const char *file, const char *buf, size_t len)
+{
+	struct scan x;
+	struct entry **sorted, *e;
+	size_t i;
+
+	(void)file;
+	(void)buf;
+	(void)len;
+	x.c = c;
+	x.old = config_take(c);
+	x.entries = NULL;
+	x.n = 0;
+	x.env_read = 0;
+	x.env = NULL;
+	memset(&x.arena, 0, sizeof x.arena);
+
+	config_files(c, add_file, &x);
+
+	sorted = malloc(x.n * sizeof *sorted);
+	if(!sorted) goto out;
+	for(i = 0, e = x.entries; e; e = e->next) sorted[i++] = e;
+	qsort(sorted, x.n, sizeof *sorted, compare);
+	for(i = 0; i < x.n; ++i) report(&x, sorted[i]);
+	free(sorted);
+
+	/* Entries whose file is gone, or has changed, go. */
+	out: free_entries(x.old);
+	config_keep(c, x.entries, (config_free_f *)free_entries);
+	free(x.env);
+	s_arena_free(&x.arena);
+}
+
+static const char *const files[] = {
+	"/boot/loader/entries/*.conf",
+	"/loader/entries/*.conf",
+	NULL
+};
+
+const struct config_scanner bls_scanner = {"bls", files, 3, scan};
@@ -0,0 +1,4 @@
+/* The scanner for Boot Loader Specification entries, one file per entry in
+ * /loader/entries (see config.h). */
+struct config_scanner;
+extern const struct config_scanner bls_scanner;
@@ -0,0 +1,455 @@
+#define _GNU_SOURCE
+#include "cache.h"
+#include "smount.h"
+#include "s.h"
+#include "throttle.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <stdint.h>
+
+#define CACHE_FILE CACHE_DIR "/targets"
+#define CACHE_MAGIC "libbootloader-cache 2"
+
+struct cache_target {
+	struct cache_target *next;
+	char *cmd, *name;
+	/* The namer has given it the name. */
+	unsigned final;
+};
+
+struct cache_fs {
+	struct cache_fs *next;
+	char *uuid, *devnode, *sb_fp, *cfg_fp;
+	struct cache_target *targets, **last;
+};
+
+struct cache {
+	pthread_mutex_t lock;
+	struct cache_fs *fs;
+	unsigned dirty;
+};
+
+static void fs_clear(struct cache_fs *fs)
+{
+	while(fs->targets) {
+		struct cache_target *t;
+		t = fs->targets;
+		fs->targets = t->next;
+		free(t->cmd);
+		free(t->name);
+		free(t);
+	}
+	fs->last = &fs->targets;
+}
+
+static void fs_free(struct cache_fs *fs)
+{
+	fs_clear(fs);
+	free(fs->uuid);
+	free(fs->devnode);
+	free(fs->sb_fp);
+	free(fs->cfg_fp);
+	free(fs);
+}
+
+static struct cache_fs *fs_find(struct cache *c, const char *uuid)
+{
+	struct cache_fs *fs;
+	for(fs = c->fs; fs; fs = fs->next) if(!strcmp(fs->uuid, uuid)) return fs;
+	return NULL;
+}
+
+/* Fingerprints are stored as "-" when there are none. */
+static char *fp_dup(const char *fp)
+{
+	return s_dup(fp ? fp : "-");
+}
+
+static unsigned fp_matches(const char *stored, const char *fp)
+{
+	return !fp || !strcmp(stored, fp);
+}
+
+static struct cache_fs *fs_new(struct cache *c, const char *uuid, const char *devnode, const char *sb_fp, const char *cfg_fp)
+{
+	struct cache_fs *fs;
+	fs = malloc(sizeof *fs);
+	if(!fs) goto err0;
+	fs->targets = NULL;
+	fs->last = &fs->targets;
+	fs->uuid = s_dup(uuid);
+	fs->devnode = s_dup(devnode);
+	fs->sb_fp = fp_dup(sb_fp);
+	fs->cfg_fp = fp_dup(cfg_fp);
+	if(!fs->uuid || !fs->devnode || !fs->sb_fp || !fs->cfg_fp) goto err1;
+
+	fs->next = c->fs;
+	c->fs = fs;
+	return fs;
+
+	err1: fs_free(fs);
+	err0: return NULL;
+}
+
+static void target_add(struct cache_fs *fs, char *cmd, char *name, unsigned final)
+{
+	struct cache_target *t;
+	if(!cmd || !name) goto err0;
+	t = malloc(sizeof *t);
+	if(!t) goto err0;
+	t->next = NULL;
+	t->cmd = cmd;
+	t->name = name;
+	t->final = final;
+	*fs->last = t;
+	fs->last = &t->next;
+	return;
+
+	err0: free(cmd);
+	free(name);
+}
+
+/*
+ * Reading and writing the cache file. It's line based:
+ *
+ * fs <uuid> <devnode> <superblock fingerprint> <config fingerprint>
+ * t <command string>
+ * n <display name>
+ *
+ * with "p" instead of "n" for a provisional name. Before version 2 there was
+ * no telling them apart, so older files aren't loaded.
+ */
+
+static void load(struct cache *c)
+{
+	FILE *f;
+	char *line;
+	struct cache_fs *fs = NULL;
+	char *cmd = NULL;
+
+	f = fopen(CACHE_FILE, "r");
+	if(!f) return;
+
+	line = s_getline(f);
+	if(!line || strcmp(line, CACHE_MAGIC)) goto out;
+
+	free(line);
+	while(line = s_getline(f)) {
+		if(!strncmp(line, "fs ", 3)) {
+			char *word[4], *p;
+			unsigned i;
+			p = line + 3;
+			for(i = 0; i < 4; ++i) {
+				word[i] = p;
+				p += strcspn(p, " ");
+				if(i < 3 && !*p) break;
+				if(*p) *p++ = '\0';
+			}
+			fs = i < 4 ? fs_new(c, word[0], word[1], word[2], word[3]) : NULL;
+		}
+		else if(!strncmp(line, "t ", 2) && fs) {
+			free(cmd);
+			cmd = s_dup(line + 2);
+		}
+		else if((!strncmp(line, "n ", 2) || !strncmp(line, "p ", 2)) && fs && cmd) {
+			target_add(fs, cmd, s_dup(line + 2), line[0] == 'n');
+			cmd = NULL;
+		}
+		free(line);
+	}
+
+	free(cmd);
+	fclose(f);
+	return;
+
+	out: free(line);
+	fclose(f);
+}
+
+int cache_save(struct cache *c)
+{
+	char tmp[] = CACHE_FILE ".XXXXXX";
+	int fd;
+	FILE *f;
+	struct cache_fs *fs;
+
+	pthread_mutex_lock(&c->lock);
+	if(!c->dirty) goto done;
+
+	mkdir(CACHE_DIR, 0700);
+	fd = mkstemp(tmp);
+	if(fd < 0) goto err0;
+	f = fdopen(fd, "w");
+	if(!f) goto err1;
+
+	fprintf(f, "%s\n", CACHE_MAGIC);
+	for(fs = c->fs; fs; fs = fs->next) {
+		struct cache_target *t;
+		fprintf(f, "fs %s %s %s %s\n", fs->uuid, fs->devnode, fs->sb_fp, fs->cfg_fp);
+		for(t = fs->targets; t; t = t->next) fprintf(f, "t %s\n%c %s\n", t->cmd, t->final ? 'n' : 'p', t->name);
+	}
+
+	if(fclose(f) != 0) goto err2;
+	if(rename(tmp, CACHE_FILE) < 0) goto err2;
+	c->dirty = 0;
+
+	done: pthread_mutex_unlock(&c->lock);
+	return 0;
+
+	err1: close(fd);
+	err2: unlink(tmp);
+	err0: pthread_mutex_unlock(&c->lock);
+	return -1;
+}
+
+static int cache_newfree(struct cache *c, struct cache **out)
+{
+	if(c) goto freeing;
+
+	c = malloc(sizeof *c);
+	if(!c) goto err0;
+	c->fs = NULL;
+	c->dirty = 0;
+	if(pthread_mutex_init(&c->lock, NULL) != 0) goto err1;
+
+	load(c);
+
+	*out = c;
+	return 0;
+
+	freeing: cache_save(c);
+	while(c->fs) {
+		struct cache_fs *fs;
+		fs = c->fs;
+		c->fs = fs->next;
+		fs_free(fs);
+	}
+	pthread_mutex_destroy(&c->lock);
+	err1: free(c);
+	err0: return -1;
+}
+
+int cache_new(struct cache **out)
+{
+	return cache_newfree(NULL, out);
+}
+
+void cache_free(struct cache *c)
+{
+	cache_newfree(c, NULL);
+}
+
+/*
+ * Lookups and updates
+ */
+
+unsigned cache_get(struct cache *c, const char *uuid, const char *sb_fp, const char *cfg_fp, cache_f *f, void *user)
+{
+	struct cache_fs *fs;
+	struct cache_target *t;
+	unsigned hit = 0;
+
+	pthread_mutex_lock(&c->lock);
+	fs = fs_find(c, uuid);
+	if(!fs) goto out;
+	if(!fp_matches(fs->sb_fp, sb_fp) || !fp_matches(fs->cfg_fp, cfg_fp)) goto out;
+	for(t = fs->targets; t; t = t->next) f(user, fs->devnode, t->cmd, t->name, t->final);
+	hit = 1;
+
+	out: pthread_mutex_unlock(&c->lock);
+	return hit;
+}
+
+unsigned cache_has_targets(struct cache *c, const char *uuid)
+{
+	struct cache_fs *fs;
+	unsigned has;
+	pthread_mutex_lock(&c->lock);
+	fs = fs_find(c, uuid);
+	has = fs && fs->targets;
+	pthread_mutex_unlock(&c->lock);
+	return has;
+}
+
+void cache_put(struct cache *c, const char *uuid, const char *devnode, const char *sb_fp, const char *cfg_fp)
+{
+	struct cache_fs **i;
+
+	pthread_mutex_lock(&c->lock);
+	for(i = &c->fs; *i; i = &(*i)->next) {
+		if(!strcmp((*i)->uuid, uuid)) {
+			struct cache_fs *fs;
+			fs = *i;
+			*i = fs->next;
+			fs_free(fs);
+			break;
+		}
+	}
+	fs_new(c, uuid, devnode, sb_fp, cfg_fp);
+	c->dirty = 1;
+	pthread_mutex_unlock(&c->lock);
+}
+
+void cache_put_target(struct cache *c, const char *uuid, const char *cmd, const char *name, unsigned final)
+{
+	struct cache_fs *fs;
+
+	/* Newlines would break the file format, don't cache such targets. */
+	if(strchr(cmd, '\n') || strchr(name, '\n')) return;
+
+	pthread_mutex_lock(&c->lock);
+	fs = fs_find(c, uuid);
+	if(fs) {
+		target_add(fs, s_dup(cmd), s_dup(name), final);
+		c->dirty = 1;
+	}
+	pthread_mutex_unlock(&c->lock);
+}
+
+void cache_rename_target(struct cache *c, const char *cmd, const char *name)
+{
+	struct cache_fs *fs;
+	struct cache_target *t;
+	char *copy;
+
+	if(strchr(name, '\n')) return;
+	copy = s_dup(name);
+	if(!copy) return;
+	pthread_mutex_lock(&c->lock);
+	for(fs = c->fs; fs; fs = fs->next) {
+		for(t = fs->targets; t; t = t->next) {
+			if(strcmp(t->cmd, cmd)) continue;
+			if(t->final && !strcmp(t->name, copy)) goto out;
+			free(t->name);
+			t->name = copy;
+			copy = NULL;
+			t->final = 1;
+			c->dirty = 1;
+			goto out;
+		}
+	}
+	out: pthread_mutex_unlock(&c->lock);
+	free(copy);
+}
+
+void cache_update(struct cache *c, const char *uuid, const char *devnode, const char *sb_fp, const char *cfg_fp)
+{
+	struct cache_fs *fs;
+	char *new_devnode, *new_sb_fp, *new_cfg_fp;
+
+	new_devnode = s_dup(devnode);
+	new_sb_fp = s_dup(sb_fp);
+	new_cfg_fp = s_dup(cfg_fp);
+	if(!new_devnode || (sb_fp && !new_sb_fp) || (cfg_fp && !new_cfg_fp)) goto out;
+
+	pthread_mutex_lock(&c->lock);
+	fs = fs_find(c, uuid);
+	if(fs) {
+		if(strcmp(fs->devnode, new_devnode)) {
+			free(fs->devnode);
+			fs->devnode = new_devnode;
+			new_devnode = NULL;
+			c->dirty = 1;
+		}
+		if(new_sb_fp && strcmp(fs->sb_fp, new_sb_fp)) {
+			free(fs->sb_fp);
+			fs->sb_fp = new_sb_fp;
+			new_sb_fp = NULL;
+			c->dirty = 1;
+		}
+		if(new_cfg_fp && strcmp(fs->cfg_fp, new_cfg_fp)) {
+			free(fs->cfg_fp);
+			fs->cfg_fp = new_cfg_fp;
+			new_cfg_fp = NULL;
+			c->dirty = 1;
+		}
+	}
+	pthread_mutex_unlock(&c->lock);
+
+	out: free(new_devnode);
+	free(new_sb_fp);
+	free(new_cfg_fp);
+}
+
+/*
+ * Superblock fingerprints
+ */
+
+static unsigned long long le(const unsigned char *p, unsigned n)
+{
+	unsigned long long v = 0;
+	while(n--) v = v << 8 | p[n];
+	return v;
+}
+
+char *cache_sb_fingerprint(const char *devnode)
+{
+	int fd;
+	struct stat st;
+	unsigned char sb[1024];
+	char buf[128];
+	char *fp = NULL;
+
+	fd = open(devnode, O_RDONLY | O_CLOEXEC);
+	if(fd < 0) goto err0;
+	if(fstat(fd, &st) < 0 || !S_ISBLK(st.st_mode)) goto err1;
+	/* A mounted filesystem may have changes that haven't reached the
+	 * superblock yet. */
+	if(smount_is_mounted(st.st_rdev)) goto err1;
+
+	/* ext2/3/4: mount time, write time, mount count and the lifetime
+	 * write counter. Any read-write mount bumps at least one of them. */
+	if(pread(fd, sb, sizeof sb, 1024) == sizeof sb && le(sb + 0x38, 2) == 0xef53) {
+		snprintf(buf, sizeof buf, "ext:%llx:%llx:%llx:%llx", le(sb + 0x2c, 4), le(sb + 0x30, 4), le(sb + 0x34, 2), le(sb + 0x178, 8));
+		fp = s_dup(buf);
+	}
+	/* btrfs: the transaction generation. */
+	else if(pread(fd, sb, sizeof sb, 0x10000) == sizeof sb && !memcmp(sb + 0x40, "_BHRfS_M", 8)) {
+		snprintf(buf, sizeof buf, "btrfs:%llx", le(sb + 0x48, 8));
+		fp = s_dup(buf);
+	}
+
+	err1: close(fd);
+	err0: return fp;
+}
+
+/* Partition tables (MBR, and GPT with 4K sectors too) and the superblocks
+ * of the usual filesystems, ISO9660's and btrfs' included, are all in
+ * there. */
+#define DEV_FP_BYTES 0x11000
+
+char *cache_dev_fingerprint(const char *devnode)
+{
+	int fd;
+	unsigned char *buf;
+	ssize_t len, i;
+	off_t size;
+	uint64_t h = 14695981039346656037ull;
+	char str[64];
+	char *fp = NULL;
+
+	fd = open(devnode, O_RDONLY | O_CLOEXEC);
+	if(fd < 0) goto err0;
+	size = lseek(fd, 0, SEEK_END);
+	if(size < 0) goto err1;
+	buf = malloc(DEV_FP_BYTES);
+	if(!buf) goto err1;
+	len = pread(fd, buf, size < DEV_FP_BYTES ? size : DEV_FP_BYTES, 0);
+	if(len < 0) goto err2;
+	throttle_read(len);
+
+	for(i = 0; i < len; ++i) {
+		h ^= buf[i];
+		h *= 1099511628211ull;
+	}
+	snprintf(str, sizeof str, "%llx:%016llx", (unsigned long long)size, (unsigned long long)h);
+	fp = s_dup(str);
+
+	err2: free(buf);
+	err1: close(fd);
+	err0: return fp;
+}
@@ -0,0 +1,57 @@
+/* Persistent record of what disk_scan() found on each filesystem, so that the
+ * targets can be published at startup before anything has been mounted.
+ *
+ * Records are keyed by filesystem UUID and carry two fingerprints: one of the
+ * superblock, which can be checked without mounting, and one of the config
+ * file, which can be checked without parsing it. Fingerprints are opaque
+ * strings; a NULL fingerprint given to cache_get() matches anything. */
+struct cache;
+
+/* Load the cache from disk. An empty cache is created if there is nothing to
+ * load. */
+int cache_new(struct cache **out);
+
+/* Save (if anything changed) and free the cache. */
+void cache_free(struct cache *c);
+
+/* Write the cache to disk if anything changed since it was last written. */
+int cache_save(struct cache *c);
+
+/* Called for each cached target. @devnode is the device node the filesystem
+ * had when the record was made. @final says if @name is the one the namer
+ * gave the target, rather than a provisional one. */
+typedef void cache_f(void *user, const char *devnode, const char *cmd, const char *name, unsigned final);
+
+/* Look up a filesystem and call @f for its targets if the fingerprints
+ * match. Returns 1 if they did, 0 otherwise. */
+unsigned cache_get(struct cache *c, const char *uuid, const char *sb_fp, const char *cfg_fp, cache_f *f, void *user);
+
+/* Whether the record of a filesystem has any targets. */
+unsigned cache_has_targets(struct cache *c, const char *uuid);
+
+/* Start a new record for a filesystem, dropping the old one. */
+void cache_put(struct cache *c, const char *uuid, const char *devnode, const char *sb_fp, const char *cfg_fp);
+
+/* Add a target to the record started by cache_put(). @final says if @name is
+ * the one the namer gave it, rather than a provisional one. */
+void cache_put_target(struct cache *c, const char *uuid, const char *cmd, const char *name, unsigned final);
+
+/* Give the target with command @cmd, in whichever record it is, its final
+ * name. Only for the namer, also if the name is the same. */
+void cache_rename_target(struct cache *c, const char *cmd, const char *name);
+
+/* Update the device node and fingerprints of a record, keeping its targets.
+ * A NULL fingerprint is left as it was. */
+void cache_update(struct cache *c, const char *uuid, const char *devnode, const char *sb_fp, const char *cfg_fp);
+
+/* Fingerprint the superblock of a filesystem by reading the device directly.
+ * Returns NULL if the filesystem type isn't known to keep anything in its
+ * superblock that changes on every write, or if the filesystem is mounted
+ * (in which case the superblock may lag behind). */
+char *cache_sb_fingerprint(const char *devnode);
+
+/* Fingerprint the start of a device, where its partition table and the
+ * superblock of a filesystem on it are, to tell if a udev change event for it
+ * changed anything. Unlike cache_sb_fingerprint() this works for any device.
+ * NULL if the device can't be read. */
+char *cache_dev_fingerprint(const char *devnode);
@@ -0,0 +1,752 @@
+#include "config.h"
+#include "fs.h"
+#include "grub.h"
+#include "menulst.h"
+#include "syslinux.h"
+#include "bls.h"
+#include "s.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <pthread.h>
+
+/* The formats understood. The order doesn't matter, they run by cost. boot.ini
+ * will go here once there is a Windows target to make of it. */
+static const struct config_scanner *const scanners[] = {
+	&grub_scanner,
+	&menulst_scanner,
+	&syslinux_scanner,
+	&bls_scanner,
+};
+#define N_SCANNERS (sizeof scanners / sizeof scanners[0])
+
+/* What is in a directory. Directories that aren't there are remembered too. */
+struct listing {
+	struct listing *next;
+	const char *path;
+	unsigned ok;
+	/* Already given to config_scan_dirs()'s callback. */
+	unsigned used;
+	char **names;
+	size_t n, size;
+};
+
+struct found_file {
+	const char *path;
+	struct fs_file *file;
+};
+
+/* A config file found, or the files matching a pattern, and the scanner for
+ * them. */
+struct found {
+	const struct config_scanner *scanner;
+	const char *path;
+	unsigned is_pattern;
+	/* In order of name. */
+	struct found_file *files;
+	size_t n_files;
+	/* The directory they are in. */
+	struct listing *dir;
+};
+
+/* What a scanner kept from a scan of a filesystem, or what it reported. */
+struct kept {
+	struct kept *next;
+	const struct config_scanner *scanner;
+	char *device, *id;
+	/* A struct replay, kept by config_scan_read() rather than by the
+	 * scanner. */
+	unsigned replay;
+	void *data;
+	config_free_f *free;
+};
+
+/* The entries a scanner reported, and what the files it read looked like, so
+ * that a later scan that finds them the same can report the entries without
+ * running the scanner. */
+struct replay {
+	/* See found_fingerprint(). */
+	char *fp;
+	/* The files it read that weren't found for it (grubenv, say), and
+	 * what they looked like, see other_add(). */
+	const char **others;
+	size_t n_others, others_size;
+	char *others_fp;
+	struct config_entry *entries;
+	size_t n, size;
+	/* Something couldn't be recorded. */
+	unsigned failed;
+	struct s_arena arena;
+};
+
+/* Scans of different filesystems run in parallel. */
+struct config_store {
+	pthread_mutex_t lock;
+	struct kept *kept;
+};
+
+struct config_scan {
+	struct fs *fs;
+	/* Where what the scanners keep goes, and under what. NULL if nothing
+	 * is kept. */
+	struct config_store *store;
+	const char *device, *id;
+	struct s_arena arena;
+	struct listing *listings;
+	struct found found[N_SCANNERS];
+	size_t n_found;
+	/* The one being read. */
+	struct found *reading;
+	/* What it reports, NULL if it isn't recorded. */
+	struct replay *recording;
+
+	config_entry_f *f;
+	void *user;
+};
+
+/* For fs_list. */
+struct lister {
+	struct config_scan *c;
+	struct listing *l;
+};
+
+static void add_name(void *user, const char *name)
+{
+	struct lister *x;
+	struct listing *l;
+	char *copy;
+
+	x = user;
+	l = x->l;
+	if(!l->ok) return;
+	copy = s_arena_dup(&x->c->arena, name);
+	if(!copy) goto err;
+	if(l->n == l->size) {
+		char **names;
+		size_t size;
+		size = l->size ? l->size * 2 : 16;
+		names = s_arena_alloc(&x->c->arena, size * sizeof *names);
+		if(!names) goto err;
+		if(l->n) memcpy(names, l->names, l->n * sizeof *names);
+		l->names = names;
+		l->size = size;
+	}
+	l->names[l->n++] = copy;
+	return;
+
+	/* Better to look for the files than to miss them. */
+	err: l->ok = 0;
+}
+
+static unsigned exists(struct config_scan *c, const char *path);
+
+/* The listing of @dir, read the first time it is asked for. The parents are
+ * listed first, so that nothing is read of a tree that isn't there. NULL if
+ * it can't be told. */
+static struct listing *list(struct config_scan *c, const char *dir)
+{
+	struct listing *l;
+	struct lister x;
+
+	for(l = c->listings; l; l = l->next) {
+		if(!strcmp(l->path, dir)) return l;
+	}
+	l = s_arena_alloc(&c->arena, sizeof *l);
+	if(!l) return NULL;
+	l->path = dir;
+	l->names = NULL;
+	l->n = l->size = 0;
+	l->used = 0;
+	l->ok = exists(c, dir);
+	x.c = c;
+	x.l = l;
+	if(l->ok && fs_list(c->fs, dir, add_name, &x) < 0) l->ok = 0;
+	l->next = c->listings;
+	c->listings = l;
+	return l;
+}
+
+/* The listing of the directory @path is in. */
+static struct listing *parent(struct config_scan *c, const char *path)
+{
+	const char *slash;
+	char *dir;
+	slash = strrchr(path, '/');
+	dir = s_arena_ndup(&c->arena, path, slash == path ? 1 : slash - path);
+	return dir ? list(c, dir) : NULL;
+}
+
+/* Whether there is something at @path. Names are compared without regard to
+ * case, so a match on a filesystem that does care may not be one; opening the
+ * file will tell. */
+static unsigned exists(struct config_scan *c, const char *path)
+{
+	struct listing *l;
+	const char *name;
+	size_t i;
+
+	if(!strcmp(path, "/")) return 1;
+	l = parent(c, path);
+	if(!l) return 1;
+	if(!l->ok) return 0;
+	name = strrchr(path, '/') + 1;
+	for(i = 0; i < l->n; ++i) {
+		if(!strcasecmp(l->names[i], name)) return 1;
+	}
+	return 0;
+}
+
+/* Whether the last part of @path is a *suffix pattern. */
+static unsigned is_pattern(const char *path)
+{
+	return strrchr(path, '/')[1] == '*';
+}
+
+static unsigned matches(const char *pattern, const char *name)
+{
+	size_t len, n;
+	pattern = strrchr(pattern, '/') + 2;
+	len = strlen(pattern);
+	n = strlen(name);
+	return n > len && !strcasecmp(name + n - len, pattern);
+}
+
+static int by_path(const void *a, const void *b)
+{
+	return strcmp(((const struct found_file *)a)->path, ((const struct found_file *)b)->path);
+}
+
+static struct found *add_found(struct config_scan *c, const struct config_scanner *scanner, const char *path)
+{
+	struct found *f;
+	size_t i;
+	/* Cheapest first. */
+	for(i = c->n_found; i > 0 && c->found[i - 1].scanner->cost > scanner->cost; --i) c->found[i] = c->found[i - 1];
+	f = &c->found[i];
+	f->scanner = scanner;
+	f->path = path;
+	f->is_pattern = is_pattern(path);
+	f->files = NULL;
+	f->n_files = 0;
+	f->dir = parent(c, path);
+	++c->n_found;
+	return f;
+}
+
+/* Look for the file at @path, or the files matching it. A directory matching
+ * a pattern is found even if there is nothing in it, so that it is
+ * watched. */
+static unsigned find(struct config_scan *c, const struct config_scanner *scanner, const char *path)
+{
+	struct found *f;
+	struct listing *l;
+	size_t i;
+
+	if(!is_pattern(path)) {
+		struct fs_file *file;
+		if(!exists(c, path)) return 0;
+		file = fs_file_open(c->fs, path);
+		if(!file) return 0;
+		f = add_found(c, scanner, path);
+		f->files = s_arena_alloc(&c->arena, sizeof *f->files);
+		if(!f->files) {
+			fs_file_close(file);
+			return 1;
+		}
+		f->files[0].path = path;
+		f->files[0].file = file;
+		f->n_files = 1;
+		return 1;
+	}
+
+	l = parent(c, path);
+	if(!l || !l->ok) return 0;
+	f = add_found(c, scanner, path);
+	if(!l->n) return 1;
+	f->files = s_arena_alloc(&c->arena, l->n * sizeof *f->files);
+	if(!f->files) return 1;
+	for(i = 0; i < l->n; ++i) {
+		struct found_file *ff;
+		if(!matches(path, l->names[i])) continue;
+		ff = &f->files[f->n_files];
+		ff->path = s_arena_concat(&c->arena, l->path, strcmp(l->path, "/") ? "/" : "", l->names[i], NULL);
+		if(!ff->path) continue;
+		/* Directories that match are left out here. */
+		ff->file = fs_file_open(c->fs, ff->path);
+		if(ff->file) ++f->n_files;
+	}
+	qsort(f->files, f->n_files, sizeof *f->files, by_path);
+	return 1;
+}
+
+static int config_scan_newfree(struct config_scan *c, struct config_scan **out, struct fs *fs, struct config_store *store, const char *device, const char *id)
+{
+	size_t i, j;
+
+	if(c) goto freeing;
+
+	c = malloc(sizeof *c);
+	if(!c) return -1;
+	c->fs = fs;
+	c->store = id ? store : NULL;
+	c->device = device;
+	c->id = id;
+	c->reading = NULL;
+	c->recording = NULL;
+	memset(&c->arena, 0, sizeof c->arena);
+	c->listings = NULL;
+	c->n_found = 0;
+
+	for(i = 0; i < N_SCANNERS; ++i) {
+		const char *const *path;
+		for(path = scanners[i]->files; *path; ++path) {
+			if(find(c, scanners[i], *path)) break;
+		}
+	}
+
+	*out = c;
+	return 0;
+
+	freeing: for(i = 0; i < c->n_found; ++i) {
+		for(j = 0; j < c->found[i].n_files; ++j) fs_file_close(c->found[i].files[j].file);
+	}
+	s_arena_free(&c->arena);
+	free(c);
+	return 0;
+}
+
+int config_scan_new(struct config_scan **out, struct fs *fs, struct config_store *store, const char *device, const char *id) { return config_scan_newfree(NULL, out, fs, store, device, id); }
+void config_scan_free(struct config_scan *c) { config_scan_newfree(c, NULL, NULL, NULL, NULL, NULL); }
+
+/* Appends "|@path@more" to *@fp. */
+static int fingerprint_add(char **fp, const char *path, const char *more)
+{
+	char *longer;
+	longer = s_concat(*fp ? *fp : "", *fp ? "|" : "", path, more, NULL);
+	free(*fp);
+	*fp = longer;
+	return *fp ? 0 : -1;
+}
+
+/* Appends "|@path:size:mtime" to *@fp. */
+static int file_add(char **fp, const char *path, struct fs_file *file)
+{
+	const struct fs_stat *st;
+	char buf[64];
+	st = fs_file_stat(file);
+	snprintf(buf, sizeof buf, ":%lld:%lld.%09ld", (long long)st->size, (long long)st->mtime, st->mtime_nsec);
+	return fingerprint_add(fp, path, buf);
+}
+
+/* Appends what the file found for @f look like to *@fp. */
+static int found_add(char **fp, struct found *f)
+{
+	size_t i;
+	if(f->is_pattern && fingerprint_add(fp, f->path, "") < 0) return -1;
+	for(i = 0; i < f->n_files; ++i) {
+		if(file_add(fp, f->files[i].path, f->files[i].file) < 0) return -1;
+	}
+	return 0;
+}
+
+char *config_scan_fingerprint(struct config_scan *c)
+{
+	char *fp = NULL;
+	size_t i;
+
+	if(!c->n_found) return s_dup("none");
+	for(i = 0; i < c->n_found; ++i) {
+		if(found_add(&fp, &c->found[i]) < 0) return NULL;
+	}
+	return fp;
+}
+
+/* What the files found for @f look like. Newly allocated, NULL if there are
+ * none or if out of memory. */
+static char *found_fingerprint(struct found *f)
+{
+	char *fp = NULL;
+	if(found_add(&fp, f) < 0) return NULL;
+	return fp;
+}
+
+/* Appends what another file a scanner read looks like to *@fp: as for the
+ * files found, or "|@path:-" if it isn't there. */
+static int other_add(char **fp, const char *path, struct fs_file *file)
+{
+	return file ? file_add(fp, path, file) : fingerprint_add(fp, path, ":-");
+}
+
+/* For the replay's arena. Sets @r->failed if out of memory. */
+static const char *record_dup(struct replay *r, const char *str)
+{
+	char *copy;
+	if(!str) return NULL;
+	copy = s_arena_dup(&r->arena, str);
+	if(!copy) r->failed = 1;
+	return copy;
+}
+
+static void record(struct replay *r, const struct config_entry *entry)
+{
+	struct config_entry *x;
+	char **initrds;
+	size_t i;
+
+	if(r->failed) return;
+	if(r->n == r->size) {
+		struct config_entry *entries;
+		size_t size;
+		size = r->size ? r->size * 2 : 16;
+		entries = s_arena_alloc(&r->arena, size * sizeof *entries);
+		if(!entries) goto err;
+		if(r->n) memcpy(entries, r->entries, r->n * sizeof *entries);
+		r->entries = entries;
+		r->size = size;
+	}
+	x = &r->entries[r->n];
+	x->title = record_dup(r, entry->title);
+	x->device = record_dup(r, entry->device);
+	x->kernel = record_dup(r, entry->kernel);
+	x->args = record_dup(r, entry->args);
+	initrds = s_arena_alloc(&r->arena, (entry->n_initrds ? entry->n_initrds : 1) * sizeof *initrds);
+	if(!initrds) goto err;
+	for(i = 0; i < entry->n_initrds; ++i) initrds[i] = (char *)record_dup(r, entry->initrds[i]);
+	x->initrds = initrds;
+	x->n_initrds = entry->n_initrds;
+	if(r->failed) return;
+	++r->n;
+	return;
+
+	err: r->failed = 1;
+}
+
+static void record_other(struct replay *r, const char *path, struct fs_file *file)
+{
+	const char *copy;
+
+	if(r->failed) return;
+	if(r->n_others == r->others_size) {
+		const char **others;
+		size_t size;
+		size = r->others_size ? r->others_size * 2 : 4;
+		others = s_arena_alloc(&r->arena, size * sizeof *others);
+		if(!others) goto err;
+		if(r->n_others) memcpy(others, r->others, r->n_others * sizeof *others);
+		r->others = others;
+		r->others_size = size;
+	}
+	copy = record_dup(r, path);
+	if(!copy || other_add(&r->others_fp, path, file) < 0) goto err;
+	r->others[r->n_others++] = copy;
+	return;
+
+	err: r->failed = 1;
+}
+
+/* Whether the other files @r was recorded with are still the same. */
+static unsigned others_same(struct config_scan *c, struct replay *r)
+{
+	char *fp = NULL;
+	unsigned same;
+	size_t i;
+
+	for(i = 0; i < r->n_others; ++i) {
+		struct fs_file *file;
+		int err;
+		file = fs_file_open(c->fs, r->others[i]);
+		err = other_add(&fp, r->others[i], file);
+		if(file) fs_file_close(file);
+		if(err < 0) return 0;
+	}
+	same = !fp == !r->others_fp && (!fp || !strcmp(fp, r->others_fp));
+	free(fp);
+	return same;
+}
+
+static void replay_free(struct replay *r)
+{
+	free(r->fp);
+	free(r->others_fp);
+	s_arena_free(&r->arena);
+	free(r);
+}
+
+/* Takes @fp. */
+static struct replay *replay_new(char *fp)
+{
+	struct replay *r;
+	r = malloc(sizeof *r);
+	if(!r) {
+		free(fp);
+		return NULL;
+	}
+	r->fp = fp;
+	r->others = NULL;
+	r->n_others = r->others_size = 0;
+	r->others_fp = NULL;
+	r->entries = NULL;
+	r->n = r->size = 0;
+	r->failed = 0;
+	memset(&r->arena, 0, sizeof r->arena);
+	return r;
+}
+
+void config_add(struct config_scan *c, const struct config_entry *entry)
+{
+	if(c->recording) record(c->recording, entry);
+	c->f(c->user, entry);
+}
+
+/*
+ * What scanners keep between scans
+ */
+
+static void kept_free(struct kept *k)
+{
+	k->free(k->data);
+	free(k->device);
+	free(k->id);
+	free(k);
+}
+
+static int config_store_newfree(struct config_store *s, struct config_store **out)
+{
+	if(s) goto freeing;
+
+	s = malloc(sizeof *s);
+	if(!s) goto err0;
+	s->kept = NULL;
+	if(pthread_mutex_init(&s->lock, NULL) != 0) goto err1;
+
+	*out = s;
+	return 0;
+
+	freeing: while(s->kept) {
+		struct kept *k;
+		k = s->kept;
+		s->kept = k->next;
+		kept_free(k);
+	}
+	pthread_mutex_destroy(&s->lock);
+	err1: free(s);
+	err0: return -1;
+}
+
+int config_store_new(struct config_store **out)
+{
+	return config_store_newfree(NULL, out);
+}
+
+void config_store_free(struct config_store *s)
+{
+	config_store_newfree(s, NULL);
+}
+
+void config_store_drop(struct config_store *s, const char *device)
+{
+	struct kept **i, *dropped = NULL;
+
+	pthread_mutex_lock(&s->lock);
+	for(i = &s->kept; *i; ) {
+		struct kept *k;
+		k = *i;
+		if(strcmp(k->device, device)) {
+			i = &k->next;
+			continue;
+		}
+		*i = k->next;
+		k->next = dropped;
+		dropped = k;
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	/* Not with the lock held, they may be long lists. */
+	while(dropped) {
+		struct kept *k;
+		k = dropped;
+		dropped = k->next;
+		kept_free(k);
+	}
+}
+
+/* Unlink what the scanner being run kept for this filesystem, or what it
+ * reported if @replay is set. Call with the lock held. */
+static struct kept *unlink_kept(struct config_scan *c, unsigned replay)
+{
+	struct kept **i, *k;
+	for(i = &c->store->kept; *i; i = &(*i)->next) {
+		k = *i;
+		if(k->scanner != c->reading->scanner || k->replay != replay || strcmp(k->device, c->device) || strcmp(k->id, c->id)) continue;
+		*i = k->next;
+		return k;
+	}
+	return NULL;
+}
+
+static void *take(struct config_scan *c, unsigned replay)
+{
+	struct kept *k;
+	void *data;
+
+	if(!c->store) return NULL;
+	pthread_mutex_lock(&c->store->lock);
+	k = unlink_kept(c, replay);
+	pthread_mutex_unlock(&c->store->lock);
+	if(!k) return NULL;
+
+	data = k->data;
+	free(k->device);
+	free(k->id);
+	free(k);
+	return data;
+}
+
+static void keep(struct config_scan *c, unsigned replay, void *data, config_free_f *free_data)
+{
+	struct kept *k, *old;
+
+	if(!c->store) goto err0;
+	k = malloc(sizeof *k);
+	if(!k) goto err0;
+	k->scanner = c->reading->scanner;
+	k->replay = replay;
+	k->data = data;
+	k->free = free_data;
+	k->device = s_dup(c->device);
+	if(!k->device) goto err1;
+	k->id = s_dup(c->id);
+	if(!k->id) goto err2;
+
+	/* Another scan of the filesystem may have kept something in the
+	 * meantime. It's older. */
+	pthread_mutex_lock(&c->store->lock);
+	old = unlink_kept(c, replay);
+	k->next = c->store->kept;
+	c->store->kept = k;
+	pthread_mutex_unlock(&c->store->lock);
+	if(old) kept_free(old);
+	return;
+
+	err2: free(k->device);
+	err1: free(k);
+	err0: free_data(data);
+}
+
+void *config_take(struct config_scan *c)
+{
+	return take(c, 0);
+}
+
+void config_keep(struct config_scan *c, void *data, config_free_f *free_data)
+{
+	keep(c, 0, data, free_data);
+}
+
+void config_files(struct config_scan *c, config_file_f *f, void *user)
+{
+	size_t i;
+	for(i = 0; i < c->reading->n_files; ++i) f(user, c->reading->files[i].path, fs_file_stat(c->reading->files[i].file));
+}
+
+char *config_read(struct config_scan *c, const char *path)
+{
+	struct fs_file *file;
+	char *buf;
+	size_t i;
+	for(i = 0; i < c->reading->n_files; ++i) {
+		if(!strcmp(c->reading->files[i].path, path)) return fs_file_read_all(c->reading->files[i].file);
+	}
+	file = fs_file_open(c->fs, path);
+	if(c->recording) record_other(c->recording, path, file);
+	if(!file) return NULL;
+	buf = fs_file_read_all(file);
+	fs_file_close(file);
+	return buf;
+}
+
+/* Report again what the scanner being run reported the last time, if its
+ * files are still the same. */
+static unsigned replay(struct config_scan *c, const char *fp)
+{
+	struct replay *r;
+	size_t i;
+
+	r = take(c, 1);
+	if(!r) return 0;
+	if(strcmp(r->fp, fp) || !others_same(c, r)) {
+		replay_free(r);
+		return 0;
+	}
+	for(i = 0; i < r->n; ++i) c->f(c->user, &r->entries[i]);
+	keep(c, 1, r, (config_free_f *)replay_free);
+	return 1;
+}
+
+static void run(struct config_scan *c, struct found *found)
+{
+	char *buf;
+	if(found->is_pattern) {
+		found->scanner->scan(c, found->path, NULL, 0);
+		return;
+	}
+	if(!found->n_files) return;
+	buf = fs_file_read_all(found->files[0].file);
+	if(!buf) return;
+	found->scanner->scan(c, found->path, buf, strlen(buf));
+	free(buf);
+}
+
+void config_scan_read(struct config_scan *c, unsigned only_changed, config_entry_f *f, void *user)
+{
+	size_t i;
+	c->f = f;
+	c->user = user;
+	for(i = 0; i < c->n_found; ++i) {
+		struct found *found;
+		char *fp;
+		found = &c->found[i];
+		c->reading = found;
+		fp = found_fingerprint(found);
+		if(only_changed && fp && replay(c, fp)) {
+			free(fp);
+			continue;
+		}
+		/* Recorded for the next time, whether or not this one only
+		 * reads what changed. */
+		c->recording = NULL;
+		if(c->store && fp) c->recording = replay_new(fp);
+		else free(fp);
+		run(c, found);
+		if(c->recording && !c->recording->failed) keep(c, 1, c->recording, (config_free_f *)replay_free);
+		else if(c->recording) replay_free(c->recording);
+		c->recording = NULL;
+	}
+	c->reading = NULL;
+}
+
+size_t config_scan_dirs(struct config_scan *c, void (*f)(void *user, const char *dir), void *user)
+{
+	size_t i, n = 0;
+	for(i = 0; i < c->n_found; ++i) {
+		struct listing *l;
+		l = c->found[i].dir;
+		if(!l || l->used) continue;
+		l->used = 1;
+		f(user, l->path);
+		++n;
+	}
+	return n;
+}
+
+unsigned config_is_file_name(const char *name)
+{
+	size_t i;
+	for(i = 0; i < N_SCANNERS; ++i) {
+		const char *const *path;
+		for(path = scanners[i]->files; *path; ++path) {
+			if(is_pattern(*path) ? matches(*path, name) : !strcasecmp(strrchr(*path, '/') + 1, name)) return 1;
+		}
+	}
+	return 0;
+}
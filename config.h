@@ -0,0 +1,102 @@
+/* Boot loader config formats. Each format has a scanner that reads its config
+ * and reports the Linux boot entries in it. The scanners are listed in
+ * config.c, and adding a format is adding one there: whoever scans a
+ * filesystem only deals with config_scan.
+ *
+ * The files the scanners name are looked for in one pass over the directories
+ * they are in, so a directory several of them look in is only read once, and
+ * one that isn't there is found out about once. Then the scanners that have a
+ * file to read run, cheapest first. */
+#include <stddef.h>
+
+struct fs;
+struct fs_stat;
+struct config_scan;
+
+/* A Linux boot entry. */
+struct config_entry {
+	/* The title, NULL if there is none. */
+	const char *title;
+	/* Where the kernel and initrds are: NULL for the filesystem the config
+	 * is on, a blkid tag (UUID=... or LABEL=...) for another one, or a boot
+	 * loader's own device name, which is taken to be the config's
+	 * filesystem too. */
+	const char *device;
+	const char *kernel;
+	/* The kernel command line. */
+	const char *args;
+	/* In the order they are to be loaded. */
+	char *const *initrds;
+	size_t n_initrds;
+};
+
+struct config_scanner {
+	const char *name;
+	/* Absolute paths of the config files it reads, in order of preference:
+	 * only the first one there is read. NULL-terminated. A path whose
+	 * last part is *suffix stands for all the files in that directory
+	 * ending in suffix. */
+	const char *const *files;
+	/* Roughly how much reading the format costs, from 1 for a list of
+	 * lines to 10 for a script to run. */
+	unsigned cost;
+	/* Read @file, whose contents are @buf (null-terminated), and report
+	 * its entries with config_add(). For a pattern @buf is NULL, and the
+	 * files are got with config_files(). */
+	void (*scan)(struct config_scan *c, const char *file, const char *buf, size_t len);
+};
+
+/* For scanners. The entry and its strings are only used during the call. */
+void config_add(struct config_scan *c, const struct config_entry *entry);
+
+/* For scanners of a pattern: call @f with each file that matched, in order of
+ * path. */
+typedef void config_file_f(void *user, const char *path, const struct fs_stat *st);
+void config_files(struct config_scan *c, config_file_f *f, void *user);
+
+/* For scanners: read a file config_files() gave, or any other file on the
+ * filesystem. Newly allocated and null-terminated, NULL if it can't be
+ * read. */
+char *config_read(struct config_scan *c, const char *path);
+
+/* For scanners that keep what they read between scans of a filesystem: take
+ * what was kept the last time (NULL if nothing was), and keep something for
+ * the next time. What is kept is freed with @free_data once it's no longer
+ * wanted, right away if nothing is kept for this scan. */
+typedef void config_free_f(void *data);
+void *config_take(struct config_scan *c);
+void config_keep(struct config_scan *c, void *data, config_free_f *free_data);
+
+/* Where what the scanners keep goes, for the scans of one enumeration. It's
+ * kept by device node and filesystem id, so that two filesystems with the same
+ * UUID (clones, say) don't get each other's. config_store_drop() drops what
+ * was kept for a device that has gone away. Thread safe. */
+struct config_store;
+int config_store_new(struct config_store **out);
+void config_store_free(struct config_store *s);
+void config_store_drop(struct config_store *s, const char *device);
+
+/* For scanning a filesystem: find the config files on @fs. It must stay open
+ * until config_scan_free(). @id identifies the filesystem on @device from one
+ * scan to the next (its UUID). What the scanners keep goes into @store; if it
+ * or @id is NULL, nothing is kept. */
+int config_scan_new(struct config_scan **out, struct fs *fs, struct config_store *store, const char *device, const char *id);
+void config_scan_free(struct config_scan *c);
+
+/* Identifies the versions of the config files found, "none" if there are
+ * none. Newly allocated. */
+char *config_scan_fingerprint(struct config_scan *c);
+
+/* Read the config files found, calling @f for each entry in them. What each
+ * scanner reports is kept in the store, with what the files it read looked
+ * like. With @only_changed, a scanner whose files are the same as the last
+ * time isn't run, what it reported then is reported again. */
+typedef void config_entry_f(void *user, const struct config_entry *entry);
+void config_scan_read(struct config_scan *c, unsigned only_changed, config_entry_f *f, void *user);
+
+/* Call @f with each directory a config file was found in, once. Returns how
+ * many there were. */
+size_t config_scan_dirs(struct config_scan *c, void (*f)(void *user, const char *dir), void *user);
+
+/* Whether a file of that name (no directory) may be a config file. */
+unsigned config_is_file_name(const char *name);
@@ -1,12 +1,18 @@
 #include "disk.h"
 #include "enumerate_2.h"
+#include "fs.h"
+#include "cache.h"
+#include "config.h"
 #include "s.h"
+#include <blkid.h>
 #include <stdlib.h>
-#include <fcntl.h>
 #include <stdio.h>
+#include <unistd.h>
 #include <sys/mount.h>
+#include <sys/inotify.h>
 
 #include <string.h>
+#include <strings.h>
 #include <errno.h>
 
 /*
@@ -18,165 +24,509 @@
  * 2. The BIOS can't read every type of device.
  * 3. The BIOS often doesn't work after Linux has been loaded.
  * 4. The fact that we're not really interested in the boot menus one might get.
+ *
+ * What was found on each filesystem is remembered in the scan cache (see
+ * cache.h), and if the filesystem or its config file hasn't changed since the
+ * last time, the cached targets are used instead of reading it again.
+ *
+ * If the filesystem was already mounted by the system, it stays mounted after
+ * the scan and can be watched with inotify: each target watches its kernel and
+ * initrd, and the directories of the config files are watched so that they are
+ * read again when one is rewritten.
  */
 
+/* The device being scanned. */
+struct scan {
+	struct bootloader_enumerate *e;
+	const char *devfile, *syspath;
+	/* From enumerate_scan_begin(), 0 when publishing from the cache on the
+	 * monitor thread. */
+	unsigned long long scan;
+	/* Filesystem UUID. NULL if there is none, in which case nothing is
+	 * cached. */
+	char *uuid;
+	/* Whether found targets go into the cache record. */
+	unsigned caching;
+	/* Where the filesystem is mounted if it stays mounted, NULL
+	 * otherwise. */
+	const char *mountpoint;
+	/* For what is only needed during the scan. */
+	struct s_arena arena;
+};
+
+/* What kind of changes to look out for. */
+#define FILE_EVENTS (IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF)
+#define DIR_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE)
+
+/* Read all pending events from an inotify fd. Returns their masks ORed
+ * together, only counting events for the names @is_name accepts (or all of
+ * them if it is NULL) and events about the watches themselves. */
+static uint32_t drain(int fd, unsigned (*is_name)(const char *name))
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	ssize_t len;
+	uint32_t mask = 0;
+	while((len = read(fd, buf, sizeof buf)) > 0) {
+		char *p;
+		for(p = buf; p < buf + len; ) {
+			struct inotify_event *ev;
+			ev = (struct inotify_event *)p;
+			if(!is_name || !ev->len || is_name(ev->name)) mask |= ev->mask;
+			p += sizeof *ev + ev->len;
+		}
+	}
+	return mask;
+}
+
+/* Target data */
+struct disk_target {
+	char *syspath;
+	/* The kernel and initrd (or NULL) when they are watched. */
+	char *files[2];
+};
+
 static void disk_target_free(struct enumerate_target *t)
 {
+	struct disk_target *d;
+	d = t->data;
+	if(t->fd >= 0) close(t->fd);
+	free(d->files[0]);
+	free(d->files[1]);
+	free(d->syspath);
+	free(d);
 	free(t->cmd);
-	free(t->data);
 	free(t);
 }
 
-static unsigned on_remove(struct enumerate_target *t, const char *syspath)
+/* (Re)watch the files of a target. Adding a watch again is harmless, and
+ * follows a file that has been replaced by a new one. Fails if a file is
+ * missing. */
+static int watch_files(struct enumerate_target *t)
 {
-	if(!strcmp(t->data, syspath)) return 1;
+	struct disk_target *d;
+	unsigned i;
+	d = t->data;
+	for(i = 0; i < 2; ++i) {
+		if(d->files[i] && inotify_add_watch(t->fd, d->files[i], FILE_EVENTS) < 0) return -1;
+	}
 	return 0;
 }
 
-static void add_target(struct bootloader_enumerate *e, char *target, const char *syspath, const char *name)
+static unsigned disk_target_event(struct enumerate_target *t)
+{
+	/* The watches are gone with the mount, but the files may well be
+	 * there. */
+	if(drain(t->fd, NULL) & IN_UNMOUNT) return 0;
+	return watch_files(t) < 0;
+}
+
+/* Path to the file named by the first word of @arg, NULL if it isn't an
+ * absolute path. */
+static char *file_path(const char *mountpoint, const char *arg)
+{
+	char *path;
+	size_t len, file_len;
+	if(arg[0] != '/') return NULL;
+	len = strlen(mountpoint);
+	file_len = strcspn(arg, " \t");
+	path = malloc(len + file_len + 1);
+	if(!path) return NULL;
+	memcpy(path, mountpoint, len);
+	memcpy(path + len, arg, file_len);
+	path[len + file_len] = '\0';
+	return path;
+}
+
+/* Watch the kernel and initrd of a target, if the filesystem stays mounted.
+ * The target works without it, so failure is ignored. */
+static void watch_target(struct scan *s, struct enumerate_target *t, const char *kernel, const char *initrd)
+{
+	struct disk_target *d;
+	d = t->data;
+	if(!s->mountpoint) return;
+
+	d->files[0] = file_path(s->mountpoint, kernel);
+	if(!d->files[0]) goto err0;
+	if(initrd) {
+		d->files[1] = file_path(s->mountpoint, initrd);
+		if(!d->files[1]) goto err0;
+	}
+	t->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if(t->fd < 0) goto err0;
+	if(watch_files(t) < 0) goto err1;
+	return;
+
+	err1: close(t->fd);
+	t->fd = -1;
+	err0: free(d->files[0]);
+	free(d->files[1]);
+	d->files[0] = d->files[1] = NULL;
+}
+
+/* Takes ownership of @cmd. */
+static struct enumerate_target *new_target(struct scan *s, char *cmd)
 {
 	struct enumerate_target *t;
+	struct disk_target *d;
 
 	t = malloc(sizeof *t);
 	if(!t) goto err0;
+	d = malloc(sizeof *d);
+	if(!d) goto err1;
+	d->files[0] = d->files[1] = NULL;
+	d->syspath = s_dup(s->syspath);
+	if(!d->syspath) goto err2;
 
 	t->free = disk_target_free;
-	t->on_remove = on_remove;
-	t->cmd = target;
+	t->event = disk_target_event;
+	t->cmd = cmd;
 	t->fd = -1;
-	t->data = s_dup(syspath);
-	enumerate_add_target(e, t, name);
+	t->data = d;
+	t->syspath = d->syspath;
+	return t;
 
-	return;
+	err2: free(d);
+	err1: free(t);
+	err0: free(cmd);
+	return NULL;
+}
+
+/* @name is only a suggestion. The name the target gets is cached as it is: a
+ * new target's is provisional until the namer gives it its final name there,
+ * one that was already there may have that already. */
+static void add_target(struct scan *s, struct enumerate_target *t, const char *name)
+{
+	char *cmd = NULL, *display_name;
+	unsigned final;
 
-	err0: free(target);
+	/* The target isn't ours any more once added. */
+	if(s->uuid && s->caching) cmd = s_arena_dup(&s->arena, t->cmd);
+	display_name = enumerate_add_target(s->e, t, name, s->scan, &final);
+	if(cmd && display_name) cache_put_target(enumerate_get_cache(s->e), s->uuid, cmd, display_name, final);
+	free(display_name);
 }
 
-static unsigned read_word(char **s, const char *word, unsigned is_symbol)
+/* Publish a cached target. The device node in the command may be out of
+ * date, as in the disk being sdb the last time and sdc now. */
+static void add_cached_target(void *user, const char *devnode, const char *cmd, const char *name, unsigned final)
 {
-	unsigned i;
-	for(i = 0; word[i]; ++i) {
-		if(word[i] != (*s)[i]) return 0;
+	struct scan *s;
+	size_t len;
+	char *target;
+	struct enumerate_target *t;
+	s = user;
+	len = strlen(devnode);
+	if(!strncmp(cmd, "linux ", 6) && !strncmp(cmd + 6, devnode, len) && cmd[6 + len] == ' ') {
+		target = s_concat("linux ", s->devfile, cmd + 6 + len, NULL);
 	}
-	if(!is_symbol && strchr("abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789", (*s)[i])) return 0;
-	*s += i;
+	else target = s_dup(cmd);
+	if(target && (t = new_target(s, target))) enumerate_add_cached_target(s->e, t, name, final, s->scan);
+}
+
+/* Publish the cached targets of the filesystem if the fingerprints match. */
+static unsigned publish_cached(struct scan *s, const char *sb_fp, const char *cfg_fp)
+{
+	struct cache *cache;
+	cache = enumerate_get_cache(s->e);
+	if(!cache_get(cache, s->uuid, sb_fp, cfg_fp, add_cached_target, s)) return 0;
+	cache_update(cache, s->uuid, s->devfile, sb_fp, cfg_fp);
 	return 1;
 }
 
-static void read_menuentry(struct bootloader_enumerate *e, const char *devfile, const char *syspath, FILE *grub_conf, const char *name)
+void disk_publish_cached(struct bootloader_enumerate *e, const char *devfile, const char *syspath, const char *uuid)
 {
-	char *line, *a, *linux_cmd = NULL, *initrd = NULL, *root = NULL;
+	struct scan s;
+	s.e = e;
+	s.devfile = devfile;
+	s.syspath = syspath;
+	s.scan = 0;
+	s.uuid = (char *)uuid;
+	s.caching = 0;
+	s.mountpoint = NULL;
+	memset(&s.arena, 0, sizeof s.arena);
+	cache_get(enumerate_get_cache(e), uuid, NULL, NULL, add_cached_target, &s);
+	s_arena_free(&s.arena);
+}
 
-	while(line = a = s_getline(grub_conf)) {
-		line += strspn(line, " \t");
+/* Look at the superblock without mounting anything. Returns 0 if the device
+ * holds a filesystem, and its UUID (or NULL) in @uuid_out. Swap, RAID and LVM
+ * members, encrypted volumes and devices with nothing on them return 1, and
+ * -1 if the device can't be read. */
+static int probe(const char *devfile, char **uuid_out)
+{
+	blkid_probe pr;
+	const char *usage, *uuid;
+	int retv = -1, found;
 
-		if(read_word(&line, "linux", 0)) {
-			line += strspn(line, " \t");
-			free(linux_cmd);
-			linux_cmd = s_dup(line);
-		}
-		else if(read_word(&line, "initrd", 0)) {
-			line += strspn(line, " \t");
-			free(initrd);
-			initrd = s_dup(line);
-		}
-		else if(read_word(&line, "search", 0)) {
-			char *set;
-			/* The search command is used to look for devices */
-			if(!strstr(line, "--fs-uuid")) goto search_out;
-			set = strstr(line, "--set");
-			if(set && strcmp(set, "--set=root")) goto search_out;
-
-			/* TODO finish this soon as someone has a system
-			 * where the kernel is not on the same partition as
-			 * grub.cfg. */
-
-			search_out:;
-		}
-		else if(read_word(&line, "}", 1)) {
-			free(a);
-			break;
-		}
+	*uuid_out = NULL;
+	pr = blkid_new_probe_from_filename(devfile);
+	if(!pr) goto err0;
+	/* Superblocks only, no partition tables. */
+	blkid_probe_enable_superblocks(pr, 1);
+	blkid_probe_set_superblocks_flags(pr, BLKID_SUBLKS_USAGE | BLKID_SUBLKS_UUID);
+	blkid_probe_enable_partitions(pr, 0);
+	found = blkid_do_safeprobe(pr);
+	if(found == -1) goto err1;
+	retv = 1;
+	if(found != 0) goto err1;
+
+	if(blkid_probe_lookup_value(pr, "USAGE", &usage, NULL) < 0) goto err1;
+	if(strcmp(usage, "filesystem")) goto err1;
+	if(blkid_probe_lookup_value(pr, "UUID", &uuid, NULL) == 0) *uuid_out = s_dup(uuid);
+	retv = 0;
+
+	err1: blkid_free_probe(pr);
+	err0: return retv;
+}
+
+/* Boot loaders' own device names can't be mapped to ours, but they nearly
+ * always name the filesystem the config is on. Returns NULL if the device isn't
+ * there. *@local_out says if it's the one being scanned. */
+static const char *resolve_device(struct scan *s, const char *device, char **resolved_out, unsigned *local_out)
+{
+	*resolved_out = NULL;
+	*local_out = 1;
+	if(!device) return s->devfile;
+	if(!strncmp(device, "UUID=", 5)) {
+		if(s->uuid && !strcasecmp(device + 5, s->uuid)) return s->devfile;
+	}
+	else if(strncmp(device, "LABEL=", 6)) return s->devfile;
+
+	*resolved_out = blkid_evaluate_spec(device, NULL);
+	if(!*resolved_out) return NULL;
+	*local_out = !strcmp(*resolved_out, s->devfile);
+	return *resolved_out;
+}
+
+static void config_entry(void *user, const struct config_entry *g)
+{
+	struct scan *s;
+	const char *devfile;
+	char *resolved, *target;
+	const char *initrds;
+	struct enumerate_target *t;
+	unsigned local;
+	size_t i;
 
-		free(a);
+	s = user;
+	devfile = resolve_device(s, g->device, &resolved, &local);
+	if(!devfile) return;
+
+	/* Each initrd as an option of its own. */
+	initrds = "";
+	for(i = 0; initrds && i < g->n_initrds; ++i) {
+		initrds = s_arena_concat(&s->arena, initrds, " initrd=", g->initrds[i], NULL);
 	}
+	if(!initrds) goto out;
 
-	if(linux_cmd) {
-		char *target;
-		target = s_concat("linux ", root ? root : devfile, " ", linux_cmd, initrd ? " initrd=" : "", initrd ? initrd : "", NULL);
-		add_target(e, target, syspath, name);
+	target = s_concat("linux ", devfile, " ", g->kernel, g->args[0] ? " " : "", g->args, initrds, NULL);
+	if(target && (t = new_target(s, target))) {
+		/* The microcode comes first, the initrd proper last. */
+		if(local) watch_target(s, t, g->kernel, g->n_initrds ? g->initrds[g->n_initrds - 1] : NULL);
+		add_target(s, t, g->title);
 	}
+	out: free(resolved);
+}
+
+/*
+ * Watching the config files
+ */
+
+struct config_watch {
+	struct enumerate_watch w;
+	struct bootloader_enumerate *e;
+	char *devfile, *syspath, *mountpoint;
+};
 
-	/* Done with this menuentry */
-	free(linux_cmd);
-	free(initrd);
-	free(root);
+static void config_watch_free(struct enumerate_watch *w)
+{
+	struct config_watch *c;
+	c = w->data;
+	close(w->fd);
+	free(c->devfile);
+	free(c->syspath);
+	free(c->mountpoint);
+	free(c);
 }
 
-void disk_scan(struct bootloader_enumerate *e, const char *devfile, const char *syspath, unsigned is_partition)
+/* A config file has been written, moved or deleted. Its configs are read
+ * again by the scan threads (see disk_scan_configs()): reading them here
+ * would hold up the monitor thread for as long as the disk takes. */
+static void config_event(struct enumerate_watch *w)
 {
-	const char *mountpoint;
-	struct smount *smnt;
+	struct config_watch *c;
+	uint32_t mask;
+
+	c = w->data;
+	mask = drain(w->fd, config_is_file_name);
+	if(!mask || mask & IN_UNMOUNT) return;
+	enumerate_rescan_configs(c->e, c->devfile);
+}
+
+/* Config files are usually replaced rather than written in place, so it's
+ * their directories that are watched. */
+static void watch_dir(void *user, const char *dir)
+{
+	struct config_watch *c;
+	char *path;
+	c = user;
+	path = s_concat(c->mountpoint, dir, NULL);
+	if(path) inotify_add_watch(c->w.fd, path, DIR_EVENTS);
+	free(path);
+}
+
+static void watch_config(struct scan *s, struct config_scan *cs)
+{
+	struct config_watch *c;
 
-	if(smount_new(&smnt, &mountpoint, devfile) < 0) goto err0;
+	c = malloc(sizeof *c);
+	if(!c) goto err0;
+	c->w.free = config_watch_free;
+	c->w.event = config_event;
+	c->w.data = c;
+	c->e = s->e;
+	c->devfile = s_dup(s->devfile);
+	c->syspath = s_dup(s->syspath);
+	c->mountpoint = s_dup(s->mountpoint);
+	c->w.syspath = c->syspath;
+	if(!c->devfile || !c->syspath || !c->mountpoint) goto err1;
+
+	c->w.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if(c->w.fd < 0) goto err1;
+	if(!config_scan_dirs(cs, watch_dir, c)) goto err2;
+
+	enumerate_add_watch(s->e, &c->w);
+	return;
 
-	/* Look for GRUB 2 config */
+	err2: close(c->w.fd);
+	err1: free(c->devfile);
+	free(c->syspath);
+	free(c->mountpoint);
+	free(c);
+	err0:;
+}
+
+/* For checking the cache without publishing anything. */
+static void ignore_target(void *user, const char *devnode, const char *cmd, const char *name, unsigned final)
+{
+}
+
+int disk_scan(struct bootloader_enumerate *e, const char *devfile, const char *syspath, unsigned is_partition, unsigned long long scan, char **uuid)
+{
+	struct scan s;
+	struct cache *cache;
+	char *sb_fp = NULL;
+	struct fs *fs;
+	int retv;
+
+	s.e = e;
+	s.devfile = devfile;
+	s.syspath = syspath;
+	s.scan = scan;
+	s.caching = 0;
+	s.mountpoint = NULL;
+	memset(&s.arena, 0, sizeof s.arena);
+	cache = enumerate_get_cache(e);
+	retv = probe(devfile, &s.uuid);
+	if(retv != 0) {
+		/* There's nothing to scan on it. */
+		if(retv > 0) retv = 0;
+		goto err0;
+	}
+
+	/* If nothing has been written to the filesystem since the last scan,
+	 * there is no need to look at it. */
+	if(s.uuid) sb_fp = cache_sb_fingerprint(devfile);
+	if(sb_fp && publish_cached(&s, sb_fp, NULL)) goto err0;
+
+	/* Only a filesystem the system has mounted can be watched. */
+	if(fs_open(&fs, devfile) < 0) {
+		retv = -1;
+		goto err0;
+	}
+	s.mountpoint = fs_system_mountpoint(fs);
+
+	/* Look for boot loader configs */
 	{
-		static const char *grub_files[] = {
-			"/boot/grub/grub.cfg",
-			"/grub/grub.cfg",
-		};
-
-		unsigned i;
-		FILE *grub_conf;
-		for(i = 0; i < sizeof grub_files / sizeof grub_files[0]; ++i) {
-			char *path;
-			path = s_concat(mountpoint, grub_files[i], NULL);
-			grub_conf = fopen(path, "r");
-			free(path);
-			if(grub_conf) break;
-		}
-		if(!grub_conf) goto grub_out;
-
-		/* Read a GRUB 2 config file (more like skim, really) */
-		{
-			char *line, *a;
-			while(line = a = s_getline(grub_conf)) {
-				line += strspn(line, " \t");
-				if(read_word(&line, "menuentry", 0)) {
-					char *name;
-					name = line + strcspn(line, "'\"") + 1;
-					*(name + strcspn(name, "'\"")) = '\0';
-					read_menuentry(e, devfile, syspath, grub_conf, name[0] == '\0' ? NULL : name);
-				}
-				free(a);
-			}
+		struct config_scan *cs;
+		char *cfg_fp;
+		unsigned read = 1;
+		if(config_scan_new(&cs, fs, enumerate_get_config_store(e), devfile, s.uuid) < 0) goto config_out;
+
+		/* The config files are the same as the last time, so are the
+		 * targets. They are still read if they can be watched, as the
+		 * cached ones can't. */
+		cfg_fp = config_scan_fingerprint(cs);
+		s.caching = 1;
+		if(s.uuid) {
+			unsigned hit;
+			if(!cfg_fp) hit = 0;
+			else if(s.mountpoint) hit = cache_get(cache, s.uuid, NULL, cfg_fp, ignore_target, NULL);
+			else hit = publish_cached(&s, NULL, cfg_fp);
+			if(hit) cache_update(cache, s.uuid, devfile, sb_fp, NULL);
+			else cache_put(cache, s.uuid, devfile, sb_fp, cfg_fp);
+			s.caching = !hit;
+			read = !hit || s.mountpoint;
 		}
+		free(cfg_fp);
 
-		fclose(grub_conf);
-		grub_out:;
+		if(read) config_scan_read(cs, 0, config_entry, &s);
+		if(s.mountpoint) watch_config(&s, cs);
+		config_scan_free(cs);
+		config_out:;
 	}
 
-	/* TODO: Look for GRUB legacy config */
-	//"/boot/grub/menu.lst",
-	//"/grub/menu.lst",
+	fs_close(fs);
+	err0: free(sb_fp);
+	*uuid = s.uuid;
+	s_arena_free(&s.arena);
+	return retv;
+}
+
+int disk_scan_configs(struct bootloader_enumerate *e, const char *devfile, const char *syspath, const char *uuid, unsigned long long scan)
+{
+	struct scan s;
+	struct cache *cache;
+	struct config_scan *cs;
+	struct fs *fs;
+	char *cfg_fp;
 
-	/* Look for boot.ini (Windows) */
-	{
-		char *boot_ini_path;
-		FILE *boot_ini;
-		boot_ini_path = s_concat(mountpoint, "/boot.ini", NULL);
-		if(!boot_ini_path) goto ini_err0;
-		boot_ini = fopen(boot_ini_path, "r");
-		if(!boot_ini) goto ini_err1;
-
-		//TODO read boot.ini for windows
-
-		fclose(boot_ini);
-		ini_err1: free(boot_ini_path);
-		ini_err0:;
+	s.e = e;
+	s.devfile = devfile;
+	s.syspath = syspath;
+	s.scan = scan;
+	s.uuid = NULL;
+	s.caching = 0;
+	memset(&s.arena, 0, sizeof s.arena);
+	cache = enumerate_get_cache(e);
+
+	/* The filesystem is mounted by the system, or it couldn't have been
+	 * watched, so this is only a lookup. */
+	if(fs_open(&fs, devfile) < 0) goto err0;
+	s.mountpoint = fs_system_mountpoint(fs);
+	if(config_scan_new(&cs, fs, enumerate_get_config_store(e), devfile, uuid) < 0) goto err1;
+
+	/* The cached targets are replaced by what is found now. Without a
+	 * superblock fingerprint, the next start reads the configs again
+	 * rather than trusting the cache. */
+	if(uuid) {
+		s.uuid = s_dup(uuid);
+		cfg_fp = config_scan_fingerprint(cs);
+		if(s.uuid && cfg_fp) {
+			cache_put(cache, s.uuid, devfile, NULL, cfg_fp);
+			s.caching = 1;
+		}
+		free(cfg_fp);
 	}
 
-	smount_free(smnt);
-	err0: return;
+	config_scan_read(cs, 1, config_entry, &s);
+	if(s.mountpoint) watch_config(&s, cs);
+	config_scan_free(cs);
+	fs_close(fs);
+	free(s.uuid);
+	s_arena_free(&s.arena);
+	return 0;
+
+	err1: fs_close(fs);
+	err0: return -1;
 }
@@ -1,2 +1,15 @@
 struct bootloader_enumerate;
-void disk_scan(struct bootloader_enumerate *e, const char *devfile, const char *syspath, unsigned is_partition);
+/* @scan is from enumerate_scan_begin(). Returns -1 if the device couldn't be
+ * read or mounted, 0 otherwise, even if there was nothing on it. *@uuid gets
+ * the UUID of the filesystem found, to be freed, or NULL. */
+int disk_scan(struct bootloader_enumerate *e, const char *devfile, const char *syspath, unsigned is_partition, unsigned long long scan, char **uuid);
+
+/* Read the configs of a filesystem disk_scan() has been through again, after
+ * some of them changed. Only the config files that changed are parsed, the
+ * entries of the others are those found the last time. @uuid is from
+ * disk_scan(). Returns -1 if the filesystem couldn't be opened. */
+int disk_scan_configs(struct bootloader_enumerate *e, const char *devfile, const char *syspath, const char *uuid, unsigned long long scan);
+
+/* Publish what the scan cache has for a filesystem without looking at it. The
+ * next disk_scan() of the device confirms or withdraws them. */
+void disk_publish_cached(struct bootloader_enumerate *e, const char *devfile, const char *syspath, const char *uuid);
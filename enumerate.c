@@ -3,18 +3,37 @@
 #include "enumerate_2.h"
 #include "target_2.h"
 #include "disk.h"
+#include "scan.h"
+#include "cache.h"
+#include "config.h"
+#include "queue.h"
+#include "namer.h"
+#include "remote.h"
+#include "table.h"
+#include "journal.h"
+#include "throttle.h"
+#include "blockdev.h"
+#include "registry.h"
+#include "smount.h"
+#include "fs.h"
 #include "s.h"
-#include <libudev.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h>
+#include <unistd.h>
 #include <sys/epoll.h>
-#include <poll.h>
+#include <sys/timerfd.h>
+#include <sys/stat.h>
 #include <pthread.h>
+#include <time.h>
+#include <fnmatch.h>
 
 /*
  * This code monitors the system for bootable devices. The monitoring itself
  * is done in a separate thread, because it needs to mount filesystems and read
  * files and generally mess about in a way that blocks for long periods of time.
+ * The scanning of the devices is handed off further to a pool of threads (see
+ * scan.h), so that one slow device doesn't hold up the others.
  */
 
 /* TODO:
@@ -22,8 +41,6 @@
  * Config file allowing to blacklist hardware devices or add netboot targets
  * at start.
  *
- * Use Inotify to see if targets become unavailable even as the device remains.
- *
  * Use AIO with eventfd instead of a thread. (Or does mount() block too long?)
  */
 
@@ -33,204 +50,1371 @@ typedef void event_f(struct bootloader_enumerate *e, void *user);
 struct event_handle {
 	event_f *f;
 	void *user;
+
+	/* Whatever owns a handle may be removed from any thread while the
+	 * monitor thread is about to call f for it. So it's only marked dead
+	 * and put on a list, and the monitor thread frees it with destroy
+	 * before it next waits for events. */
+	unsigned dead;
+	event_f *destroy;
+	struct event_handle *next_dead;
 };
 
 /* Main context for this part of the library. */
 struct bootloader_enumerate {
+	struct bootloader_enumerate_settings settings;
 	pthread_t monitor_thread;
 	int command_pipe[2];
-	char *target_cmd, *display_name;
+
+	/* Threads scanning devices. */
+	struct scan_pool *pool;
+
+	/* Names the targets the scans find. */
+	struct namer *namer;
+
+	/* What the last scans found, for a quick start. */
+	struct cache *cache;
+	/* What the config scanners read in the last scans, to read only what
+	 * has changed. */
+	struct config_store *store;
+
+	/* Keeps the scans, the namer and the monitor thread out of the way
+	 * (see throttle.h). NULL in a client, which doesn't scan. */
+	struct throttle *throttle;
+
+	/* Protects the targets, which are used from the scan threads as
+	 * well as the monitor thread. Also makes whoever holds it the single
+	 * producer of the change queue. */
+	pthread_mutex_t lock;
 
 	/* Used in the monitor thread to wait for several sources. */
 	int epoll_fd;
 
-	/* Udev stuff */
-	struct udev *udev;
-	struct udev_monitor *monitor;
+	/* Other processes getting the targets from this one, if it serves
+	 * them (see remote.h). Protected by lock. */
+	struct remote_server *server;
+	struct event_handle server_handle;
+	/* What the clients have been sent, which is everything. The id
+	 * tells this daemon from the one that was there before, whose
+	 * generations meant something else. */
+	char *id;
+	unsigned long long served;
+	struct journal *served_journal;
+
+	/* Where the targets come from instead of udev in a client of a
+	 * daemon. NULL while it's gone, when the timer is for trying again.
+	 * Only used in the monitor thread. */
+	char *daemon_path;
+	struct remote_conn *daemon;
+	struct event_handle daemon_handle;
+	/* Which daemon was last heard from, up to which generation (see
+	 * REMOTE_HELLO). Set while it's sending all its targets, which
+	 * replace the ones it sent before. And whether the targets have
+	 * been given up on, after the daemon went away and didn't come back
+	 * right away. */
+	char *daemon_id;
+	unsigned long long daemon_generation;
+	unsigned resyncing;
+	unsigned abandoned;
+
+	/* Block devices and their events, from udev or the kernel. */
+	struct blockdev_source *source;
 	struct event_handle monitor_handle;
 
-	/* Active targets, and associated information. */
-	struct target_list *targets;
+	/* Devices with events waiting to settle (struct pending), and
+	 * the timer for the first one that will. Only used in the monitor
+	 * thread. */
+	struct pending *pending;
+	int timer_fd;
+	struct event_handle timer_handle;
+
+	/* Active targets (struct target_node), and associated information. */
+	struct registry *targets;
+
+	/* Watches on things like config files (struct watch_node). */
+	struct watch_node *watches;
+
+	/* What is known about the devices that have been scanned (struct
+	 * device). Protected by lock. */
+	struct device *devices;
+	/* The number of the last scan started (see enumerate_scan_begin()).
+	 * Protected by lock. */
+	unsigned long long scans;
+
+	/* What the user wants to hear about, with the strings owned.
+	 * Protected by lock. */
+	struct bootloader_filter filter;
+
+	/* Handles waiting to be freed by the monitor thread. */
+	struct event_handle *dead;
+
+	/* Changes waiting for bootloader_enumerate_get_change(). Its eventfd
+	 * is the user-visible fd. */
+	struct queue *changes;
+
+	/* Number of changes so far, and the last of them. Protected by
+	 * lock. */
+	unsigned long long generation;
+	struct journal *journal;
+
+	/* The targets the user has been told about, in shared memory.
+	 * Written under lock. */
+	struct table *table;
+
+	/* The device the running system has /boot on, and the syspath of its
+	 * disk, to scan them first. 0 and NULL if they aren't known. */
+	dev_t boot_dev;
+	char *boot_disk;
+
+	/* When the enumeration started, and what has happened since. The
+	 * devices that were there at the start have been queued once
+	 * enumerated is set. Protected by lock. */
+	unsigned long long start_ms;
+	struct bootloader_enumerate_stats stats;
+	unsigned enumerated;
+};
+
+static unsigned long long now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+/* What bootloader_enumerate_get_change() returns. */
+enum { CHANGE_NONE, CHANGE_ADD, CHANGE_REMOVE, CHANGE_RENAME };
+
+/*
+ * Devices
+ */
 
-	/* User-visible fd. Events take the form of a character ('a' for add or
-	 * 'd' for delete) followed by a null-terminated string. */
-	int event_pipe[2];
+struct device {
+	struct device *next;
+	char *syspath;
+	/* What the start of the device looked like when a scan last got
+	 * through it (see cache_dev_fingerprint()), NULL if it couldn't be
+	 * read. */
+	char *fp;
+	/* The UUID of the filesystem the last full scan found on it, NULL if
+	 * none, for reading just its configs again. */
+	char *uuid;
+	/* BOOTLOADER_DEVICE_* */
+	unsigned type;
+	/* The last scan started on it, the only one that may still publish
+	 * for it. A scan given up on may return long after its retry. */
+	unsigned long long scan;
 };
 
+/* Call with the lock held. */
+static struct device *find_device(struct bootloader_enumerate *e, const char *syspath)
+{
+	struct device *d;
+	for(d = e->devices; d && strcmp(d->syspath, syspath); d = d->next);
+	return d;
+}
+
+/* Find the device, or start a record of it. NULL if out of memory. Call with
+ * the lock held. */
+static struct device *add_device(struct bootloader_enumerate *e, const char *syspath)
+{
+	struct device *d;
+	d = find_device(e, syspath);
+	if(d) return d;
+	d = malloc(sizeof *d);
+	if(!d) goto err0;
+	d->syspath = s_dup(syspath);
+	if(!d->syspath) goto err1;
+	d->fp = NULL;
+	d->uuid = NULL;
+	d->type = BOOTLOADER_DEVICE_FIXED;
+	d->scan = 0;
+	d->next = e->devices;
+	e->devices = d;
+	return d;
+
+	err1: free(d);
+	err0: return NULL;
+}
+
+/* Call with the lock held. */
+static void forget_device(struct bootloader_enumerate *e, const char *syspath)
+{
+	struct device **i, *d;
+	for(i = &e->devices; *i && strcmp((*i)->syspath, syspath); i = &(*i)->next);
+	d = *i;
+	if(!d) return;
+	*i = d->next;
+	free(d->syspath);
+	free(d->fp);
+	free(d->uuid);
+	free(d);
+}
+
+/* USB hard drives don't say they're removable. */
+static unsigned device_type(struct blockdev *d, struct blockdev *disk)
+{
+	const char *removable, *bus;
+	if(blockdev_get_property(d, "ID_CDROM")) return BOOTLOADER_DEVICE_OPTICAL;
+	removable = blockdev_get_sysattr(disk, "removable");
+	bus = blockdev_get_property(d, "ID_BUS");
+	if((removable && !strcmp(removable, "1")) || (bus && !strcmp(bus, "usb"))) return BOOTLOADER_DEVICE_REMOVABLE;
+	return BOOTLOADER_DEVICE_FIXED;
+}
+
+/* Remember what type of device @d is before its targets are published, for
+ * the filter. */
+static void note_device(struct bootloader_enumerate *e, struct blockdev *d, struct blockdev *disk)
+{
+	struct device *dev;
+	pthread_mutex_lock(&e->lock);
+	dev = add_device(e, blockdev_get_syspath(d));
+	if(dev) dev->type = device_type(d, disk);
+	pthread_mutex_unlock(&e->lock);
+}
+
 /*
  * Targets
  */
 
-struct target_list {
-	struct target_list *next;
+struct target_node {
+	/* Indexed by the target's cmd and syspath. Must be first. */
+	struct registry_node node;
 	/* This data is specific to the type of target and is created/handled elsewhere. */
 	struct enumerate_target *target;
 	struct event_handle handle;
 	char *display_name;
+	/* Cleared when a scan of the target's device starts, set again if the
+	 * scan finds the target. */
+	unsigned confirmed;
+	/* Published from the cache and not yet found by a scan. */
+	unsigned from_cache;
+	/* Handed to the namer, or has its name already. */
+	unsigned named;
+	/* Has the name the namer gave it, in this run or an earlier one (see
+	 * cache_rename_target()). */
+	unsigned final;
+	/* The user has been told about it, as it passes the filter. */
+	unsigned told;
+	/* Watched by the daemon it came from. */
+	unsigned watched;
 };
 
-static void target_event(struct bootloader_enumerate *e, struct target_list *t)
+/* Whether @str is @word or starts with it and a space. */
+static unsigned starts_with_word(const char *str, const char *word)
+{
+	size_t len;
+	len = strlen(word);
+	return !strncmp(str, word, len) && (str[len] == ' ' || !str[len]);
+}
+
+/* Whether the user wants to hear about @t. Targets on no device the library
+ * knows count as being on a fixed one. Call with the lock held. */
+static unsigned wanted(struct bootloader_enumerate *e, struct target_node *t)
+{
+	const struct bootloader_filter *f;
+	f = &e->filter;
+	if(f->devices) {
+		struct device *d;
+		d = t->node.syspath ? find_device(e, t->node.syspath) : NULL;
+		if(!(f->devices & (d ? d->type : BOOTLOADER_DEVICE_FIXED))) return 0;
+	}
+	if(f->type && !starts_with_word(t->node.cmd, f->type)) return 0;
+	if(f->cmd_pattern && fnmatch(f->cmd_pattern, t->node.cmd, 0)) return 0;
+	if(f->name_pattern && fnmatch(f->name_pattern, t->display_name, 0)) return 0;
+	return 1;
+}
+
+/* BOOTLOADER_TARGET_* */
+static unsigned target_flags(struct target_node *t)
+{
+	unsigned flags = 0;
+	if(t->from_cache) flags |= BOOTLOADER_TARGET_FROM_CACHE;
+	if(t->target->fd >= 0 || t->watched) flags |= BOOTLOADER_TARGET_WATCHED;
+	return flags;
+}
+
+/* A change to @t, for a journal. Call with the lock held. */
+static void describe(struct bootloader_enumerate *e, int type, unsigned long long generation, struct target_node *t, struct journal_entry *out)
 {
-	if(t->target->event(t->target)) {
-		/* The target has become unavailable. */
-		struct target_list **i;
-		char *target_str;
+	struct device *d;
+	d = t->node.syspath ? find_device(e, t->node.syspath) : NULL;
+	out->generation = generation;
+	out->type = type;
+	out->flags = target_flags(t);
+	out->device = d ? d->type : BOOTLOADER_DEVICE_FIXED;
+	out->cmd = t->node.cmd;
+	out->display_name = t->display_name;
+	out->syspath = t->node.syspath;
+}
 
-		/* Tell the user. */
-		write(e->event_pipe[1], "d", 1);
-		write(e->event_pipe[1], t->target->cmd, strlen(t->target->cmd) + 1);
-		write(e->event_pipe[1], t->display_name, strlen(t->display_name) + 1);
+/* Call with the lock held. */
+static void update_table(struct bootloader_enumerate *e)
+{
+	struct registry_node *i;
+	size_t n = 0;
+	for(i = registry_next(e->targets, NULL); i; i = registry_next(e->targets, i)) n += ((struct target_node *)i)->told;
+	table_begin(e->table, n, e->generation);
+	for(i = registry_next(e->targets, NULL); i; i = registry_next(e->targets, i)) {
+		struct target_node *t;
+		t = (struct target_node *)i;
+		if(t->told) table_add(e->table, i->cmd, t->display_name, i->syspath, target_flags(t));
+	}
+	table_end(e->table);
+}
 
-		/* Remove it. */
-		for(i = &e->targets; *i != t; i = &(*i)->next);
-		*i = t->next;
+/* Tell the user about a change to @t if it's one they want to hear about.
+ * What they don't want never gets into the queue, so it costs them neither a
+ * wakeup nor a copy. Call with the lock held. */
+static void tell_user(struct bootloader_enumerate *e, int type, struct target_node *t)
+{
+	struct journal_entry entry;
+	unsigned want;
+	want = type != CHANGE_REMOVE && wanted(e, t);
+	if(type == CHANGE_ADD && !want) return;
+	if(type == CHANGE_REMOVE && !t->told) return;
+	/* A new name may take the target in or out of the filter. */
+	if(type == CHANGE_RENAME) {
+		if(!want && !t->told) return;
+		if(!want) type = CHANGE_REMOVE;
+		else if(!t->told) type = CHANGE_ADD;
+	}
+	t->told = type != CHANGE_REMOVE;
 
-		if(t->target->fd >= 0) epoll_ctl(e->epoll_fd, EPOLL_CTL_DEL, t->target->fd, NULL);
-		t->target->free(t->target);
-		free(t);
+	++e->generation;
+	queue_push(e->changes, type, e->generation, t->target->cmd, t->display_name);
+	describe(e, type, e->generation, t, &entry);
+	journal_add(e->journal, &entry);
+	update_table(e);
+	if(type == CHANGE_ADD) {
+		long long now;
+		now = now_ms() - e->start_ms;
+		if(e->stats.first_target_ms < 0) e->stats.first_target_ms = now;
+		if(!t->from_cache && e->stats.first_scanned_target_ms < 0) e->stats.first_scanned_target_ms = now;
 	}
 }
 
-static unsigned target_exists(struct bootloader_enumerate *e, const char *target)
+/* Call with the lock held. */
+static void send_entry(struct bootloader_enumerate *e, struct remote_client *c, const struct journal_entry *entry)
 {
-	struct target_list *i;
-	for(i = e->targets; i; i = i->next) if(!strcmp(target, i->target->cmd)) return 1;
-	return 0;
+	struct remote_record r;
+	r.type = entry->type;
+	r.generation = entry->generation;
+	r.flags = entry->flags;
+	r.device = entry->device;
+	r.cmd = entry->cmd;
+	r.display_name = entry->display_name;
+	r.syspath = entry->syspath;
+	remote_send(e->server, c, &r);
 }
 
-void enumerate_add_target(struct bootloader_enumerate *e, struct enumerate_target *target, const char *suggested_name)
+/* Tell the clients, if this is a daemon, and the user about a change to @t.
+ * The clients have filters of their own, so they have a count and a journal
+ * of their own too. Call with the lock held. */
+static void tell(struct bootloader_enumerate *e, int type, struct target_node *t)
 {
-	struct target_list *node;
-	char *name;
+	if(e->server) {
+		struct journal_entry entry;
+		describe(e, type, ++e->served, t, &entry);
+		journal_add(e->served_journal, &entry);
+		send_entry(e, NULL, &entry);
+	}
+	tell_user(e, type, t);
+}
+
+/* Call with the lock held. */
+static void bury(struct bootloader_enumerate *e, struct event_handle *h)
+{
+	h->dead = 1;
+	h->next_dead = e->dead;
+	e->dead = h;
+}
+
+/* Free what has been buried. Only in the monitor thread, or once it's gone. */
+static void free_dead(struct bootloader_enumerate *e)
+{
+	struct event_handle *h;
+	pthread_mutex_lock(&e->lock);
+	h = e->dead;
+	e->dead = NULL;
+	pthread_mutex_unlock(&e->lock);
+	while(h) {
+		struct event_handle *next;
+		next = h->next_dead;
+		h->destroy(e, h->user);
+		h = next;
+	}
+}
+
+static void destroy_target(struct bootloader_enumerate *e, struct target_node *t)
+{
+	t->target->free(t->target);
+	free(t->display_name);
+	free(t);
+}
+
+/* Call with the lock held. */
+static void free_target(struct bootloader_enumerate *e, struct target_node *t)
+{
+	if(t->target->fd < 0) {
+		destroy_target(e, t);
+		return;
+	}
+	epoll_ctl(e->epoll_fd, EPOLL_CTL_DEL, t->target->fd, NULL);
+	bury(e, &t->handle);
+}
 
-	if(target_exists(e, target->cmd)) goto err0;
+static void watch_target(struct bootloader_enumerate *e, struct target_node *t)
+{
+	struct epoll_event ev = { EPOLLIN };
+	ev.data.ptr = &t->handle;
+	epoll_ctl(e->epoll_fd, EPOLL_CTL_ADD, t->target->fd, &ev);
+}
+
+/* Tell the user a target is gone, and free it. Call with the lock held. */
+static void remove_target(struct bootloader_enumerate *e, struct target_node *t)
+{
+	tell(e, CHANGE_REMOVE, t);
+	registry_remove(e->targets, &t->node);
+	free_target(e, t);
+}
+
+static void target_event(struct bootloader_enumerate *e, struct target_node *t)
+{
+	pthread_mutex_lock(&e->lock);
+	/* The target has become unavailable. */
+	if(!t->handle.dead && t->target->event(t->target)) remove_target(e, t);
+	pthread_mutex_unlock(&e->lock);
+}
+
+static struct target_node *find_target(struct bootloader_enumerate *e, const char *cmd)
+{
+	return (struct target_node *)registry_find(e->targets, cmd);
+}
+
+/* If we already have the target, confirm it, return a copy of its name and
+ * whether it's final, and free @target. Call with the lock held. */
+static unsigned confirm_target(struct bootloader_enumerate *e, struct enumerate_target *target, unsigned from_cache, char **name_out, unsigned *final_out)
+{
+	struct target_node *t;
+	t = find_target(e, target->cmd);
+	if(!t) return 0;
+	t->confirmed = 1;
+	if(!from_cache) t->from_cache = 0;
+	*name_out = s_dup(t->display_name);
+	if(final_out) *final_out = t->final;
 
-	/* The name we get from inspecting the target OS has priority for the
-	 * sake if consistency. */
-	name = target_get_display_name(target->cmd);
-	if(!name) name = s_dup(suggested_name);
-	if(!name) goto err0;
+	/* The new one may be watched where the old one wasn't, like when the
+	 * old one came from the cache. Keep the watched one. */
+	if(t->target->fd < 0 && target->fd >= 0 && t->target->syspath && target->syspath && !strcmp(t->target->syspath, target->syspath)) {
+		struct enumerate_target *old;
+		old = t->target;
+		t->target = target;
+		t->node.cmd = target->cmd;
+		t->node.syspath = target->syspath;
+		watch_target(e, t);
+		target = old;
+	}
+	target->free(target);
+	return 1;
+}
+
+/* Whether scan @scan of @syspath is too late to publish anything, the device
+ * having been removed (or found not worth scanning) or scanned again since.
+ * A @scan of 0 is from the monitor thread, which removes devices itself, and
+ * never too late. Call with the lock held. */
+static unsigned stale(struct bootloader_enumerate *e, const char *syspath, unsigned long long scan)
+{
+	struct device *d;
+	if(!scan || !syspath) return 0;
+	d = find_device(e, syspath);
+	return !d || d->scan != scan;
+}
+
+/* Takes ownership of @name, which is final if @final. A target found by @scan
+ * is dropped if that scan is stale. Returns a copy of the name the target has,
+ * and in *@final_out (unless NULL) whether that's final. */
+static char *add_target(struct bootloader_enumerate *e, struct enumerate_target *target, char *name, unsigned from_cache, unsigned final, unsigned long long scan, unsigned *final_out)
+{
+	struct target_node *node;
+	char *name_out;
 
 	node = malloc(sizeof *node);
 	if(!node) goto err0;
+	node->node.cmd = target->cmd;
+	node->node.syspath = target->syspath;
 	node->display_name = name;
 	node->target = target;
 	node->handle.f = (event_f *)target_event;
 	node->handle.user = node;
+	node->handle.dead = 0;
+	node->handle.destroy = (event_f *)destroy_target;
+	node->confirmed = 1;
+	node->from_cache = from_cache;
+	node->named = node->final = final;
+	node->told = 0;
+	node->watched = 0;
+
+	/* Another scan thread may have found it in the meantime. */
+	pthread_mutex_lock(&e->lock);
+	if(stale(e, target->syspath, scan)) goto err2;
+	if(confirm_target(e, target, from_cache, &name_out, final_out)) goto err1;
+	if(registry_insert(e->targets, &node->node) < 0) goto err2;
+
+	if(target->fd >= 0) watch_target(e, node);
+
+	tell(e, CHANGE_ADD, node);
+	name_out = s_dup(name);
+	if(final_out) *final_out = final;
+	pthread_mutex_unlock(&e->lock);
+
+	return name_out;
+
+	err1: pthread_mutex_unlock(&e->lock);
+	free(node);
+	free(name);
+	return name_out;
+
+	err2: pthread_mutex_unlock(&e->lock);
+	free(node);
+	err0: free(name);
+	target->free(target);
+	return NULL;
+}
+
+char *enumerate_add_target(struct bootloader_enumerate *e, struct enumerate_target *target, const char *suggested_name, unsigned long long scan, unsigned *final_out)
+{
+	char *name;
+	unsigned exists;
+
+	pthread_mutex_lock(&e->lock);
+	if(stale(e, target->syspath, scan)) {
+		pthread_mutex_unlock(&e->lock);
+		target->free(target);
+		return NULL;
+	}
+	exists = confirm_target(e, target, 0, &name, final_out);
+	pthread_mutex_unlock(&e->lock);
+	if(exists) return name;
+
+	/* Until the namer has been at it. */
+	name = s_dup(suggested_name ? suggested_name : target->cmd);
+	if(!name) {
+		target->free(target);
+		return NULL;
+	}
+
+	return add_target(e, target, name, 0, 0, scan, final_out);
+}
+
+void enumerate_add_cached_target(struct bootloader_enumerate *e, struct enumerate_target *target, const char *name, unsigned final, unsigned long long scan)
+{
+	char *name_copy;
+	name_copy = s_dup(name);
+	if(!name_copy) {
+		target->free(target);
+		return;
+	}
+	free(add_target(e, target, name_copy, 1, final, scan, NULL));
+}
+
+struct cache *enumerate_get_cache(struct bootloader_enumerate *e)
+{
+	return e->cache;
+}
+
+struct config_store *enumerate_get_config_store(struct bootloader_enumerate *e)
+{
+	return e->store;
+}
+
+/* Returns 1 if the target was renamed. Either way, @name is final. */
+static unsigned rename_target(struct bootloader_enumerate *e, const char *cmd, const char *name)
+{
+	struct target_node *t;
+	unsigned renamed = 0;
+
+	pthread_mutex_lock(&e->lock);
+	t = find_target(e, cmd);
+	if(t) t->final = 1;
+	if(t && strcmp(t->display_name, name)) {
+		char *copy;
+		copy = s_dup(name);
+		if(copy) {
+			free(t->display_name);
+			t->display_name = copy;
+			tell(e, CHANGE_RENAME, t);
+			renamed = 1;
+		}
+	}
+	pthread_mutex_unlock(&e->lock);
+	return renamed;
+}
+
+/* Run from the namer thread. The name we get from inspecting the target OS
+ * has priority over the one the scan suggested, for the sake of
+ * consistency. */
+static void name_target(struct bootloader_enumerate *e, const char *cmd)
+{
+	char *name;
+	throttle_thread(e->throttle);
+	name = target_get_display_name(cmd);
+	if(!name) return;
+	rename_target(e, cmd, name);
+	/* Also if the name hasn't changed, so that it's final in the cache. */
+	cache_rename_target(e->cache, cmd, name);
+	free(name);
+}
+
+/*
+ * Watches
+ */
+
+struct watch_node {
+	struct watch_node *next;
+	struct enumerate_watch *watch;
+	struct event_handle handle;
+};
+
+static void watch_event(struct bootloader_enumerate *e, struct watch_node *w)
+{
+	w->watch->event(w->watch);
+}
+
+static void destroy_watch(struct bootloader_enumerate *e, struct watch_node *w)
+{
+	w->watch->free(w->watch);
+	free(w);
+}
+
+/* Remove the watches of a device, or all of them if @syspath is NULL. Call
+ * with the lock held. */
+static void remove_watches(struct bootloader_enumerate *e, const char *syspath)
+{
+	struct watch_node **i;
+	for(i = &e->watches; *i; ) {
+		struct watch_node *w;
+		w = *i;
+		if(!syspath || !strcmp(w->watch->syspath, syspath)) {
+			*i = w->next;
+			epoll_ctl(e->epoll_fd, EPOLL_CTL_DEL, w->watch->fd, NULL);
+			bury(e, &w->handle);
+		}
+		else i = &w->next;
+	}
+}
+
+void enumerate_add_watch(struct bootloader_enumerate *e, struct enumerate_watch *watch)
+{
+	struct watch_node *w;
+	struct epoll_event ev = { EPOLLIN };
 
-	node->next = e->targets;
-	e->targets = node;
+	w = malloc(sizeof *w);
+	if(!w) {
+		watch->free(watch);
+		return;
+	}
+	w->watch = watch;
+	w->handle.f = (event_f *)watch_event;
+	w->handle.user = w;
+	w->handle.dead = 0;
+	w->handle.destroy = (event_f *)destroy_watch;
+	ev.data.ptr = &w->handle;
+
+	pthread_mutex_lock(&e->lock);
+	remove_watches(e, watch->syspath);
+	w->next = e->watches;
+	e->watches = w;
+	epoll_ctl(e->epoll_fd, EPOLL_CTL_ADD, watch->fd, &ev);
+	pthread_mutex_unlock(&e->lock);
+}
+
+/*
+ * Scanning
+ */
+
+/* Targets that were on the device before but weren't found by the scan have
+ * gone away, which is how targets published from the cache get withdrawn.
+ * Any earlier scan of the device still running is stale from now on. */
+unsigned long long enumerate_scan_begin(struct bootloader_enumerate *e, const char *syspath)
+{
+	struct device *d;
+	struct registry_node *i;
+	unsigned long long scan = 0;
+	pthread_mutex_lock(&e->lock);
+	d = find_device(e, syspath);
+	if(!d) goto out;
+	scan = d->scan = ++e->scans;
+	for(i = registry_on_device(e->targets, syspath); i; i = i->dev_next) ((struct target_node *)i)->confirmed = 0;
+	out: pthread_mutex_unlock(&e->lock);
+	return scan;
+}
+
+/* The new targets are named once the scan is done with the device, so that
+ * the device isn't contended for, and the scan has cached their provisional
+ * names by the time they are renamed. */
+void enumerate_scan_end(struct bootloader_enumerate *e, const char *syspath, unsigned long long scan)
+{
+	struct registry_node *i, *next;
+	pthread_mutex_lock(&e->lock);
+	/* The targets went with the device, or are the later scan's to
+	 * confirm. */
+	if(stale(e, syspath, scan)) goto out;
+	for(i = registry_on_device(e->targets, syspath); i; i = next) {
+		struct target_node *t;
+		t = (struct target_node *)i;
+		next = i->dev_next;
+		if(!t->confirmed) remove_target(e, t);
+		else if(!t->named) {
+			namer_add(e->namer, i->cmd);
+			t->named = 1;
+		}
+	}
+	out: pthread_mutex_unlock(&e->lock);
+}
+
+/* Run from the scan threads, for a SCAN_CONFIGS job: the device was scanned
+ * before, and only its configs are looked at again. If they can't be read,
+ * the targets stay as they are. */
+static void scan_configs(struct bootloader_enumerate *e, const char *devnode, const char *syspath)
+{
+	struct device *d;
+	char *uuid = NULL;
+	unsigned long long scan_id;
+
+	pthread_mutex_lock(&e->lock);
+	d = find_device(e, syspath);
+	if(d && d->uuid) uuid = s_dup(d->uuid);
+	pthread_mutex_unlock(&e->lock);
 
-	if(target->fd >= 0) epoll_ctl(e->epoll_fd, EPOLL_CTL_ADD, target->fd, NULL);
+	scan_id = enumerate_scan_begin(e, syspath);
+	if(!scan_id) goto out;
+	if(disk_scan_configs(e, devnode, syspath, uuid, scan_id) == 0) enumerate_scan_end(e, syspath, scan_id);
+	out: free(uuid);
+}
+
+/* Run from the scan threads.
+ *
+ * A change event may be about anything from a resize to a new
+ * partition table to a new card in a reader, or nothing at all. A device
+ * whose start looks the same after a change event isn't scanned again, so
+ * its targets stay as they are. */
+static void scan(struct bootloader_enumerate *e, const char *devnode, const char *syspath, unsigned is_partition, unsigned mode)
+{
+	char *fp, *uuid = NULL;
+	struct device *d;
+	unsigned long long scan_id;
+	unsigned failed;
+	struct stat st;
+
+	throttle_thread(e->throttle);
+	if(mode == SCAN_CONFIGS) {
+		scan_configs(e, devnode, syspath);
+		return;
+	}
+	fp = cache_dev_fingerprint(devnode);
+	pthread_mutex_lock(&e->lock);
+	/* The device was noted when the scan was queued. If the record is
+	 * gone, so is the device. */
+	d = find_device(e, syspath);
+	if(!d || (mode == SCAN_IF_CHANGED && fp && d->fp && !strcmp(d->fp, fp))) goto out;
+	pthread_mutex_unlock(&e->lock);
+
+	scan_id = enumerate_scan_begin(e, syspath);
+	if(!scan_id) goto err0;
+	/* A mount kept from before may be of a medium that's no longer
+	 * there. */
+	if(stat(devnode, &st) == 0 && S_ISBLK(st.st_mode)) smount_drop(st.st_rdev);
+	failed = disk_scan(e, devnode, syspath, is_partition, scan_id, &uuid) < 0;
+	enumerate_scan_end(e, syspath, scan_id);
+
+	/* Only now is the device known to look like this. After a scan that
+	 * failed, the next change event scans it again whatever it looks
+	 * like. One that was given up on and retried leaves it to the
+	 * retry. */
+	pthread_mutex_lock(&e->lock);
+	d = find_device(e, syspath);
+	if(d && d->scan == scan_id) {
+		free(d->fp);
+		d->fp = failed ? NULL : fp;
+		if(!failed) fp = NULL;
+		free(d->uuid);
+		d->uuid = uuid;
+		uuid = NULL;
+	}
+	out: pthread_mutex_unlock(&e->lock);
+	err0: free(fp);
+	free(uuid);
+}
 
-	/* Tell the user */
-	write(e->event_pipe[1], "a", 1);
-	write(e->event_pipe[1], target->cmd, strlen(target->cmd) + 1);
-	write(e->event_pipe[1], name, strlen(name) + 1);
+/* Called when all queued scans are done. */
+static void scan_idle(struct bootloader_enumerate *e)
+{
+	pthread_mutex_lock(&e->lock);
+	if(e->enumerated && e->stats.complete_ms < 0 && !scan_pool_busy(e->pool)) e->stats.complete_ms = now_ms() - e->start_ms;
+	pthread_mutex_unlock(&e->lock);
+	cache_save(e->cache);
+}
 
-	return;
-	err0: target->free(target);
+/* Called when the namer has named all it was given. */
+static void name_idle(struct bootloader_enumerate *e)
+{
+	cache_save(e->cache);
 }
 
 /*
- * Handling of udev_monitor events.
+ * Handling of device events.
  */
 
-static void scan_device(struct bootloader_enumerate *e, struct udev_device *d)
+/* Filesystem types that can't hold a boot configuration, going by what udev's
+ * blkid builtin found. Normally ID_FS_USAGE already says so, this is for when
+ * it doesn't. */
+static const char *useless_fs_types[] = {
+	"swap", "crypto_LUKS", "LVM2_member", "linux_raid_member",
+	"isw_raid_member", "ddf_raid_member", "zfs_member", "bcache",
+	"BitLocker", NULL,
+};
+
+/* Partition types that can't hold one either: extended partitions, swap,
+ * LVM, RAID, LUKS and BIOS boot. GPT types are GUIDs, MBR ones look like
+ * "0x82". */
+static const char *useless_part_types[] = {
+	"0x5", "0xf", "0x85", "0x82", "0x8e", "0xfd",
+	"21686148-6449-6e6f-744e-656564454649",
+	"0657fd6d-a4ab-43c4-84e5-0933c84b4f4f",
+	"e6d6d379-f507-44c2-a23c-238f2a3df928",
+	"a19d880f-05fc-4d3b-a006-743f0f84911e",
+	"ca7d7ccb-63ed-4c53-861c-1742536059cc",
+	NULL,
+};
+
+static unsigned in_list(const char *s, const char **list)
+{
+	if(!s) return 0;
+	for(; *list; ++list) if(!strcasecmp(s, *list)) return 1;
+	return 0;
+}
+
+/* Weed out devices that can't hold a boot configuration using what udev
+ * already knows, so we don't even try to mount them. Devices udev knows
+ * nothing about, and all of them when udev isn't used, pass; disk_scan()
+ * probes the superblock before mounting. */
+static unsigned may_boot(struct blockdev *d, unsigned is_partition)
+{
+	const char *size, *fs_type, *fs_usage;
+
+	/* Empty card readers and optical drives. */
+	size = blockdev_get_sysattr(d, "size");
+	if(size && !strcmp(size, "0")) return 0;
+
+	fs_type = blockdev_get_property(d, "ID_FS_TYPE");
+	fs_usage = blockdev_get_property(d, "ID_FS_USAGE");
+	if(fs_usage && strcmp(fs_usage, "filesystem")) return 0;
+	if(in_list(fs_type, useless_fs_types)) return 0;
+
+	if(is_partition) {
+		if(in_list(blockdev_get_property(d, "ID_PART_ENTRY_TYPE"), useless_part_types)) return 0;
+	}
+	/* A partitioned disk has its filesystems on the partitions, unless
+	 * it's a hybrid ISO image, which has both. */
+	else if(blockdev_get_property(d, "ID_PART_TABLE_TYPE") && !fs_type) return 0;
+
+	return 1;
+}
+
+/* How soon to scan a device, lower being sooner, so that the targets the
+ * user most likely wants show up first. In order of importance: the device
+ * the running system has /boot on, then the rest of its disk; fixed disks
+ * before removable ones; devices that had targets the last time; and those
+ * that can be read without mounting them. */
+static unsigned scan_priority(struct bootloader_enumerate *e, struct blockdev *d, struct blockdev *disk)
+{
+	const char *uuid, *fs_type;
+	unsigned priority;
+
+	if(blockdev_get_devnum(d) == e->boot_dev) priority = 0;
+	else if(e->boot_disk && !strcmp(blockdev_get_syspath(disk), e->boot_disk)) priority = 1;
+	else priority = 2;
+
+	priority = priority << 1 | (device_type(d, disk) != BOOTLOADER_DEVICE_FIXED);
+
+	uuid = blockdev_get_property(d, "ID_FS_UUID");
+	priority = priority << 1 | !(uuid && uuid[0] && cache_has_targets(e->cache, uuid));
+
+	fs_type = blockdev_get_property(d, "ID_FS_TYPE");
+	priority = priority << 1 | !(fs_type && fs_type_is_read_directly(fs_type));
+	return priority;
+}
+
+/* Returns 1 if a scan was queued, 0 if the device can't have any targets.
+ * @mode is one of SCAN_*. */
+static unsigned scan_device(struct bootloader_enumerate *e, struct blockdev *d, unsigned mode)
 {
 	const char *devtype, *devnode, *syspath;
-	devtype = udev_device_get_devtype(d);
-	if(!devtype) return;
-	devnode = udev_device_get_devnode(d);
-	syspath = udev_device_get_syspath(d);
-	if(!strcmp(devtype, "partition")) disk_scan(e, devnode, syspath, 1);
-	else if(!strcmp(devtype, "disk")) disk_scan(e, devnode, syspath, 0);
+	devtype = blockdev_get_devtype(d);
+	if(!devtype) return 0;
+	devnode = blockdev_get_devnode(d);
+	syspath = blockdev_get_syspath(d);
+	if(!devnode) return 0;
+	if(!may_boot(d, !strcmp(devtype, "partition"))) return 0;
+	if(!strcmp(devtype, "partition")) {
+		/* Queue it behind the other partitions of the same disk. */
+		struct blockdev *disk;
+		disk = blockdev_get_disk(d);
+		note_device(e, d, disk ? disk : d);
+		return scan_pool_add(e->pool, disk ? blockdev_get_syspath(disk) : syspath, devnode, syspath, 1, scan_priority(e, d, disk ? disk : d), mode) == 0;
+	}
+	else if(!strcmp(devtype, "disk")) {
+		note_device(e, d, d);
+		return scan_pool_add(e->pool, syspath, devnode, syspath, 0, scan_priority(e, d, d), mode) == 0;
+	}
+	return 0;
+}
+
+/* Run from the monitor thread. */
+void enumerate_rescan_configs(struct bootloader_enumerate *e, const char *devnode)
+{
+	struct stat st;
+	struct blockdev *d;
+	if(stat(devnode, &st) < 0 || !S_ISBLK(st.st_mode)) return;
+	d = blockdev_from_devnum(e->source, st.st_rdev);
+	if(!d) return;
+	scan_device(e, d, SCAN_CONFIGS);
+	blockdev_unref(d);
+}
+
+/* A warm start: publish what the cache has for the device right away. The
+ * scan queued after this confirms or withdraws it. */
+static void publish_cached(struct bootloader_enumerate *e, struct blockdev *d)
+{
+	const char *uuid, *devnode;
+	struct blockdev *disk;
+	uuid = blockdev_get_property(d, "ID_FS_UUID");
+	devnode = blockdev_get_devnode(d);
+	if(!uuid || !uuid[0] || !devnode) return;
+	disk = blockdev_get_disk(d);
+	note_device(e, d, disk ? disk : d);
+	disk_publish_cached(e, devnode, blockdev_get_syspath(d), uuid);
+}
+
+/*
+ * Coalescing device events
+ *
+ * Partition table rewrites, multipath failovers and hub resets come as storms
+ * of events for the same devices. Events are held per device until none have
+ * come for settle_ms, and then only the last one counts: a removal removes,
+ * anything else (add, change, or a removal followed by an add) rescans. If
+ * there were only change events, only what has changed is rescanned.
+ */
+
+struct pending {
+	struct pending *next;
+	/* The device from the last event. */
+	struct blockdev *d;
+	unsigned remove;
+	/* All the events were change events. */
+	unsigned change;
+	unsigned long long deadline;
+};
+
+static void postpone(struct bootloader_enumerate *e, struct blockdev *d, unsigned remove, unsigned change)
+{
+	struct pending **i;
+	const char *syspath;
+	syspath = blockdev_get_syspath(d);
+	for(i = &e->pending; *i && strcmp(blockdev_get_syspath((*i)->d), syspath); i = &(*i)->next);
+	if(!*i) {
+		*i = malloc(sizeof **i);
+		if(!*i) return;
+		(*i)->next = NULL;
+		(*i)->change = change;
+	}
+	else {
+		blockdev_unref((*i)->d);
+		(*i)->change = change && (*i)->change;
+	}
+	(*i)->d = blockdev_ref(d);
+	(*i)->remove = remove;
+	(*i)->deadline = now_ms() + e->settings.settle_ms;
+}
+
+/* A change to a disk may be a change to its partitions, which get no events
+ * of their own for it (a resize, say). They are rescanned too if they have
+ * changed. */
+static void change_partition(struct bootloader_enumerate *e, struct blockdev *d)
+{
+	scan_device(e, d, SCAN_IF_CHANGED);
 }
 
-static int monitor_event(struct bootloader_enumerate *e, char **target_out, void *ignored)
+static void change_partitions(struct bootloader_enumerate *e, struct blockdev *disk)
 {
-	struct udev_device *d;
 	const char *devtype;
-	d = udev_monitor_receive_device(e->monitor);
-
-	if(!strcmp(udev_device_get_action(d), "add")) {
-		scan_device(e, d);
-	}
-	else if(!strcmp(udev_device_get_action(d), "remove")) {
-		/* Remove all targets on a certain device */
-		const char *syspath;
-		struct target_list **i;
-		syspath = udev_device_get_syspath(d);
-
-		for(i = &e->targets; *i; i = &(*i)->next) {
-			struct target_list *node;
-			next: node = *i;
-			if(node->target->on_remove(node->target, syspath)) {
-				/* Tell the user */
-				write(e->event_pipe[1], "d", 1);
-				write(e->event_pipe[1], node->target->cmd, strlen(node->target->cmd) + 1);
-				write(e->event_pipe[1], node->display_name, strlen(node->display_name) + 1);
-
-				/* Free the target */
-				node->target->free(node->target);
-				*i = node->next;
-				free(node);
-
-				goto next;
+	devtype = blockdev_get_devtype(disk);
+	if(!devtype || strcmp(devtype, "disk")) return;
+	blockdev_list(e->source, disk, (blockdev_f *)change_partition, e);
+}
+
+static void settled(struct bootloader_enumerate *e, struct pending *p)
+{
+	const char *syspath;
+	struct registry_node *i;
+	syspath = blockdev_get_syspath(p->d);
+
+	/* The scan finds out what's still there. But if there's no longer
+	 * anything worth scanning (the medium was ejected, say), the targets
+	 * go as if the device had been removed. */
+	if(p->change) change_partitions(e, p->d);
+	if(!p->remove && scan_device(e, p->d, p->change ? SCAN_IF_CHANGED : SCAN_FULL)) return;
+
+	/* No point in scanning it if it hasn't been done yet, in keeping it
+	 * mounted, or in keeping what was read from it. The monitor thread
+	 * doesn't wait for the umount. */
+	if(p->remove) scan_pool_cancel(e->pool, syspath);
+	smount_drop_later(blockdev_get_devnum(p->d));
+	if(blockdev_get_devnode(p->d)) config_store_drop(e->store, blockdev_get_devnode(p->d));
+
+	/* Remove all targets on the device */
+	pthread_mutex_lock(&e->lock);
+	while(i = registry_on_device(e->targets, syspath)) remove_target(e, (struct target_node *)i);
+	remove_watches(e, syspath);
+	forget_device(e, syspath);
+	pthread_mutex_unlock(&e->lock);
+}
+
+/* Act on the devices that have settled by @now, and set the timer for the
+ * next one. */
+static void flush(struct bootloader_enumerate *e, unsigned long long now)
+{
+	struct pending **i;
+	unsigned long long next = 0;
+	struct itimerspec its = { { 0, 0 }, { 0, 0 } };
+
+	for(i = &e->pending; *i; ) {
+		struct pending *p;
+		p = *i;
+		if(p->deadline > now) {
+			if(!next || p->deadline < next) next = p->deadline;
+			i = &p->next;
+			continue;
+		}
+		*i = p->next;
+		settled(e, p);
+		blockdev_unref(p->d);
+		free(p);
+	}
+
+	/* All zero disarms it. */
+	its.it_value.tv_sec = next / 1000;
+	its.it_value.tv_nsec = next % 1000 * 1000000;
+	timerfd_settime(e->timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+static void monitor_event(struct bootloader_enumerate *e, void *ignored)
+{
+	struct blockdev *d;
+
+	while(d = blockdev_receive(e->source)) {
+		const char *action;
+		action = blockdev_get_action(d);
+		if(!action) ;
+		else if(!strcmp(action, "remove")) postpone(e, d, 1, 0);
+		else if(!strcmp(action, "add")) postpone(e, d, 0, 0);
+		else if(!strcmp(action, "change")) postpone(e, d, 0, 1);
+		blockdev_unref(d);
+	}
+	/* Without a settle window everything is due now, otherwise this only
+	 * sets the timer. */
+	flush(e, e->settings.settle_ms ? 0 : now_ms());
+}
+
+static void timer_event(struct bootloader_enumerate *e, void *ignored)
+{
+	unsigned long long expirations;
+	read(e->timer_fd, &expirations, sizeof expirations);
+	flush(e, now_ms());
+}
+
+/*
+ * Daemon and clients
+ *
+ * An enumeration may serve its targets to other processes, so that a
+ * machine with several programs wanting to know what can be booted only scans
+ * once. The clients are enumerations too, which get their targets from the
+ * daemon instead of udev; the user of one can't tell the difference.
+ */
+
+struct client_ref {
+	struct bootloader_enumerate *e;
+	struct remote_client *c;
+};
+
+static void resend(struct client_ref *x, const struct journal_entry *entry)
+{
+	send_entry(x->e, x->c, entry);
+}
+
+/* Answer a client's hello: with what it has missed, if it was here before
+ * and the journal still has that, or else with all the targets. Called with
+ * the lock held. */
+static void serve_client(struct bootloader_enumerate *e, struct remote_client *c, const struct remote_record *hello)
+{
+	struct remote_record r;
+	struct client_ref x;
+
+	memset(&r, 0, sizeof r);
+	r.type = REMOTE_BEGIN;
+	r.cmd = e->id;
+	x.e = e;
+	x.c = c;
+	if(!strcmp(hello->cmd, e->id) && journal_has(e->served_journal, hello->generation)) {
+		r.generation = hello->generation;
+		remote_send(e->server, c, &r);
+		journal_since(e->served_journal, hello->generation, (journal_f *)resend, &x);
+	}
+	else {
+		struct registry_node *i;
+		r.flags = REMOTE_FULL;
+		r.generation = e->served;
+		remote_send(e->server, c, &r);
+		for(i = registry_next(e->targets, NULL); i; i = registry_next(e->targets, i)) {
+			struct journal_entry entry;
+			describe(e, CHANGE_ADD, e->served, (struct target_node *)i, &entry);
+			send_entry(e, c, &entry);
+		}
+	}
+	r.type = REMOTE_END;
+	r.flags = 0;
+	r.generation = e->served;
+	remote_send(e->server, c, &r);
+}
+
+static void server_event(struct bootloader_enumerate *e, void *ignored)
+{
+	pthread_mutex_lock(&e->lock);
+	remote_server_event(e->server);
+	pthread_mutex_unlock(&e->lock);
+}
+
+static void free_remote_target(struct enumerate_target *t)
+{
+	free(t->cmd);
+	free((char *)t->syspath);
+	free(t);
+}
+
+static struct enumerate_target *remote_target(const struct remote_record *r)
+{
+	struct enumerate_target *t;
+	t = malloc(sizeof *t);
+	if(!t) goto err0;
+	t->free = free_remote_target;
+	t->event = NULL;
+	t->fd = -1;
+	t->data = NULL;
+	t->cmd = s_dup(r->cmd);
+	if(!t->cmd) goto err1;
+	t->syspath = s_dup(r->syspath);
+	if(r->syspath && !t->syspath) goto err2;
+	return t;
+
+	err2: free(t->cmd);
+	err1: free(t);
+	err0: return NULL;
+}
+
+/* Run in the monitor thread of a client. */
+static void daemon_record(struct bootloader_enumerate *e, const struct remote_record *r)
+{
+	struct enumerate_target *target;
+	struct target_node *t;
+	struct registry_node *i, *next;
+	char *name;
+
+	switch(r->type) {
+	case REMOTE_BEGIN:
+		free(e->daemon_id);
+		e->daemon_id = s_dup(r->cmd);
+		if(!(r->flags & REMOTE_FULL)) break;
+		/* What isn't sent again is gone. */
+		e->resyncing = 1;
+		pthread_mutex_lock(&e->lock);
+		for(i = registry_next(e->targets, NULL); i; i = registry_next(e->targets, i)) ((struct target_node *)i)->confirmed = 0;
+		pthread_mutex_unlock(&e->lock);
+		break;
+	case REMOTE_END:
+		if(e->resyncing) {
+			pthread_mutex_lock(&e->lock);
+			for(i = registry_next(e->targets, NULL); i; i = next) {
+				next = registry_next(e->targets, i);
+				if(!((struct target_node *)i)->confirmed) remove_target(e, (struct target_node *)i);
 			}
+			pthread_mutex_unlock(&e->lock);
+			e->resyncing = 0;
+		}
+		e->daemon_generation = r->generation;
+		break;
+	case CHANGE_ADD:
+		target = remote_target(r);
+		if(!target) return;
+		name = s_dup(r->display_name ? r->display_name : r->cmd);
+		if(!name) {
+			target->free(target);
+			return;
 		}
+		/* The device type is needed before the filter sees the
+		 * target. */
+		if(r->syspath) {
+			struct device *d;
+			pthread_mutex_lock(&e->lock);
+			d = add_device(e, r->syspath);
+			if(d) d->type = r->device;
+			pthread_mutex_unlock(&e->lock);
+		}
+		/* The daemon names its targets. */
+		free(add_target(e, target, name, !!(r->flags & BOOTLOADER_TARGET_FROM_CACHE), 1, 0, NULL));
+		pthread_mutex_lock(&e->lock);
+		t = find_target(e, r->cmd);
+		if(t) t->watched = !!(r->flags & BOOTLOADER_TARGET_WATCHED);
+		pthread_mutex_unlock(&e->lock);
+		/* It may have been renamed while the daemon was away. */
+		if(r->display_name) rename_target(e, r->cmd, r->display_name);
+		e->daemon_generation = r->generation;
+		break;
+	case CHANGE_REMOVE:
+		pthread_mutex_lock(&e->lock);
+		t = find_target(e, r->cmd);
+		if(t) remove_target(e, t);
+		pthread_mutex_unlock(&e->lock);
+		e->daemon_generation = r->generation;
+		break;
+	case CHANGE_RENAME:
+		if(r->display_name) rename_target(e, r->cmd, r->display_name);
+		e->daemon_generation = r->generation;
+		break;
 	}
+}
+
+static void watch_daemon(struct bootloader_enumerate *e)
+{
+	struct epoll_event ev = { EPOLLIN };
+	ev.data.ptr = &e->daemon_handle;
+	epoll_ctl(e->epoll_fd, EPOLL_CTL_ADD, remote_conn_get_fd(e->daemon), &ev);
+}
 
-	udev_device_unref(d);
+/* Say where we left off, unless all the targets are to be sent again. */
+static int connect_daemon(struct bootloader_enumerate *e)
+{
+	struct remote_record hello;
+	memset(&hello, 0, sizeof hello);
+	hello.type = REMOTE_HELLO;
+	hello.cmd = "";
+	if(e->daemon_id && !e->resyncing) {
+		hello.cmd = e->daemon_id;
+		hello.generation = e->daemon_generation;
+	}
+	if(remote_connect(&e->daemon, e->daemon_path, &hello) < 0) return -1;
+	watch_daemon(e);
 	return 0;
 }
 
+/* The connection may have been dropped for falling behind, and the daemon
+ * takes the client back where it left off, so the targets stay for a first
+ * try soon after. If that fails, they are only good while the daemon is
+ * there: they go, and it's looked for every second. If it comes back, it
+ * sends them all again. */
+static void daemon_gone(struct bootloader_enumerate *e)
+{
+	struct itimerspec its = { { 1, 0 }, { 0, 100000000 } };
+	epoll_ctl(e->epoll_fd, EPOLL_CTL_DEL, remote_conn_get_fd(e->daemon), NULL);
+	remote_conn_free(e->daemon);
+	e->daemon = NULL;
+	e->abandoned = 0;
+	timerfd_settime(e->timer_fd, 0, &its, NULL);
+}
+
+static void daemon_event(struct bootloader_enumerate *e, void *ignored)
+{
+	if(remote_conn_read(e->daemon, (remote_record_f *)daemon_record, e) < 0) daemon_gone(e);
+}
+
+static void reconnect_event(struct bootloader_enumerate *e, void *ignored)
+{
+	unsigned long long expirations;
+	struct itimerspec its = { { 0, 0 }, { 0, 0 } };
+	read(e->timer_fd, &expirations, sizeof expirations);
+	if(connect_daemon(e) == 0) {
+		timerfd_settime(e->timer_fd, 0, &its, NULL);
+		return;
+	}
+	if(!e->abandoned) {
+		struct registry_node *i;
+		pthread_mutex_lock(&e->lock);
+		while(i = registry_next(e->targets, NULL)) remove_target(e, (struct target_node *)i);
+		while(e->devices) forget_device(e, e->devices->syspath);
+		pthread_mutex_unlock(&e->lock);
+		free(e->daemon_id);
+		e->daemon_id = NULL;
+		e->abandoned = 1;
+	}
+}
+
 /*
  * Monitor thread
  */
 
+static void initial_device(struct bootloader_enumerate *e, struct blockdev *d)
+{
+	publish_cached(e, d);
+	scan_device(e, d, SCAN_FULL);
+}
+
 static void *monitor(void *user)
 {
-	struct pollfd pfd;
 	struct bootloader_enumerate *e;
+	unsigned quit = 0;
 	e = user;
 
-	/* Enumerate all initial devices, scan them and put them in target_list now. */
-	{
-		struct udev_enumerate *enr;
-		struct udev_list_entry *i;
-
-		enr = udev_enumerate_new(e->udev);
-		if(!enr) goto err6;
-		if(udev_enumerate_scan_devices(enr) < 0) goto err7;
-
-		for(i = udev_enumerate_get_list_entry(enr); i; i = udev_list_entry_get_next(i)) {
-			const char *devpath;
-			struct udev_device *d;
-			devpath = udev_list_entry_get_name(i);
-			d = udev_device_new_from_syspath(e->udev, devpath);
-			scan_device(e, d);
-			udev_device_unref(d);
-		}
+	/* A client has nothing to scan. */
+	if(e->daemon_path) goto monitor_events;
+	throttle_thread(e->throttle);
 
-		err7: udev_enumerate_unref(enr);
-	}
+	/* Enumerate all initial devices, scan them and put their targets in
+	 * the registry. They are all queued before any is scanned, so that
+	 * they are scanned by priority rather than in the order they are
+	 * listed. */
+	scan_pool_hold(e->pool, 1);
+	blockdev_list(e->source, NULL, (blockdev_f *)initial_device, e);
+	scan_pool_hold(e->pool, 0);
 
-	err6: pfd.fd = e->command_pipe[0];
-	pfd.events = POLLIN;
-	while(1) {
-		struct epoll_event ev;
-		epoll_wait(e->epoll_fd, &ev, 1, -1);
-		/* User commands have priority. */
-		if(poll(&pfd, 1, 0) > 0) {
+	/* The scans may all be done already. */
+	monitor_events: pthread_mutex_lock(&e->lock);
+	e->enumerated = 1;
+	if(!e->pool || !scan_pool_busy(e->pool)) e->stats.complete_ms = now_ms() - e->start_ms;
+	pthread_mutex_unlock(&e->lock);
+
+	while(!quit) {
+		struct epoll_event ev[16];
+		int n, i;
+		free_dead(e);
+		if(e->throttle) throttle_thread(e->throttle);
+		n = epoll_wait(e->epoll_fd, ev, sizeof ev / sizeof ev[0], -1);
+
+		/* User commands have priority. The command pipe is the one
+		 * without a handle. */
+		for(i = 0; i < n; ++i) {
 			char command;
-			read(e->command_pipe[0], &command, 1);
-			if(command == 'x') break;
+			if(ev[i].data.ptr) continue;
+			while(read(e->command_pipe[0], &command, 1) == 1) if(command == 'x') quit = 1;
 		}
-		else {
+
+		for(i = 0; i < n && !quit; ++i) {
 			struct event_handle *handle;
-			handle = ev.data.ptr;
-			handle->f(e, handle->user);
+			unsigned dead;
+			handle = ev[i].data.ptr;
+			if(!handle) continue;
+			pthread_mutex_lock(&e->lock);
+			dead = handle->dead;
+			pthread_mutex_unlock(&e->lock);
+			if(!dead) handle->f(e, handle->user);
 		}
 	}
 
@@ -241,105 +1425,459 @@ static void *monitor(void *user)
  * Setup/freeing, API
  */
 
-static void dont_log(struct udev *udev, int prio, const char *file, int line, const char *fn, const char *frm, va_list args) {}
+static void finish_free(struct bootloader_enumerate *e);
+static void filter_free(struct bootloader_filter *f);
+
+/* Where the running system has /boot. */
+static void find_boot(struct bootloader_enumerate *e)
+{
+	struct stat st;
+	struct blockdev *d, *disk;
+	if(stat("/boot", &st) < 0 && stat("/", &st) < 0) return;
+	d = blockdev_from_devnum(e->source, st.st_dev);
+	if(!d) return;
+	e->boot_dev = st.st_dev;
+	disk = blockdev_get_disk(d);
+	e->boot_disk = s_dup(blockdev_get_syspath(disk ? disk : d));
+	blockdev_unref(d);
+}
+
+/* Tells this daemon from the others that were at the same path. */
+static char *make_id(void)
+{
+	struct timespec ts;
+	char buf[64];
+	clock_gettime(CLOCK_REALTIME, &ts);
+	snprintf(buf, sizeof buf, "%d.%lld.%09ld", (int)getpid(), (long long)ts.tv_sec, ts.tv_nsec);
+	return s_dup(buf);
+}
 
 /* Initialize/free the struct bootloader_enumerate. */
-static struct bootloader_enumerate *bootloader_enumerate(struct bootloader_enumerate *e)
+static struct bootloader_enumerate *bootloader_enumerate(struct bootloader_enumerate *e, const struct bootloader_enumerate_settings *s)
 {
 	if(e) goto freeing;
 
 	e = malloc(sizeof *e);
 	if(!e) goto err0;
 
-	e->udev = udev_new();
-	if(!e->udev) goto err1;
-	udev_set_log_fn(e->udev, dont_log);
-
-	/* Make the communication pipes. */
-	if(pipe2(e->event_pipe, O_CLOEXEC) < 0) goto err2;
-	if(pipe2(e->command_pipe, O_NONBLOCK | O_CLOEXEC) < 0) goto err3;
+	if(s) e->settings = *s;
+	else bootloader_enumerate_settings_init(&e->settings);
+	if(e->settings.scan_workers == 0) e->settings.scan_workers = 1;
 
-	/* Create the device event monitor. */
-	e->monitor = udev_monitor_new_from_netlink(e->udev, "udev");
-	if(!e->monitor) goto err4;
+	e->watches = NULL;
+	e->devices = NULL;
+	e->scans = 0;
+	memset(&e->filter, 0, sizeof e->filter);
+	e->dead = NULL;
+	e->pending = NULL;
+	e->generation = 0;
+	e->start_ms = now_ms();
+	e->stats.first_target_ms = e->stats.first_scanned_target_ms = e->stats.complete_ms = -1;
+	e->enumerated = 0;
+	e->boot_dev = 0;
+	e->boot_disk = NULL;
+	e->source = NULL;
+	e->cache = NULL;
+	e->store = NULL;
+	e->throttle = NULL;
+	e->namer = NULL;
+	e->pool = NULL;
+	e->server = NULL;
+	e->daemon = NULL;
+	e->table = NULL;
+	e->journal = NULL;
+	e->id = NULL;
+	e->served = 0;
+	e->served_journal = NULL;
+	e->daemon_path = NULL;
+	e->daemon_id = NULL;
+	e->daemon_generation = 0;
+	e->resyncing = 0;
+	e->abandoned = 0;
+	if(registry_new(&e->targets) < 0) goto err0_5;
+	if(pthread_mutex_init(&e->lock, NULL) != 0) goto err0_75;
 
-	/* Enable monitoring. Done before enumerating, so we don't miss any events. */
-	if(udev_monitor_enable_receiving(e->monitor) < 0) goto err5;
+	/* Make the communication channels. */
+	if(queue_new(&e->changes) < 0) goto err1;
+	if(table_new(&e->table) < 0) goto err1_5;
+	if(journal_new(&e->journal, e->settings.journal_size) < 0) goto err1_75;
+	if(pipe2(e->command_pipe, O_NONBLOCK | O_CLOEXEC) < 0) goto err2;
 
 	/* Create the epoll fd. */
 	e->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
-	if(e->epoll_fd < 0) goto err5;
+	if(e->epoll_fd < 0) goto err3;
 	{
 		struct epoll_event ev = { EPOLLIN };
 
-		/* Listen to udev_monitor */
-		e->monitor_handle.f = (event_f *)monitor_event;
-		ev.data.ptr = &e->monitor_handle;
-		epoll_ctl(e->epoll_fd, EPOLL_CTL_ADD, udev_monitor_get_fd(e->monitor), &ev);
-
 		/* Listen to user events (bootloader_enumerate_free) */
 		ev.data.ptr = NULL;
 		epoll_ctl(e->epoll_fd, EPOLL_CTL_ADD, e->command_pipe[0], &ev);
+
+		/* Settled device events, or in a client, when to look for the
+		 * daemon again */
+		e->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		if(e->timer_fd < 0) goto err4;
+		e->timer_handle.f = e->settings.daemon_path ? reconnect_event : timer_event;
+		e->timer_handle.dead = 0;
+		ev.data.ptr = &e->timer_handle;
+		epoll_ctl(e->epoll_fd, EPOLL_CTL_ADD, e->timer_fd, &ev);
+
+		/* Clients, if this is a daemon */
+		if(e->settings.serve_path) {
+			if(journal_new(&e->served_journal, e->settings.journal_size) < 0) goto err5;
+			e->id = make_id();
+			if(!e->id) goto err5;
+			if(remote_server_new(&e->server, e->settings.serve_path, (remote_hello_f *)serve_client, e) < 0) goto err5;
+			e->server_handle.f = server_event;
+			e->server_handle.dead = 0;
+			ev.data.ptr = &e->server_handle;
+			epoll_ctl(e->epoll_fd, EPOLL_CTL_ADD, remote_server_get_fd(e->server), &ev);
+		}
 	}
 
-	e->target_cmd = NULL;
-	e->display_name = NULL;
+	/* The paths aren't the user's to keep valid. */
+	e->settings.serve_path = NULL;
+	if(e->settings.daemon_path) {
+		e->daemon_path = s_dup(e->settings.daemon_path);
+		e->settings.daemon_path = NULL;
+		if(!e->daemon_path) goto err6;
+		e->daemon_handle.f = daemon_event;
+		e->daemon_handle.dead = 0;
+		if(connect_daemon(e) < 0) goto err6;
+		return e;
+	}
+
+	/* Udev has nothing to give without udevd. Events are listened to from
+	 * here on, before the devices are enumerated, so we don't miss any. */
+	if(e->settings.device_source == BOOTLOADER_DEVICES_AUTO) e->settings.device_source = blockdev_udev_running() ? BOOTLOADER_DEVICES_UDEV : BOOTLOADER_DEVICES_KERNEL;
+	if(blockdev_source_new(&e->source, e->settings.device_source == BOOTLOADER_DEVICES_UDEV) < 0) goto err6;
+	find_boot(e);
+	{
+		struct epoll_event ev = { EPOLLIN };
+
+		/* Listen to device events */
+		e->monitor_handle.f = (event_f *)monitor_event;
+		e->monitor_handle.dead = 0;
+		ev.data.ptr = &e->monitor_handle;
+		epoll_ctl(e->epoll_fd, EPOLL_CTL_ADD, blockdev_source_get_fd(e->source), &ev);
+	}
+
+	if(throttle_new(&e->throttle, &e->settings.policy) < 0) goto err7;
+	if(cache_new(&e->cache) < 0) goto err8;
+	if(config_store_new(&e->store) < 0) goto err9;
+	if(namer_new(&e->namer, (namer_f *)name_target, (namer_idle_f *)name_idle, e) < 0) goto err10;
+	if(scan_pool_new(&e->pool, e->settings.scan_workers, e->settings.scan_timeout_ms, (scan_f *)scan, (scan_idle_f *)scan_idle, e) < 0) goto err11;
 
 	return e;
 
-	freeing: if(e->target_cmd) free(e->target_cmd);
-	if(e->display_name) free(e->display_name);
-	err6: close(e->epoll_fd);
-	err5: udev_monitor_unref(e->monitor);
-	err4: close(e->command_pipe[0]);
+	/* Scans stuck on a device are left behind, and the last of them comes
+	 * back here when it's done. */
+	freeing: if(e->pool) {
+		struct scan_pool *pool;
+		pool = e->pool;
+		e->pool = NULL;
+		if(scan_pool_free(pool, (scan_idle_f *)finish_free)) return NULL;
+	}
+	/* Likewise a target being named. */
+	if(e->namer) {
+		struct namer *namer;
+		namer = e->namer;
+		e->namer = NULL;
+		if(namer_free(namer, (namer_idle_f *)finish_free)) return NULL;
+	}
+	{
+		/* No more changes will be read, just free the targets. */
+		struct registry_node *i, *next;
+		for(i = registry_next(e->targets, NULL); i; i = next) {
+			next = registry_next(e->targets, i);
+			registry_remove(e->targets, i);
+			free_target(e, (struct target_node *)i);
+		}
+	}
+	remove_watches(e, NULL);
+	free_dead(e);
+	while(e->devices) forget_device(e, e->devices->syspath);
+	filter_free(&e->filter);
+	while(e->pending) {
+		struct pending *p;
+		p = e->pending;
+		e->pending = p->next;
+		blockdev_unref(p->d);
+		free(p);
+	}
+	/* Don't leave mounts behind. */
+	smount_flush();
+	err11: if(e->namer) namer_free(e->namer, NULL);
+	err10: if(e->store) config_store_free(e->store);
+	err9: if(e->cache) cache_free(e->cache);
+	err8: if(e->throttle) throttle_free(e->throttle);
+	err7: free(e->boot_disk);
+	if(e->source) blockdev_source_free(e->source);
+	err6: if(e->daemon) remote_conn_free(e->daemon);
+	free(e->daemon_path);
+	free(e->daemon_id);
+	if(e->server) remote_server_free(e->server);
+	err5: free(e->id);
+	if(e->served_journal) journal_free(e->served_journal);
+	close(e->timer_fd);
+	err4: close(e->epoll_fd);
+	err3: close(e->command_pipe[0]);
 	close(e->command_pipe[1]);
-	err3: close(e->event_pipe[0]);
-	close(e->event_pipe[1]);
-	err2: udev_unref(e->udev);
-	err1: free(e);
+	err2: journal_free(e->journal);
+	err1_75: table_free(e->table);
+	err1_5: queue_free(e->changes);
+	err1: pthread_mutex_destroy(&e->lock);
+	err0_75: registry_free(e->targets);
+	err0_5: free(e);
 	err0: return NULL;
 }
 
-struct bootloader_enumerate *bootloader_enumerate_new(void) {
+static void finish_free(struct bootloader_enumerate *e)
+{
+	bootloader_enumerate(e, NULL);
+}
+
+void bootloader_enumerate_settings_init(struct bootloader_enumerate_settings *s)
+{
+	s->scan_workers = 4;
+	s->settle_ms = 250;
+	s->scan_timeout_ms = 20000;
+	s->serve_path = NULL;
+	s->daemon_path = NULL;
+	s->journal_size = 1024;
+	s->device_source = BOOTLOADER_DEVICES_AUTO;
+	s->policy.idle_io = 1;
+	s->policy.nice = 10;
+	s->policy.bytes_per_sec = 32 << 20;
+	s->policy.mounts_per_sec = 4;
+	s->policy.thread_hook = NULL;
+	s->policy.hook_user = NULL;
+}
+
+struct bootloader_enumerate *bootloader_enumerate_new_with_settings(const struct bootloader_enumerate_settings *s) {
 	struct bootloader_enumerate *e;
-	e = bootloader_enumerate(NULL);
+	e = bootloader_enumerate(NULL, s);
 	if(!e) return NULL;
 
 	if(pthread_create(&e->monitor_thread, NULL, monitor, e) != 0) {
-		bootloader_enumerate(e);
+		bootloader_enumerate(e, NULL);
 		return NULL;
 	}
 	return e;
 }
 
+struct bootloader_enumerate *bootloader_enumerate_new(void) {
+	return bootloader_enumerate_new_with_settings(NULL);
+}
+
 void bootloader_enumerate_free(struct bootloader_enumerate *e) {
 	write(e->command_pipe[1], "x", 1);
 	pthread_join(e->monitor_thread, NULL);
-	bootloader_enumerate(e);
+	bootloader_enumerate(e, NULL);
 }
 
 int bootloader_enumerate_get_change(struct bootloader_enumerate *e, const char **str_out, const char **display_name_out)
 {
-	struct pollfd fd;
-	fd.fd = e->event_pipe[0];
-	fd.events = POLLIN;
-	if(poll(&fd, 1, 0) > 0) {
-		char cmd;
-		read(e->event_pipe[0], &cmd, 1);
-		if(cmd == 'a' || cmd == 'd') {
-			if(e->target_cmd) free(e->target_cmd);
-			*str_out = e->target_cmd = s_getstr(e->event_pipe[0]);
-			if(e->display_name) free(e->display_name);
-			e->display_name = s_getstr(e->event_pipe[0]);
-			if(display_name_out) *display_name_out = e->display_name;
-			return cmd == 'a' ? 1 : 2;
-		}
+	int type;
+	type = queue_pop(e->changes, str_out, display_name_out);
+	if(type == CHANGE_NONE) {
+		*str_out = NULL;
+		if(display_name_out) *display_name_out = NULL;
 	}
-	return 0;
+	return type;
 }
 
 int bootloader_enumerate_get_fd(struct bootloader_enumerate *e)
 {
-	return e->event_pipe[0];
+	return queue_get_fd(e->changes);
+}
+
+void bootloader_enumerate_get_stats(struct bootloader_enumerate *e, struct bootloader_enumerate_stats *out)
+{
+	pthread_mutex_lock(&e->lock);
+	*out = e->stats;
+	pthread_mutex_unlock(&e->lock);
+}
+
+static void filter_free(struct bootloader_filter *f)
+{
+	free((char *)f->type);
+	free((char *)f->cmd_pattern);
+	free((char *)f->name_pattern);
+}
+
+/* Like s_dup(), but NULL stays NULL. */
+static int dup_opt(const char **out, const char *s)
+{
+	*out = NULL;
+	if(!s) return 0;
+	*out = s_dup(s);
+	return *out ? 0 : -1;
+}
+
+int bootloader_enumerate_set_filter(struct bootloader_enumerate *e, const struct bootloader_filter *f)
+{
+	struct bootloader_filter copy;
+	struct registry_node *i;
+
+	memset(&copy, 0, sizeof copy);
+	if(f) {
+		copy.devices = f->devices;
+		if(dup_opt(&copy.type, f->type) < 0) goto err;
+		if(dup_opt(&copy.cmd_pattern, f->cmd_pattern) < 0) goto err;
+		if(dup_opt(&copy.name_pattern, f->name_pattern) < 0) goto err;
+	}
+
+	pthread_mutex_lock(&e->lock);
+	filter_free(&e->filter);
+	e->filter = copy;
+	/* Bring the user up to date with the new filter. */
+	for(i = registry_next(e->targets, NULL); i; i = registry_next(e->targets, i)) {
+		struct target_node *t;
+		t = (struct target_node *)i;
+		if(wanted(e, t) != t->told) tell_user(e, t->told ? CHANGE_REMOVE : CHANGE_ADD, t);
+	}
+	pthread_mutex_unlock(&e->lock);
+	return 0;
+
+	err: filter_free(&copy);
+	return -1;
+}
+
+void bootloader_enumerate_boot_imminent(struct bootloader_enumerate *e, unsigned imminent)
+{
+	if(e->throttle) throttle_lift(e->throttle, imminent);
+}
+
+int bootloader_enumerate_get_table_fd(struct bootloader_enumerate *e)
+{
+	return table_get_fd(e->table);
+}
+
+unsigned long long bootloader_enumerate_get_change_generation(struct bootloader_enumerate *e)
+{
+	return queue_get_generation(e->changes);
+}
+
+/* For the two passes over the journal: the size of the changes, then the
+ * changes. */
+struct change_copy {
+	size_t n, size;
+	struct bootloader_change *change;
+	char *str;
+};
+
+static void measure_change(struct change_copy *x, const struct journal_entry *entry)
+{
+	++x->n;
+	x->size += sizeof *x->change + strlen(entry->cmd) + 1 + strlen(entry->display_name) + 1;
+}
+
+static void copy_change(struct change_copy *x, const struct journal_entry *entry)
+{
+	x->change->generation = entry->generation;
+	x->change->type = entry->type;
+	x->change->cmd = x->str;
+	x->str = stpcpy(x->str, entry->cmd) + 1;
+	x->change->display_name = x->str;
+	x->str = stpcpy(x->str, entry->display_name) + 1;
+	++x->change;
+}
+
+/* One allocation, like a snapshot. */
+int bootloader_enumerate_get_changes_since(struct bootloader_enumerate *e, unsigned long long generation, struct bootloader_changes **out)
+{
+	struct bootloader_changes *changes;
+	struct change_copy x;
+	int ret = -1;
+
+	pthread_mutex_lock(&e->lock);
+	if(!journal_has(e->journal, generation)) {
+		ret = 1;
+		goto out;
+	}
+	x.n = 0;
+	x.size = sizeof *changes;
+	journal_since(e->journal, generation, (journal_f *)measure_change, &x);
+	changes = malloc(x.size);
+	if(!changes) goto out;
+	changes->generation = e->generation;
+	changes->n_changes = x.n;
+	changes->changes = x.change = (struct bootloader_change *)(changes + 1);
+	x.str = (char *)(x.change + x.n);
+	journal_since(e->journal, generation, (journal_f *)copy_change, &x);
+	*out = changes;
+	ret = 0;
+
+	out: pthread_mutex_unlock(&e->lock);
+	return ret;
+}
+
+void bootloader_changes_free(struct bootloader_changes *changes)
+{
+	free(changes);
+}
+
+unsigned long long bootloader_enumerate_get_generation(struct bootloader_enumerate *e)
+{
+	unsigned long long generation;
+	pthread_mutex_lock(&e->lock);
+	generation = e->generation;
+	pthread_mutex_unlock(&e->lock);
+	return generation;
+}
+
+/* The snapshot is one allocation: the header, then the entries, then the
+ * strings they point to. */
+struct bootloader_snapshot *bootloader_enumerate_snapshot(struct bootloader_enumerate *e)
+{
+	struct bootloader_snapshot *snap;
+	struct bootloader_snapshot_entry *entry;
+	struct registry_node *i;
+	size_t n = 0, size;
+	char *str;
+
+	pthread_mutex_lock(&e->lock);
+	size = sizeof *snap;
+	for(i = registry_next(e->targets, NULL); i; i = registry_next(e->targets, i)) {
+		struct target_node *t;
+		t = (struct target_node *)i;
+		if(!t->told) continue;
+		size += sizeof *entry + strlen(i->cmd) + 1 + strlen(t->display_name) + 1;
+		if(i->syspath) size += strlen(i->syspath) + 1;
+		++n;
+	}
+
+	snap = malloc(size);
+	if(!snap) goto out;
+	snap->generation = e->generation;
+	snap->n_entries = n;
+	snap->entries = entry = (struct bootloader_snapshot_entry *)(snap + 1);
+	str = (char *)(entry + n);
+	for(i = registry_next(e->targets, NULL); i; i = registry_next(e->targets, i)) {
+		struct target_node *t;
+		t = (struct target_node *)i;
+		if(!t->told) continue;
+		entry->flags = target_flags(t);
+
+		entry->cmd = str;
+		str = stpcpy(str, i->cmd) + 1;
+		entry->display_name = str;
+		str = stpcpy(str, t->display_name) + 1;
+		entry->syspath = NULL;
+		if(i->syspath) {
+			entry->syspath = str;
+			str = stpcpy(str, i->syspath) + 1;
+		}
+		++entry;
+	}
+
+	out: pthread_mutex_unlock(&e->lock);
+	return snap;
+}
+
+void bootloader_snapshot_free(struct bootloader_snapshot *snap)
+{
+	free(snap);
 }
 
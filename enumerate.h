@@ -11,12 +11,102 @@
  * strings) of their own.
  */
 
+#include <stddef.h>
+#include <stdint.h>
+
 /**
  * This struct contains information that the library uses to determine when a
  * boot target becomes available or unavailable.
  */
 struct bootloader_enumerate;
 
+/**
+ * How much of the system scanning may take, so that it stays out of the way
+ * of whatever else is running. It applies to the library's own threads, not
+ * to yours. See bootloader_enumerate_boot_imminent() to lift it.
+ */
+struct bootloader_scan_policy {
+	/** Nonzero to do I/O in the idle I/O scheduling class, only when the
+	 * disk has nothing else to do. */
+	unsigned idle_io;
+	/** The nice level to run at. */
+	int nice;
+	/** Bytes per second that may be read from devices, 0 for no limit. */
+	unsigned long long bytes_per_sec;
+	/** Filesystems per second that may be mounted, 0 for no limit. */
+	unsigned mounts_per_sec;
+	/** Called once in each thread the library scans in, when it starts,
+	 * to move it to a cgroup, say. May be called from any thread, at the
+	 * same time. %NULL for none. */
+	void (*thread_hook)(void *user);
+	void *hook_user;
+};
+
+/** Where the devices come from: udev if udevd is running, the kernel if not. */
+#define BOOTLOADER_DEVICES_AUTO 0
+/** From udev, which knows what filesystems they have, say, so that devices
+ * that can't boot aren't even looked at. Needs udevd running. */
+#define BOOTLOADER_DEVICES_UDEV 1
+/** Straight from the kernel (sysfs and its uevents), for when udevd isn't
+ * running yet, in an initramfs say, or at all. Every device is looked at. */
+#define BOOTLOADER_DEVICES_KERNEL 2
+
+/**
+ * Tunables for an enumeration. Fill it in with
+ * bootloader_enumerate_settings_init() first, then change what you need, so
+ * that fields added later get sensible values.
+ */
+struct bootloader_enumerate_settings {
+	/** Number of threads scanning devices. Different physical disks are
+	 * scanned in parallel, partitions of the same disk one at a time. */
+	unsigned scan_workers;
+
+	/** Milliseconds a device must go without udev events before it is
+	 * (re)scanned or its targets are removed, so that a burst of events
+	 * leads to one rescan. 0 acts on every event right away. */
+	unsigned settle_ms;
+
+	/** Milliseconds a scan of one device may take. A device that takes
+	 * longer is given up on and tried again later, a few times, so that a
+	 * failing device doesn't hold up the rest. 0 for no limit. */
+	unsigned scan_timeout_ms;
+
+	/** Also serve the targets to other processes, over a Unix socket at
+	 * this path, so that they needn't scan themselves. A socket left
+	 * behind by a daemon that is gone is taken over. %NULL not to. */
+	const char *serve_path;
+
+	/** Get the targets from the process serving them at this path (see
+	 * serve_path) instead of scanning. The enumeration works the same
+	 * otherwise: it starts with what the daemon has, then gets its
+	 * changes. Creating it fails if nothing is serving there. If the
+	 * connection is lost, the daemon is tried again right away, and only
+	 * sends what has changed since. If it isn't there, its targets are
+	 * removed, and it is looked for every second. %NULL to scan. */
+	const char *daemon_path;
+
+	/** How many changes are kept for bootloader_enumerate_get_changes_since()
+	 * and for clients coming back to the daemon. A client that comes back
+	 * after more changes than that gets all the targets again. */
+	unsigned journal_size;
+
+	/** Where to get the block devices and their events from, one of
+	 * BOOTLOADER_DEVICES_*. */
+	unsigned device_source;
+
+	/** What scanning may take. By default, it's done at idle I/O
+	 * priority and nice 10, reading at most 32 MiB and mounting at most 4
+	 * filesystems a second. */
+	struct bootloader_scan_policy policy;
+};
+
+/**
+ * Fill in the default settings.
+ *
+ * @param	s The settings.
+ */
+void bootloader_enumerate_settings_init(struct bootloader_enumerate_settings *s);
+
 /**
  * Create an enumeration. To get the devices, call bootloader_enumerate_get_change()
  * until it returns 0.
@@ -25,6 +115,15 @@ struct bootloader_enumerate;
  */
 struct bootloader_enumerate *bootloader_enumerate_new(void);
 
+/**
+ * Like bootloader_enumerate_new(), but with non-default settings.
+ *
+ * @param	s The settings, or %NULL for the defaults. Not used after this
+ *		function returns.
+ * @return	The enumeration.
+ */
+struct bootloader_enumerate *bootloader_enumerate_new_with_settings(const struct bootloader_enumerate_settings *s);
+
 /**
  * Free the enumeration.
  *
@@ -37,14 +136,21 @@ void bootloader_enumerate_free(struct bootloader_enumerate *e);
  *
  * The devices available to boot to may change with time (USB drives inserted
  * or removed, for example). When that has happened, call this function to get
- * that change. Doesn't block.
+ * that change. Doesn't block, and makes no syscalls while changes are
+ * pending.
+ *
+ * A target is added under a provisional name (the one its boot menu gives
+ * it, say), and renamed once the library has looked at the system it boots,
+ * which may take mounting its root filesystem. That is done in the
+ * background, so that targets show up as soon as they are found.
  *
  * @param	e The library context.
  * @param	str_out	Returns the string identifying the boot target that became
  *		(un)available. Is set to %NULL whet no more devices have changed.
  *		Remains valid until the next call to this function.
- * @return	1 if the target is to be added, 2 if it's to be removed, 0 if no
- *		changes are left.
+ * @return	1 if the target is to be added, 2 if it's to be removed, 3 if it
+ *		has been renamed (to @display_name_out), 0 if no changes are
+ *		left.
  */
 int bootloader_enumerate_get_change(struct bootloader_enumerate *e, const char **cmd_out, const char **display_name_out);
 
@@ -57,3 +163,307 @@ int bootloader_enumerate_get_change(struct bootloader_enumerate *e, const char *
  * @return	The aforementioned fd.
  */
 int bootloader_enumerate_get_fd(struct bootloader_enumerate *e);
+
+/**
+ * How quickly targets showed up. Times are in milliseconds since the
+ * enumeration was created, -1 for what hasn't happened yet.
+ */
+struct bootloader_enumerate_stats {
+	/** The first target was published, from the cache or by a scan. */
+	long long first_target_ms;
+	/** A scan found its first target. */
+	long long first_scanned_target_ms;
+	/** The devices that were there at the start have all been scanned. */
+	long long complete_ms;
+};
+
+/**
+ * Get the stats so far. Devices are scanned in order of how likely they are
+ * to hold what the user wants to boot: the disk the running system has /boot
+ * on first, then fixed disks, then removable ones.
+ *
+ * @param	e The library context.
+ * @param	out Filled in with the stats.
+ */
+void bootloader_enumerate_get_stats(struct bootloader_enumerate *e, struct bootloader_enumerate_stats *out);
+
+/**
+ * Say whether the user is about to boot something, say because the menu is
+ * up or a key was pressed. While they are, scanning goes at full speed and
+ * normal priority, to get the targets up as soon as possible, instead of
+ * keeping to the scan policy (see struct bootloader_enumerate_settings).
+ * Loading a target is never held back either way.
+ *
+ * @param	e The library context.
+ * @param	imminent Nonzero if it is, 0 to go back to the policy.
+ */
+void bootloader_enumerate_boot_imminent(struct bootloader_enumerate *e, unsigned imminent);
+
+/** A disk that stays put. Devices the library knows nothing about are
+ * counted as such. */
+#define BOOTLOADER_DEVICE_FIXED 1
+/** A removable disk, or a USB one (which don't always say they're
+ * removable). */
+#define BOOTLOADER_DEVICE_REMOVABLE 2
+/** A CD or DVD drive. */
+#define BOOTLOADER_DEVICE_OPTICAL 4
+
+/**
+ * Which targets to hear about. A target has to pass all of the tests that
+ * are set.
+ */
+struct bootloader_filter {
+	/** BOOTLOADER_DEVICE_* flags for the types of devices the target may
+	 * be on, 0 for any. */
+	unsigned devices;
+	/** The first word of the command string (the type of target), or
+	 * %NULL for any. */
+	const char *type;
+	/** fnmatch() patterns the command string and the display name have
+	 * to match, or %NULL. As targets are renamed once the library has
+	 * looked at what they boot, a target may come and go as it is. */
+	const char *cmd_pattern, *name_pattern;
+};
+
+/**
+ * Only hear about the targets that pass a filter. It is applied before
+ * changes are queued, so the others don't make the fd readable. Targets that
+ * stop passing it are removed and those that start passing it are added, as
+ * if they had come and gone. Snapshots and the generation only count what
+ * passes too.
+ *
+ * @param	e The library context.
+ * @param	f The filter, or %NULL for everything. Not used after this
+ *		function returns.
+ * @return	0, or -1 if out of memory, in which case the filter is left as
+ *		it was.
+ */
+int bootloader_enumerate_set_filter(struct bootloader_enumerate *e, const struct bootloader_filter *f);
+
+/**
+ * Get the generation of the change bootloader_enumerate_get_change() last
+ * returned, to be given to bootloader_enumerate_get_changes_since() later.
+ *
+ * @param	e The library context.
+ * @return	The generation, 0 if no change has been returned yet.
+ */
+unsigned long long bootloader_enumerate_get_change_generation(struct bootloader_enumerate *e);
+
+/**
+ * A change as kept in the journal.
+ */
+struct bootloader_change {
+	unsigned long long generation;
+	/** As from bootloader_enumerate_get_change(). */
+	int type;
+	const char *cmd, *display_name;
+};
+
+/**
+ * The changes after some generation.
+ */
+struct bootloader_changes {
+	/** The last generation there is. */
+	unsigned long long generation;
+	size_t n_changes;
+	/** Oldest first. */
+	const struct bootloader_change *changes;
+};
+
+/**
+ * Get the changes since a generation from the journal, for example to catch
+ * up on what was missed after throwing the state away. The change queue is
+ * not affected.
+ *
+ * @param	e The library context.
+ * @param	generation The generation of the last change seen, as from
+ *		bootloader_enumerate_get_change_generation() or a snapshot.
+ * @param	out Set to the changes, a single allocation to be freed with
+ *		bootloader_changes_free().
+ * @return	0, 1 if some of the changes are no longer kept (see
+ *		journal_size), in which case take a snapshot instead, or -1
+ *		if out of memory.
+ */
+int bootloader_enumerate_get_changes_since(struct bootloader_enumerate *e, unsigned long long generation, struct bootloader_changes **out);
+
+/**
+ * Free changes.
+ *
+ * @param	changes The changes.
+ */
+void bootloader_changes_free(struct bootloader_changes *changes);
+
+/**
+ * A target as seen in a snapshot.
+ */
+struct bootloader_snapshot_entry {
+	/** The command string, as from bootloader_enumerate_get_change(). */
+	const char *cmd;
+	const char *display_name;
+	/** The sysfs path of the device the target is on, or %NULL. */
+	const char *syspath;
+	/** BOOTLOADER_TARGET_* flags. */
+	unsigned flags;
+};
+
+/** The target was remembered from an earlier run and hasn't been found by a
+ * scan yet. It may still go away once its device has been scanned. */
+#define BOOTLOADER_TARGET_FROM_CACHE 1
+/** The files of the target are being watched, so it goes away as soon as
+ * they do. */
+#define BOOTLOADER_TARGET_WATCHED 2
+
+/**
+ * All targets at one point in time.
+ */
+struct bootloader_snapshot {
+	/** The generation the snapshot was taken at. See
+	 * bootloader_enumerate_get_generation(). */
+	unsigned long long generation;
+	size_t n_entries;
+	const struct bootloader_snapshot_entry *entries;
+};
+
+/**
+ * Get the number of changes so far. Every change that
+ * bootloader_enumerate_get_change() will return bumps it by one, so it can be
+ * compared with the generation of a snapshot to see if it's out of date.
+ *
+ * @param	e The library context.
+ * @return	The generation.
+ */
+unsigned long long bootloader_enumerate_get_generation(struct bootloader_enumerate *e);
+
+/**
+ * Get all current targets (that pass the filter) in one go, for example to
+ * fill a menu. The snapshot is a single allocation that isn't touched by the
+ * library after this function returns, so it can be kept around and read
+ * from any thread.
+ *
+ * The change queue is not affected. The snapshot already contains the
+ * changes that bootloader_enumerate_get_change() has yet to return up to its
+ * generation; applying them again is harmless.
+ *
+ * @param	e The library context.
+ * @return	The snapshot, or %NULL if out of memory. Free it with
+ *		bootloader_snapshot_free().
+ */
+struct bootloader_snapshot *bootloader_enumerate_snapshot(struct bootloader_enumerate *e);
+
+/**
+ * Free a snapshot.
+ *
+ * @param	snap The snapshot.
+ */
+void bootloader_snapshot_free(struct bootloader_snapshot *snap);
+
+/**
+ * A target in the shared table. The strings are at offsets from the start of
+ * the table; get them with bootloader_table_string().
+ */
+struct bootloader_table_entry {
+	uint32_t cmd, display_name;
+	/** 0 if the target isn't on a device. */
+	uint32_t syspath;
+	/** BOOTLOADER_TARGET_* flags. */
+	uint32_t flags;
+};
+
+/**
+ * The targets of an enumeration (those that pass the filter) in shared
+ * memory, for readers that look often: reading it takes no syscalls and no
+ * copying, and needn't go through the enumeration's lock or its changes.
+ * Read it like this:
+ *
+ * @code
+ * do {
+ *	if(bootloader_table_read_begin(t, &seq) < 0) ... try again later ...
+ *	n = bootloader_table_count(t);
+ *	for(i = 0; i < n; ++i) ... bootloader_table_string(t, t->entries[i].cmd) ...
+ * } while(bootloader_table_read_retry(t, seq));
+ * @endcode
+ *
+ * What is read before bootloader_table_read_retry() says it's all right may
+ * be half-written, so only act on it afterwards. The accessors keep a reader
+ * inside the table whatever it finds there.
+ */
+struct bootloader_table {
+	uint32_t magic;
+	/** Of the mapping. */
+	uint32_t size;
+	/** Odd while the table is being written. */
+	uint64_t seq;
+	/** As from bootloader_enumerate_get_generation(). */
+	uint64_t generation;
+	uint32_t n_entries;
+	/** Not all targets fit. */
+	uint32_t truncated;
+	struct bootloader_table_entry entries[];
+};
+
+/**
+ * Get the fd of the shared table. It can be mapped with
+ * bootloader_table_map(), also in another process it is passed to, and
+ * stays valid as long as the enumeration or a mapping of it is there.
+ *
+ * @param	e The library context.
+ * @return	The fd. Don't close it.
+ */
+int bootloader_enumerate_get_table_fd(struct bootloader_enumerate *e);
+
+/**
+ * Map a shared table.
+ *
+ * @param	fd From bootloader_enumerate_get_table_fd(). May be closed
+ *		afterwards.
+ * @return	The table, or %NULL if it couldn't be mapped.
+ */
+const struct bootloader_table *bootloader_table_map(int fd);
+
+/**
+ * Unmap a shared table.
+ *
+ * @param	t The table.
+ */
+void bootloader_table_unmap(const struct bootloader_table *t);
+
+/**
+ * Start reading a shared table. Waits for a write in progress to finish, but
+ * not for long: a writer that takes longer has likely died in the middle of
+ * it, and the table stays half-written until the enumeration is created
+ * again.
+ *
+ * @param	t The table.
+ * @param	seq_out Set to what to give bootloader_table_read_retry().
+ * @return	0, or -1 if a write has been in progress for too long, in which
+ *		case there is nothing to read now.
+ */
+int bootloader_table_read_begin(const struct bootloader_table *t, uint64_t *seq_out);
+
+/**
+ * Finish reading a shared table.
+ *
+ * @param	t The table.
+ * @param	seq From bootloader_table_read_begin().
+ * @return	1 if the table changed while it was being read, and what was
+ *		read has to be thrown away and read again, 0 if it's
+ *		consistent.
+ */
+int bootloader_table_read_retry(const struct bootloader_table *t, uint64_t seq);
+
+/**
+ * The number of entries in a shared table.
+ *
+ * @param	t The table.
+ * @return	The number of entries, never more than fit in the table.
+ */
+size_t bootloader_table_count(const struct bootloader_table *t);
+
+/**
+ * A string in a shared table.
+ *
+ * @param	t The table.
+ * @param	offset From an entry.
+ * @return	The string, or %NULL if @offset is 0.
+ */
+const char *bootloader_table_string(const struct bootloader_table *t, uint32_t offset);
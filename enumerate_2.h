@@ -7,16 +7,74 @@ struct enumerate_target {
 	 * for freeing the string and closing the fd. */
 	void (*free)(struct enumerate_target *self);
 
-	/* This function is called when fd becomes readable. Return 1 to
-	 * signal that the target has become unavailable. */
+	/* This function is called from the monitor thread when fd becomes
+	 * readable. Return 1 to signal that the target has become
+	 * unavailable. fd is -1 if there is nothing to watch. */
 	unsigned (*event)(struct enumerate_target *self);
 
-	/* Called every time a device is removed. Return 1 as above. */
-	unsigned (*on_remove)(struct enumerate_target *self, const char *syspath);
-
 	char *cmd;
+
+	/* The syspath of the device the target is on, or NULL. The target
+	 * becomes unavailable when that device is removed. Must stay valid
+	 * until free is called. */
+	const char *syspath;
+	int fd;
+	void *data;
+};
+
+/* Publish a target. Takes ownership of @target. Returns a copy of the name
+ * the target is published under, also if it already existed, or NULL if it
+ * couldn't be added. A new target is published under @suggested_name (or its
+ * command if that is NULL) and renamed after enumerate_scan_end(), once it
+ * has been looked at for a better one.
+ *
+ * @scan is what enumerate_scan_begin() returned for the scan that found the
+ * target. Nothing is published if the device has been removed or scanned
+ * again since. 0 publishes regardless, from the monitor thread only.
+ *
+ * *@final_out says if the name is final, the one the namer gave a target that
+ * was already there; it's provisional for a new one. */
+char *enumerate_add_target(struct bootloader_enumerate *e, struct enumerate_target *target, const char *suggested_name, unsigned long long scan, unsigned *final_out);
+
+/* As above, for a target from the scan cache, published under @name. If
+ * @final, that's the name the namer gave it and it isn't renamed. Otherwise
+ * it's only the provisional name it had, and it's renamed after the next
+ * enumerate_scan_end() of the device like a new one. */
+void enumerate_add_cached_target(struct bootloader_enumerate *e, struct enumerate_target *target, const char *name, unsigned final, unsigned long long scan);
+
+/* The persistent scan cache (see cache.h). */
+struct cache *enumerate_get_cache(struct bootloader_enumerate *e);
+
+/* What the config scanners keep between scans (see config.h). */
+struct config_store *enumerate_get_config_store(struct bootloader_enumerate *e);
+
+/* Something to keep an eye on for a device, like its config file. */
+struct enumerate_watch {
+	/* Free this struct, close the fd and so on. */
+	void (*free)(struct enumerate_watch *self);
+
+	/* Called from the monitor thread when fd becomes readable. */
+	void (*event)(struct enumerate_watch *self);
+
 	int fd;
+	/* The device this is for. Must stay valid until free is called. */
+	const char *syspath;
 	void *data;
 };
 
-void enumerate_add_target(struct bootloader_enumerate *e, struct enumerate_target *target, const char *suggested_name);
+/* Takes ownership of @watch. It replaces any earlier watch for the same
+ * device, and goes away with the device. */
+void enumerate_add_watch(struct bootloader_enumerate *e, struct enumerate_watch *watch);
+
+/* Queue a read of the configs on a device again, after some of them
+ * changed (see disk_scan_configs()). From the monitor thread only, like the
+ * watch events. */
+void enumerate_rescan_configs(struct bootloader_enumerate *e, const char *devnode);
+
+/* Bracket a (re)scan of a device. Targets on the device that weren't added
+ * again between the two calls are removed by enumerate_scan_end().
+ * enumerate_scan_begin() returns the number of the scan, to be passed to the
+ * other calls, or 0 if the device is gone and there's no point in scanning
+ * it. A scan that has been superseded by a later one changes nothing. */
+unsigned long long enumerate_scan_begin(struct bootloader_enumerate *e, const char *syspath);
+void enumerate_scan_end(struct bootloader_enumerate *e, const char *syspath, unsigned long long scan);
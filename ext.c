@@ -0,0 +1,415 @@
+#include "ext.h"
+#include "fs.h"
+#include "s.h"
+#include "throttle.h"
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/*
+ * A read-only ext2/3/4 reader. It reads straight from the block device, so it
+ * must only be used on filesystems that aren't mounted, and it refuses ones
+ * whose journal needs to be replayed.
+ *
+ * Directories are searched entry by entry. That works for hashed (htree)
+ * directories too: their index blocks look like empty entries to anyone who
+ * doesn't know about them, which is how ext2 could read them.
+ */
+
+#define EXT_MAGIC 0xef53
+
+/* Incompatible features. Unknown ones mean we can't read the filesystem. */
+#define INCOMPAT_FILETYPE 0x2
+#define INCOMPAT_RECOVER 0x4
+#define INCOMPAT_EXTENTS 0x40
+#define INCOMPAT_64BIT 0x80
+#define INCOMPAT_MMP 0x100
+#define INCOMPAT_FLEX_BG 0x200
+#define INCOMPAT_EA_INODE 0x400
+#define INCOMPAT_CSUM_SEED 0x2000
+#define INCOMPAT_LARGEDIR 0x4000
+#define INCOMPAT_INLINE_DATA 0x8000
+#define INCOMPAT_CASEFOLD 0x20000
+#define INCOMPAT_KNOWN (INCOMPAT_FILETYPE | INCOMPAT_RECOVER | INCOMPAT_EXTENTS | INCOMPAT_64BIT | INCOMPAT_MMP | INCOMPAT_FLEX_BG | INCOMPAT_EA_INODE | INCOMPAT_CSUM_SEED | INCOMPAT_LARGEDIR | INCOMPAT_INLINE_DATA | INCOMPAT_CASEFOLD)
+
+/* Inode flags */
+#define EXTENTS_FL 0x80000
+#define INLINE_DATA_FL 0x10000000
+
+#define ROOT_INO 2
+/* Symlinks followed in one lookup, like the kernel's. */
+#define MAX_LINKS 40
+
+struct ext {
+	int fd;
+	unsigned block_size, inode_size, desc_size;
+	unsigned long long gdt_block;
+	unsigned long inodes_per_group, groups;
+	unsigned filetype;
+	/* For extent tree nodes and directory blocks. */
+	unsigned char *node, *dir;
+};
+
+struct ext_file {
+	unsigned mode;
+	unsigned long flags;
+	unsigned long long size;
+	long long mtime;
+	long mtime_nsec;
+	unsigned char block[60];
+};
+
+static unsigned long long le(const unsigned char *p, unsigned n)
+{
+	unsigned long long v = 0;
+	while(n--) v = v << 8 | p[n];
+	return v;
+}
+
+static int read_at(struct ext *x, void *buf, size_t len, unsigned long long off)
+{
+	throttle_read(len);
+	return pread(x->fd, buf, len, off) == (ssize_t)len ? 0 : -1;
+}
+
+static int read_inode(struct ext *x, unsigned long ino, struct ext_file *f)
+{
+	unsigned char desc[64], raw[256];
+	unsigned long group, index;
+	unsigned long long table;
+	unsigned len;
+
+	if(ino == 0) return -1;
+	group = (ino - 1) / x->inodes_per_group;
+	index = (ino - 1) % x->inodes_per_group;
+	if(group >= x->groups) return -1;
+
+	if(read_at(x, desc, x->desc_size, x->gdt_block * x->block_size + (unsigned long long)group * x->desc_size) < 0) return -1;
+	table = le(desc + 0x8, 4);
+	if(x->desc_size >= 64) table |= le(desc + 0x28, 4) << 32;
+
+	len = x->inode_size < sizeof raw ? x->inode_size : sizeof raw;
+	if(read_at(x, raw, len, table * x->block_size + (unsigned long long)index * x->inode_size) < 0) return -1;
+
+	f->mode = le(raw, 2);
+	f->size = le(raw + 0x4, 4) | le(raw + 0x6c, 4) << 32;
+	f->mtime = (int)le(raw + 0x10, 4);
+	f->mtime_nsec = 0;
+	f->flags = le(raw + 0x20, 4);
+	memcpy(f->block, raw + 0x28, sizeof f->block);
+	/* Nanoseconds and the epoch bits, if the inode is big enough. */
+	if(len >= 0x8c && le(raw + 0x80, 2) >= 0xc) {
+		unsigned long extra;
+		extra = le(raw + 0x88, 4);
+		f->mtime += (long long)(extra & 3) << 32;
+		f->mtime_nsec = extra >> 2;
+	}
+	return 0;
+}
+
+/* Find where logical block @lblk of a file is. *pblk_out is 0 for a hole (or
+ * an unwritten extent, which reads as zeroes too). *count_out is how many
+ * blocks from there on are contiguous on disk, or also holes. */
+static int map(struct ext *x, struct ext_file *f, unsigned long long lblk, unsigned long long *pblk_out, unsigned long long *count_out)
+{
+	*pblk_out = 0;
+	*count_out = 1;
+
+	if(f->flags & EXTENTS_FL) {
+		const unsigned char *node;
+		unsigned depth = 0;
+		node = f->block;
+		while(1) {
+			unsigned n, i;
+			if(le(node, 2) != 0xf30a) return -1;
+			n = le(node + 2, 2);
+			/* No more entries than the header says fit, and than do
+			 * fit: 4 in the inode, a block's worth below it. */
+			if(n > le(node + 4, 2)) return -1;
+			if(n > (node == f->block ? sizeof f->block - 12 : x->block_size - 12) / 12) return -1;
+			if(le(node + 6, 2) != depth && node != f->block) return -1;
+			depth = le(node + 6, 2);
+
+			if(depth == 0) {
+				for(i = 0; i < n; ++i) {
+					const unsigned char *e;
+					unsigned long long start, len;
+					e = node + 12 + 12 * i;
+					start = le(e, 4);
+					len = le(e + 4, 2);
+					if(lblk < start) {
+						*count_out = start - lblk;
+						return 0;
+					}
+					if(len > 32768) len -= 32768;
+					else if(lblk < start + len) *pblk_out = (le(e + 6, 2) << 32 | le(e + 8, 4)) + lblk - start;
+					if(lblk < start + len) {
+						*count_out = start + len - lblk;
+						return 0;
+					}
+				}
+				return 0;
+			}
+
+			/* The last index that starts at or before lblk. */
+			for(i = 0; i + 1 < n && le(node + 12 + 12 * (i + 1), 4) <= lblk; ++i);
+			if(n == 0) return 0;
+			if(read_at(x, x->node, x->block_size, (le(node + 12 + 12 * i + 8, 2) << 32 | le(node + 12 + 12 * i + 4, 4)) * x->block_size) < 0) return -1;
+			node = x->node;
+			--depth;
+		}
+	}
+	else {
+		/* Direct, indirect, double and triple indirect blocks. */
+		unsigned long long per_block, span = 1, blk;
+		unsigned level;
+		per_block = x->block_size / 4;
+		if(lblk < 12) {
+			*pblk_out = le(f->block + 4 * lblk, 4);
+			return 0;
+		}
+		lblk -= 12;
+		for(level = 1; level <= 3; ++level) {
+			span *= per_block;
+			if(lblk < span) break;
+			lblk -= span;
+		}
+		if(level > 3) return -1;
+		blk = le(f->block + 4 * (11 + level), 4);
+		while(blk && level--) {
+			unsigned char ptr[4];
+			span /= per_block;
+			if(read_at(x, ptr, 4, blk * x->block_size + lblk / span * 4) < 0) return -1;
+			blk = le(ptr, 4);
+			lblk %= span;
+		}
+		*pblk_out = blk;
+		return 0;
+	}
+}
+
+ssize_t ext_pread(struct ext *x, struct ext_file *f, void *buf, size_t len, unsigned long long off)
+{
+	size_t done = 0;
+	if(off >= f->size) return 0;
+	if(len > f->size - off) len = f->size - off;
+
+	if(f->flags & INLINE_DATA_FL) {
+		/* Only what fits in the inode, the rest is in an xattr. */
+		if(off + len > sizeof f->block) return -1;
+		memcpy(buf, f->block + off, len);
+		return len;
+	}
+
+	while(done < len) {
+		unsigned long long pblk, count, in_block, run;
+		if(map(x, f, off / x->block_size, &pblk, &count) < 0) return -1;
+		in_block = off % x->block_size;
+		run = count * x->block_size - in_block;
+		if(run > len - done) run = len - done;
+		if(pblk == 0) memset((char *)buf + done, 0, run);
+		else if(read_at(x, (char *)buf + done, run, pblk * x->block_size + in_block) < 0) return -1;
+		done += run;
+		off += run;
+	}
+	return done;
+}
+
+/* Look for @name in the entries between @p and @end. If @list isn't NULL,
+ * it gets every entry instead (but . and ..) and @name isn't looked for. */
+static unsigned long find_entry(struct ext *x, const unsigned char *p, const unsigned char *end, const char *name, size_t len, fs_list_f *list, void *user)
+{
+	while(p + 8 <= end) {
+		unsigned long ino, rec_len, name_len;
+		ino = le(p, 4);
+		rec_len = le(p + 4, 2);
+		/* How 64k blocks fit in 16 bits. */
+		if(rec_len == 0 || rec_len == 65535) rec_len = 65536;
+		else rec_len = (rec_len & 65532) | (rec_len & 3) << 16;
+		name_len = x->filetype ? p[6] : le(p + 6, 2);
+		if(ino && p + 8 + name_len <= end) {
+			if(list) {
+				char buf[256];
+				if(name_len < sizeof buf && !(name_len == 1 && p[8] == '.') && !(name_len == 2 && p[8] == '.' && p[9] == '.')) {
+					memcpy(buf, p + 8, name_len);
+					buf[name_len] = '\0';
+					list(user, buf);
+				}
+			}
+			else if(name_len == len && !memcmp(p + 8, name, len)) return ino;
+		}
+		if(rec_len < 8) break;
+		p += rec_len;
+	}
+	return 0;
+}
+
+static unsigned long lookup_entry(struct ext *x, struct ext_file *dir, const char *name, size_t len, fs_list_f *list, void *user)
+{
+	unsigned long long off;
+	if(!S_ISDIR(dir->mode)) return 0;
+
+	/* The parent's inode number, then the entries. */
+	if(dir->flags & INLINE_DATA_FL) {
+		if(!list && len == 2 && !memcmp(name, "..", 2)) return le(dir->block, 4);
+		if(!list && len == 1 && name[0] == '.') return 0;
+		return find_entry(x, dir->block + 4, dir->block + sizeof dir->block, name, len, list, user);
+	}
+
+	for(off = 0; off < dir->size; off += x->block_size) {
+		unsigned long ino;
+		if(ext_pread(x, dir, x->dir, x->block_size, off) != (ssize_t)x->block_size) return 0;
+		ino = find_entry(x, x->dir, x->dir + x->block_size, name, len, list, user);
+		if(ino) return ino;
+	}
+	return 0;
+}
+
+static char *read_link(struct ext *x, struct ext_file *f)
+{
+	char *target;
+	if(f->size > 4096) return NULL;
+	/* Short symlinks are kept in the inode. */
+	if(f->size < sizeof f->block && !(f->flags & EXTENTS_FL)) return s_ndup((char *)f->block, f->size);
+	target = malloc(f->size + 1);
+	if(!target) return NULL;
+	if(ext_pread(x, f, target, f->size, 0) != (ssize_t)f->size) {
+		free(target);
+		return NULL;
+	}
+	target[f->size] = '\0';
+	return target;
+}
+
+/* Follow @path from the root into @f. */
+static int resolve(struct ext *x, const char *path, struct ext_file *f)
+{
+	struct ext_file next;
+	char *todo, *p;
+	unsigned links = 0;
+
+	if(read_inode(x, ROOT_INO, f) < 0) goto err0;
+	todo = s_dup(path);
+	if(!todo) goto err0;
+
+	p = todo;
+	while(1) {
+		size_t len;
+		p += strspn(p, "/");
+		if(!*p) break;
+		len = strcspn(p, "/");
+		if(read_inode(x, lookup_entry(x, f, p, len, NULL, NULL), &next) < 0) goto err1;
+
+		if(S_ISLNK(next.mode)) {
+			char *target, *rest;
+			if(++links > MAX_LINKS) goto err1;
+			target = read_link(x, &next);
+			if(!target) goto err1;
+			/* Absolute links start over from the root, relative ones
+			 * go on from the directory the link is in. */
+			if(target[0] == '/' && read_inode(x, ROOT_INO, f) < 0) {
+				free(target);
+				goto err1;
+			}
+			rest = s_concat(target, "/", p + len, NULL);
+			free(target);
+			if(!rest) goto err1;
+			free(todo);
+			p = todo = rest;
+			continue;
+		}
+
+		*f = next;
+		p += len;
+	}
+	free(todo);
+	return 0;
+
+	err1: free(todo);
+	err0: return -1;
+}
+
+struct ext_file *ext_lookup(struct ext *x, const char *path, struct fs_stat *st_out)
+{
+	struct ext_file *f;
+
+	f = malloc(sizeof *f);
+	if(!f) goto err0;
+	if(resolve(x, path, f) < 0) goto err1;
+	if(!S_ISREG(f->mode)) goto err1;
+
+	st_out->size = f->size;
+	st_out->mtime = f->mtime;
+	st_out->mtime_nsec = f->mtime_nsec;
+	return f;
+
+	err1: free(f);
+	err0: return NULL;
+}
+
+int ext_list(struct ext *x, const char *path, fs_list_f *f, void *user)
+{
+	struct ext_file dir;
+	if(resolve(x, path, &dir) < 0 || !S_ISDIR(dir.mode)) return -1;
+	lookup_entry(x, &dir, NULL, 0, f, user);
+	return 0;
+}
+
+void ext_release(struct ext *x, struct ext_file *f)
+{
+	free(f);
+}
+
+struct ext *ext_open(int fd)
+{
+	unsigned char sb[1024];
+	struct ext *x;
+	unsigned long incompat, log_block_size, blocks_per_group;
+	unsigned long long blocks, first_data_block;
+
+	if(pread(fd, sb, sizeof sb, 1024) != sizeof sb) goto err0;
+	if(le(sb + 0x38, 2) != EXT_MAGIC) goto err0;
+	incompat = le(sb + 0x60, 4);
+	/* A journal to replay means the metadata on disk isn't to be
+	 * trusted. Mounting takes care of that. */
+	if(incompat & ~INCOMPAT_KNOWN || incompat & INCOMPAT_RECOVER) goto err0;
+
+	x = malloc(sizeof *x);
+	if(!x) goto err0;
+	x->fd = fd;
+	log_block_size = le(sb + 0x18, 4);
+	if(log_block_size > 6) goto err1;
+	x->block_size = 1024 << log_block_size;
+	x->inode_size = le(sb + 0x4c, 4) ? le(sb + 0x58, 2) : 128;
+	if(x->inode_size < 128 || x->inode_size > x->block_size || x->inode_size & (x->inode_size - 1)) goto err1;
+	x->desc_size = incompat & INCOMPAT_64BIT ? le(sb + 0xfe, 2) : 32;
+	if(x->desc_size < 32 || x->desc_size > 64) goto err1;
+	x->filetype = !!(incompat & INCOMPAT_FILETYPE);
+
+	x->inodes_per_group = le(sb + 0x28, 4);
+	blocks_per_group = le(sb + 0x20, 4);
+	if(!x->inodes_per_group || !blocks_per_group) goto err1;
+	blocks = le(sb + 0x4, 4);
+	if(incompat & INCOMPAT_64BIT) blocks |= le(sb + 0x150, 4) << 32;
+	first_data_block = le(sb + 0x14, 4);
+	if(blocks <= first_data_block) goto err1;
+	x->groups = (blocks - first_data_block + blocks_per_group - 1) / blocks_per_group;
+	x->gdt_block = first_data_block + 1;
+
+	x->node = malloc(x->block_size);
+	if(!x->node) goto err1;
+	x->dir = malloc(x->block_size);
+	if(!x->dir) goto err2;
+	return x;
+
+	err2: free(x->node);
+	err1: free(x);
+	err0: return NULL;
+}
+
+void ext_close(struct ext *x)
+{
+	free(x->node);
+	free(x->dir);
+	free(x);
+}
@@ -0,0 +1,16 @@
+/* A read-only ext2/3/4 reader working on the block device. See fs.h. */
+#include <sys/types.h>
+
+struct ext;
+struct ext_file;
+struct fs_stat;
+
+/* Returns NULL if the device doesn't hold an ext filesystem that can be read
+ * safely. */
+struct ext *ext_open(int fd);
+void ext_close(struct ext *x);
+
+struct ext_file *ext_lookup(struct ext *x, const char *path, struct fs_stat *st_out);
+ssize_t ext_pread(struct ext *x, struct ext_file *f, void *buf, size_t len, unsigned long long off);
+void ext_release(struct ext *x, struct ext_file *f);
+int ext_list(struct ext *x, const char *path, void (*f)(void *user, const char *name), void *user);
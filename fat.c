@@ -0,0 +1,438 @@
+#include "fat.h"
+#include "fs.h"
+#include "fs_2.h"
+#include "s.h"
+#include "throttle.h"
+#include <stdlib.h>
+#include <unistd.h>
+#include <strings.h>
+
+/*
+ * A read-only FAT12/16/32 reader, for EFI system partitions and removable
+ * media. Long (VFAT) names are matched as well as the 8.3 ones, both without
+ * regard to case, as Windows does.
+ *
+ * Timestamps are in local time of whoever wrote them, and are taken as UTC:
+ * they are only compared with themselves.
+ */
+
+#define ATTR_VOLUME 0x08
+#define ATTR_DIR 0x10
+#define ATTR_LFN 0x0f
+
+/* How much of the FAT is read at once. Following a cluster chain mostly
+ * stays within it. */
+#define FAT_WINDOW 8192
+
+/* Long names are up to 255 UCS-2 characters, in entries of 13. */
+#define LFN_ENTRIES 20
+
+struct fat {
+	int fd;
+	unsigned type;
+	unsigned long cluster_size;
+	unsigned long long fat_off, fat_size, data_off;
+	/* FAT12/16 have the root directory in a fixed place, FAT32 in a
+	 * cluster chain like any other. */
+	unsigned long long root_off;
+	unsigned long root_size, root_cluster;
+	unsigned long clusters;
+
+	unsigned char *window;
+	unsigned long long window_off;
+	size_t window_len;
+	unsigned char *dir;
+};
+
+struct fat_file {
+	/* 0 for the fixed root directory. */
+	unsigned long first;
+	unsigned long long size;
+	unsigned is_dir;
+	long long mtime;
+	/* Where the last read ended, so that reading a file from start to end
+	 * doesn't follow the chain from the start every time. */
+	unsigned long long pos_index;
+	unsigned long pos_cluster;
+};
+
+static unsigned long long le(const unsigned char *p, unsigned n)
+{
+	unsigned long long v = 0;
+	while(n--) v = v << 8 | p[n];
+	return v;
+}
+
+static int read_at(struct fat *x, void *buf, size_t len, unsigned long long off)
+{
+	throttle_read(len);
+	return pread(x->fd, buf, len, off) == (ssize_t)len ? 0 : -1;
+}
+
+/* The cluster after @cluster, or 0 at the end of the chain. */
+static unsigned long next_cluster(struct fat *x, unsigned long cluster)
+{
+	unsigned long long off;
+	unsigned long next;
+	unsigned n;
+
+	if(x->type == 12) off = cluster + cluster / 2;
+	else off = cluster * (x->type / 8);
+	n = x->type == 32 ? 4 : 2;
+	if(off + n > x->fat_size) return 0;
+
+	if(off < x->window_off || off + n > x->window_off + x->window_len) {
+		size_t len;
+		x->window_off = off - off % FAT_WINDOW;
+		/* A FAT12 entry may straddle the window. */
+		if(off + n > x->window_off + FAT_WINDOW) x->window_off = off;
+		len = x->fat_size - x->window_off < FAT_WINDOW ? x->fat_size - x->window_off : FAT_WINDOW;
+		x->window_len = 0;
+		if(read_at(x, x->window, len, x->fat_off + x->window_off) < 0) return 0;
+		x->window_len = len;
+	}
+
+	next = le(x->window + (off - x->window_off), n);
+	if(x->type == 12) next = cluster & 1 ? next >> 4 : next & 0xfff;
+	else if(x->type == 32) next &= 0x0fffffff;
+	/* End of chain, bad clusters, and anything else that can't be in a
+	 * chain. */
+	if(next < 2 || next >= x->clusters + 2) return 0;
+	return next;
+}
+
+static unsigned long long cluster_off(struct fat *x, unsigned long cluster)
+{
+	return x->data_off + (unsigned long long)(cluster - 2) * x->cluster_size;
+}
+
+ssize_t fat_pread(struct fat *x, struct fat_file *f, void *buf, size_t len, unsigned long long off)
+{
+	size_t done = 0;
+	unsigned long long index, i;
+	unsigned long cluster;
+
+	if(off >= f->size) return 0;
+	if(len > f->size - off) len = f->size - off;
+	if(!f->first) return -1;
+
+	index = off / x->cluster_size;
+	if(f->pos_cluster && f->pos_index <= index) {
+		cluster = f->pos_cluster;
+		i = f->pos_index;
+	}
+	else {
+		cluster = f->first;
+		i = 0;
+	}
+	for(; i < index; ++i) {
+		cluster = next_cluster(x, cluster);
+		if(!cluster) return -1;
+	}
+
+	while(done < len) {
+		unsigned long long in_cluster, run;
+		unsigned long start, next;
+		/* Read contiguous clusters in one go. */
+		start = cluster;
+		in_cluster = off % x->cluster_size;
+		run = x->cluster_size - in_cluster;
+		while(run < len - done && (next = next_cluster(x, cluster)) == cluster + 1) {
+			run += x->cluster_size;
+			cluster = next;
+			++i;
+		}
+		if(run > len - done) run = len - done;
+		if(read_at(x, (char *)buf + done, run, cluster_off(x, start) + in_cluster) < 0) return -1;
+		done += run;
+		off += run;
+
+		if(done < len) {
+			cluster = next_cluster(x, cluster);
+			if(!cluster) return -1;
+			++i;
+		}
+	}
+	f->pos_cluster = cluster;
+	f->pos_index = i;
+	return done;
+}
+
+static unsigned char checksum(const unsigned char *short_name)
+{
+	unsigned char sum = 0;
+	unsigned i;
+	for(i = 0; i < 11; ++i) sum = ((sum & 1) << 7) + (sum >> 1) + short_name[i];
+	return sum;
+}
+
+/* The 8.3 name of an entry as NAME.EXT. */
+static void short_name(const unsigned char *e, char *out)
+{
+	unsigned i, len = 0;
+	for(i = 0; i < 8 && e[i] != ' '; ++i) out[len++] = e[i];
+	/* 0xe5 marks deleted entries, so a name starting with it has 0x05. */
+	if(len && out[0] == 0x05) out[0] = (char)0xe5;
+	if(e[8] != ' ') {
+		out[len++] = '.';
+		for(i = 8; i < 11 && e[i] != ' '; ++i) out[len++] = e[i];
+	}
+	out[len] = '\0';
+}
+
+static void read_entry(const unsigned char *e, struct fat_file *f)
+{
+	unsigned date, time;
+	f->first = le(e + 0x1a, 2) | le(e + 0x14, 2) << 16;
+	f->size = le(e + 0x1c, 4);
+	f->is_dir = !!(e[0xb] & ATTR_DIR);
+	f->pos_cluster = 0;
+	date = le(e + 0x18, 2);
+	time = le(e + 0x16, 2);
+	f->mtime = fs_mktime(1980 + (date >> 9), date >> 5 & 0xf, date & 0x1f, time >> 11, time >> 5 & 0x3f, (time & 0x1f) * 2);
+}
+
+/* State of a long name being put together from the entries before the short
+ * one. */
+struct lfn {
+	unsigned char name[LFN_ENTRIES * 26];
+	unsigned next_seq, complete;
+	unsigned char sum;
+};
+
+/* Look at one directory entry. Returns 1 if it's the one called @name (and
+ * fills in @f), -1 at the end of the directory, 0 otherwise. If @list isn't
+ * NULL, it gets the entry's name instead (but . and ..). */
+static int match_entry(const unsigned char *e, struct lfn *l, const char *name, size_t len, struct fat_file *f, fs_list_f *list, void *user)
+{
+	static const unsigned char chars[13] = {1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30};
+	char buf[LFN_ENTRIES * 13 * 3 + 1];
+	unsigned seq, i;
+
+	if(e[0] == 0) return -1;
+	if(e[0] == 0xe5) {
+		l->complete = 0;
+		return 0;
+	}
+
+	if((e[0xb] & 0x3f) == ATTR_LFN) {
+		/* The entries come last part first, down to 1. */
+		seq = e[0] & 0x1f;
+		if(seq == 0 || seq > LFN_ENTRIES) goto broken;
+		if(e[0] & 0x40) {
+			memset(l->name, 0, sizeof l->name);
+			l->sum = e[13];
+		}
+		else if(l->complete || seq != l->next_seq || e[13] != l->sum) goto broken;
+		for(i = 0; i < 13; ++i) {
+			l->name[(seq - 1) * 26 + 2 * i] = e[chars[i]];
+			l->name[(seq - 1) * 26 + 2 * i + 1] = e[chars[i] + 1];
+		}
+		l->next_seq = seq - 1;
+		l->complete = seq == 1;
+		return 0;
+	}
+
+	if(e[0xb] & ATTR_VOLUME) goto broken;
+
+	/* A long name belongs to the short entry right after it, if that
+	 * wasn't changed by something that doesn't know about long names. */
+	if(l->complete && l->sum == checksum(e) && fs_ucs2_to_utf8(buf, sizeof buf, l->name, sizeof l->name, 0) == 0) {
+		l->complete = 0;
+		if(list) goto listed;
+		if(strlen(buf) == len && !strncasecmp(buf, name, len)) goto found;
+	}
+	l->complete = 0;
+	short_name(e, buf);
+	if(list) goto listed;
+	if(strlen(buf) == len && !strncasecmp(buf, name, len)) goto found;
+	return 0;
+
+	listed: if(strcmp(buf, ".") && strcmp(buf, "..")) list(user, buf);
+	return 0;
+
+	broken: l->complete = 0;
+	l->next_seq = 0;
+	return 0;
+
+	found: read_entry(e, f);
+	return 1;
+}
+
+static int lookup_entry(struct fat *x, struct fat_file *dir, const char *name, size_t len, struct fat_file *f, fs_list_f *list, void *user)
+{
+	struct lfn l;
+	unsigned long cluster;
+	unsigned long long n = 0;
+
+	if(!dir->is_dir) return -1;
+	l.next_seq = l.complete = 0;
+	l.sum = 0;
+	/* No . or .. in the root. Elsewhere they point back to it with 0. */
+	if(!list && (dir->first == 0 || dir->first == x->root_cluster)) {
+		if((len == 1 && name[0] == '.') || (len == 2 && !memcmp(name, "..", 2))) {
+			*f = *dir;
+			return 0;
+		}
+	}
+
+	if(dir->first == 0) {
+		unsigned long off;
+		for(off = 0; off < x->root_size; off += x->cluster_size) {
+			unsigned long size, i;
+			size = x->root_size - off < x->cluster_size ? x->root_size - off : x->cluster_size;
+			if(read_at(x, x->dir, size, x->root_off + off) < 0) return -1;
+			for(i = 0; i + 32 <= size; i += 32) {
+				int found;
+				found = match_entry(x->dir + i, &l, name, len, f, list, user);
+				if(found) return found > 0 ? 0 : -1;
+			}
+		}
+		return -1;
+	}
+
+	/* Chains that loop are cut off at the size of the filesystem. */
+	for(cluster = dir->first; cluster && n++ < x->clusters; cluster = next_cluster(x, cluster)) {
+		unsigned long i;
+		if(read_at(x, x->dir, x->cluster_size, cluster_off(x, cluster)) < 0) return -1;
+		for(i = 0; i + 32 <= x->cluster_size; i += 32) {
+			int found;
+			found = match_entry(x->dir + i, &l, name, len, f, list, user);
+			if(found) return found > 0 ? 0 : -1;
+		}
+	}
+	return -1;
+}
+
+static void root(struct fat *x, struct fat_file *f)
+{
+	f->first = x->type == 32 ? x->root_cluster : 0;
+	f->size = 0;
+	f->is_dir = 1;
+	f->mtime = 0;
+	f->pos_cluster = 0;
+}
+
+/* Follow @path from the root into @f. */
+static int resolve(struct fat *x, const char *path, struct fat_file *f)
+{
+	struct fat_file next;
+	const char *p;
+
+	root(x, f);
+	p = path;
+	while(1) {
+		size_t len;
+		p += strspn(p, "/");
+		if(!*p) break;
+		len = strcspn(p, "/");
+		if(lookup_entry(x, f, p, len, &next, NULL, NULL) < 0) return -1;
+		/* .. pointing at the root. */
+		if(next.is_dir && next.first == 0) root(x, &next);
+		*f = next;
+		p += len;
+	}
+	return 0;
+}
+
+struct fat_file *fat_lookup(struct fat *x, const char *path, struct fs_stat *st_out)
+{
+	struct fat_file *f;
+
+	f = malloc(sizeof *f);
+	if(!f) goto err0;
+	if(resolve(x, path, f) < 0) goto err1;
+	if(f->is_dir) goto err1;
+
+	st_out->size = f->size;
+	st_out->mtime = f->mtime;
+	st_out->mtime_nsec = 0;
+	return f;
+
+	err1: free(f);
+	err0: return NULL;
+}
+
+int fat_list(struct fat *x, const char *path, fs_list_f *f, void *user)
+{
+	struct fat_file dir;
+	if(resolve(x, path, &dir) < 0 || !dir.is_dir) return -1;
+	lookup_entry(x, &dir, NULL, 0, NULL, f, user);
+	return 0;
+}
+
+void fat_release(struct fat *x, struct fat_file *f)
+{
+	free(f);
+}
+
+struct fat *fat_open(int fd)
+{
+	unsigned char bs[512];
+	struct fat *x;
+	unsigned long bytes_per_sector, sectors_per_cluster, reserved, fats, root_entries;
+	unsigned long long sectors, fat_sectors;
+
+	if(pread(fd, bs, sizeof bs, 0) != sizeof bs) goto err0;
+	if(bs[510] != 0x55 || bs[511] != 0xaa) goto err0;
+	/* A jump to the boot code comes first. */
+	if(bs[0] != 0xeb && bs[0] != 0xe9) goto err0;
+
+	bytes_per_sector = le(bs + 0xb, 2);
+	sectors_per_cluster = bs[0xd];
+	reserved = le(bs + 0xe, 2);
+	fats = bs[0x10];
+	root_entries = le(bs + 0x11, 2);
+	sectors = le(bs + 0x13, 2);
+	if(!sectors) sectors = le(bs + 0x20, 4);
+	fat_sectors = le(bs + 0x16, 2);
+	if(!fat_sectors) fat_sectors = le(bs + 0x24, 4);
+	/* Media descriptor */
+	if(bs[0x15] != 0xf0 && bs[0x15] < 0xf8) goto err0;
+	if(bytes_per_sector < 512 || bytes_per_sector > 4096 || bytes_per_sector & (bytes_per_sector - 1)) goto err0;
+	if(!sectors_per_cluster || sectors_per_cluster & (sectors_per_cluster - 1)) goto err0;
+	if(!reserved || !fats || !fat_sectors) goto err0;
+
+	x = malloc(sizeof *x);
+	if(!x) goto err0;
+	x->fd = fd;
+	x->cluster_size = bytes_per_sector * sectors_per_cluster;
+	x->fat_off = (unsigned long long)reserved * bytes_per_sector;
+	x->fat_size = fat_sectors * bytes_per_sector;
+	x->root_off = x->fat_off + fats * x->fat_size;
+	x->root_size = root_entries * 32;
+	x->data_off = x->root_off + (x->root_size + bytes_per_sector - 1) / bytes_per_sector * bytes_per_sector;
+	if(sectors * bytes_per_sector <= x->data_off) goto err1;
+	x->clusters = (sectors * bytes_per_sector - x->data_off) / x->cluster_size;
+
+	/* The type goes by the number of clusters, and nothing else. */
+	if(x->clusters < 4085) x->type = 12;
+	else if(x->clusters < 65525) x->type = 16;
+	else x->type = 32;
+	x->root_cluster = 0;
+	if(x->type == 32) {
+		if(root_entries) goto err1;
+		x->root_cluster = le(bs + 0x2c, 4);
+		if(x->root_cluster < 2 || x->root_cluster >= x->clusters + 2) goto err1;
+	}
+	else if(!root_entries) goto err1;
+	if(x->fat_size < (x->clusters + 2) * x->type / 8) goto err1;
+
+	x->window = malloc(FAT_WINDOW);
+	if(!x->window) goto err1;
+	x->window_off = x->window_len = 0;
+	x->dir = malloc(x->cluster_size);
+	if(!x->dir) goto err2;
+	return x;
+
+	err2: free(x->window);
+	err1: free(x);
+	err0: return NULL;
+}
+
+void fat_close(struct fat *x)
+{
+	free(x->window);
+	free(x->dir);
+	free(x);
+}
@@ -0,0 +1,15 @@
+/* A read-only FAT12/16/32 reader working on the block device. See fs.h. */
+#include <sys/types.h>
+
+struct fat;
+struct fat_file;
+struct fs_stat;
+
+/* Returns NULL if the device doesn't hold a FAT filesystem. */
+struct fat *fat_open(int fd);
+void fat_close(struct fat *x);
+
+struct fat_file *fat_lookup(struct fat *x, const char *path, struct fs_stat *st_out);
+ssize_t fat_pread(struct fat *x, struct fat_file *f, void *buf, size_t len, unsigned long long off);
+void fat_release(struct fat *x, struct fat_file *f);
+int fat_list(struct fat *x, const char *path, void (*f)(void *user, const char *name), void *user);
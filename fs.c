@@ -0,0 +1,285 @@
+#include "fs.h"
+#include "fs_2.h"
+#include "ext.h"
+#include "fat.h"
+#include "iso.h"
+#include "smount.h"
+#include "s.h"
+#include "throttle.h"
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <dirent.h>
+
+typedef void *open_f(int fd);
+typedef void close_f(void *fs);
+typedef void *lookup_f(void *fs, const char *path, struct fs_stat *st_out);
+typedef ssize_t pread_f(void *fs, void *file, void *buf, size_t len, unsigned long long off);
+typedef void release_f(void *fs, void *file);
+typedef int list_f(void *fs, const char *path, fs_list_f *f, void *user);
+struct reader {
+	/* As blkid names them, space-separated. */
+	const char *types;
+	open_f *open;
+	close_f *close;
+	lookup_f *lookup;
+	pread_f *pread;
+	release_f *release;
+	list_f *list;
+};
+
+/* In order of how sure they can be that a device is theirs. */
+static const struct reader readers[] = {
+	{
+		"ext2 ext3 ext4",
+		(open_f *) ext_open,
+		(close_f *) ext_close,
+		(lookup_f *) ext_lookup,
+		(pread_f *) ext_pread,
+		(release_f *) ext_release,
+		(list_f *) ext_list,
+	},
+	{
+		"iso9660",
+		(open_f *) iso_open,
+		(close_f *) iso_close,
+		(lookup_f *) iso_lookup,
+		(pread_f *) iso_pread,
+		(release_f *) iso_release,
+		(list_f *) iso_list,
+	},
+	{
+		"vfat msdos",
+		(open_f *) fat_open,
+		(close_f *) fat_close,
+		(lookup_f *) fat_lookup,
+		(pread_f *) fat_pread,
+		(release_f *) fat_release,
+		(list_f *) fat_list,
+	},
+};
+
+/* Either a built-in reader or a mount. */
+struct fs {
+	const struct reader *reader;
+	void *data;
+	int fd;
+
+	struct smount *mnt;
+	const char *mountpoint;
+};
+
+struct fs_file {
+	struct fs *fs;
+	void *file;
+	int fd;
+	struct fs_stat st;
+};
+
+static int fs_newfree(struct fs *fs, struct fs **out, const char *device)
+{
+	struct stat st;
+
+	if(fs) goto freeing;
+
+	fs = malloc(sizeof *fs);
+	if(!fs) goto err0;
+	fs->reader = NULL;
+	fs->mnt = NULL;
+
+	if(stat(device, &st) < 0 || !S_ISBLK(st.st_mode)) goto err1;
+	if(!smount_is_mounted(st.st_rdev)) {
+		unsigned i;
+		fs->fd = open(device, O_RDONLY | O_CLOEXEC);
+		if(fs->fd < 0) goto err1;
+		for(i = 0; i < sizeof readers / sizeof readers[0]; ++i) {
+			fs->data = readers[i].open(fs->fd);
+			if(fs->data) {
+				fs->reader = &readers[i];
+				goto done;
+			}
+		}
+		close(fs->fd);
+	}
+
+	/* Nothing built in for it, or it's mounted already. */
+	if(smount_new(&fs->mnt, &fs->mountpoint, device) < 0) goto err1;
+
+	done: *out = fs;
+	return 0;
+
+	freeing: if(fs->reader) {
+		fs->reader->close(fs->data);
+		close(fs->fd);
+	}
+	else smount_free(fs->mnt);
+	err1: free(fs);
+	err0: return -1;
+}
+
+unsigned fs_type_is_read_directly(const char *type)
+{
+	size_t i, len;
+	const char *p;
+	len = strlen(type);
+	for(i = 0; i < sizeof readers / sizeof readers[0]; ++i) {
+		for(p = readers[i].types; *p; p += strspn(p, " ")) {
+			size_t n;
+			n = strcspn(p, " ");
+			if(n == len && !memcmp(p, type, n)) return 1;
+			p += n;
+		}
+	}
+	return 0;
+}
+
+int fs_open(struct fs **out, const char *device)
+{
+	return fs_newfree(NULL, out, device);
+}
+
+void fs_close(struct fs *fs)
+{
+	fs_newfree(fs, NULL, NULL);
+}
+
+const char *fs_system_mountpoint(struct fs *fs)
+{
+	if(!fs->mnt || !smount_is_borrowed(fs->mnt)) return NULL;
+	return fs->mountpoint;
+}
+
+struct fs_file *fs_file_open(struct fs *fs, const char *path)
+{
+	struct fs_file *f;
+
+	f = malloc(sizeof *f);
+	if(!f) goto err0;
+	f->fs = fs;
+	f->fd = -1;
+
+	if(fs->reader) {
+		f->file = fs->reader->lookup(fs->data, path, &f->st);
+		if(!f->file) goto err1;
+	}
+	else {
+		char *full_path;
+		struct stat st;
+		full_path = s_concat(fs->mountpoint, "/", path, NULL);
+		if(!full_path) goto err1;
+		f->fd = open(full_path, O_RDONLY | O_CLOEXEC);
+		free(full_path);
+		if(f->fd < 0) goto err1;
+		if(fstat(f->fd, &st) < 0 || !S_ISREG(st.st_mode)) goto err2;
+		f->st.size = st.st_size;
+		f->st.mtime = st.st_mtim.tv_sec;
+		f->st.mtime_nsec = st.st_mtim.tv_nsec;
+	}
+	return f;
+
+	err2: close(f->fd);
+	err1: free(f);
+	err0: return NULL;
+}
+
+void fs_file_close(struct fs_file *f)
+{
+	if(f->fs->reader) f->fs->reader->release(f->fs->data, f->file);
+	else close(f->fd);
+	free(f);
+}
+
+const struct fs_stat *fs_file_stat(struct fs_file *f)
+{
+	return &f->st;
+}
+
+ssize_t fs_file_pread(struct fs_file *f, void *buf, size_t len, unsigned long long off)
+{
+	size_t done = 0;
+	if(f->fs->reader) return f->fs->reader->pread(f->fs->data, f->file, buf, len, off);
+	while(done < len) {
+		ssize_t n;
+		n = pread(f->fd, (char *)buf + done, len - done, off + done);
+		if(n < 0) return -1;
+		if(n == 0) break;
+		throttle_read(n);
+		done += n;
+	}
+	return done;
+}
+
+int fs_list(struct fs *fs, const char *path, fs_list_f *f, void *user)
+{
+	char *full_path;
+	DIR *dir;
+	struct dirent *d;
+
+	if(fs->reader) return fs->reader->list(fs->data, path, f, user);
+	full_path = s_concat(fs->mountpoint, "/", path, NULL);
+	if(!full_path) return -1;
+	dir = opendir(full_path);
+	free(full_path);
+	if(!dir) return -1;
+	while(d = readdir(dir)) {
+		if(strcmp(d->d_name, ".") && strcmp(d->d_name, "..")) f(user, d->d_name);
+	}
+	closedir(dir);
+	return 0;
+}
+
+char *fs_file_read_all(struct fs_file *f)
+{
+	char *buf;
+	ssize_t len;
+	/* Config files, not disk images. */
+	if(f->st.size > 16 << 20) return NULL;
+	buf = malloc(f->st.size + 1);
+	if(!buf) return NULL;
+	len = fs_file_pread(f, buf, f->st.size, 0);
+	if(len < 0) {
+		free(buf);
+		return NULL;
+	}
+	buf[len] = '\0';
+	return buf;
+}
+
+long long fs_mktime(int year, int mon, int day, int hour, int min, int sec)
+{
+	long long days;
+	int era, yoe, doy;
+	/* Days since 1970-01-01, with the year starting in March so that leap
+	 * days come last. */
+	if(mon <= 2) --year;
+	era = (year >= 0 ? year : year - 399) / 400;
+	yoe = year - era * 400;
+	doy = (153 * (mon > 2 ? mon - 3 : mon + 9) + 2) / 5 + day - 1;
+	days = era * 146097LL + yoe * 365 + yoe / 4 - yoe / 100 + doy - 719468;
+	return ((days * 24 + hour) * 60 + min) * 60 + sec;
+}
+
+int fs_ucs2_to_utf8(char *out, size_t size, const unsigned char *in, size_t n, unsigned big_endian)
+{
+	size_t i, len = 0;
+	for(i = 0; i + 1 < n; i += 2) {
+		unsigned c;
+		c = big_endian ? in[i] << 8 | in[i + 1] : in[i + 1] << 8 | in[i];
+		if(!c) break;
+		if(len + 4 > size) return -1;
+		if(c < 0x80) out[len++] = c;
+		else if(c < 0x800) {
+			out[len++] = 0xc0 | c >> 6;
+			out[len++] = 0x80 | (c & 0x3f);
+		}
+		else {
+			out[len++] = 0xe0 | c >> 12;
+			out[len++] = 0x80 | (c >> 6 & 0x3f);
+			out[len++] = 0x80 | (c & 0x3f);
+		}
+	}
+	if(len >= size) return -1;
+	out[len] = '\0';
+	return 0;
+}
@@ -0,0 +1,45 @@
+/* Read-only access to the files on a filesystem. Filesystems that a built-in
+ * reader understands are read straight from the block device, without
+ * mounting anything. Others are mounted (see smount.h). A filesystem that the
+ * system already has mounted is always used through that mount, as the block
+ * device may lag behind it. */
+#include <sys/types.h>
+
+struct fs;
+struct fs_file;
+
+struct fs_stat {
+	unsigned long long size;
+	long long mtime;
+	long mtime_nsec;
+};
+
+int fs_open(struct fs **out, const char *device);
+void fs_close(struct fs *fs);
+
+/* Whether a filesystem of that type (as blkid names it) is read without
+ * mounting it, which is a lot cheaper. */
+unsigned fs_type_is_read_directly(const char *type);
+
+/* Where the system has the filesystem mounted. NULL if it doesn't, in which
+ * case there is nothing to watch for changes either. Valid until fs_close. */
+const char *fs_system_mountpoint(struct fs *fs);
+
+/* Open a regular file by absolute path. Symlinks are followed, with absolute
+ * ones relative to the root of the filesystem. */
+struct fs_file *fs_file_open(struct fs *fs, const char *path);
+void fs_file_close(struct fs_file *f);
+
+const struct fs_stat *fs_file_stat(struct fs_file *f);
+
+/* Returns the number of bytes read, which is less than @len only at the end
+ * of the file, or -1 on error. */
+ssize_t fs_file_pread(struct fs_file *f, void *buf, size_t len, unsigned long long off);
+
+/* Read the whole file into a newly allocated, null-terminated buffer. */
+char *fs_file_read_all(struct fs_file *f);
+
+/* Call @f with the name of every entry of a directory but . and .., in no
+ * particular order. The name is only valid during the call. */
+typedef void fs_list_f(void *user, const char *name);
+int fs_list(struct fs *fs, const char *path, fs_list_f *f, void *user);
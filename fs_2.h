@@ -0,0 +1,9 @@
+/* Internal interface of fs.c, for the built-in readers. */
+#include <stddef.h>
+
+/* Seconds since the epoch of a UTC date. @mon and @day start at 1. */
+long long fs_mktime(int year, int mon, int day, int hour, int min, int sec);
+
+/* Convert @n bytes of UCS-2 to a null-terminated UTF-8 string in @out, stopping
+ * at the first null character. Returns -1 if it doesn't fit. */
+int fs_ucs2_to_utf8(char *out, size_t size, const unsigned char *in, size_t n, unsigned big_endian);
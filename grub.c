@@ -0,0 +1,771 @@
+#include "grub.h"
+#include "config.h"
+#include "s.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * GRUB script is a small shell language. Commands are read one at a time
+ * straight from the buffer and run as they are read, so blocks that aren't
+ * to be run are only read past. The only commands that do anything here are
+ * variable assignments, search, and, in a menu entry, the ones loading a
+ * kernel or initrds.
+ *
+ * Everything made along the way (words, variables, entries) comes from an
+ * arena that goes when the parse is done, so nothing is freed one by one and
+ * words aren't copied again once read: a variable's value is the word it was
+ * set from.
+ */
+
+/* How deeply blocks may nest. */
+#define MAX_DEPTH 32
+
+struct var {
+	struct var *next;
+	const char *name;
+	/* NULL if unset. */
+	const char *value;
+};
+
+/* A command, with its words expanded. */
+struct command {
+	char **words;
+	size_t n, size;
+	/* Words read, including those that expanded to nothing. */
+	unsigned read;
+	/* The first word was written without quotes, escapes or variables, so
+	 * it may be a keyword. */
+	unsigned plain;
+	/* The first word is an assignment, with the = at this offset. */
+	size_t assign;
+	/* It ended with a { that starts a block. */
+	unsigned open;
+	/* A variable in it wasn't set, and may be when GRUB runs it. */
+	unsigned unknown;
+};
+
+/* A word being put together. Unquoted variables may split it into several.
+ * There is one, reused for every word, which is copied out when done. */
+struct word {
+	char *buf;
+	size_t len, size;
+	/* Quotes make a word even if there is nothing in them. */
+	unsigned quoted;
+};
+
+/* Functions are run from where they are in the buffer. */
+struct function {
+	struct function *next;
+	const char *name;
+	const char *start, *end;
+};
+
+/* A menu entry being run. */
+struct entry {
+	const char *device;
+	char *kernel, *args;
+	char **initrds;
+	size_t n_initrds;
+};
+
+struct parser {
+	const char *p, *end;
+	/* Innermost scope first, down to where the current one starts. */
+	struct var *vars, *scope;
+	struct function *functions;
+	/* The arguments of the function being run. */
+	char **argv;
+	size_t argc;
+	struct entry *entry;
+	unsigned depth;
+	grub_entry_f *f;
+	void *user;
+	struct s_arena arena;
+	struct word w;
+};
+
+static int put(struct word *w, const char *s, size_t len)
+{
+	if(w->len + len + 1 > w->size) {
+		char *buf;
+		size_t size;
+		size = w->size ? w->size : 64;
+		while(size < w->len + len + 1) size *= 2;
+		buf = realloc(w->buf, size);
+		if(!buf) return -1;
+		w->buf = buf;
+		w->size = size;
+	}
+	memcpy(w->buf + w->len, s, len);
+	w->len += len;
+	w->buf[w->len] = '\0';
+	return 0;
+}
+
+/* Add the word to the command, even if it's empty. */
+static int push(struct parser *x, struct command *c)
+{
+	struct word *w;
+	w = &x->w;
+	if(c->n == c->size) {
+		char **words;
+		size_t size;
+		size = c->size ? c->size * 2 : 8;
+		words = s_arena_alloc(&x->arena, size * sizeof *words);
+		if(!words) return -1;
+		if(c->n) memcpy(words, c->words, c->n * sizeof *words);
+		c->words = words;
+		c->size = size;
+	}
+	c->words[c->n] = s_arena_ndup(&x->arena, w->len ? w->buf : "", w->len);
+	if(!c->words[c->n]) return -1;
+	++c->n;
+	w->len = 0;
+	w->quoted = 0;
+	return 0;
+}
+
+static const char *get_var(struct parser *x, const char *name, size_t len)
+{
+	struct var *v;
+	if(len && name[0] >= '1' && name[0] <= '9') {
+		size_t i, n = 0;
+		for(i = 0; i < len && name[i] >= '0' && name[i] <= '9'; ++i) n = n * 10 + name[i] - '0';
+		return i == len && n <= x->argc ? x->argv[n - 1] : NULL;
+	}
+	for(v = x->vars; v; v = v->next) {
+		if(strlen(v->name) == len && !memcmp(v->name, name, len)) return v->value;
+	}
+	return NULL;
+}
+
+/* Set or, if @value is NULL, unset a variable in the current scope. @value
+ * has to be in the arena. */
+static int set_var(struct parser *x, const char *name, size_t len, const char *value)
+{
+	struct var *v;
+
+	for(v = x->vars; v != x->scope; v = v->next) {
+		if(strlen(v->name) == len && !memcmp(v->name, name, len)) {
+			v->value = value;
+			return 0;
+		}
+	}
+
+	v = s_arena_alloc(&x->arena, sizeof *v);
+	if(!v) return -1;
+	v->name = s_arena_ndup(&x->arena, name, len);
+	if(!v->name) return -1;
+	v->value = value;
+	v->next = x->vars;
+	x->vars = v;
+	return 0;
+}
+
+/* Leave a scope, dropping the variables set in it. */
+static void pop_vars(struct parser *x, struct var *vars, struct var *scope)
+{
+	x->vars = vars;
+	x->scope = scope;
+}
+
+static unsigned is_name_char(char c, unsigned first)
+{
+	return c == '_' || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (!first && c >= '0' && c <= '9');
+}
+
+/* A variable reference after a $. Returns how much of the input it takes
+ * up, 0 if it isn't one (the $ is then taken as it is). */
+static size_t var_ref(const char *p, const char *end, const char **name_out, size_t *len_out)
+{
+	const char *q;
+	if(p == end) return 0;
+	if(*p == '{') {
+		q = memchr(p, '}', end - p);
+		if(!q) return 0;
+		*name_out = p + 1;
+		*len_out = q - p - 1;
+		return q + 1 - p;
+	}
+	q = p;
+	if(is_name_char(*q, 1)) while(q < end && is_name_char(*q, 0)) ++q;
+	else if(*q >= '0' && *q <= '9') while(q < end && *q >= '0' && *q <= '9') ++q;
+	else if(*q == '?' || *q == '#' || *q == '*' || *q == '@') ++q;
+	*name_out = p;
+	*len_out = q - p;
+	return q - p;
+}
+
+/* An unquoted variable's value is split into words at blanks. */
+static int put_split(struct parser *x, struct command *c, const char *value)
+{
+	struct word *w;
+	w = &x->w;
+	while(*value) {
+		size_t len;
+		len = strcspn(value, " \t\n");
+		if(len && put(w, value, len) < 0) return -1;
+		value += len;
+		if(!*value) break;
+		if((w->len || w->quoted) && push(x, c) < 0) return -1;
+		value += strspn(value, " \t\n");
+	}
+	return 0;
+}
+
+static int read_word(struct parser *x, struct command *c)
+{
+	struct word *w;
+	/* Only the first word may be a keyword or an assignment. */
+	unsigned first, plain = 1, name = 1;
+	size_t assign = 0;
+
+	w = &x->w;
+	w->len = 0;
+	w->quoted = 0;
+	first = c->read++ == 0;
+	while(x->p < x->end) {
+		const char *var;
+		size_t len, n;
+		char ch;
+		ch = *x->p;
+		if(ch == ' ' || ch == '\t' || ch == '\n' || ch == ';') break;
+		n = ch == '$' ? var_ref(x->p + 1, x->end, &var, &len) : 0;
+
+		if(ch == '\\') {
+			plain = name = 0;
+			if(++x->p == x->end) break;
+			/* A newline escaped is a line continued. */
+			if(*x->p != '\n' && put(w, x->p, 1) < 0) return -1;
+			++x->p;
+		}
+		else if(ch == '\'') {
+			const char *q;
+			plain = name = 0;
+			w->quoted = 1;
+			++x->p;
+			q = memchr(x->p, '\'', x->end - x->p);
+			if(!q) q = x->end;
+			if(put(w, x->p, q - x->p) < 0) return -1;
+			x->p = q == x->end ? q : q + 1;
+		}
+		else if(ch == '"') {
+			plain = name = 0;
+			w->quoted = 1;
+			for(++x->p; x->p < x->end && *x->p != '"'; ) {
+				const char *value;
+				if(*x->p == '\\' && x->p + 1 < x->end && strchr("$\"\\\n", x->p[1])) {
+					if(x->p[1] != '\n' && put(w, x->p + 1, 1) < 0) return -1;
+					x->p += 2;
+				}
+				else if(*x->p == '$' && (n = var_ref(x->p + 1, x->end, &var, &len))) {
+					value = get_var(x, var, len);
+					if(!value) c->unknown = 1;
+					else if(put(w, value, strlen(value)) < 0) return -1;
+					x->p += 1 + n;
+				}
+				else if(put(w, x->p++, 1) < 0) return -1;
+			}
+			if(x->p < x->end) ++x->p;
+		}
+		else if(n) {
+			const char *value;
+			plain = name = 0;
+			x->p += 1 + n;
+			value = get_var(x, var, len);
+			if(!value) c->unknown = 1;
+			else if(put_split(x, c, value) < 0) return -1;
+		}
+		else {
+			if(ch == '=' && name && w->len && !assign) {
+				assign = w->len;
+				name = 0;
+			}
+			else if(!is_name_char(ch, !w->len)) name = 0;
+			if(put(w, x->p++, 1) < 0) return -1;
+		}
+	}
+
+	if(first) {
+		c->plain = plain;
+		c->assign = assign;
+	}
+	/* A { of its own after something else starts a block. */
+	if(!first && plain && w->len == 1 && w->buf[0] == '{') {
+		c->open = 1;
+		return 0;
+	}
+	if((w->len || w->quoted) && push(x, c) < 0) return -1;
+	return 0;
+}
+
+/* Keywords that are a command of their own even if more follows on the
+ * line. */
+static unsigned stands_alone(const char *word)
+{
+	static const char *keywords[] = {"then", "else", "do", "fi", "done", "}", "{"};
+	unsigned i;
+	for(i = 0; i < sizeof keywords / sizeof keywords[0]; ++i) {
+		if(!strcmp(word, keywords[i])) return 1;
+	}
+	return 0;
+}
+
+/* Returns 1 if a command was read, 0 at the end of the input. */
+static int read_command(struct parser *x, struct command *c)
+{
+	c->words = NULL;
+	c->n = c->size = 0;
+	c->read = c->plain = c->open = c->unknown = 0;
+	c->assign = 0;
+
+	while(x->p < x->end) {
+		char ch;
+		ch = *x->p;
+		if(ch == ' ' || ch == '\t') ++x->p;
+		else if(ch == '\\' && x->p + 1 < x->end && x->p[1] == '\n') x->p += 2;
+		else if(ch == '\n' || ch == ';') {
+			++x->p;
+			if(c->read) break;
+		}
+		else if(ch == '#') {
+			const char *nl;
+			nl = memchr(x->p, '\n', x->end - x->p);
+			x->p = nl ? nl : x->end;
+		}
+		/* A } of its own ends a command as well as the block. */
+		else if(ch == '}' && c->read && (x->p + 1 == x->end || strchr(" \t\n;", x->p[1]))) break;
+		else {
+			if(read_word(x, c) < 0) goto err;
+			if(c->open) break;
+			if(c->read == 1 && c->plain && c->n && stands_alone(c->words[0])) break;
+		}
+	}
+	return c->read != 0;
+
+	err: x->p = x->end;
+	return 0;
+}
+
+static int run_block(struct parser *x, unsigned run, const char *const *until, struct command *end);
+static int compound(struct parser *x, struct command *c, unsigned run);
+
+/* GRUB device names and paths like (hd0,gpt2)/boot/vmlinuz. Returns the
+ * path, which is in the arena as it's part of @path. */
+static char *split_device(struct parser *x, char *path, const char **device_out)
+{
+	char *close;
+	*device_out = NULL;
+	if(path[0] != '(') return path;
+	close = strchr(path, ')');
+	if(!close) return path;
+	*device_out = s_arena_ndup(&x->arena, path + 1, close - path - 1);
+	return close + 1;
+}
+
+/* Join the words into a command line. Those with blanks in them are quoted,
+ * which is how the kernel takes them. */
+static char *join(struct parser *x, char **words, size_t n)
+{
+	struct word *w;
+	size_t i;
+	w = &x->w;
+	w->len = 0;
+	for(i = 0; i < n; ++i) {
+		unsigned quote;
+		quote = words[i][strcspn(words[i], " \t\n")] != '\0';
+		if(i && put(w, " ", 1) < 0) return NULL;
+		if(quote && put(w, "\"", 1) < 0) return NULL;
+		if(put(w, words[i], strlen(words[i])) < 0) return NULL;
+		if(quote && put(w, "\"", 1) < 0) return NULL;
+	}
+	return s_arena_ndup(&x->arena, w->len ? w->buf : "", w->len);
+}
+
+static int load_linux(struct parser *x, struct command *c)
+{
+	struct entry *e;
+	const char *device, *root;
+
+	e = x->entry;
+	if(c->n < 2) return 0;
+	/* Loading a kernel unloads the initrds. */
+	e->initrds = NULL;
+	e->n_initrds = 0;
+	e->kernel = split_device(x, c->words[1], &device);
+	if(!device && (root = get_var(x, "root", 4)) && *root) device = root;
+	e->device = device;
+	e->args = join(x, c->words + 2, c->n - 2);
+	if(!e->args) return -1;
+	return 0;
+}
+
+static int load_initrds(struct parser *x, struct command *c)
+{
+	struct entry *e;
+	size_t i;
+
+	e = x->entry;
+	e->initrds = NULL;
+	e->n_initrds = 0;
+	if(c->n < 2) return 0;
+	e->initrds = s_arena_alloc(&x->arena, (c->n - 1) * sizeof *e->initrds);
+	if(!e->initrds) return -1;
+	for(i = 1; i < c->n; ++i) {
+		const char *device;
+		/* They are expected to be with the kernel. */
+		e->initrds[e->n_initrds++] = split_device(x, c->words[i], &device);
+	}
+	return 0;
+}
+
+/* search [--fs-uuid|--label|--file] [--set[=VAR]] [options] NAME, and the
+ * search.fs_uuid NAME [VAR] kind. The variable gets a blkid tag for the
+ * filesystem, which is what GRUB's device name is good for to us. Files can't
+ * be looked for ahead of time, so the variable is unset and the filesystem the
+ * config is on assumed. */
+static int search(struct parser *x, struct command *c)
+{
+	static const char *with_arg[] = {"--hint", "--hint-bios", "--hint-efi", "--hint-baremetal", "--hint-ieee1275", "--hint-arc", "-h"};
+	const char *kind = NULL, *name = NULL, *var = NULL;
+	char *value;
+	size_t i;
+
+	if(!strcmp(c->words[0], "search")) {
+		for(i = 1; i < c->n; ++i) {
+			const char *a;
+			a = c->words[i];
+			if(!strcmp(a, "--fs-uuid") || !strcmp(a, "-u")) kind = "UUID=";
+			else if(!strcmp(a, "--label") || !strcmp(a, "-l")) kind = "LABEL=";
+			else if(!strcmp(a, "--file") || !strcmp(a, "-f")) kind = NULL;
+			else if(!strcmp(a, "--set") || !strcmp(a, "-s")) var = "root";
+			else if(!strncmp(a, "--set=", 6)) var = a + 6;
+			else if(a[0] == '-') {
+				unsigned j;
+				for(j = 0; j < sizeof with_arg / sizeof with_arg[0]; ++j) {
+					if(!strcmp(a, with_arg[j])) {
+						++i;
+						break;
+					}
+				}
+			}
+			else if(!name) name = a;
+		}
+	}
+	else {
+		if(!strcmp(c->words[0], "search.fs_uuid")) kind = "UUID=";
+		else if(!strcmp(c->words[0], "search.fs_label")) kind = "LABEL=";
+		name = c->n > 1 ? c->words[1] : NULL;
+		var = c->n > 2 ? c->words[2] : "root";
+	}
+	if(!name || !var) return 0;
+
+	if(!kind) return set_var(x, var, strlen(var), NULL);
+	value = s_arena_concat(&x->arena, kind, name, NULL);
+	if(!value) return -1;
+	return set_var(x, var, strlen(var), value);
+}
+
+static int call(struct parser *x, struct function *f, struct command *c)
+{
+	static const char *const close[] = {"}", NULL};
+	const char *p, *end;
+	char **argv;
+	size_t argc;
+
+	p = x->p;
+	end = x->end;
+	argv = x->argv;
+	argc = x->argc;
+	x->p = f->start;
+	x->end = f->end;
+	x->argv = c->words + 1;
+	x->argc = c->n - 1;
+	/* Whatever goes wrong in there, it's only this call that fails. */
+	run_block(x, 1, close, NULL);
+	x->p = p;
+	x->end = end;
+	x->argv = argv;
+	x->argc = argc;
+	return 0;
+}
+
+static int define(struct parser *x, struct command *c)
+{
+	static const char *const close[] = {"}", NULL};
+	struct function *f;
+	const char *start;
+
+	start = x->p;
+	if(run_block(x, 0, close, NULL) < 0) return -1;
+	if(c->n < 2) return 0;
+	f = s_arena_alloc(&x->arena, sizeof *f);
+	if(!f) return -1;
+	f->name = c->words[1];
+	f->start = start;
+	f->end = x->p;
+	f->next = x->functions;
+	x->functions = f;
+	return 0;
+}
+
+static int run_command(struct parser *x, struct command *c)
+{
+	struct function *f;
+	const char *cmd;
+
+	if(c->assign) return set_var(x, c->words[0], c->assign, c->words[0] + c->assign + 1);
+	cmd = c->words[0];
+
+	if(!strcmp(cmd, "set")) {
+		size_t i;
+		for(i = 1; i < c->n; ++i) {
+			const char *equals;
+			equals = strchr(c->words[i], '=');
+			if(equals && set_var(x, c->words[i], equals - c->words[i], equals + 1) < 0) return -1;
+		}
+	}
+	else if(!strcmp(cmd, "unset")) {
+		size_t i;
+		for(i = 1; i < c->n; ++i) {
+			if(set_var(x, c->words[i], strlen(c->words[i]), NULL) < 0) return -1;
+		}
+	}
+	else if(!strncmp(cmd, "search", 6) && (!cmd[6] || cmd[6] == '.')) return search(x, c);
+	else if(x->entry) {
+		if(!strcmp(cmd, "linux") || !strcmp(cmd, "linux16") || !strcmp(cmd, "linuxefi")) return load_linux(x, c);
+		if(!strcmp(cmd, "initrd") || !strcmp(cmd, "initrd16") || !strcmp(cmd, "initrdefi")) return load_initrds(x, c);
+	}
+	for(f = x->functions; f; f = f->next) {
+		if(!strcmp(f->name, cmd)) return call(x, f, c);
+	}
+	return 0;
+}
+
+/* The title is the first argument that isn't an option. */
+static const char *title(struct command *c)
+{
+	static const char *with_arg[] = {"--class", "--users", "--hotkey", "--id", "--source"};
+	size_t i;
+	for(i = 1; i < c->n; ++i) {
+		unsigned j;
+		if(c->words[i][0] != '-' || !c->words[i][1]) return c->words[i];
+		for(j = 0; j < sizeof with_arg / sizeof with_arg[0]; ++j) {
+			if(!strcmp(c->words[i], with_arg[j])) {
+				++i;
+				break;
+			}
+		}
+	}
+	return NULL;
+}
+
+/* menuentry and submenu. The block has its own scope. */
+static int menu_block(struct parser *x, struct command *c, unsigned run, unsigned is_entry)
+{
+	static const char *const until[] = {"}", NULL};
+	struct var *vars, *scope;
+	struct entry e, *outer;
+	int r;
+
+	vars = x->vars;
+	scope = x->scope;
+	outer = x->entry;
+	x->scope = x->vars;
+	/* Entries in entries are only defined when the outer one is run. */
+	if(outer) run = 0;
+	if(is_entry) {
+		e.device = e.kernel = e.args = NULL;
+		e.initrds = NULL;
+		e.n_initrds = 0;
+		x->entry = &e;
+	}
+
+	r = run_block(x, run, until, NULL);
+	if(r == 0 && run && is_entry && e.kernel) {
+		struct config_entry g;
+		g.title = title(c);
+		g.device = e.device;
+		g.kernel = e.kernel;
+		g.args = e.args;
+		g.initrds = e.initrds;
+		g.n_initrds = e.n_initrds;
+		x->f(x->user, &g);
+	}
+
+	if(is_entry) x->entry = outer;
+	pop_vars(x, vars, scope);
+	return r == 0 ? 0 : -1;
+}
+
+/* What [ and test would say, 1 for true, 0 for false, -1 if it can't be told
+ * before boot: with variables that aren't set, or tests of files and such. */
+static int test(char **words, size_t n, unsigned unknown)
+{
+	char **a;
+	int not = 0, r;
+
+	if(!n) return -1;
+	a = words + 1;
+	--n;
+	if(!strcmp(words[0], "[")) {
+		if(!n || strcmp(a[n - 1], "]")) return -1;
+		--n;
+	}
+	else if(strcmp(words[0], "test")) return -1;
+	if(unknown) return -1;
+
+	if(n && !strcmp(a[0], "!")) {
+		not = 1;
+		++a;
+		--n;
+	}
+	if(n == 0) r = 0;
+	else if(n == 1) r = a[0][0] != '\0';
+	else if(n == 2 && !strcmp(a[0], "-n")) r = a[1][0] != '\0';
+	else if(n == 2 && !strcmp(a[0], "-z")) r = a[1][0] == '\0';
+	else if(n == 3 && (!strcmp(a[1], "=") || !strcmp(a[1], "=="))) r = !strcmp(a[0], a[2]);
+	else if(n == 3 && !strcmp(a[1], "!=")) r = !!strcmp(a[0], a[2]);
+	else return -1;
+	return not ? !r : r;
+}
+
+/* Read the commands of an if or elif condition, up to the then. The first is
+ * in the if or elif command @first itself. Returns what the last of them
+ * would say (see test), or -2 on error. */
+static int condition(struct parser *x, struct command *first)
+{
+	struct command c;
+	int cond;
+
+	cond = test(first->words + 1, first->n - 1, first->unknown);
+	while(read_command(x, &c)) {
+		int r;
+		if(c.n && c.plain && !strcmp(c.words[0], "then")) return cond;
+		cond = test(c.words, c.n, c.unknown);
+		r = c.n && c.plain ? compound(x, &c, 0) : 0;
+		if(r < 0) break;
+		if(r) cond = -1;
+	}
+	return -2;
+}
+
+/* Compound commands, starting with a keyword. Returns 1 if @c was one. */
+static int compound(struct parser *x, struct command *c, unsigned run)
+{
+	static const char *const branches[] = {"elif", "else", "fi", NULL};
+	static const char *const fi[] = {"fi", NULL};
+	static const char *const do_[] = {"do", NULL};
+	static const char *const done[] = {"done", NULL};
+	static const char *const close[] = {"}", NULL};
+	const char *cmd;
+	int r;
+
+	cmd = c->words[0];
+	if(!strcmp(cmd, "if")) {
+		/* Once a branch is known to be taken, the rest aren't. Until
+		 * then every branch that may be taken is. */
+		struct command elif;
+		unsigned taken = 0;
+		int cond;
+		cond = condition(x, c);
+		while(1) {
+			if(cond == -2) return -1;
+			r = run_block(x, run && !taken && cond != 0, branches, &elif);
+			if(cond == 1) taken = 1;
+			if(r < 0) break;
+			if(r != 0) break;
+			cond = condition(x, &elif);
+		}
+		if(r == 1) r = run_block(x, run && !taken, fi, NULL);
+		return r < 0 ? -1 : 1;
+	}
+	if(!strcmp(cmd, "while") || !strcmp(cmd, "until") || !strcmp(cmd, "for")) {
+		if(run_block(x, 0, do_, NULL) < 0) return -1;
+		return run_block(x, 0, done, NULL) < 0 ? -1 : 1;
+	}
+	if(!c->open) return 0;
+	if(!strcmp(cmd, "menuentry")) return menu_block(x, c, run, 1) < 0 ? -1 : 1;
+	if(!strcmp(cmd, "submenu")) return menu_block(x, c, run, 0) < 0 ? -1 : 1;
+	/* Defined when run, called as commands. */
+	if(!strcmp(cmd, "function")) {
+		if(run) return define(x, c) < 0 ? -1 : 1;
+		return run_block(x, 0, close, NULL) < 0 ? -1 : 1;
+	}
+	/* Anything else with a block. */
+	return run_block(x, 0, close, NULL) < 0 ? -1 : 1;
+}
+
+/* Run (or if @run is 0, read past) commands until one of the keywords in
+ * @until. Returns which one, and the command if @end isn't NULL, or -1 at
+ * the end of the input. */
+static int run_block(struct parser *x, unsigned run, const char *const *until, struct command *end)
+{
+	struct command c;
+	int r = -1;
+
+	if(++x->depth > MAX_DEPTH) goto out;
+	while(read_command(x, &c)) {
+		if(c.n && c.plain) {
+			unsigned i;
+			for(i = 0; until && until[i]; ++i) {
+				if(!strcmp(c.words[0], until[i])) {
+					if(end) *end = c;
+					r = i;
+					goto out;
+				}
+			}
+			r = compound(x, &c, run);
+			if(r < 0) goto out;
+			if(r) {
+				r = -1;
+				continue;
+			}
+		}
+		if(run && c.n && run_command(x, &c) < 0) goto out;
+	}
+
+	out: --x->depth;
+	return r;
+}
+
+int grub_parse(const char *buf, size_t len, grub_entry_f *f, void *user)
+{
+	struct parser x;
+	int r;
+
+	x.p = buf;
+	x.end = buf + len;
+	x.vars = x.scope = NULL;
+	x.functions = NULL;
+	x.argv = NULL;
+	x.argc = 0;
+	x.entry = NULL;
+	x.depth = 0;
+	x.f = f;
+	x.user = user;
+	memset(&x.arena, 0, sizeof x.arena);
+	memset(&x.w, 0, sizeof x.w);
+
+	r = run_block(&x, 1, NULL, NULL);
+	s_arena_free(&x.arena);
+	free(x.w.buf);
+	/* Only running out of input is the normal way to end. */
+	return r == -1 && x.p == x.end ? 0 : -1;
+}
+
+static void scan(struct config_scan *c, const char *file, const char *buf, size_t len)
+{
+	grub_parse(buf, len, (grub_entry_f *)config_add, c);
+}
+
+static const char *const files[] = {
+	"/boot/grub/grub.cfg",
+	"/grub/grub.cfg",
+	/* Fedora's */
+	"/boot/grub2/grub.cfg",
+	"/grub2/grub.cfg",
+	NULL
+};
+
+const struct config_scanner grub_scanner = {"grub2", files, 10, scan};
@@ -0,0 +1,22 @@
+/* A GRUB 2 config parser. It runs the script the way GRUB would build its
+ * menu: blocks, variables, quoting and search are understood, and every Linux
+ * menu entry (submenus included) is reported once the script has been read up
+ * to its closing brace. Conditions are evaluated when they only test variables
+ * the script has set; the others can't be ahead of boot, so all their branches
+ * are taken. Functions are run, loops aren't. */
+#include <stddef.h>
+
+struct config_entry;
+struct config_scanner;
+
+/* The scanner for grub.cfg (see config.h). */
+extern const struct config_scanner grub_scanner;
+
+/* The device of an entry is NULL for the filesystem the config is on (GRUB's
+ * default root), a blkid tag for one that was searched for, or a GRUB device
+ * name. The entry and its strings are only valid during the call. */
+typedef void grub_entry_f(void *user, const struct config_entry *entry);
+
+/* @buf needn't be null-terminated. Returns -1 if it couldn't be read to the
+ * end, but the entries before that have been reported. */
+int grub_parse(const char *buf, size_t len, grub_entry_f *f, void *user);
@@ -0,0 +1,453 @@
+#include "iso.h"
+#include "fs.h"
+#include "fs_2.h"
+#include "s.h"
+#include "throttle.h"
+#include <stdlib.h>
+#include <unistd.h>
+#include <strings.h>
+
+/*
+ * A read-only ISO9660 reader, for install and rescue media. Rock Ridge names,
+ * symlinks and timestamps are used if there are any, otherwise Joliet names if
+ * there are any, otherwise the plain ISO9660 ones. Only Rock Ridge names are
+ * matched with regard to case. The ;1 versions are left out.
+ *
+ * Files recorded in several extents (those over 4G) and interleaved ones
+ * aren't supported.
+ */
+
+#define SECTOR 2048
+#define FIRST_DESCRIPTOR 16
+/* There are rarely more than 4. */
+#define MAX_DESCRIPTORS 32
+
+/* Directory record flags */
+#define FLAG_DIR 0x02
+#define FLAG_ASSOCIATED 0x04
+#define FLAG_MULTI_EXTENT 0x80
+
+/* Symlinks followed in one lookup, like the kernel's. */
+#define MAX_LINKS 40
+/* Continuation areas followed for one directory record. */
+#define MAX_CONTINUATIONS 16
+#define MAX_LINK_LEN 4096
+
+struct iso {
+	int fd;
+	unsigned long block_size;
+	unsigned joliet, rock_ridge;
+	/* Bytes to skip at the start of each System Use area. */
+	unsigned skip;
+	unsigned char root[34];
+	/* For directory blocks and continuation areas. */
+	unsigned char *dir, *ce;
+};
+
+struct iso_file {
+	unsigned long long start, size;
+	unsigned is_dir;
+	long long mtime;
+};
+
+/* What Rock Ridge says about a directory record. */
+struct rr {
+	char name[256];
+	size_t name_len;
+	unsigned has_name;
+	char *link;
+	size_t link_len;
+	unsigned need_sep;
+	long long mtime;
+	unsigned has_mtime;
+	unsigned relocated;
+	unsigned long child;
+};
+
+static unsigned long long le(const unsigned char *p, unsigned n)
+{
+	unsigned long long v = 0;
+	while(n--) v = v << 8 | p[n];
+	return v;
+}
+
+static int read_at(struct iso *x, void *buf, size_t len, unsigned long long off)
+{
+	throttle_read(len);
+	return pread(x->fd, buf, len, off) == (ssize_t)len ? 0 : -1;
+}
+
+/* 7 bytes: years since 1900, month, day, hour, minute, second and the
+ * offset from UTC in 15 minutes. */
+static long long short_time(const unsigned char *p)
+{
+	return fs_mktime(1900 + p[0], p[1], p[2], p[3], p[4], p[5]) - (signed char)p[6] * 15 * 60;
+}
+
+/* 17 bytes: "YYYYMMDDHHMMSScc" and the offset. */
+static long long long_time(const unsigned char *p)
+{
+	int v[6], i, j;
+	static const unsigned digits[6] = {4, 2, 2, 2, 2, 2};
+	for(i = 0; i < 6; ++i) {
+		v[i] = 0;
+		for(j = 0; j < digits[i]; ++j) v[i] = v[i] * 10 + (*p++ - '0');
+	}
+	return fs_mktime(v[0], v[1], v[2], v[3], v[4], v[5]) - (signed char)p[2] * 15 * 60;
+}
+
+static void append_link(struct rr *rr, const char *s, size_t len)
+{
+	char *link;
+	if(!rr->link && !(rr->link = malloc(MAX_LINK_LEN))) return;
+	if(rr->link_len + len >= MAX_LINK_LEN) {
+		free(rr->link);
+		rr->link = NULL;
+		rr->link_len = MAX_LINK_LEN;
+		return;
+	}
+	link = rr->link;
+	memcpy(link + rr->link_len, s, len);
+	rr->link_len += len;
+	link[rr->link_len] = '\0';
+}
+
+/* A symlink, as components. */
+static void read_sl(struct rr *rr, const unsigned char *p, const unsigned char *end)
+{
+	/* Too long already. */
+	if(rr->link_len == MAX_LINK_LEN) return;
+	if(!rr->link) append_link(rr, "", 0);
+	while(p + 2 <= end && p + 2 + p[1] <= end) {
+		unsigned flags;
+		flags = p[0];
+		if(rr->need_sep && !(flags & 0x08)) append_link(rr, "/", 1);
+		if(flags & 0x08) append_link(rr, "/", 1);
+		else if(flags & 0x02) append_link(rr, ".", 1);
+		else if(flags & 0x04) append_link(rr, "..", 2);
+		else append_link(rr, (const char *)p + 2, p[1]);
+		/* A component may go on in the next one. */
+		rr->need_sep = !(flags & 0x08) && !(flags & 0x01);
+		p += 2 + p[1];
+	}
+}
+
+static void read_su(struct iso *x, const unsigned char *r, struct rr *rr)
+{
+	const unsigned char *p, *end;
+	unsigned continuations = 0;
+
+	rr->has_name = rr->has_mtime = rr->relocated = 0;
+	rr->name_len = rr->link_len = 0;
+	rr->need_sep = 0;
+	rr->link = NULL;
+	rr->child = 0;
+
+	p = r + 33 + r[32] + !(r[32] & 1) + x->skip;
+	end = r + r[0];
+	while(1) {
+		unsigned long long ce_block = 0, ce_off = 0, ce_len = 0;
+		for(; p + 4 <= end && p[2] >= 4 && p + p[2] <= end; p += p[2]) {
+			unsigned len;
+			len = p[2];
+			if(!memcmp(p, "ST", 2)) break;
+			else if(!memcmp(p, "CE", 2) && len >= 28) {
+				ce_block = le(p + 4, 4);
+				ce_off = le(p + 12, 4);
+				ce_len = le(p + 20, 4);
+			}
+			else if(!memcmp(p, "NM", 2) && len >= 5) {
+				size_t n;
+				rr->has_name = 1;
+				if(p[4] & 0x06) {
+					strcpy(rr->name, p[4] & 0x02 ? "." : "..");
+					rr->name_len = strlen(rr->name);
+					continue;
+				}
+				n = len - 5;
+				if(rr->name_len + n >= sizeof rr->name) n = sizeof rr->name - 1 - rr->name_len;
+				memcpy(rr->name + rr->name_len, p + 5, n);
+				rr->name_len += n;
+				rr->name[rr->name_len] = '\0';
+			}
+			else if(!memcmp(p, "SL", 2) && len >= 5) read_sl(rr, p + 5, p + len);
+			else if(!memcmp(p, "TF", 2) && len >= 5) {
+				unsigned size, index;
+				size = p[4] & 0x80 ? 17 : 7;
+				/* Creation time comes before modification. */
+				index = p[4] & 0x01;
+				if(p[4] & 0x02 && 5 + (index + 1) * size <= len) {
+					rr->mtime = size == 17 ? long_time(p + 5 + index * size) : short_time(p + 5 + index * size);
+					rr->has_mtime = 1;
+				}
+			}
+			else if(!memcmp(p, "RE", 2)) rr->relocated = 1;
+			else if(!memcmp(p, "CL", 2) && len >= 12) rr->child = le(p + 4, 4);
+		}
+
+		if(!ce_len || ++continuations > MAX_CONTINUATIONS) break;
+		if(ce_off >= x->block_size) break;
+		if(ce_len > x->block_size - ce_off) ce_len = x->block_size - ce_off;
+		if(read_at(x, x->ce, ce_len, ce_block * x->block_size + ce_off) < 0) break;
+		p = x->ce;
+		end = x->ce + ce_len;
+	}
+	if(rr->link_len == MAX_LINK_LEN) rr->link_len = 0;
+}
+
+static void read_record(struct iso *x, const unsigned char *r, struct iso_file *f)
+{
+	f->start = (le(r + 2, 4) + r[1]) * x->block_size;
+	f->size = le(r + 10, 4);
+	f->is_dir = !!(r[25] & FLAG_DIR);
+	f->mtime = short_time(r + 18);
+}
+
+/* The name of a record without Rock Ridge, in @buf. */
+static int record_name(struct iso *x, const unsigned char *r, char *buf, size_t size)
+{
+	size_t len;
+	char *semicolon;
+
+	len = r[32];
+	if(len == 1 && r[33] <= 1) {
+		strcpy(buf, r[33] ? ".." : ".");
+		return 0;
+	}
+	if(x->joliet) {
+		if(fs_ucs2_to_utf8(buf, size, r + 33, len, 1) < 0) return -1;
+	}
+	else {
+		if(len >= size) return -1;
+		memcpy(buf, r + 33, len);
+		buf[len] = '\0';
+	}
+	semicolon = strchr(buf, ';');
+	if(semicolon) *semicolon = '\0';
+	/* A name without an extension may still have the dot. */
+	len = strlen(buf);
+	if(len > 1 && buf[len - 1] == '.') buf[len - 1] = '\0';
+	return 0;
+}
+
+/* Look at one directory record. Returns 1 if it's the one called @name (and
+ * fills in @f and @link_out), 0 otherwise. If @list isn't NULL, it gets the
+ * record's name instead (but . and ..). */
+static int match_record(struct iso *x, const unsigned char *r, const char *name, size_t len, struct iso_file *f, char **link_out, fs_list_f *list, void *user)
+{
+	char buf[256 * 3 + 1];
+	struct rr rr;
+
+	if(r[25] & FLAG_ASSOCIATED) return 0;
+	if(x->rock_ridge) {
+		read_su(x, r, &rr);
+		/* Directories that were too deep are moved away and pointed
+		 * to from where they belong. */
+		if(rr.relocated) goto no;
+		if(rr.has_name) {
+			if(list) {
+				memcpy(buf, rr.name, rr.name_len);
+				buf[rr.name_len] = '\0';
+				goto listed;
+			}
+			if(rr.name_len != len || memcmp(rr.name, name, len)) goto no;
+			goto found;
+		}
+	}
+	if(record_name(x, r, buf, sizeof buf) < 0) goto no;
+	if(list) goto listed;
+	if(strlen(buf) != len || strncasecmp(buf, name, len)) goto no;
+
+	found: if(r[25] & FLAG_MULTI_EXTENT || r[26] || r[27]) goto no;
+	read_record(x, r, f);
+	*link_out = NULL;
+	if(x->rock_ridge) {
+		if(rr.has_mtime) f->mtime = rr.mtime;
+		*link_out = rr.link;
+		if(rr.child) {
+			/* The directory's own . record has its size. */
+			unsigned char dot[34];
+			if(read_at(x, dot, sizeof dot, rr.child * x->block_size) < 0 || dot[0] < 34) goto no;
+			read_record(x, dot, f);
+		}
+	}
+	return 1;
+
+	listed: if(strcmp(buf, ".") && strcmp(buf, "..")) list(user, buf);
+	no: if(x->rock_ridge) free(rr.link);
+	return 0;
+}
+
+static int lookup_entry(struct iso *x, struct iso_file *dir, const char *name, size_t len, struct iso_file *f, char **link_out, fs_list_f *list, void *user)
+{
+	unsigned long long off;
+
+	if(!dir->is_dir) return -1;
+	for(off = 0; off < dir->size; off += x->block_size) {
+		unsigned long i;
+		if(read_at(x, x->dir, x->block_size, dir->start + off) < 0) return -1;
+		/* Records don't cross blocks, the rest of a block is zeroes. */
+		for(i = 0; i + 34 <= x->block_size && x->dir[i]; i += x->dir[i]) {
+			if(x->dir[i] < 34 || i + x->dir[i] > x->block_size) break;
+			if(x->dir[i] < 33 + x->dir[i + 32]) break;
+			if(match_record(x, x->dir + i, name, len, f, link_out, list, user)) return 0;
+		}
+	}
+	return -1;
+}
+
+ssize_t iso_pread(struct iso *x, struct iso_file *f, void *buf, size_t len, unsigned long long off)
+{
+	if(off >= f->size) return 0;
+	if(len > f->size - off) len = f->size - off;
+	if(read_at(x, buf, len, f->start + off) < 0) return -1;
+	return len;
+}
+
+/* Follow @path from the root into @f. */
+static int resolve(struct iso *x, const char *path, struct iso_file *f)
+{
+	struct iso_file next;
+	char *todo, *p;
+	unsigned links = 0;
+
+	read_record(x, x->root, f);
+	todo = s_dup(path);
+	if(!todo) goto err0;
+
+	p = todo;
+	while(1) {
+		size_t len;
+		char *target;
+		p += strspn(p, "/");
+		if(!*p) break;
+		len = strcspn(p, "/");
+		if(lookup_entry(x, f, p, len, &next, &target, NULL, NULL) < 0) goto err1;
+
+		if(target) {
+			char *rest;
+			if(++links > MAX_LINKS) {
+				free(target);
+				goto err1;
+			}
+			/* Absolute links start over from the root, relative ones
+			 * go on from the directory the link is in. */
+			if(target[0] == '/') read_record(x, x->root, f);
+			rest = s_concat(target, "/", p + len, NULL);
+			free(target);
+			if(!rest) goto err1;
+			free(todo);
+			p = todo = rest;
+			continue;
+		}
+
+		*f = next;
+		p += len;
+	}
+	free(todo);
+	return 0;
+
+	err1: free(todo);
+	err0: return -1;
+}
+
+struct iso_file *iso_lookup(struct iso *x, const char *path, struct fs_stat *st_out)
+{
+	struct iso_file *f;
+
+	f = malloc(sizeof *f);
+	if(!f) goto err0;
+	if(resolve(x, path, f) < 0) goto err1;
+	if(f->is_dir) goto err1;
+
+	st_out->size = f->size;
+	st_out->mtime = f->mtime;
+	st_out->mtime_nsec = 0;
+	return f;
+
+	err1: free(f);
+	err0: return NULL;
+}
+
+int iso_list(struct iso *x, const char *path, fs_list_f *f, void *user)
+{
+	struct iso_file dir;
+	if(resolve(x, path, &dir) < 0 || !dir.is_dir) return -1;
+	lookup_entry(x, &dir, NULL, 0, NULL, NULL, f, user);
+	return 0;
+}
+
+void iso_release(struct iso *x, struct iso_file *f)
+{
+	free(f);
+}
+
+/* Whether the root directory's . record starts with SUSP's SP entry. */
+static unsigned has_rock_ridge(struct iso *x)
+{
+	unsigned char dot[255];
+	const unsigned char *su;
+
+	if(read_at(x, dot, sizeof dot, (le(x->root + 2, 4) + x->root[1]) * x->block_size) < 0) return 0;
+	if(dot[0] < 34 + 7 || dot[32] != 1) return 0;
+	su = dot + 34;
+	if(memcmp(su, "SP", 2) || su[2] < 7 || su[4] != 0xbe || su[5] != 0xef) return 0;
+	x->skip = su[6];
+	return 1;
+}
+
+struct iso *iso_open(int fd)
+{
+	unsigned char vd[SECTOR], joliet_root[34];
+	struct iso *x;
+	unsigned i, primary = 0;
+
+	x = malloc(sizeof *x);
+	if(!x) goto err0;
+	x->fd = fd;
+	x->joliet = x->rock_ridge = 0;
+	x->skip = 0;
+
+	for(i = 0; i < MAX_DESCRIPTORS; ++i) {
+		if(pread(fd, vd, sizeof vd, (FIRST_DESCRIPTOR + i) * SECTOR) != sizeof vd) goto err1;
+		if(memcmp(vd + 1, "CD001", 5)) goto err1;
+		if(vd[0] == 255) break;
+		if(vd[0] == 1 && !primary) {
+			x->block_size = le(vd + 128, 2);
+			if(x->block_size < 512 || x->block_size > SECTOR || x->block_size & (x->block_size - 1)) goto err1;
+			memcpy(x->root, vd + 156, sizeof x->root);
+			primary = 1;
+		}
+		/* Joliet is a supplementary descriptor with UCS-2 names. */
+		else if(vd[0] == 2 && primary && !x->joliet && vd[88] == '%' && vd[89] == '/' && (vd[90] == '@' || vd[90] == 'C' || vd[90] == 'E') && le(vd + 128, 2) == x->block_size) {
+			memcpy(joliet_root, vd + 156, sizeof joliet_root);
+			x->joliet = 1;
+		}
+	}
+	if(!primary) goto err1;
+
+	x->dir = malloc(x->block_size);
+	if(!x->dir) goto err1;
+	x->ce = malloc(x->block_size);
+	if(!x->ce) goto err2;
+
+	/* Rock Ridge is on the primary tree only, and says more than Joliet
+	 * does. */
+	if(has_rock_ridge(x)) {
+		x->rock_ridge = 1;
+		x->joliet = 0;
+	}
+	else if(x->joliet) memcpy(x->root, joliet_root, sizeof x->root);
+	return x;
+
+	err2: free(x->dir);
+	err1: free(x);
+	err0: return NULL;
+}
+
+void iso_close(struct iso *x)
+{
+	free(x->dir);
+	free(x->ce);
+	free(x);
+}
@@ -0,0 +1,15 @@
+/* A read-only ISO9660 reader working on the block device. See fs.h. */
+#include <sys/types.h>
+
+struct iso;
+struct iso_file;
+struct fs_stat;
+
+/* Returns NULL if the device doesn't hold an ISO9660 filesystem. */
+struct iso *iso_open(int fd);
+void iso_close(struct iso *x);
+
+struct iso_file *iso_lookup(struct iso *x, const char *path, struct fs_stat *st_out);
+ssize_t iso_pread(struct iso *x, struct iso_file *f, void *buf, size_t len, unsigned long long off);
+void iso_release(struct iso *x, struct iso_file *f);
+int iso_list(struct iso *x, const char *path, void (*f)(void *user, const char *name), void *user);
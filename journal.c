@@ -0,0 +1,105 @@
+#include "journal.h"
+#include <stdlib.h>
+#include <string.h>
+
+struct journal {
+	/* A ring of the last n entries, the oldest at first. Each entry's
+	 * strings are one allocation starting at its cmd. */
+	struct journal_entry *ring;
+	size_t size, first, n;
+	/* The last generation added, and the last one dropped. */
+	unsigned long long last, dropped;
+};
+
+static int journal_newfree(struct journal *j, struct journal **out, size_t size)
+{
+	if(j) goto freeing;
+
+	j = malloc(sizeof *j);
+	if(!j) goto err0;
+	j->size = size;
+	j->first = j->n = 0;
+	j->last = j->dropped = 0;
+	j->ring = NULL;
+	if(size) {
+		j->ring = malloc(size * sizeof *j->ring);
+		if(!j->ring) goto err1;
+	}
+
+	*out = j;
+	return 0;
+
+	freeing: for(; j->n; --j->n, j->first = (j->first + 1) % j->size) free((char *)j->ring[j->first].cmd);
+	free(j->ring);
+	err1: free(j);
+	err0: return -1;
+}
+
+int journal_new(struct journal **out, size_t size)
+{
+	return journal_newfree(NULL, out, size);
+}
+
+void journal_free(struct journal *j)
+{
+	journal_newfree(j, NULL, 0);
+}
+
+static void drop_oldest(struct journal *j)
+{
+	j->dropped = j->ring[j->first].generation;
+	free((char *)j->ring[j->first].cmd);
+	j->first = (j->first + 1) % j->size;
+	--j->n;
+}
+
+int journal_add(struct journal *j, const struct journal_entry *entry)
+{
+	struct journal_entry *e;
+	size_t cmd_len, name_len, syspath_len;
+	char *buf;
+
+	j->last = entry->generation;
+	if(!j->size) {
+		j->dropped = entry->generation;
+		return 0;
+	}
+	if(j->n == j->size) drop_oldest(j);
+
+	cmd_len = strlen(entry->cmd) + 1;
+	name_len = entry->display_name ? strlen(entry->display_name) + 1 : 0;
+	syspath_len = entry->syspath ? strlen(entry->syspath) + 1 : 0;
+	buf = malloc(cmd_len + name_len + syspath_len);
+	if(!buf) {
+		while(j->n) drop_oldest(j);
+		j->dropped = entry->generation;
+		return -1;
+	}
+	memcpy(buf, entry->cmd, cmd_len);
+	if(name_len) memcpy(buf + cmd_len, entry->display_name, name_len);
+	if(syspath_len) memcpy(buf + cmd_len + name_len, entry->syspath, syspath_len);
+
+	e = &j->ring[(j->first + j->n++) % j->size];
+	*e = *entry;
+	e->cmd = buf;
+	e->display_name = name_len ? buf + cmd_len : NULL;
+	e->syspath = syspath_len ? buf + cmd_len + name_len : NULL;
+	return 0;
+}
+
+unsigned journal_has(struct journal *j, unsigned long long since)
+{
+	return since >= j->dropped && since <= j->last;
+}
+
+int journal_since(struct journal *j, unsigned long long since, journal_f *f, void *user)
+{
+	size_t i;
+	if(!journal_has(j, since)) return -1;
+	for(i = 0; i < j->n; ++i) {
+		struct journal_entry *e;
+		e = &j->ring[(j->first + i) % j->size];
+		if(e->generation > since) f(user, e);
+	}
+	return 0;
+}
@@ -0,0 +1,38 @@
+/* The last changes made, each with its generation, so that whoever has seen
+ * up to some generation can be given just what came after. It holds a fixed
+ * number of changes; older ones are dropped, after which whoever needs them
+ * has to start over from the full set of targets.
+ *
+ * Not thread-safe. */
+#include <stddef.h>
+
+struct journal;
+
+struct journal_entry {
+	/* One more than the entry before. */
+	unsigned long long generation;
+	/* What bootloader_enumerate_get_change() returns for it. */
+	int type;
+	/* BOOTLOADER_TARGET_* and BOOTLOADER_DEVICE_* of the target. */
+	unsigned flags, device;
+	/* syspath may be NULL. */
+	const char *cmd, *display_name, *syspath;
+};
+
+/* @size entries are kept. With 0, only those after the last one can be
+ * asked for. */
+int journal_new(struct journal **out, size_t size);
+void journal_free(struct journal *j);
+
+/* The entry is copied. Returns -1 if out of memory, in which case everything
+ * before it is dropped. */
+int journal_add(struct journal *j, const struct journal_entry *entry);
+
+/* Whether all the entries after generation @since are there. */
+unsigned journal_has(struct journal *j, unsigned long long since);
+
+/* Call @f for each entry after generation @since, oldest first. The entry is
+ * only valid during the call. Returns -1, without calling @f, if some of
+ * them have been dropped or @since is after the last one. */
+typedef void journal_f(void *user, const struct journal_entry *entry);
+int journal_since(struct journal *j, unsigned long long since, journal_f *f, void *user);
@@ -3,6 +3,8 @@
 #include "s.h"
 #include "aio.h"
 #include "kexec.h"
+#include "fs.h"
+#include <blkid.h>
 #include <stdlib.h>
 #include <sys/epoll.h>
 #include <asm/bootparam.h>
@@ -45,9 +47,24 @@ static const char *find_arg(const char *cmd, const char *arg)
 	arglen = strlen(arg);
 	pos = cmd;
 	while(needle = strstr(pos, arg)) {
-		if(pos == cmd || pos[-1] == ' ') {
+		if(needle == cmd || needle[-1] == ' ') {
 			if(!needle[arglen] || needle[arglen] == ' ' || needle[arglen] == '=') return needle;
 		}
+		pos = needle + 1;
+	}
+	return NULL;
+}
+
+/* The value of the option @opt found by find_arg, NULL if it has none. */
+static char *arg_value(const char *opt, const char *arg)
+{
+	size_t len;
+	len = strlen(arg);
+	if(opt[len] == '=') {
+		const char *s;
+		s = strchr(opt + len + 1, ' ');
+		if(s) return s_ndup(opt + len + 1, s - (opt + len + 1));
+		return s_dup(opt + len + 1);
 	}
 	return NULL;
 }
@@ -55,16 +72,7 @@ static const char *find_arg(const char *cmd, const char *arg)
 static char *get_arg_value(const char *cmd, const char *arg)
 {
 	const char *opt;
-	if(opt = find_arg(cmd, arg)) {
-		size_t len;
-		len = strlen(arg);
-		if(opt[len] == '=') {
-			const char *s;
-			s = strchr(opt + len + 1, ' ');
-			if(s) return s_ndup(opt + len + 1, s - (opt + len + 1));
-			return s_dup(opt + len + 1);
-		}
-	}
+	if(opt = find_arg(cmd, arg)) return arg_value(opt, arg);
 	return NULL;
 }
 
@@ -83,9 +91,7 @@ static unsigned has_opt(const char *cmd, const char *arg)
 char *linux_get_name(const char *cmd)
 {
 	char *root, *distro, *full_name, *version;
-	size_t version_len;
-	struct smount *mnt;
-	const char *mountpoint;
+	struct fs *fs;
 	int err;
 	distro = full_name = version = NULL;
 	root = get_arg_value(cmd, "root");
@@ -94,36 +100,43 @@ char *linux_get_name(const char *cmd)
 		goto err0;
 	}
 
-	if(!strncmp(root, "UUID=", 5)) err = smount_new_from_uuid(&mnt, &mountpoint, root + 5);
-	else err = smount_new(&mnt, &mountpoint, root);
+	if(!strncmp(root, "UUID=", 5)) {
+		char *device;
+		device = blkid_evaluate_tag("UUID", root + 5, NULL);
+		if(!device) goto err1;
+		err = fs_open(&fs, device);
+		free(device);
+	}
+	else err = fs_open(&fs, root);
 	if(err < 0) goto err1;
 
 	/* The LSB method, only supported by newer distros. */
 	{
-		char *lsb_release_path, *line;
-		FILE *lsb_release;
-		lsb_release_path = s_concat(mountpoint, "/etc/lsb-release", NULL);
-		if(!lsb_release_path) goto lsb_err0;
-		lsb_release = fopen(lsb_release_path, "r");
+		struct fs_file *lsb_file;
+		char *lsb_release, *line, *next;
+		lsb_file = fs_file_open(fs, "/etc/lsb-release");
+		if(!lsb_file) goto lsb_err0;
+		lsb_release = fs_file_read_all(lsb_file);
 		if(!lsb_release) goto lsb_err1;
 
-		while(!distro && (line = s_getline(lsb_release))) {
+		for(line = lsb_release; !distro && line; line = next) {
 			const char *equals;
+			next = strchr(line, '\n');
+			if(next) *next++ = '\0';
 			equals = strchr(line, '=');
-			if(!equals) goto lsb_line_out;
+			if(!equals) continue;
 			if(!strncmp(line, "DISTRIB_DESCRIPTION", equals - line)) {
 				const char *start_quote, *end_quote;
 				start_quote = strchr(equals + 1, '"');
-				if(!start_quote) goto lsb_line_out;
+				if(!start_quote) continue;
 				end_quote = strchr(start_quote + 1, '"');
-				if(!end_quote) goto lsb_line_out;
+				if(!end_quote) continue;
 				distro = s_ndup(start_quote + 1, end_quote - start_quote - 2);
 			}
-			lsb_line_out: free(line);
 		}
 
-		fclose(lsb_release);
-		lsb_err1: free(lsb_release_path);
+		free(lsb_release);
+		lsb_err1: fs_file_close(lsb_file);
 		lsb_err0:;
 	}
 
@@ -134,37 +147,37 @@ char *linux_get_name(const char *cmd)
 	 * them). */
 	{
 		/* "0x20e/2 pointer to kernel version string" */
-		char *device, *filename, *path;
-		struct smount *mnt;
-		const char *mp;
-		int err, kernel;
+		char *device, *filename;
+		struct fs *kernel_fs;
+		struct fs_file *kernel;
+		int err;
 		unsigned char buf[2];
+		char str[256];
+		ssize_t len;
 		err = 1;
 
 		device = get_word_2(cmd, 0);
 		if(!device) goto ver_err0;
-		if(smount_new(&mnt, &mp, device) < 0) goto ver_err1;
+		if(fs_open(&kernel_fs, device) < 0) goto ver_err1;
 		filename = get_word_2(cmd, 1);
 		if(!filename) goto ver_err2;
-		path = s_concat(mp, filename, NULL);
-		if(!path) goto ver_err3;
-		kernel = open(path, O_RDONLY | O_CLOEXEC);
-		if(kernel < 0) goto ver_err4;
+		kernel = fs_file_open(kernel_fs, filename);
+		if(!kernel) goto ver_err3;
 
-		if(lseek(kernel, 0x20e, SEEK_SET) < 0) goto ver_err5;
-		if(read(kernel, buf, 2) < 0) goto ver_err5;
-		if(lseek(kernel, (buf[0] | buf[1] << 8) + 0x200, SEEK_SET) < 0) goto ver_err5;
+		if(fs_file_pread(kernel, buf, 2, 0x20e) != 2) goto ver_err4;
+		len = fs_file_pread(kernel, str, sizeof str - 1, (buf[0] | buf[1] << 8) + 0x200);
+		if(len < 0) goto ver_err4;
+		str[len] = '\0';
 
-		version = s_getstr(kernel);
-		if(!version) goto ver_err5;
+		version = s_dup(str);
+		if(!version) goto ver_err4;
 		err = 0;
 
-		ver_err5: close(kernel);
-		ver_err4: free(path);
+		ver_err4: fs_file_close(kernel);
 		ver_err3: free(filename);
-		ver_err2: smount_free(mnt);
+		ver_err2: fs_close(kernel_fs);
 		ver_err1: free(device);
-		ver_err0: if(err) goto err1;
+		ver_err0: if(err) goto err2;
 	}
 
 	if(distro) {
@@ -180,8 +193,8 @@ char *linux_get_name(const char *cmd)
 	}
 
 	free(version);
-	free(distro);
-	smount_free(mnt);
+	err2: free(distro);
+	fs_close(fs);
 	err1: free(root);
 	err0: return full_name;
 }
@@ -205,8 +218,11 @@ struct linux_target {
 	struct kexec *kexec_ctx;
 	int epoll_fd;
 
-	struct aio *kernel, *initrd;
-	size_t krn_full, krn_now, inrd_full, inrd_now;
+	/* There may be several initrds (microcode first, say), to be loaded
+	 * one after the other. */
+	struct aio *kernel, **initrds;
+	size_t n_initrds, *inrd_now;
+	size_t krn_full, krn_now, inrd_full;
 };
 
 static int load(struct linux_target *t, struct linux_target **out, const char *cmd)
@@ -252,42 +268,61 @@ static int load(struct linux_target *t, struct linux_target **out, const char *c
 	/* Avoid div by 0 in linux_get_progress. */
 	if(t->krn_full == 0) goto err3;
 
-	/* Start loading the initrd if we have one */
+	/* Start loading the initrds if we have any. Note: not an error not to
+	 * have one. */
+	t->initrds = NULL;
+	t->inrd_now = NULL;
+	t->n_initrds = t->inrd_full = 0;
 	{
-		int err;
-		char *initrd, *initrd_full_path;
-		err = 0;
-		t->initrd = NULL;
-
-		initrd = get_arg_value(cmd, "initrd");
-		/* Note: not an error not to have an initrd. */
-		if(!initrd) {
-			t->inrd_full = 0;
-			goto initrd_err0;
+		const char *opt;
+		size_t n = 0;
+		for(opt = find_arg(cmd, "initrd"); opt; opt = find_arg(opt + 1, "initrd")) ++n;
+		if(n) {
+			t->initrds = malloc(n * sizeof *t->initrds);
+			t->inrd_now = calloc(n, sizeof *t->inrd_now);
+			if(!t->initrds || !t->inrd_now) goto err4;
+		}
+	}
+	{
+		const char *opt;
+		for(opt = find_arg(cmd, "initrd"); opt; opt = find_arg(opt + 1, "initrd")) {
+			int err = 1;
+			char *initrd, *initrd_full_path;
+			size_t size;
+
+			initrd = arg_value(opt, "initrd");
+			if(!initrd) goto initrd_err0;
+
+			initrd_full_path = s_concat(t->mountpoint, "/", initrd, NULL);
+			if(!initrd_full_path) goto initrd_err1;
+
+			if(aio_begin_read(&t->initrds[t->n_initrds], initrd_full_path, &size) < 0) goto initrd_err2;
+			++t->n_initrds;
+			t->inrd_full += size;
+			err = 0;
+
+			initrd_err2: free(initrd_full_path);
+			initrd_err1: free(initrd);
+			initrd_err0: if(err) goto err4;
 		}
-
-		initrd_full_path = s_concat(t->mountpoint, "/", initrd, NULL);
-		if(!initrd_full_path) { err = 1; goto initrd_err1; }
-
-		if(aio_begin_read(&t->initrd, initrd_full_path, &t->inrd_full) < 0) err = 1;
-		t->inrd_now = 0;
-
-		free(initrd_full_path);
-		initrd_err1: free(initrd);
-		initrd_err0: if(err) goto err4;
 	}
 
-	/* Give the user an epoll fd, since we may have 2 fds to listen to */
+	/* Give the user an epoll fd, since we may have several fds to listen
+	 * to */
 	t->epoll_fd = epoll_create1(0);
-	if(t->epoll_fd < 0) goto err5;
+	if(t->epoll_fd < 0) goto err4;
 
 	{
 		struct epoll_event ev;
+		size_t i;
 		ev.events = EPOLLIN;
 		ev.data.u32 = 1;
 		if(epoll_ctl(t->epoll_fd, EPOLL_CTL_ADD, aio_get_fd(t->kernel), &ev) < 0) goto err6;
-		ev.data.u32 = 2;
-		if(t->initrd) if(epoll_ctl(t->epoll_fd, EPOLL_CTL_ADD, aio_get_fd(t->initrd), &ev) < 0) goto err6;
+		/* Initrd i is 2 + i. */
+		for(i = 0; i < t->n_initrds; ++i) {
+			ev.data.u32 = 2 + i;
+			if(epoll_ctl(t->epoll_fd, EPOLL_CTL_ADD, aio_get_fd(t->initrds[i]), &ev) < 0) goto err6;
+		}
 	}
 
 	free(kernel_fs_devname);
@@ -295,8 +330,10 @@ static int load(struct linux_target *t, struct linux_target **out, const char *c
 	return 0;
 
 	freeing: err6: close(t->epoll_fd);
-	err5: aio_free(t->initrd);
-	err4: aio_free(t->kernel);
+	err4: while(t->n_initrds) aio_free(t->initrds[--t->n_initrds]);
+	free(t->initrds);
+	free(t->inrd_now);
+	aio_free(t->kernel);
 	err3: smount_free(t->kernel_fs);
 	err2: free(kernel_fs_devname);
 	err1_5: kexec_free(t->kexec_ctx);
@@ -317,18 +354,23 @@ int linux_get_progress(struct linux_target *t)
 	struct epoll_event ev;
 	int progress;
 
-	if(epoll_wait(t->epoll_fd, &ev, 1, 0)) {
-		int err;
+	size_t i, now;
+
+	if(epoll_wait(t->epoll_fd, &ev, 1, 0) > 0) {
+		int err = 0;
 		if(ev.data.u32 == 1) {
 			err = aio_process(t->kernel, &t->krn_now, NULL);
 		}
-		else if(ev.data.u32 == 2) {
-			err = aio_process(t->initrd, &t->inrd_now, NULL);
+		else if(ev.data.u32 - 2 < t->n_initrds) {
+			i = ev.data.u32 - 2;
+			err = aio_process(t->initrds[i], &t->inrd_now[i], NULL);
 		}
 
 		if(err < 0) return -1;
 	}
-	return aio_progress_div(t->krn_now + t->inrd_now, t->krn_full + t->inrd_full, 1000);
+	now = t->krn_now;
+	for(i = 0; i < t->n_initrds; ++i) now += t->inrd_now[i];
+	return aio_progress_div(now, t->krn_full + t->inrd_full, 1000);
 }
 
 /*
@@ -380,7 +422,7 @@ int linux_boot(struct linux_target *t)
 #	include <stdint.h>
 printf("linux_trampoline_code: %p\nlinux_trampoline_size: %lu\nlinux_trampoline_cmdline_offset: %lu\n",&linux_trampoline_code, linux_trampoline_size, linux_trampoline_params_offset);
 	int retv = -1;
-	unsigned char *bzimage;
+	unsigned char *bzimage, *joined = NULL;
 	size_t start32, bzimage_sz;
 	const char *cmdline_args;
 	struct boot_params *p;
@@ -489,12 +531,33 @@ printf("linux_trampoline_code: %p\nlinux_trampoline_size: %lu\nlinux_trampoline_
 		p->hdr.cmd_line_ptr = (kexec_addr)CMDLINE(p_start);
 		p->hdr.cmdline_size = strlen(cmdline_args);
 
-		if(t->initrd) {
-			size_t inrd_size;
+		if(t->n_initrds) {
+			size_t inrd_size, i;
 			kexec_addr inrd_start, inrd_max;
 			unsigned char *inrd;
 
-			inrd = aio_get_file_data(t->initrd, &inrd_size);
+			/* Several initrds are loaded as one, each padded to 4
+			 * bytes the way GRUB does it: the kernel unpacks cpio
+			 * archives one after the other. */
+			if(t->n_initrds == 1) inrd = aio_get_file_data(t->initrds[0], &inrd_size);
+			else {
+				inrd_size = 0;
+				for(i = 0; i < t->n_initrds; ++i) {
+					size_t sz;
+					aio_get_file_data(t->initrds[i], &sz);
+					inrd_size += (sz + 3) & ~(size_t)3;
+				}
+				inrd = joined = calloc(1, inrd_size);
+				if(!inrd) goto err0;
+				inrd_size = 0;
+				for(i = 0; i < t->n_initrds; ++i) {
+					unsigned char *data;
+					size_t sz;
+					data = aio_get_file_data(t->initrds[i], &sz);
+					memcpy(inrd + inrd_size, data, sz);
+					inrd_size += (sz + 3) & ~(size_t)3;
+				}
+			}
 			inrd_start = p->alt_mem_k * 1024 - inrd_size;
 			inrd_max = p->hdr.version >= 0x0203 ? p->hdr.initrd_addr_max : 0x37ffffff;
 			if(inrd_start + inrd_size >= inrd_max) inrd_start = inrd_max - inrd_size;
@@ -511,6 +574,7 @@ printf("linux_trampoline_code: %p\nlinux_trampoline_size: %lu\nlinux_trampoline_
 
 	retv = 0;
 
-	err0: free(p);
+	err0: free(joined);
+	free(p);
 	return retv;
 }
@@ -17,7 +17,7 @@ int main(int argc, char **argv)
 		int i;
 		const char *cmd, *name;
 		i = bootloader_enumerate_get_change(e, &cmd, &name);
-		if(i) printf("%s: %s (%s)\n\n", i == 1 ? "add" : "remove",name,cmd);
+		if(i) printf("%s: %s (%s)\n\n", i == 1 ? "add" : i == 2 ? "remove" : "rename",name,cmd);
 	}
 
 	bootloader_enumerate_free(e);
@@ -0,0 +1,136 @@
+#include "menulst.h"
+#include "config.h"
+#include "s.h"
+#include <stdlib.h>
+
+/*
+ * GRUB legacy's menu.lst is a list of commands, one per line. A title starts
+ * an entry, which is made up of the commands up to the next title. Only root,
+ * uuid, kernel and initrd matter here. A root set before the first title is
+ * the default for all entries.
+ */
+
+struct entry {
+	char *title, *device, *kernel, *args, *initrd;
+};
+
+static void report(struct config_scan *c, struct entry *e)
+{
+	struct config_entry g;
+	if(!e->kernel) return;
+	g.title = e->title;
+	g.device = e->device;
+	g.kernel = e->kernel;
+	g.args = e->args ? e->args : "";
+	g.initrds = &e->initrd;
+	g.n_initrds = e->initrd ? 1 : 0;
+	config_add(c, &g);
+}
+
+/* A path with the device it's on in front, as in (hd0,0)/vmlinuz. The device
+ * goes to @device_out if there is one. */
+static char *split_device(struct s_arena *a, struct s_view v, char **device_out)
+{
+	const char *close;
+	if(v.len && v.p[0] == '(' && (close = memchr(v.p, ')', v.len))) {
+		*device_out = s_arena_ndup(a, v.p + 1, close - v.p - 1);
+		v.len -= close + 1 - v.p;
+		v.p = close + 1;
+	}
+	return s_arena_view(a, v);
+}
+
+static void skip_blanks(struct s_view *v)
+{
+	while(v->len && (*v->p == ' ' || *v->p == '\t')) {
+		++v->p;
+		--v->len;
+	}
+}
+
+/* The first word of @rest, taken off it. Options (--type=linux and such) are
+ * skipped if @options is set. */
+static struct s_view word(struct s_view *rest, unsigned options)
+{
+	struct s_view w;
+	do {
+		skip_blanks(rest);
+		w.p = rest->p;
+		for(w.len = 0; w.len < rest->len && w.p[w.len] != ' ' && w.p[w.len] != '\t'; ++w.len);
+		rest->p += w.len;
+		rest->len -= w.len;
+	} while(options && w.len > 2 && !memcmp(w.p, "--", 2));
+	return w;
+}
+
+static void scan(struct config_scan *c, const char *file, const char *buf, size_t len)
+{
+	struct s_arena a = {NULL, NULL, NULL};
+	struct s_view rest, line;
+	struct entry e = {NULL, NULL, NULL, NULL, NULL};
+	char *root = NULL;
+	unsigned in_entry = 0;
+
+	rest.p = buf;
+	rest.len = len;
+	while(s_view_line(&rest, &line)) {
+		struct s_view cmd;
+		size_t n;
+
+		skip_blanks(&line);
+		while(line.len && strchr(" \t\r", line.p[line.len - 1])) --line.len;
+		if(!line.len || line.p[0] == '#') continue;
+
+		/* The command and its arguments are split by blanks or an =. */
+		for(n = 0; n < line.len && !strchr(" \t=", line.p[n]); ++n);
+		cmd.p = line.p;
+		cmd.len = n;
+		if(n < line.len && line.p[n] == '=') ++n;
+		line.p += n;
+		line.len -= n;
+
+		if(s_view_is(cmd, "title")) {
+			if(in_entry) report(c, &e);
+			in_entry = 1;
+			skip_blanks(&line);
+			e.title = s_arena_view(&a, line);
+			e.device = root;
+			e.kernel = e.args = e.initrd = NULL;
+		}
+		else if(s_view_is(cmd, "root") || s_view_is(cmd, "rootnoverify")) {
+			struct s_view dev;
+			char *device = NULL;
+			dev = word(&line, 0);
+			if(dev.len > 2 && dev.p[0] == '(' && dev.p[dev.len - 1] == ')') device = s_arena_ndup(&a, dev.p + 1, dev.len - 2);
+			if(in_entry) e.device = device;
+			else root = device;
+		}
+		else if(s_view_is(cmd, "uuid")) {
+			char *uuid, *device = NULL;
+			uuid = s_arena_view(&a, word(&line, 0));
+			if(uuid) device = s_arena_concat(&a, "UUID=", uuid, NULL);
+			if(in_entry) e.device = device;
+			else root = device;
+		}
+		else if(in_entry && s_view_is(cmd, "kernel")) {
+			e.kernel = split_device(&a, word(&line, 1), &e.device);
+			skip_blanks(&line);
+			e.args = s_arena_view(&a, line);
+			e.initrd = NULL;
+		}
+		else if(in_entry && s_view_is(cmd, "initrd")) {
+			char *ignored = NULL;
+			e.initrd = split_device(&a, word(&line, 0), &ignored);
+		}
+	}
+	if(in_entry) report(c, &e);
+	s_arena_free(&a);
+}
+
+static const char *const files[] = {
+	"/boot/grub/menu.lst",
+	"/grub/menu.lst",
+	NULL
+};
+
+const struct config_scanner menulst_scanner = {"menu.lst", files, 2, scan};
@@ -0,0 +1,3 @@
+/* The scanner for GRUB legacy's menu.lst (see config.h). */
+struct config_scanner;
+extern const struct config_scanner menulst_scanner;
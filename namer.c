@@ -0,0 +1,174 @@
+#include "namer.h"
+#include "s.h"
+#include <stdlib.h>
+#include <pthread.h>
+
+struct job {
+	struct job *next;
+	char *cmd;
+};
+
+struct namer {
+	pthread_mutex_t lock;
+	/* Wakes up the thread. */
+	pthread_cond_t cond;
+	/* Signalled when the thread exits. */
+	pthread_cond_t exited;
+
+	struct job *jobs, **last;
+	unsigned quit, running, done;
+
+	namer_f *f;
+	namer_idle_f *idle, *finish;
+	void *user;
+};
+
+static void drop_jobs(struct namer *n)
+{
+	while(n->jobs) {
+		struct job *j;
+		j = n->jobs;
+		n->jobs = j->next;
+		free(j->cmd);
+		free(j);
+	}
+	n->last = &n->jobs;
+}
+
+static void destroy(struct namer *n)
+{
+	drop_jobs(n);
+	pthread_cond_destroy(&n->exited);
+	pthread_cond_destroy(&n->cond);
+	pthread_mutex_destroy(&n->lock);
+	free(n);
+}
+
+static void *thread(void *user)
+{
+	struct namer *n;
+	unsigned finishing;
+	n = user;
+
+	pthread_mutex_lock(&n->lock);
+	while(!n->quit) {
+		struct job *j;
+		if(!n->jobs) {
+			pthread_cond_wait(&n->cond, &n->lock);
+			continue;
+		}
+		j = n->jobs;
+		n->jobs = j->next;
+		if(!n->jobs) n->last = &n->jobs;
+		n->running = 1;
+		pthread_mutex_unlock(&n->lock);
+
+		n->f(n->user, j->cmd);
+		free(j->cmd);
+		free(j);
+
+		pthread_mutex_lock(&n->lock);
+		n->running = 0;
+		if(!n->jobs && n->idle && !n->quit) {
+			pthread_mutex_unlock(&n->lock);
+			n->idle(n->user);
+			pthread_mutex_lock(&n->lock);
+		}
+	}
+	n->done = 1;
+	finishing = n->finish != NULL;
+	pthread_cond_broadcast(&n->exited);
+	pthread_mutex_unlock(&n->lock);
+	if(finishing) {
+		n->finish(n->user);
+		destroy(n);
+	}
+	return NULL;
+}
+
+/* When freeing, @idle is the finish callback. */
+static int namer_newfree(struct namer *n, struct namer **out, namer_f *f, namer_idle_f *idle, void *user)
+{
+	pthread_t t;
+	pthread_attr_t attr;
+	int err;
+
+	if(n) goto freeing;
+
+	n = malloc(sizeof *n);
+	if(!n) goto err0;
+	n->jobs = NULL;
+	n->last = &n->jobs;
+	n->quit = n->running = n->done = 0;
+	n->f = f;
+	n->idle = idle;
+	n->finish = NULL;
+	n->user = user;
+	if(pthread_mutex_init(&n->lock, NULL) != 0) goto err1;
+	if(pthread_cond_init(&n->cond, NULL) != 0) goto err2;
+	if(pthread_cond_init(&n->exited, NULL) != 0) goto err3;
+
+	/* Detached, so that a stuck one can be left behind. */
+	if(pthread_attr_init(&attr) != 0) goto err4;
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	err = pthread_create(&t, &attr, thread, n);
+	pthread_attr_destroy(&attr);
+	if(err != 0) goto err4;
+
+	*out = n;
+	return 0;
+
+	freeing: pthread_mutex_lock(&n->lock);
+	n->quit = 1;
+	drop_jobs(n);
+	pthread_cond_signal(&n->cond);
+	if(n->running) {
+		n->finish = idle;
+		pthread_mutex_unlock(&n->lock);
+		return 1;
+	}
+	while(!n->done) pthread_cond_wait(&n->exited, &n->lock);
+	pthread_mutex_unlock(&n->lock);
+	destroy(n);
+	return 0;
+
+	err4: pthread_cond_destroy(&n->exited);
+	err3: pthread_cond_destroy(&n->cond);
+	err2: pthread_mutex_destroy(&n->lock);
+	err1: free(n);
+	err0: return -1;
+}
+
+int namer_new(struct namer **out, namer_f *f, namer_idle_f *idle, void *user)
+{
+	return namer_newfree(NULL, out, f, idle, user);
+}
+
+unsigned namer_free(struct namer *n, namer_idle_f *finish)
+{
+	return namer_newfree(n, NULL, NULL, finish, NULL);
+}
+
+int namer_add(struct namer *n, const char *cmd)
+{
+	struct job *j, *i;
+
+	pthread_mutex_lock(&n->lock);
+	for(i = n->jobs; i; i = i->next) {
+		if(!strcmp(i->cmd, cmd)) goto out;
+	}
+	j = malloc(sizeof *j);
+	if(!j) goto err0;
+	j->cmd = s_dup(cmd);
+	if(!j->cmd) goto err1;
+	j->next = NULL;
+	*n->last = j;
+	n->last = &j->next;
+	pthread_cond_signal(&n->cond);
+	out: pthread_mutex_unlock(&n->lock);
+	return 0;
+
+	err1: free(j);
+	err0: pthread_mutex_unlock(&n->lock);
+	return -1;
+}
@@ -0,0 +1,20 @@
+/* A thread that names targets in the background. Naming may mount the
+ * target's root filesystem and read its kernel, so targets are published
+ * under a provisional name first, and renamed once this is done with them.
+ * Targets are named one at a time, in the order they were queued. */
+struct namer;
+
+typedef void namer_f(void *user, const char *cmd);
+typedef void namer_idle_f(void *user);
+
+/* @f is called from the thread for every queued command, and @idle, if not
+ * NULL, whenever it has done the last one queued. */
+int namer_new(struct namer **out, namer_f *f, namer_idle_f *idle, void *user);
+
+/* Drop the queued commands. Returns 0 if the thread is done. Otherwise it
+ * is still naming a target (mount() may be stuck on a failing device), and
+ * returns 1; the thread calls @finish and frees the namer when it's done. */
+unsigned namer_free(struct namer *n, namer_idle_f *finish);
+
+/* Nothing is queued if the command already is. */
+int namer_add(struct namer *n, const char *cmd);
@@ -0,0 +1,215 @@
+#include "queue.h"
+#include "s.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+/* Must be a power of two. */
+#define RING_SIZE 256
+
+struct record {
+	int type;
+	unsigned long long generation;
+	/* The command string followed by the display name, in one
+	 * allocation. */
+	char *buf;
+	/* Only used on the overflow list. */
+	struct record *next;
+};
+
+struct queue {
+	struct record ring[RING_SIZE];
+	/* Free-running counters. head is only written by the producer, tail
+	 * only by the consumer. */
+	unsigned head, tail;
+
+	int event_fd;
+	/* Set when the eventfd has been written to and the consumer hasn't
+	 * seen the queue empty since. Saves a write() per record. */
+	int signalled;
+
+	/* Records that didn't fit in the ring, oldest first. overflowed is set
+	 * while the list isn't empty. */
+	pthread_mutex_t overflow_lock;
+	struct record *overflow, **overflow_last;
+	int overflowed;
+
+	/* What the last queue_pop() handed out. */
+	char *current;
+	unsigned long long current_generation;
+};
+
+static int queue_newfree(struct queue *q, struct queue **out)
+{
+	if(q) goto freeing;
+
+	q = malloc(sizeof *q);
+	if(!q) goto err0;
+	q->head = q->tail = 0;
+	q->signalled = 0;
+	q->overflow = NULL;
+	q->overflow_last = &q->overflow;
+	q->overflowed = 0;
+	q->current = NULL;
+	q->current_generation = 0;
+
+	q->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(q->event_fd < 0) goto err1;
+	if(pthread_mutex_init(&q->overflow_lock, NULL) != 0) goto err2;
+
+	*out = q;
+	return 0;
+
+	freeing: while(q->tail != q->head) free(q->ring[q->tail++ % RING_SIZE].buf);
+	while(q->overflow) {
+		struct record *r;
+		r = q->overflow;
+		q->overflow = r->next;
+		free(r->buf);
+		free(r);
+	}
+	free(q->current);
+	pthread_mutex_destroy(&q->overflow_lock);
+	err2: close(q->event_fd);
+	err1: free(q);
+	err0: return -1;
+}
+
+int queue_new(struct queue **out)
+{
+	return queue_newfree(NULL, out);
+}
+
+void queue_free(struct queue *q)
+{
+	queue_newfree(q, NULL);
+}
+
+int queue_get_fd(struct queue *q)
+{
+	return q->event_fd;
+}
+
+/* Producer side of the ring. Returns 0 if it's full. */
+static unsigned ring_put(struct queue *q, const struct record *r)
+{
+	unsigned head;
+	head = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+	if(head - __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) == RING_SIZE) return 0;
+	q->ring[head % RING_SIZE] = *r;
+	__atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+/* Consumer side of the ring. Returns 0 if it's empty. */
+static unsigned ring_get(struct queue *q, struct record *r)
+{
+	unsigned tail;
+	tail = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+	if(tail == __atomic_load_n(&q->head, __ATOMIC_ACQUIRE)) return 0;
+	*r = q->ring[tail % RING_SIZE];
+	__atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+/* Move what fits from the overflow list into the ring. Whoever holds the lock
+ * is the producer for the time being: the real producer only pushes to the
+ * ring directly while nothing has overflowed. */
+static void flush_overflow(struct queue *q)
+{
+	while(q->overflow && ring_put(q, q->overflow)) {
+		struct record *r;
+		r = q->overflow;
+		q->overflow = r->next;
+		free(r);
+	}
+	if(!q->overflow) {
+		q->overflow_last = &q->overflow;
+		__atomic_store_n(&q->overflowed, 0, __ATOMIC_RELEASE);
+	}
+}
+
+int queue_push(struct queue *q, int type, unsigned long long generation, const char *cmd, const char *display_name)
+{
+	size_t cmd_len, name_len;
+	struct record rec;
+
+	cmd_len = strlen(cmd) + 1;
+	name_len = strlen(display_name) + 1;
+	rec.type = type;
+	rec.generation = generation;
+	rec.buf = malloc(cmd_len + name_len);
+	if(!rec.buf) return -1;
+	memcpy(rec.buf, cmd, cmd_len);
+	memcpy(rec.buf + cmd_len, display_name, name_len);
+
+	if(__atomic_load_n(&q->overflowed, __ATOMIC_ACQUIRE) || !ring_put(q, &rec)) {
+		/* Keep the order: nothing goes in the ring before what's
+		 * already on the overflow list. */
+		struct record *r;
+		pthread_mutex_lock(&q->overflow_lock);
+		flush_overflow(q);
+		if(q->overflow || !ring_put(q, &rec)) {
+			r = malloc(sizeof *r);
+			if(!r) {
+				pthread_mutex_unlock(&q->overflow_lock);
+				free(rec.buf);
+				return -1;
+			}
+			*r = rec;
+			r->next = NULL;
+			*q->overflow_last = r;
+			q->overflow_last = &r->next;
+			__atomic_store_n(&q->overflowed, 1, __ATOMIC_RELEASE);
+		}
+		pthread_mutex_unlock(&q->overflow_lock);
+	}
+
+	if(!__atomic_exchange_n(&q->signalled, 1, __ATOMIC_SEQ_CST)) {
+		uint64_t one = 1;
+		write(q->event_fd, &one, sizeof one);
+	}
+	return 0;
+}
+
+static unsigned take(struct queue *q, struct record *r)
+{
+	if(ring_get(q, r)) return 1;
+	if(!__atomic_load_n(&q->overflowed, __ATOMIC_ACQUIRE)) return 0;
+	pthread_mutex_lock(&q->overflow_lock);
+	flush_overflow(q);
+	pthread_mutex_unlock(&q->overflow_lock);
+	return ring_get(q, r);
+}
+
+int queue_pop(struct queue *q, const char **cmd_out, const char **display_name_out)
+{
+	struct record r;
+
+	free(q->current);
+	q->current = NULL;
+
+	if(!take(q, &r)) {
+		/* Looks empty. Reset the eventfd, then look again, since the
+		 * producer may have pushed something just before the reset and
+		 * then not signalled. */
+		uint64_t count;
+		__atomic_exchange_n(&q->signalled, 0, __ATOMIC_SEQ_CST);
+		read(q->event_fd, &count, sizeof count);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if(!take(q, &r)) return 0;
+	}
+
+	q->current = r.buf;
+	q->current_generation = r.generation;
+	*cmd_out = r.buf;
+	if(display_name_out) *display_name_out = r.buf + strlen(r.buf) + 1;
+	return r.type;
+}
+
+unsigned long long queue_get_generation(struct queue *q)
+{
+	return q->current_generation;
+}
@@ -0,0 +1,26 @@
+/* The queue of changes from the monitor and scan threads to the user. It's a
+ * single-producer, single-consumer ring of preallocated records: pushing never
+ * blocks and popping makes no syscalls unless the queue has run dry. An
+ * eventfd is readable while there may be something to pop.
+ *
+ * If the consumer falls so far behind that the ring fills up, records go to an
+ * overflow list instead, under a lock that is only touched in that case. */
+struct queue;
+
+int queue_new(struct queue **out);
+void queue_free(struct queue *q);
+
+/* The eventfd. */
+int queue_get_fd(struct queue *q);
+
+/* Producer side. Only one thread may push at a time. @type is what
+ * bootloader_enumerate_get_change() will return. */
+int queue_push(struct queue *q, int type, unsigned long long generation, const char *cmd, const char *display_name);
+
+/* Consumer side. Returns 0 if the queue is empty. The strings are handed out
+ * without copying and stay valid until the next call. */
+int queue_pop(struct queue *q, const char **cmd_out, const char **display_name_out);
+
+/* Consumer side. The generation of what the last queue_pop() handed out, 0
+ * if nothing has been. */
+unsigned long long queue_get_generation(struct queue *q);
@@ -0,0 +1,245 @@
+#include "registry.h"
+#include "s.h"
+#include <stdlib.h>
+#include <stdint.h>
+
+/* Buckets to start with. The tables double when they have as many entries as
+ * buckets. Must be a power of two. */
+#define MIN_BUCKETS 64
+
+struct registry_dev {
+	struct registry_dev *next;
+	char *syspath;
+	struct registry_node *nodes;
+};
+
+struct table {
+	void **buckets;
+	size_t n_buckets, n_entries;
+};
+
+struct registry {
+	/* Of struct registry_node, chained through cmd_next. */
+	struct table cmds;
+	/* Of struct registry_dev. */
+	struct table devs;
+};
+
+/* FNV-1a */
+static size_t hash(const char *s)
+{
+	uint32_t h = 2166136261u;
+	for(; *s; ++s) {
+		h ^= (unsigned char)*s;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static int table_init(struct table *t)
+{
+	t->n_buckets = MIN_BUCKETS;
+	t->n_entries = 0;
+	t->buckets = calloc(t->n_buckets, sizeof *t->buckets);
+	return t->buckets ? 0 : -1;
+}
+
+static struct registry_node **cmd_bucket(struct table *t, const char *cmd)
+{
+	return (struct registry_node **)&t->buckets[hash(cmd) & (t->n_buckets - 1)];
+}
+
+static struct registry_dev **dev_bucket(struct table *t, const char *syspath)
+{
+	return (struct registry_dev **)&t->buckets[hash(syspath) & (t->n_buckets - 1)];
+}
+
+/* Double the number of buckets of the command table. Failing to is not an
+ * error, the chains just get longer. */
+static void grow_cmds(struct table *t)
+{
+	struct registry_node **old;
+	size_t i, n_old;
+	old = (struct registry_node **)t->buckets;
+	n_old = t->n_buckets;
+	t->buckets = calloc(n_old * 2, sizeof *t->buckets);
+	if(!t->buckets) {
+		t->buckets = (void **)old;
+		return;
+	}
+	t->n_buckets = n_old * 2;
+	for(i = 0; i < n_old; ++i) {
+		while(old[i]) {
+			struct registry_node *n, **b;
+			n = old[i];
+			old[i] = n->cmd_next;
+			b = cmd_bucket(t, n->cmd);
+			n->cmd_next = *b;
+			*b = n;
+		}
+	}
+	free(old);
+}
+
+static void grow_devs(struct table *t)
+{
+	struct registry_dev **old;
+	size_t i, n_old;
+	old = (struct registry_dev **)t->buckets;
+	n_old = t->n_buckets;
+	t->buckets = calloc(n_old * 2, sizeof *t->buckets);
+	if(!t->buckets) {
+		t->buckets = (void **)old;
+		return;
+	}
+	t->n_buckets = n_old * 2;
+	for(i = 0; i < n_old; ++i) {
+		while(old[i]) {
+			struct registry_dev *d, **b;
+			d = old[i];
+			old[i] = d->next;
+			b = dev_bucket(t, d->syspath);
+			d->next = *b;
+			*b = d;
+		}
+	}
+	free(old);
+}
+
+static int registry_newfree(struct registry *r, struct registry **out)
+{
+	if(r) goto freeing;
+
+	r = malloc(sizeof *r);
+	if(!r) goto err0;
+	if(table_init(&r->cmds) < 0) goto err1;
+	if(table_init(&r->devs) < 0) goto err2;
+
+	*out = r;
+	return 0;
+
+	freeing: {
+		size_t i;
+		for(i = 0; i < r->devs.n_buckets; ++i) {
+			while(r->devs.buckets[i]) {
+				struct registry_dev *d;
+				d = r->devs.buckets[i];
+				r->devs.buckets[i] = d->next;
+				free(d->syspath);
+				free(d);
+			}
+		}
+	}
+	free(r->devs.buckets);
+	err2: free(r->cmds.buckets);
+	err1: free(r);
+	err0: return -1;
+}
+
+int registry_new(struct registry **out)
+{
+	return registry_newfree(NULL, out);
+}
+
+void registry_free(struct registry *r)
+{
+	registry_newfree(r, NULL);
+}
+
+struct registry_node *registry_find(struct registry *r, const char *cmd)
+{
+	struct registry_node *n;
+	for(n = *cmd_bucket(&r->cmds, cmd); n; n = n->cmd_next) if(!strcmp(n->cmd, cmd)) return n;
+	return NULL;
+}
+
+static struct registry_dev *find_dev(struct registry *r, const char *syspath)
+{
+	struct registry_dev *d;
+	for(d = *dev_bucket(&r->devs, syspath); d; d = d->next) if(!strcmp(d->syspath, syspath)) return d;
+	return NULL;
+}
+
+int registry_insert(struct registry *r, struct registry_node *n)
+{
+	struct registry_node **b;
+
+	n->dev = NULL;
+	n->dev_next = NULL;
+	n->dev_prev = NULL;
+	if(n->syspath) {
+		struct registry_dev *d;
+		d = find_dev(r, n->syspath);
+		if(!d) {
+			struct registry_dev **db;
+			d = malloc(sizeof *d);
+			if(!d) return -1;
+			d->syspath = s_dup(n->syspath);
+			if(!d->syspath) {
+				free(d);
+				return -1;
+			}
+			d->nodes = NULL;
+			if(++r->devs.n_entries > r->devs.n_buckets) grow_devs(&r->devs);
+			db = dev_bucket(&r->devs, d->syspath);
+			d->next = *db;
+			*db = d;
+		}
+		n->dev = d;
+		n->dev_next = d->nodes;
+		if(d->nodes) d->nodes->dev_prev = &n->dev_next;
+		n->dev_prev = &d->nodes;
+		d->nodes = n;
+	}
+
+	if(++r->cmds.n_entries > r->cmds.n_buckets) grow_cmds(&r->cmds);
+	b = cmd_bucket(&r->cmds, n->cmd);
+	n->cmd_next = *b;
+	*b = n;
+	return 0;
+}
+
+void registry_remove(struct registry *r, struct registry_node *n)
+{
+	struct registry_node **i;
+
+	for(i = cmd_bucket(&r->cmds, n->cmd); *i != n; i = &(*i)->cmd_next);
+	*i = n->cmd_next;
+	--r->cmds.n_entries;
+
+	if(n->dev) {
+		struct registry_dev *d;
+		*n->dev_prev = n->dev_next;
+		if(n->dev_next) n->dev_next->dev_prev = n->dev_prev;
+
+		/* Forget the device along with its last target. */
+		d = n->dev;
+		if(!d->nodes) {
+			struct registry_dev **j;
+			for(j = dev_bucket(&r->devs, d->syspath); *j != d; j = &(*j)->next);
+			*j = d->next;
+			--r->devs.n_entries;
+			free(d->syspath);
+			free(d);
+		}
+	}
+}
+
+struct registry_node *registry_on_device(struct registry *r, const char *syspath)
+{
+	struct registry_dev *d;
+	d = find_dev(r, syspath);
+	return d ? d->nodes : NULL;
+}
+
+struct registry_node *registry_next(struct registry *r, struct registry_node *n)
+{
+	size_t i;
+	if(n) {
+		if(n->cmd_next) return n->cmd_next;
+		i = (hash(n->cmd) & (r->cmds.n_buckets - 1)) + 1;
+	}
+	else i = 0;
+	for(; i < r->cmds.n_buckets; ++i) if(r->cmds.buckets[i]) return r->cmds.buckets[i];
+	return NULL;
+}
@@ -0,0 +1,35 @@
+/* The set of published targets, hashed by command string and grouped by the
+ * device they are on, so that adding, looking up and removing targets, and
+ * finding the targets of a device, don't depend on how many targets there
+ * are. */
+struct registry;
+struct registry_dev;
+
+/* Embed this in whatever represents a target. */
+struct registry_node {
+	/* The keys. They must stay valid while the node is in the registry.
+	 * syspath may be NULL. */
+	const char *cmd, *syspath;
+
+	/* Private */
+	struct registry_node *cmd_next;
+	struct registry_node *dev_next, **dev_prev;
+	struct registry_dev *dev;
+};
+
+int registry_new(struct registry **out);
+/* The nodes still in the registry are not touched. */
+void registry_free(struct registry *r);
+
+struct registry_node *registry_find(struct registry *r, const char *cmd);
+
+/* There must not already be a node with the same cmd. */
+int registry_insert(struct registry *r, struct registry_node *n);
+void registry_remove(struct registry *r, struct registry_node *n);
+
+/* The nodes on a device. Follow dev_next for the rest. */
+struct registry_node *registry_on_device(struct registry *r, const char *syspath);
+
+/* Iterate all nodes. Start with NULL. Don't remove the node you're at before
+ * getting the next one. */
+struct registry_node *registry_next(struct registry *r, struct registry_node *n);
@@ -0,0 +1,484 @@
+#define _GNU_SOURCE
+#include "remote.h"
+#include "s.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+
+/* How much may be held back for a client before it is dropped. Also the
+ * largest record a client takes. */
+#define MAX_BACKLOG (1 << 20)
+
+/* On the wire a record is this, then its strings, each null-terminated. The
+ * two ends are on the same machine, so it's in its byte order. */
+struct wire {
+	uint32_t size;
+	int32_t type;
+	uint32_t flags;
+	uint32_t device;
+	uint64_t generation;
+	/* Of cmd, display_name and syspath, terminators included. 0 for
+	 * NULL. */
+	uint32_t lens[3];
+};
+
+static size_t str_len(const char *s)
+{
+	return s ? strlen(s) + 1 : 0;
+}
+
+/* Newly allocated. */
+static char *encode(const struct remote_record *r, size_t *size_out)
+{
+	struct wire w;
+	const char *strs[3];
+	char *buf, *p;
+	size_t i;
+
+	strs[0] = r->cmd;
+	strs[1] = r->display_name;
+	strs[2] = r->syspath;
+	w.size = sizeof w;
+	for(i = 0; i < 3; ++i) {
+		w.lens[i] = str_len(strs[i]);
+		w.size += w.lens[i];
+	}
+	w.type = r->type;
+	w.flags = r->flags;
+	w.device = r->device;
+	w.generation = r->generation;
+
+	buf = malloc(w.size);
+	if(!buf) return NULL;
+	memcpy(buf, &w, sizeof w);
+	p = buf + sizeof w;
+	for(i = 0; i < 3; ++i) {
+		memcpy(p, strs[i], w.lens[i]);
+		p += w.lens[i];
+	}
+	*size_out = w.size;
+	return buf;
+}
+
+/* Returns the size of the record at the start of @buf, 0 if it hasn't all
+ * come yet, or -1 if it isn't one. */
+static long decode(char *buf, size_t len, struct remote_record *r)
+{
+	struct wire w;
+	const char **strs[3];
+	char *p;
+	size_t i, size;
+
+	if(len < sizeof w) return 0;
+	memcpy(&w, buf, sizeof w);
+	if(w.size < sizeof w || w.size > MAX_BACKLOG) return -1;
+	if(len < w.size) return 0;
+	strs[0] = &r->cmd;
+	strs[1] = &r->display_name;
+	strs[2] = &r->syspath;
+	size = sizeof w;
+	p = buf + sizeof w;
+	for(i = 0; i < 3; ++i) {
+		*strs[i] = NULL;
+		if(w.lens[i] > w.size - size) return -1;
+		if(w.lens[i]) {
+			if(p[w.lens[i] - 1]) return -1;
+			*strs[i] = p;
+		}
+		p += w.lens[i];
+		size += w.lens[i];
+	}
+	if(size != w.size || !r->cmd) return -1;
+	r->type = w.type;
+	r->flags = w.flags;
+	r->device = w.device;
+	r->generation = w.generation;
+	return w.size;
+}
+
+/*
+ * Server
+ */
+
+struct remote_client {
+	struct remote_client *next;
+	int fd;
+	/* Gone, and to be freed by the next remote_server_event(). Sends to
+	 * it do nothing in the meantime. */
+	unsigned dead;
+	/* What the socket didn't take yet. */
+	char *out;
+	size_t n, size;
+	/* Waiting for the hello. */
+	unsigned greeted;
+	char in[1024];
+	size_t n_in;
+};
+
+struct remote_server {
+	char *path;
+	int listen_fd;
+	/* The listening socket has no user data, the clients have
+	 * themselves. */
+	int epoll_fd;
+	struct remote_client *clients;
+	remote_hello_f *hello;
+	void *user;
+};
+
+static void drop(struct remote_client *c)
+{
+	if(c->dead) return;
+	c->dead = 1;
+	/* Also takes it off the epoll set. */
+	close(c->fd);
+	free(c->out);
+	c->out = NULL;
+	c->n = c->size = 0;
+}
+
+static void reap(struct remote_server *s)
+{
+	struct remote_client **i;
+	for(i = &s->clients; *i; ) {
+		struct remote_client *c;
+		c = *i;
+		if(!c->dead) {
+			i = &c->next;
+			continue;
+		}
+		*i = c->next;
+		free(c);
+	}
+}
+
+/* Ask to hear when the socket takes more, or to stop. */
+static void want_out(struct remote_server *s, struct remote_client *c, unsigned out)
+{
+	struct epoll_event ev = { EPOLLIN | EPOLLRDHUP };
+	if(out) ev.events |= EPOLLOUT;
+	ev.data.ptr = c;
+	epoll_ctl(s->epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+static void send_to(struct remote_server *s, struct remote_client *c, const char *buf, size_t len)
+{
+	if(c->dead) return;
+	/* Nothing may overtake what is held back. */
+	if(!c->n) {
+		ssize_t n;
+		n = send(c->fd, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if(n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) goto drop;
+		if(n < 0) n = 0;
+		buf += n;
+		len -= n;
+		if(!len) return;
+	}
+	if(c->n + len > MAX_BACKLOG) goto drop;
+	if(c->n + len > c->size) {
+		char *out;
+		size_t size;
+		for(size = c->size ? c->size : 4096; size < c->n + len; size *= 2);
+		out = realloc(c->out, size);
+		if(!out) goto drop;
+		c->out = out;
+		c->size = size;
+	}
+	memcpy(c->out + c->n, buf, len);
+	if(!c->n) want_out(s, c, 1);
+	c->n += len;
+	return;
+
+	/* It would miss the record, and a client can't be left to think it
+	 * knows what there is when it doesn't. It finds out it has been
+	 * dropped and starts over. */
+	drop: drop(c);
+}
+
+static void flush_out(struct remote_server *s, struct remote_client *c)
+{
+	ssize_t n;
+	n = send(c->fd, c->out, c->n, MSG_DONTWAIT | MSG_NOSIGNAL);
+	if(n < 0) {
+		if(errno != EAGAIN && errno != EWOULDBLOCK) drop(c);
+		return;
+	}
+	memmove(c->out, c->out + n, c->n - n);
+	c->n -= n;
+	if(!c->n) want_out(s, c, 0);
+}
+
+void remote_send(struct remote_server *s, struct remote_client *c, const struct remote_record *r)
+{
+	char *buf;
+	size_t size;
+	buf = encode(r, &size);
+	if(!buf) {
+		/* Same as not getting it sent. */
+		if(c) drop(c);
+		else for(c = s->clients; c; c = c->next) drop(c);
+		return;
+	}
+	/* Clients get nothing before their hello has been answered. */
+	if(c) send_to(s, c, buf, size);
+	else for(c = s->clients; c; c = c->next) if(c->greeted) send_to(s, c, buf, size);
+	free(buf);
+}
+
+static void accept_clients(struct remote_server *s)
+{
+	int fd;
+	while((fd = accept4(s->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+		struct remote_client *c;
+		struct epoll_event ev = { EPOLLIN | EPOLLRDHUP };
+		c = malloc(sizeof *c);
+		if(!c) goto err0;
+		c->fd = fd;
+		c->dead = 0;
+		c->out = NULL;
+		c->n = c->size = 0;
+		c->greeted = 0;
+		c->n_in = 0;
+		ev.data.ptr = c;
+		if(epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) goto err1;
+		c->next = s->clients;
+		s->clients = c;
+		continue;
+
+		err1: free(c);
+		err0: close(fd);
+	}
+}
+
+/* Clients only send their hello, so anything else is them going away. */
+static void read_client(struct remote_server *s, struct remote_client *c)
+{
+	struct remote_record r;
+	ssize_t got;
+	long size;
+
+	if(c->greeted) {
+		char buf[256];
+		while((got = read(c->fd, buf, sizeof buf)) > 0);
+		if(got == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) drop(c);
+		return;
+	}
+
+	got = read(c->fd, c->in + c->n_in, sizeof c->in - c->n_in);
+	if(got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+	if(got <= 0) goto drop;
+	c->n_in += got;
+	size = decode(c->in, c->n_in, &r);
+	if(size < 0 || (!size && c->n_in == sizeof c->in)) goto drop;
+	if(!size) return;
+	if(r.type != REMOTE_HELLO) goto drop;
+	c->greeted = 1;
+	s->hello(s->user, c, &r);
+	return;
+
+	drop: drop(c);
+}
+
+void remote_server_event(struct remote_server *s)
+{
+	struct epoll_event ev[16];
+	int n, i;
+
+	n = epoll_wait(s->epoll_fd, ev, sizeof ev / sizeof ev[0], 0);
+	for(i = 0; i < n; ++i) {
+		struct remote_client *c;
+		c = ev[i].data.ptr;
+		if(!c) {
+			accept_clients(s);
+			continue;
+		}
+		if(c->dead) continue;
+		if(ev[i].events & EPOLLOUT) flush_out(s, c);
+		if(ev[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) read_client(s, c);
+	}
+	reap(s);
+}
+
+int remote_server_get_fd(struct remote_server *s)
+{
+	return s->epoll_fd;
+}
+
+static int unix_address(struct sockaddr_un *addr, const char *path)
+{
+	if(strlen(path) >= sizeof addr->sun_path) return -1;
+	memset(addr, 0, sizeof *addr);
+	addr->sun_family = AF_UNIX;
+	strcpy(addr->sun_path, path);
+	return 0;
+}
+
+/* A socket left behind by a daemon that is gone is taken over, one that a
+ * daemon is still listening on isn't. */
+static int bind_socket(int fd, const struct sockaddr_un *addr)
+{
+	int probe, taken;
+	if(bind(fd, (const struct sockaddr *)addr, sizeof *addr) == 0) return 0;
+	if(errno != EADDRINUSE) return -1;
+	probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(probe < 0) return -1;
+	taken = connect(probe, (const struct sockaddr *)addr, sizeof *addr) == 0 || errno != ECONNREFUSED;
+	close(probe);
+	if(taken) return -1;
+	unlink(addr->sun_path);
+	return bind(fd, (const struct sockaddr *)addr, sizeof *addr);
+}
+
+static int remote_server_newfree(struct remote_server *s, struct remote_server **out, const char *path, remote_hello_f *hello, void *user)
+{
+	struct sockaddr_un addr;
+	struct epoll_event ev = { EPOLLIN };
+
+	if(s) goto freeing;
+
+	if(unix_address(&addr, path) < 0) goto err0;
+	s = malloc(sizeof *s);
+	if(!s) goto err0;
+	s->clients = NULL;
+	s->hello = hello;
+	s->user = user;
+	s->path = s_dup(path);
+	if(!s->path) goto err1;
+
+	s->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if(s->listen_fd < 0) goto err2;
+	if(bind_socket(s->listen_fd, &addr) < 0) goto err3;
+	if(listen(s->listen_fd, 16) < 0) goto err4;
+
+	s->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if(s->epoll_fd < 0) goto err4;
+	ev.data.ptr = NULL;
+	if(epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, s->listen_fd, &ev) < 0) goto err5;
+
+	*out = s;
+	return 0;
+
+	freeing: while(s->clients) {
+		struct remote_client *c;
+		c = s->clients;
+		s->clients = c->next;
+		drop(c);
+		free(c);
+	}
+	err5: close(s->epoll_fd);
+	err4: unlink(s->path);
+	err3: close(s->listen_fd);
+	err2: free(s->path);
+	err1: free(s);
+	err0: return -1;
+}
+
+int remote_server_new(struct remote_server **out, const char *path, remote_hello_f *hello, void *user)
+{
+	return remote_server_newfree(NULL, out, path, hello, user);
+}
+
+void remote_server_free(struct remote_server *s)
+{
+	remote_server_newfree(s, NULL, NULL, NULL, NULL);
+}
+
+/*
+ * Client
+ */
+
+struct remote_conn {
+	int fd;
+	/* Records that haven't all come yet. */
+	char *in;
+	size_t n, size;
+};
+
+static int remote_conn_newfree(struct remote_conn *c, struct remote_conn **out, const char *path, const struct remote_record *hello)
+{
+	struct sockaddr_un addr;
+	char *buf;
+	size_t size;
+	ssize_t sent;
+
+	if(c) goto freeing;
+
+	if(unix_address(&addr, path) < 0) goto err0;
+	c = malloc(sizeof *c);
+	if(!c) goto err0;
+	c->n = 0;
+	c->size = 4096;
+	c->in = malloc(c->size);
+	if(!c->in) goto err1;
+
+	/* Connecting doesn't take long on a Unix socket, reading is what
+	 * mustn't block. */
+	c->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(c->fd < 0) goto err2;
+	if(connect(c->fd, (struct sockaddr *)&addr, sizeof addr) < 0) goto err3;
+	buf = encode(hello, &size);
+	if(!buf) goto err3;
+	sent = send(c->fd, buf, size, MSG_NOSIGNAL);
+	free(buf);
+	if(sent != (ssize_t)size) goto err3;
+	if(fcntl(c->fd, F_SETFL, O_NONBLOCK) < 0) goto err3;
+
+	*out = c;
+	return 0;
+
+	freeing: err3: close(c->fd);
+	err2: free(c->in);
+	err1: free(c);
+	err0: return -1;
+}
+
+int remote_connect(struct remote_conn **out, const char *path, const struct remote_record *hello)
+{
+	return remote_conn_newfree(NULL, out, path, hello);
+}
+
+void remote_conn_free(struct remote_conn *c)
+{
+	remote_conn_newfree(c, NULL, NULL, NULL);
+}
+
+int remote_conn_get_fd(struct remote_conn *c)
+{
+	return c->fd;
+}
+
+int remote_conn_read(struct remote_conn *c, remote_record_f *f, void *user)
+{
+	while(1) {
+		struct remote_record r;
+		ssize_t got;
+		size_t done = 0;
+		long size;
+
+		if(c->n == c->size) {
+			char *in;
+			if(c->size >= MAX_BACKLOG) return -1;
+			in = realloc(c->in, c->size * 2);
+			if(!in) return -1;
+			c->in = in;
+			c->size *= 2;
+		}
+		got = read(c->fd, c->in + c->n, c->size - c->n);
+		if(got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+		if(got <= 0) return -1;
+		c->n += got;
+
+		while((size = decode(c->in + done, c->n - done, &r)) > 0) {
+			f(user, &r);
+			done += size;
+		}
+		if(size < 0) return -1;
+		memmove(c->in, c->in + done, c->n - done);
+		c->n -= done;
+	}
+}
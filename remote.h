@@ -0,0 +1,71 @@
+/* Sharing one enumeration between processes over a Unix socket. The daemon
+ * is an ordinary enumeration that also serves its targets; a client is an
+ * enumeration that gets its targets from the daemon instead of scanning.
+ *
+ * A client starts with a hello, saying which daemon it last heard from and up
+ * to which generation. If the daemon still has the changes since then, the
+ * client gets just those; otherwise it gets an add for every target there
+ * is. Either way they come between a begin and an end, and then every change
+ * as it happens. Records are sent without blocking: what doesn't fit in the
+ * socket is kept until it does, and a client so far behind that too much is
+ * kept is dropped. It can come back for what it missed. */
+#include <stddef.h>
+
+struct remote_server;
+struct remote_client;
+struct remote_conn;
+
+/* A change to a target, or one of these. @type is what
+ * bootloader_enumerate_get_change() returns for a change. display_name and
+ * syspath may be NULL. */
+enum {
+	/* From the client. cmd is the id of the daemon it last heard from,
+	 * "" if none, and generation the last one it heard of. */
+	REMOTE_HELLO = -1,
+	/* cmd is the daemon's id. With REMOTE_FULL, what follows is all the
+	 * targets there are, as of generation; without, what happened after
+	 * generation. */
+	REMOTE_BEGIN = -2,
+	/* The client is up to date, with generation. */
+	REMOTE_END = -3
+};
+#define REMOTE_FULL 1
+
+struct remote_record {
+	int type;
+	/* Of the change, in the daemon's count. */
+	unsigned long long generation;
+	/* BOOTLOADER_TARGET_* */
+	unsigned flags;
+	/* The BOOTLOADER_DEVICE_* type of the device it is on. */
+	unsigned device;
+	const char *cmd, *display_name, *syspath;
+};
+
+/* The server side. None of it blocks, and none of it is thread-safe: call it
+ * all under the same lock. @hello is called with each client's hello, to
+ * send it what it needs. */
+typedef void remote_hello_f(void *user, struct remote_client *c, const struct remote_record *hello);
+int remote_server_new(struct remote_server **out, const char *path, remote_hello_f *hello, void *user);
+/* Disconnects the clients and removes the socket. */
+void remote_server_free(struct remote_server *s);
+
+/* Readable when there is a client to accept, a client has said hello or gone
+ * away, or records held back can be sent. Then call remote_server_event(). */
+int remote_server_get_fd(struct remote_server *s);
+void remote_server_event(struct remote_server *s);
+
+/* Send to @c, or to all clients if it's NULL. */
+void remote_send(struct remote_server *s, struct remote_client *c, const struct remote_record *r);
+
+/* The client side. @hello is sent right away. */
+int remote_connect(struct remote_conn **out, const char *path, const struct remote_record *hello);
+void remote_conn_free(struct remote_conn *c);
+
+/* Readable when records have come. */
+int remote_conn_get_fd(struct remote_conn *c);
+
+/* Call @f for each record that has come, without blocking. The record is
+ * only valid during the call. Returns -1 once the daemon is gone. */
+typedef void remote_record_f(void *user, const struct remote_record *r);
+int remote_conn_read(struct remote_conn *c, remote_record_f *f, void *user);
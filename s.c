@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include "s.h"
 #include <stdio.h>
 #include <stddef.h>
@@ -5,71 +6,73 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 char *s_dup(const char *str)
 {
-	char *dup;
 	if(!str) return NULL;
-	dup = malloc(strlen(str) + 1);
-	strcpy(dup, str);
-	return dup;
+	return s_ndup(str, strlen(str));
 }
 
 char *s_ndup(const char *str, size_t n)
 {
-	size_t len;
+	const char *nul;
 	char *dup;
 	if(!str) return NULL;
-	len = strlen(str);
-	if(n < len) len = n;
-	dup = malloc(len + 1);
-	memcpy(dup, str, len);
-	dup[len] = '\0';
+	nul = memchr(str, '\0', n);
+	if(nul) n = nul - str;
+	dup = malloc(n + 1);
+	if(!dup) return NULL;
+	memcpy(dup, str, n);
+	dup[n] = '\0';
 	return dup;
 }
 
+/* Concatenating into @out, which is big enough, if it isn't NULL. Returns the
+ * length. */
+static size_t concat(char *out, const char *s1, va_list args)
+{
+	const char *i;
+	size_t len = 0;
+	for(i = s1; i; i = va_arg(args, const char *)) {
+		size_t n;
+		n = strlen(i);
+		if(out) memcpy(out + len, i, n);
+		len += n;
+	}
+	if(out) out[len] = '\0';
+	return len;
+}
+
 char *s_concat(const char *s1, ...)
 {
 	va_list args;
-	const char *i;
 	size_t len;
 	char *out;
-	len = 0;
 	va_start(args, s1);
-	for(i = s1; i; i = va_arg(args, const char *)) len += strlen(i);
+	len = concat(NULL, s1, args);
 	va_end(args);
 	out = malloc(len + 1);
 	if(!out) return NULL;
-	out[0] = '\0';
 	va_start(args, s1);
-	for(i = s1; i; i = va_arg(args, const char *)) strcat(out, i);
+	concat(out, s1, args);
 	va_end(args);
 	return out;
 }
 
 char *s_getline(void *file)
 {
-	size_t sz = 128, i = 0;
 	char *buf = NULL;
-	while(1) {
-		int c;
-		c = getc(file);
-		if(c == EOF && i == 0) break;
-		if(c == EOF || c == '\n') c = '\0';
-
-		if(!buf) buf = malloc(sz);
-		else if(i == sz - 1) {
-			char *newbuf;
-			newbuf = realloc(buf, sz *= 2);
-			if(!newbuf) free(buf);
-			buf = newbuf;
-		}
-		if(!buf) return NULL;
-
-		buf[i] = c;
-		if(!c) break;
-		++i;
+	size_t size = 0;
+	ssize_t len;
+	len = getline(&buf, &size, file);
+	if(len < 0) {
+		free(buf);
+		return NULL;
 	}
+	if(len && buf[len - 1] == '\n') buf[len - 1] = '\0';
 	return buf;
 }
 
@@ -96,3 +99,163 @@ char *s_getstr(int fd)
 	}
 	return buf;
 }
+
+char *s_read_file(const char *path, size_t *len_out)
+{
+	size_t len = 0, size = 4096;
+	char *buf, *newbuf;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if(fd < 0) goto err0;
+	buf = malloc(size);
+	if(!buf) goto err1;
+	/* Files in /proc have no size to go by. */
+	while(1) {
+		ssize_t n;
+		if(len + 1 == size) {
+			newbuf = realloc(buf, size *= 2);
+			if(!newbuf) goto err2;
+			buf = newbuf;
+		}
+		n = read(fd, buf + len, size - len - 1);
+		if(n < 0) goto err2;
+		if(n == 0) break;
+		len += n;
+	}
+	buf[len] = '\0';
+	close(fd);
+	if(len_out) *len_out = len;
+	return buf;
+
+	err2: free(buf);
+	err1: close(fd);
+	err0: return NULL;
+}
+
+unsigned s_view_line(struct s_view *rest, struct s_view *line)
+{
+	const char *nl;
+	if(!rest->len) return 0;
+	line->p = rest->p;
+	nl = memchr(rest->p, '\n', rest->len);
+	if(!nl) {
+		line->len = rest->len;
+		rest->p += rest->len;
+		rest->len = 0;
+		return 1;
+	}
+	line->len = nl - rest->p;
+	rest->len -= line->len + 1;
+	rest->p = nl + 1;
+	return 1;
+}
+
+unsigned s_view_is(struct s_view v, const char *str)
+{
+	return strlen(str) == v.len && !memcmp(v.p, str, v.len);
+}
+
+unsigned s_view_starts(struct s_view v, const char *prefix)
+{
+	size_t len;
+	len = strlen(prefix);
+	return len <= v.len && !memcmp(v.p, prefix, len);
+}
+
+/* Arena memory comes in blocks of at least this much. */
+#define ARENA_BLOCK 4096
+
+struct s_arena_block {
+	struct s_arena_block *next;
+};
+
+static void *arena_alloc(struct s_arena *a, size_t size, size_t align)
+{
+	struct s_arena_block *b;
+	size_t pad, block;
+
+	pad = a->p ? -(uintptr_t)a->p & (align - 1) : 0;
+	if(a->p && size + pad <= (size_t)(a->end - a->p)) {
+		void *p;
+		p = a->p + pad;
+		a->p += pad + size;
+		return p;
+	}
+
+	/* Big ones get a block of their own, so as not to waste what is left
+	 * of the current one. */
+	block = sizeof(struct s_arena_block) + size + align;
+	if(block < ARENA_BLOCK) block = ARENA_BLOCK;
+	b = malloc(block);
+	if(!b) return NULL;
+	if(block > ARENA_BLOCK && a->blocks) {
+		b->next = a->blocks->next;
+		a->blocks->next = b;
+	}
+	else {
+		b->next = a->blocks;
+		a->blocks = b;
+		a->p = (char *)(b + 1);
+		a->end = (char *)b + block;
+		return arena_alloc(a, size, align);
+	}
+	return (char *)(b + 1) + (-(uintptr_t)(b + 1) & (align - 1));
+}
+
+void *s_arena_alloc(struct s_arena *a, size_t size)
+{
+	return arena_alloc(a, size, sizeof(void *) * 2);
+}
+
+char *s_arena_dup(struct s_arena *a, const char *str)
+{
+	if(!str) return NULL;
+	return s_arena_ndup(a, str, strlen(str));
+}
+
+char *s_arena_ndup(struct s_arena *a, const char *str, size_t n)
+{
+	const char *nul;
+	char *dup;
+	if(!str) return NULL;
+	nul = memchr(str, '\0', n);
+	if(nul) n = nul - str;
+	dup = arena_alloc(a, n + 1, 1);
+	if(!dup) return NULL;
+	memcpy(dup, str, n);
+	dup[n] = '\0';
+	return dup;
+}
+
+char *s_arena_view(struct s_arena *a, struct s_view v)
+{
+	return s_arena_ndup(a, v.p, v.len);
+}
+
+char *s_arena_concat(struct s_arena *a, const char *s1, ...)
+{
+	va_list args;
+	size_t len;
+	char *out;
+	va_start(args, s1);
+	len = concat(NULL, s1, args);
+	va_end(args);
+	out = arena_alloc(a, len + 1, 1);
+	if(!out) return NULL;
+	va_start(args, s1);
+	concat(out, s1, args);
+	va_end(args);
+	return out;
+}
+
+void s_arena_free(struct s_arena *a)
+{
+	while(a->blocks) {
+		struct s_arena_block *b;
+		b = a->blocks;
+		a->blocks = b->next;
+		free(b);
+	}
+	a->p = a->end = NULL;
+}
@@ -12,3 +12,38 @@ char *s_getline(void *file);
 
 /* Read a null-terminated string from an fd. */
 char *s_getstr(int fd);
+
+/* Read a whole file, /proc ones included, into a newly-allocated
+ * null-terminated buffer. */
+char *s_read_file(const char *path, size_t *len_out);
+
+/* Part of a string, not null-terminated and not owned. */
+struct s_view {
+	const char *p;
+	size_t len;
+};
+
+/* Split the next line off @rest into @line, without the newline. Returns 0
+ * once there are no more. As with s_getline there is no empty line after a
+ * newline at the end. */
+unsigned s_view_line(struct s_view *rest, struct s_view *line);
+
+/* Whether @v is @str, or starts with it. */
+unsigned s_view_is(struct s_view v, const char *str);
+unsigned s_view_starts(struct s_view v, const char *prefix);
+
+/* A bump allocator for the strings made while scanning or loading one thing.
+ * They all go at once with s_arena_free; only what outlives it has to be
+ * copied out. Zero-initialise it before use. */
+struct s_arena {
+	struct s_arena_block *blocks;
+	char *p, *end;
+};
+
+void *s_arena_alloc(struct s_arena *a, size_t size);
+/* Like s_dup, s_ndup and s_concat. */
+char *s_arena_dup(struct s_arena *a, const char *str);
+char *s_arena_ndup(struct s_arena *a, const char *str, size_t n);
+char *s_arena_view(struct s_arena *a, struct s_view v);
+char *s_arena_concat(struct s_arena *a, const char *s1, ...);
+void s_arena_free(struct s_arena *a);
@@ -0,0 +1,556 @@
+#include "scan.h"
+#include "s.h"
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+
+/* A scan that runs past its deadline is tried this many times in all, the
+ * first retry BACKOFF_MS after it was given up on, doubling after that. */
+#define ATTEMPTS 3
+#define BACKOFF_MS 1000
+
+struct job {
+	struct job *next;
+	char *disk, *devnode, *syspath;
+	unsigned is_partition;
+	/* Lower goes first. */
+	unsigned priority;
+	/* SCAN_* */
+	unsigned mode;
+
+	unsigned attempts;
+	/* When a running scan is given up on, or when a retry is due. 0 for
+	 * never. */
+	unsigned long long deadline;
+	/* Given up on. The thread running it exits when it returns, and
+	 * until then it's on the stuck list. */
+	unsigned abandoned;
+};
+
+/* Queued work for one physical disk. A disk is on the list as long as it has
+ * jobs left or one of its jobs is running. */
+struct disk {
+	struct disk *next;
+	char *syspath;
+	struct job *jobs, **last;
+	struct job *running;
+};
+
+struct scan_pool {
+	pthread_mutex_t lock;
+	/* Wakes up idle workers. */
+	pthread_cond_t cond;
+	/* Wakes up the watchdog. */
+	pthread_cond_t wake;
+	/* Signalled when a thread exits. */
+	pthread_cond_t exited;
+
+	struct disk *disks;
+	/* Abandoned scans waiting to be tried again, and those still
+	 * running. A retry doesn't start before the scan it retries has
+	 * returned, so that a device is never scanned twice at once. */
+	struct job *retries, *stuck;
+	unsigned quit;
+	/* No new scans are started. */
+	unsigned held;
+
+	/* Threads, including the watchdog, and how many of them are running a
+	 * scan that is still wanted or one that has been abandoned. */
+	unsigned n_threads, n_running, n_stuck;
+	unsigned timeout_ms;
+
+	scan_f *f;
+	scan_idle_f *idle, *finish;
+	void *user;
+};
+
+static unsigned long long now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+static struct job *job_new(const char *disk, const char *devnode, const char *syspath, unsigned is_partition, unsigned priority, unsigned mode)
+{
+	struct job *j;
+	j = malloc(sizeof *j);
+	if(!j) goto err0;
+	j->next = NULL;
+	j->is_partition = is_partition;
+	j->priority = priority;
+	j->mode = mode;
+	j->attempts = 0;
+	j->deadline = 0;
+	j->abandoned = 0;
+	j->disk = s_dup(disk);
+	if(!j->disk) goto err1;
+	j->devnode = s_dup(devnode);
+	if(!j->devnode) goto err2;
+	j->syspath = s_dup(syspath);
+	if(!j->syspath) goto err3;
+	return j;
+
+	err3: free(j->devnode);
+	err2: free(j->disk);
+	err1: free(j);
+	err0: return NULL;
+}
+
+static void job_free(struct job *j)
+{
+	free(j->disk);
+	free(j->devnode);
+	free(j->syspath);
+	free(j);
+}
+
+static void drop_jobs(struct job **jobs)
+{
+	while(*jobs) {
+		struct job *j;
+		j = *jobs;
+		*jobs = j->next;
+		job_free(j);
+	}
+}
+
+static void disk_free(struct disk *d)
+{
+	drop_jobs(&d->jobs);
+	free(d->syspath);
+	free(d);
+}
+
+/* Unlink @d from the list. Put it back at the end if it still has work, so
+ * that a disk with many partitions doesn't starve the others. */
+static void disk_done(struct scan_pool *p, struct disk *d)
+{
+	struct disk **i;
+	for(i = &p->disks; *i != d; i = &(*i)->next);
+	*i = d->next;
+	if(!d->jobs) {
+		disk_free(d);
+		return;
+	}
+	for(; *i; i = &(*i)->next);
+	d->next = NULL;
+	*i = d;
+	pthread_cond_signal(&p->cond);
+}
+
+/* Queue @j behind the other jobs of its disk that go before it, or free it
+ * if it's redundant. Call with the lock held. */
+static void enqueue(struct scan_pool *p, struct job *j)
+{
+	struct job *i, **at;
+	struct disk *d;
+
+	for(d = p->disks; d && strcmp(d->syspath, j->disk); d = d->next);
+	if(!d) {
+		struct disk **l;
+		d = malloc(sizeof *d);
+		if(!d) goto err0;
+		d->syspath = s_dup(j->disk);
+		if(!d->syspath) goto err1;
+		d->jobs = NULL;
+		d->last = &d->jobs;
+		d->running = NULL;
+		d->next = NULL;
+		for(l = &p->disks; *l; l = &(*l)->next);
+		*l = d;
+	}
+
+	/* A scan that hasn't started yet will see the device as it is now,
+	 * another one would be redundant. It has to be a full one unless both
+	 * ask for the same. */
+	for(i = d->jobs; i; i = i->next) {
+		if(strcmp(i->syspath, j->syspath)) continue;
+		if(i->mode != j->mode) i->mode = SCAN_FULL;
+		goto err0;
+	}
+
+	for(at = &d->jobs; *at && (*at)->priority <= j->priority; at = &(*at)->next);
+	j->next = *at;
+	*at = j;
+	if(!j->next) d->last = &j->next;
+	if(!d->running) pthread_cond_signal(&p->cond);
+	return;
+
+	err1: free(d);
+	err0: job_free(j);
+}
+
+static void pool_destroy(struct scan_pool *p)
+{
+	while(p->disks) {
+		struct disk *d;
+		d = p->disks;
+		p->disks = d->next;
+		disk_free(d);
+	}
+	drop_jobs(&p->retries);
+	pthread_cond_destroy(&p->exited);
+	pthread_cond_destroy(&p->wake);
+	pthread_cond_destroy(&p->cond);
+	pthread_mutex_destroy(&p->lock);
+	free(p);
+}
+
+/* Call with the lock held, which this releases. */
+static void thread_exit(struct scan_pool *p)
+{
+	unsigned last;
+	last = --p->n_threads == 0 && p->finish;
+	pthread_cond_broadcast(&p->exited);
+	pthread_mutex_unlock(&p->lock);
+	if(last) {
+		p->finish(p->user);
+		pool_destroy(p);
+	}
+}
+
+/* Nothing queued, running, stuck or to be tried again. Call with the lock
+ * held. */
+static unsigned is_idle(struct scan_pool *p)
+{
+	return !p->disks && !p->retries && !p->stuck;
+}
+
+static void *worker(void *user)
+{
+	struct scan_pool *p;
+	unsigned stuck;
+	p = user;
+
+	pthread_mutex_lock(&p->lock);
+	while(!p->quit) {
+		struct disk *d, *i;
+		struct job *j;
+
+		/* The disk with the most urgent job. Of those that are as
+		 * urgent, the one that has waited longest. */
+		d = NULL;
+		for(i = p->held ? NULL : p->disks; i; i = i->next) {
+			if(!i->running && (!d || i->jobs->priority < d->jobs->priority)) d = i;
+		}
+		if(!d) {
+			pthread_cond_wait(&p->cond, &p->lock);
+			continue;
+		}
+
+		j = d->jobs;
+		d->jobs = j->next;
+		if(!d->jobs) d->last = &d->jobs;
+		d->running = j;
+		++j->attempts;
+		if(p->timeout_ms) {
+			j->deadline = now_ms() + p->timeout_ms;
+			pthread_cond_signal(&p->wake);
+		}
+		++p->n_running;
+		pthread_mutex_unlock(&p->lock);
+
+		p->f(p->user, j->devnode, j->syspath, j->is_partition, j->mode);
+
+		pthread_mutex_lock(&p->lock);
+		/* Another thread has taken over. */
+		stuck = j->abandoned;
+		if(stuck) {
+			struct job **k;
+			for(k = &p->stuck; *k != j; k = &(*k)->next);
+			*k = j->next;
+			--p->n_stuck;
+		}
+		else {
+			--p->n_running;
+			d->running = NULL;
+			disk_done(p, d);
+		}
+		job_free(j);
+		/* A retry may be waiting for a stuck scan. */
+		pthread_cond_signal(&p->wake);
+
+		if(is_idle(p) && p->idle && !p->quit) {
+			pthread_mutex_unlock(&p->lock);
+			p->idle(p->user);
+			pthread_mutex_lock(&p->lock);
+		}
+		if(stuck) break;
+	}
+	thread_exit(p);
+
+	return NULL;
+}
+
+/* Threads are detached, so that stuck ones can be left behind. Call with the
+ * lock held. */
+static int spawn(struct scan_pool *p, void *(*f)(void *))
+{
+	pthread_t thread;
+	pthread_attr_t attr;
+	int err;
+	if(pthread_attr_init(&attr) != 0) return -1;
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	err = pthread_create(&thread, &attr, f, p);
+	pthread_attr_destroy(&attr);
+	if(err != 0) return -1;
+	++p->n_threads;
+	return 0;
+}
+
+/* The scan running on @d is past its deadline. It can't be interrupted, so
+ * its thread is left to it and replaced, and the rest of the disk goes on.
+ * Call with the lock held. */
+static void abandon(struct scan_pool *p, struct disk *d, unsigned long long now)
+{
+	struct job *j, *retry;
+	j = d->running;
+	j->abandoned = 1;
+	j->next = p->stuck;
+	p->stuck = j;
+	d->running = NULL;
+	--p->n_running;
+	++p->n_stuck;
+
+	if(!p->quit) {
+		spawn(p, worker);
+		if(j->attempts < ATTEMPTS && (retry = job_new(j->disk, j->devnode, j->syspath, j->is_partition, j->priority, j->mode))) {
+			retry->attempts = j->attempts;
+			retry->deadline = now + ((unsigned long long)BACKOFF_MS << (j->attempts - 1));
+			retry->next = p->retries;
+			p->retries = retry;
+		}
+	}
+	disk_done(p, d);
+}
+
+/* Whether a scan of the device is still running after being given up on.
+ * Call with the lock held. */
+static unsigned is_stuck(struct scan_pool *p, const char *syspath)
+{
+	struct job *j;
+	for(j = p->stuck; j && strcmp(j->syspath, syspath); j = j->next);
+	return j != NULL;
+}
+
+/* Gives up on scans past their deadline, and queues retries when they are
+ * due and the scan they retry has returned. Keeps going after quit until no
+ * wanted scans are left running. */
+static void *watchdog(void *user)
+{
+	struct scan_pool *p;
+	p = user;
+
+	pthread_mutex_lock(&p->lock);
+	while(!p->quit || p->n_running) {
+		unsigned long long now, next = 0;
+		struct disk *d, *d_next;
+		struct job **i;
+
+		now = now_ms();
+		for(d = p->disks; d; d = d_next) {
+			d_next = d->next;
+			if(!d->running) continue;
+			if(d->running->deadline <= now) abandon(p, d, now);
+			else if(!next || d->running->deadline < next) next = d->running->deadline;
+		}
+		for(i = &p->retries; *i; ) {
+			struct job *j;
+			j = *i;
+			if(j->deadline > now && !p->quit) {
+				if(!next || j->deadline < next) next = j->deadline;
+				i = &j->next;
+				continue;
+			}
+			/* Woken up when it returns. */
+			if(!p->quit && is_stuck(p, j->syspath)) {
+				i = &j->next;
+				continue;
+			}
+			*i = j->next;
+			j->deadline = 0;
+			if(p->quit) job_free(j);
+			else enqueue(p, j);
+		}
+
+		if(next) {
+			struct timespec ts;
+			ts.tv_sec = next / 1000;
+			ts.tv_nsec = next % 1000 * 1000000;
+			pthread_cond_timedwait(&p->wake, &p->lock, &ts);
+		}
+		else pthread_cond_wait(&p->wake, &p->lock);
+	}
+	thread_exit(p);
+
+	return NULL;
+}
+
+/* When freeing, @idle is the finish callback. */
+static int pool_newfree(struct scan_pool *p, struct scan_pool **out, unsigned workers, unsigned timeout_ms, scan_f *f, scan_idle_f *idle, void *user)
+{
+	pthread_condattr_t attr;
+
+	if(p) goto freeing;
+
+	p = malloc(sizeof *p);
+	if(!p) goto err0;
+	p->disks = NULL;
+	p->retries = p->stuck = NULL;
+	p->quit = 0;
+	p->held = 0;
+	p->n_threads = p->n_running = p->n_stuck = 0;
+	p->timeout_ms = timeout_ms;
+	p->f = f;
+	p->idle = idle;
+	p->finish = NULL;
+	p->user = user;
+
+	if(pthread_mutex_init(&p->lock, NULL) != 0) goto err1;
+	if(pthread_cond_init(&p->cond, NULL) != 0) goto err2;
+	/* Deadlines are on the monotonic clock. */
+	if(pthread_condattr_init(&attr) != 0) goto err3;
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	if(pthread_cond_init(&p->wake, &attr) != 0) goto err4;
+	if(pthread_cond_init(&p->exited, NULL) != 0) goto err5;
+	pthread_condattr_destroy(&attr);
+
+	pthread_mutex_lock(&p->lock);
+	while(p->n_threads < workers && spawn(p, worker) == 0);
+	/* Fewer threads than asked for is fine, none is not. Without a
+	 * watchdog there are no deadlines. */
+	if(p->n_threads == 0) goto err6;
+	if(p->timeout_ms && spawn(p, watchdog) < 0) p->timeout_ms = 0;
+	pthread_mutex_unlock(&p->lock);
+
+	*out = p;
+	return 0;
+
+	freeing: pthread_mutex_lock(&p->lock);
+	p->quit = 1;
+	{
+		/* Drop whatever hasn't started. Running jobs keep their disk
+		 * alive until they're done. */
+		struct disk **i;
+		for(i = &p->disks; *i; ) {
+			struct disk *d;
+			d = *i;
+			drop_jobs(&d->jobs);
+			d->last = &d->jobs;
+			if(d->running) i = &d->next;
+			else {
+				*i = d->next;
+				disk_free(d);
+			}
+		}
+	}
+	drop_jobs(&p->retries);
+	pthread_cond_broadcast(&p->cond);
+	pthread_cond_signal(&p->wake);
+
+	/* Wait for the scans that are still running, up to their deadline. */
+	while(p->n_threads > p->n_stuck) pthread_cond_wait(&p->exited, &p->lock);
+	if(p->n_threads) {
+		/* The last stuck one cleans up when it's done. */
+		p->finish = idle;
+		pthread_mutex_unlock(&p->lock);
+		return 1;
+	}
+	pthread_mutex_unlock(&p->lock);
+	pool_destroy(p);
+	return 0;
+
+	err6: pthread_mutex_unlock(&p->lock);
+	pthread_cond_destroy(&p->exited);
+	err5: pthread_cond_destroy(&p->wake);
+	err4: pthread_condattr_destroy(&attr);
+	err3: pthread_cond_destroy(&p->cond);
+	err2: pthread_mutex_destroy(&p->lock);
+	err1: free(p);
+	err0: return -1;
+}
+
+int scan_pool_new(struct scan_pool **out, unsigned workers, unsigned timeout_ms, scan_f *f, scan_idle_f *idle, void *user)
+{
+	return pool_newfree(NULL, out, workers, timeout_ms, f, idle, user);
+}
+
+unsigned scan_pool_free(struct scan_pool *p, scan_idle_f *finish)
+{
+	return pool_newfree(p, NULL, 0, 0, NULL, finish, NULL);
+}
+
+int scan_pool_add(struct scan_pool *p, const char *disk, const char *devnode, const char *syspath, unsigned is_partition, unsigned priority, unsigned mode)
+{
+	struct job *j;
+	j = job_new(disk, devnode, syspath, is_partition, priority, mode);
+	if(!j) return -1;
+	pthread_mutex_lock(&p->lock);
+	enqueue(p, j);
+	pthread_mutex_unlock(&p->lock);
+	return 0;
+}
+
+void scan_pool_hold(struct scan_pool *p, unsigned hold)
+{
+	pthread_mutex_lock(&p->lock);
+	p->held = hold;
+	if(!hold) pthread_cond_broadcast(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+}
+
+unsigned scan_pool_busy(struct scan_pool *p)
+{
+	unsigned busy;
+	pthread_mutex_lock(&p->lock);
+	busy = !is_idle(p);
+	pthread_mutex_unlock(&p->lock);
+	return busy;
+}
+
+void scan_pool_cancel(struct scan_pool *p, const char *syspath)
+{
+	struct disk **i;
+	struct job **j;
+	unsigned was_idle, idle;
+
+	pthread_mutex_lock(&p->lock);
+	was_idle = is_idle(p);
+	for(i = &p->disks; *i; ) {
+		struct disk *d;
+		unsigned whole_disk;
+		d = *i;
+		whole_disk = !strcmp(d->syspath, syspath);
+
+		for(j = &d->jobs; *j; ) {
+			struct job *job;
+			job = *j;
+			if(whole_disk || !strcmp(job->syspath, syspath)) {
+				*j = job->next;
+				job_free(job);
+			}
+			else j = &job->next;
+		}
+		for(d->last = &d->jobs; *d->last; d->last = &(*d->last)->next);
+
+		if(!d->jobs && !d->running) {
+			*i = d->next;
+			disk_free(d);
+		}
+		else i = &d->next;
+	}
+	for(j = &p->retries; *j; ) {
+		struct job *job;
+		job = *j;
+		if(!strcmp(job->disk, syspath) || !strcmp(job->syspath, syspath)) {
+			*j = job->next;
+			job_free(job);
+		}
+		else j = &job->next;
+	}
+	/* What was dropped may have been all that was left. */
+	idle = !was_idle && is_idle(p) && p->idle && !p->quit;
+	pthread_mutex_unlock(&p->lock);
+	if(idle) p->idle(p->user);
+}
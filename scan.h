@@ -0,0 +1,58 @@
+/* A pool of threads running disk_scan() in parallel. Scans are grouped by the
+ * physical disk they belong to: different disks are scanned concurrently, but
+ * the partitions of one disk are scanned one at a time, so a spindle doesn't
+ * seek back and forth between them.
+ *
+ * Each scan has a priority. A free thread takes the disk whose next scan is
+ * the most urgent, and the scans of a disk go by priority, then in the order
+ * they were queued.
+ *
+ * A scan can have a deadline. A scan past it (a failing stick stuck in
+ * mount(), say) can't be interrupted, so its thread is left to it and
+ * replaced, the other partitions of the disk go on, and the scan is tried
+ * again later, a few times at increasing intervals. A retry waits for the
+ * stuck scan to return, so that a device is never scanned twice at once. */
+struct scan_pool;
+
+/* What a queued scan is to do. */
+/* Everything: probe the device and read its configs. */
+#define SCAN_FULL 0
+/* The same, unless the device hasn't changed since it was last scanned. */
+#define SCAN_IF_CHANGED 1
+/* Only read the configs again, on a device that was scanned before. */
+#define SCAN_CONFIGS 2
+
+/* @mode is passed on from scan_pool_add(). */
+typedef void scan_f(void *user, const char *devnode, const char *syspath, unsigned is_partition, unsigned mode);
+typedef void scan_idle_f(void *user);
+
+/* Start @workers threads that call @f for every queued device. @idle, if not
+ * NULL, is called whenever the last scan is done or dropped, with none left
+ * queued, running, stuck or waiting to be tried again.
+ * @timeout_ms is the deadline of each scan, 0 for none. */
+int scan_pool_new(struct scan_pool **out, unsigned workers, unsigned timeout_ms, scan_f *f, scan_idle_f *idle, void *user);
+
+/* Drop the queued scans and wait for the running ones to finish, or to pass
+ * their deadline. Returns 0 if everything is done. Otherwise returns 1, and
+ * the stuck scans carry on; the last one to return calls @finish and frees
+ * the pool. Until then, whatever @f uses must stay around. */
+unsigned scan_pool_free(struct scan_pool *p, scan_idle_f *finish);
+
+/* Queue a scan of a device. @disk is the syspath of the physical disk the
+ * device is on (its own syspath if it is a whole disk). Lower @priority goes
+ * first. @mode is one of SCAN_*. Nothing is queued if a scan of the device is
+ * already waiting to start; it is made a full one if the two differ. */
+int scan_pool_add(struct scan_pool *p, const char *disk, const char *devnode, const char *syspath, unsigned is_partition, unsigned priority, unsigned mode);
+
+/* While held, queued scans don't start, so that a batch can be queued and
+ * then started in order of priority. */
+void scan_pool_hold(struct scan_pool *p, unsigned hold);
+
+/* Whether any scans are queued, running, stuck or waiting to be tried
+ * again. */
+unsigned scan_pool_busy(struct scan_pool *p);
+
+/* Drop queued scans of a device, and its retries. If it is a whole disk, scans
+ * of its partitions are dropped too. Scans already running are not affected.
+ * Calls @idle if that leaves nothing to do. */
+void scan_pool_cancel(struct scan_pool *p, const char *syspath);
@@ -1,11 +1,18 @@
 #include "smount.h"
+#include "s.h"
+#include "throttle.h"
 #include <blkid.h>
 #include <mntent.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
-
-#define CACHE_DIR "/var/cache/libbootloader"
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
 
 /* Should we change /etc/mtab? I think no, we don't use the mount command, it's
  * easier and getting the lock file might block or be tedious to program. */
@@ -22,30 +29,139 @@
 # define MNTTAB_FILE "/proc/mounts"
 #endif
 
+/* How long an unused mount is kept around in case someone wants it again. */
+#define IDLE_MS 5000
+
+/* Mounts are shared: there is one per filesystem (block device), for as long
+ * as anyone is using it and IDLE_MS after that. Scanning a device, naming its
+ * targets and loading one of them all use the same mount. */
 struct smount {
+	struct smount *next;
+	dev_t dev;
+	unsigned refs;
+	/* Set once the mount is done, by which time failed says how it went.
+	 * Until then others wanting it wait. */
+	unsigned ready, failed;
+	/* Unmount as soon as it's unused, the device has gone away. */
+	unsigned drop;
+	unsigned long long expires;
+
 	char buf[512];
+	const char *mountpoint;
 	const char *path_to_umount;
 };
 
-static int smount(struct smount **out, const char **mp_out, const char *dev)
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static struct smount *mounts;
+/* Whether the thread unmounting idle mounts is running. */
+static unsigned reaping;
+
+static unsigned long long now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+static void init(void)
+{
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&cond, &attr);
+	pthread_condattr_destroy(&attr);
+}
+
+static void unlink_mount(struct smount *m)
+{
+	struct smount **i;
+	for(i = &mounts; *i != m; i = &(*i)->next);
+	*i = m->next;
+}
+
+/* Unmount and free. Not with the lock held, umount can take a while. */
+static void unmount(struct smount *m)
+{
+	if(m->path_to_umount) {
+		/* Someone may still have a file open in it. */
+		if(umount(m->path_to_umount) < 0) umount2(m->path_to_umount, MNT_DETACH);
+		rmdir(m->path_to_umount);
+	}
+	free(m);
+}
+
+/* Find where the filesystem on @dev is mounted, in @buf. Bind mounts of
+ * directories in it don't count. Returns 1 if it is, 0 if it isn't, -1 if
+ * that can't be told. */
+static int find_mount(dev_t dev, char *buf, size_t size)
+{
+	char *mountinfo;
+	struct s_view rest, line;
+	int found = 0;
+
+	/* This is read for every device scanned, so in one go. */
+	mountinfo = s_read_file("/proc/self/mountinfo", &rest.len);
+	if(!mountinfo) return -1;
+	rest.p = mountinfo;
+	while(!found && s_view_line(&rest, &line)) {
+		unsigned maj, min;
+		int root = 0, mp = 0;
+		/* ID, parent ID, major:minor, root, mount point, ... */
+		sscanf(line.p, "%*u %*u %u:%u %n%*s %n", &maj, &min, &root, &mp);
+		if(mp && (size_t)mp < line.len && maj == major(dev) && min == minor(dev) && !strncmp(line.p + root, "/ ", 2)) {
+			/* Spaces and such are escaped as \ooo. */
+			const char *p, *end;
+			size_t i = 0;
+			end = line.p + line.len;
+			for(p = line.p + mp; p < end && *p != ' ' && i + 1 < size; ++i) {
+				if(p[0] == '\\' && end - p >= 4) {
+					buf[i] = (p[1] - '0') << 6 | (p[2] - '0') << 3 | (p[3] - '0');
+					p += 4;
+				}
+				else buf[i] = *p++;
+			}
+			if(size) buf[i] = '\0';
+			found = 1;
+		}
+	}
+	free(mountinfo);
+	return found;
+}
+
+unsigned smount_is_mounted(dev_t dev)
+{
+	char buf[1];
+	/* Can't tell, so assume the worst. */
+	return find_mount(dev, buf, sizeof buf) != 0;
+}
+
+/* Find where the device is already mounted, or mount it at
+ * /var/cache/libbootloader/XXXXXX. */
+static int do_mount(struct smount *m, const char *dev)
 {
-	struct smount *m;
 	char *filesystem;
 	const char *mountpoint = NULL;
 
-	if(*out) goto freeing;
-	m = malloc(sizeof *m);
-	if(!m) goto err0;
-	m->path_to_umount = NULL;
+	/* Using someone else's mount is cheaper, and that one is kept up to
+	 * date while a second mount of our own might not be. */
+	if(find_mount(m->dev, m->buf, sizeof m->buf) == 1) {
+		m->mountpoint = m->buf;
+		return 0;
+	}
 
-	/* Try to mount the device at /var/cache/libbootloader/XXXXX */
 	filesystem = blkid_get_tag_value(NULL, "TYPE", dev);
 	if(!filesystem) goto err0;
 	strcpy(m->buf, CACHE_DIR);
 	mkdir(m->buf, 0700);
 	strcat(m->buf, "/XXXXXX");
 	if(!mkdtemp(m->buf)) goto err1;
-	if(mount(dev, m->buf, filesystem, 0, NULL) < 0) {
+	/* Read-only, we only ever look at files. This also keeps the superblock
+	 * fingerprints of the scan cache from changing because of our own
+	 * mounts. */
+	throttle_mount();
+	if(mount(dev, m->buf, filesystem, MS_RDONLY, NULL) < 0) {
 		rmdir(m->buf);
 
 		if(errno == EBUSY) {
@@ -74,21 +190,123 @@ static int smount(struct smount **out, const char **mp_out, const char *dev)
 	if(!mountpoint) goto err1;
 
 	free(filesystem);
-	*out = m;
-	*mp_out = mountpoint;
+	m->mountpoint = mountpoint;
 	return 0;
 
-	freeing: m = *out;
-	err3: if(m->path_to_umount) umount(m->path_to_umount);
-	err2: if(m->path_to_umount) rmdir(m->path_to_umount);
-	err1: if(!*out) free(filesystem);
+	err1: free(filesystem);
 	err0: return -1;
 }
 
+/* Unmounts idle mounts as they expire, and exits when there are none left.
+ * Runs with the lock held except while unmounting. */
+static void *reaper(void *ignored)
+{
+	pthread_mutex_lock(&lock);
+	while(1) {
+		struct smount *m, *next_m, *expired = NULL;
+		unsigned long long now, next = 0;
+
+		now = now_ms();
+		for(m = mounts; m; m = next_m) {
+			next_m = m->next;
+			if(m->refs) continue;
+			if(m->expires <= now) {
+				unlink_mount(m);
+				m->next = expired;
+				expired = m;
+			}
+			else if(!next || m->expires < next) next = m->expires;
+		}
+
+		if(expired) {
+			pthread_mutex_unlock(&lock);
+			while(expired) {
+				m = expired;
+				expired = m->next;
+				unmount(m);
+			}
+			pthread_mutex_lock(&lock);
+			continue;
+		}
+		if(!next) break;
+
+		{
+			struct timespec ts;
+			ts.tv_sec = next / 1000;
+			ts.tv_nsec = next % 1000 * 1000000;
+			pthread_cond_timedwait(&cond, &lock, &ts);
+		}
+	}
+	reaping = 0;
+	pthread_mutex_unlock(&lock);
+	return NULL;
+}
+
+/* Make sure an idle mount will be unmounted. Call with the lock held. */
+static void reap(void)
+{
+	pthread_t thread;
+	pthread_attr_t attr;
+
+	/* Those waiting for a mount to be ready wait on the same condition. */
+	if(reaping) {
+		pthread_cond_broadcast(&cond);
+		return;
+	}
+	if(pthread_attr_init(&attr) != 0) return;
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if(pthread_create(&thread, &attr, reaper, NULL) == 0) reaping = 1;
+	pthread_attr_destroy(&attr);
+}
+
 int smount_new(struct smount **out, const char **mountpoint_out, const char *device)
 {
-	*out = NULL;
-	return smount(out, mountpoint_out, device);
+	struct smount *m;
+	struct stat st;
+
+	if(stat(device, &st) < 0 || !S_ISBLK(st.st_mode)) goto err0;
+	pthread_once(&once, init);
+
+	pthread_mutex_lock(&lock);
+	for(m = mounts; m && m->dev != st.st_rdev; m = m->next);
+	if(m) {
+		++m->refs;
+		while(!m->ready) pthread_cond_wait(&cond, &lock);
+		if(m->failed) goto err1;
+		pthread_mutex_unlock(&lock);
+		goto out;
+	}
+
+	m = malloc(sizeof *m);
+	if(!m) goto err2;
+	m->dev = st.st_rdev;
+	m->refs = 1;
+	m->ready = m->failed = m->drop = 0;
+	m->path_to_umount = NULL;
+	m->next = mounts;
+	mounts = m;
+	pthread_mutex_unlock(&lock);
+
+	/* Others wanting the same filesystem wait for this, but only them. */
+	m->failed = do_mount(m, device) < 0;
+
+	pthread_mutex_lock(&lock);
+	m->ready = 1;
+	pthread_cond_broadcast(&cond);
+	if(m->failed) goto err1;
+	pthread_mutex_unlock(&lock);
+
+	out: *out = m;
+	*mountpoint_out = m->mountpoint;
+	return 0;
+
+	/* The last one to see the failure frees it. */
+	err1: if(--m->refs == 0) {
+		unlink_mount(m);
+		free(m);
+	}
+	err2: pthread_mutex_unlock(&lock);
+	err0: return -1;
 }
 
 int smount_new_from_uuid(struct smount **out, const char **mountpoint_out, const char *uuid)
@@ -104,5 +322,80 @@ int smount_new_from_uuid(struct smount **out, const char **mountpoint_out, const
 
 void smount_free(struct smount *m)
 {
-	smount(&m, NULL, NULL);
+	pthread_mutex_lock(&lock);
+	if(--m->refs == 0) {
+		if(m->drop) {
+			unlink_mount(m);
+			pthread_mutex_unlock(&lock);
+			unmount(m);
+			return;
+		}
+		m->expires = now_ms() + IDLE_MS;
+		reap();
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+unsigned smount_is_borrowed(struct smount *m)
+{
+	return !m->path_to_umount;
+}
+
+void smount_drop(dev_t dev)
+{
+	struct smount *m;
+
+	pthread_once(&once, init);
+	pthread_mutex_lock(&lock);
+	for(m = mounts; m && (m->dev != dev || !m->ready); m = m->next);
+	if(!m) goto out;
+	if(m->refs) {
+		m->drop = 1;
+		goto out;
+	}
+	unlink_mount(m);
+	pthread_mutex_unlock(&lock);
+	unmount(m);
+	return;
+
+	out: pthread_mutex_unlock(&lock);
+}
+
+void smount_drop_later(dev_t dev)
+{
+	struct smount *m;
+
+	pthread_once(&once, init);
+	pthread_mutex_lock(&lock);
+	for(m = mounts; m && (m->dev != dev || !m->ready); m = m->next);
+	if(m) {
+		if(m->refs) m->drop = 1;
+		else {
+			m->expires = 0;
+			reap();
+		}
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+void smount_flush(void)
+{
+	struct smount *m, *next, *idle = NULL;
+
+	pthread_once(&once, init);
+	pthread_mutex_lock(&lock);
+	for(m = mounts; m; m = next) {
+		next = m->next;
+		if(m->refs) continue;
+		unlink_mount(m);
+		m->next = idle;
+		idle = m;
+	}
+	pthread_mutex_unlock(&lock);
+
+	while(idle) {
+		m = idle;
+		idle = m->next;
+		unmount(m);
+	}
 }
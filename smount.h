@@ -1,10 +1,38 @@
 /* Simple mount wrapper that will find a device's existing mount point
- * if it can't be mounted otherwise. */
+ * if it can't be mounted otherwise. Mounts are shared and reference counted:
+ * everyone asking for the same device gets the same mount, and it's kept for
+ * a few seconds after the last smount_free in case it's wanted again. */
+#include <sys/types.h>
+
 struct smount;
+
+/* Temporary mount points are made in here. The scan cache lives here too. */
+#define CACHE_DIR "/var/cache/libbootloader"
+
 /* Mount the given filesystem somewhere. mountpoint_out is the mount point,
  * without trailing slash, until you call smount_free. */
 int smount_new(struct smount **out, const char **mountpoint_out, const char *device);
 /* As above but using UUID rather than devname. */
 int smount_new_from_uuid(struct smount **out, const char **mountpoint_out, const char *uuid);
 
+/* Thread safe, like the rest. */
 void smount_free(struct smount *m);
+
+/* Whether the filesystem on a device is mounted. Also if that can't be
+ * told. */
+unsigned smount_is_mounted(dev_t dev);
+
+/* Whether the filesystem was already mounted by someone else, so that the
+ * mount point stays after smount_free. */
+unsigned smount_is_borrowed(struct smount *m);
+
+/* The device has gone away or changed: unmount it now, or as soon as it's no
+ * longer used. */
+void smount_drop(dev_t dev);
+
+/* As above, but leaves unmounting to the thread that unmounts idle mounts, so
+ * it doesn't block. */
+void smount_drop_later(dev_t dev);
+
+/* Unmount everything that isn't in use. */
+void smount_flush(void);
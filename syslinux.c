@@ -0,0 +1,214 @@
+#include "syslinux.h"
+#include "config.h"
+#include "s.h"
+#include <stdlib.h>
+#include <strings.h>
+
+/*
+ * SYSLINUX and friends: each LABEL starts an entry, made up of the lines up
+ * to the next one. Keywords don't care about case. Relative paths are from
+ * the directory the config is in. An APPEND before the first LABEL is for the
+ * labels without one of their own. Entries booting something else than a
+ * Linux kernel (COM32 modules, boot sectors, the local disk) are left out, and
+ * so are INCLUDEd files.
+ */
+
+struct entry {
+	char *title, *kernel, *args, *initrds;
+	unsigned is_kernel, has_args;
+};
+
+struct parser {
+	struct config_scan *c;
+	struct s_arena a;
+	/* With the slash at the end. */
+	char *dir;
+	char *default_args;
+};
+
+static void skip_blanks(struct s_view *v)
+{
+	while(v->len && (*v->p == ' ' || *v->p == '\t')) {
+		++v->p;
+		--v->len;
+	}
+}
+
+static char *path(struct parser *x, const char *p, size_t len)
+{
+	char *file;
+	file = s_arena_ndup(&x->a, p, len);
+	if(!file || file[0] == '/') return file;
+	return s_arena_concat(&x->a, x->dir, file, NULL);
+}
+
+/* Whether the kernel of a KERNEL line is one. The others are told apart by
+ * their extensions. */
+static unsigned is_linux(const char *kernel)
+{
+	static const char *others[] = {".c32", ".cbt", ".com", ".bin", ".bs", ".bss", ".0"};
+	const char *dot;
+	unsigned i;
+	dot = strrchr(kernel, '.');
+	if(!dot || strchr(dot, '/')) return 1;
+	for(i = 0; i < sizeof others / sizeof others[0]; ++i) {
+		if(!strcasecmp(dot, others[i])) return 0;
+	}
+	return 1;
+}
+
+/* Take the initrd= options out of the command line, into @initrds. */
+static char *take_initrds(struct parser *x, const char *args, char **initrds)
+{
+	char *out, *o;
+	const char *p;
+	out = o = s_arena_alloc(&x->a, strlen(args) + 1);
+	if(!out) return NULL;
+	for(p = args; *p; ) {
+		size_t len;
+		len = strcspn(p, " \t");
+		if(len > 7 && !strncmp(p, "initrd=", 7)) *initrds = s_arena_ndup(&x->a, p + 7, len - 7);
+		else if(len) {
+			if(o != out) *o++ = ' ';
+			memcpy(o, p, len);
+			o += len;
+		}
+		p += len;
+		p += strspn(p, " \t");
+	}
+	*o = '\0';
+	return out;
+}
+
+static void report(struct parser *x, struct entry *e)
+{
+	struct config_entry g;
+	char *args, *initrds = e->initrds, **list = NULL;
+	const char *p;
+	size_t n = 0;
+
+	if(!e->kernel || !e->is_kernel) return;
+	args = e->has_args ? e->args : x->default_args;
+	if(!args) args = "";
+	args = take_initrds(x, args, &initrds);
+	if(!args) return;
+
+	/* Several initrds are separated by commas. */
+	if(initrds) {
+		list = s_arena_alloc(&x->a, (strlen(initrds) / 2 + 1) * sizeof *list);
+		if(!list) return;
+		for(p = initrds; *p; ) {
+			size_t len;
+			len = strcspn(p, ",");
+			if(len && !(list[n++] = path(x, p, len))) return;
+			p += len;
+			p += strspn(p, ",");
+		}
+	}
+
+	g.title = e->title;
+	g.device = NULL;
+	g.kernel = e->kernel;
+	g.args = args;
+	g.initrds = list;
+	g.n_initrds = n;
+	config_add(x->c, &g);
+}
+
+/* Caret marks the hotkey in a menu label. */
+static char *label(struct parser *x, struct s_view v)
+{
+	char *title, *p, *q;
+	title = s_arena_view(&x->a, v);
+	if(!title) return NULL;
+	for(p = q = title; *p; ++p) {
+		if(*p != '^') *q++ = *p;
+	}
+	*q = '\0';
+	return title;
+}
+
+static void scan(struct config_scan *c, const char *file, const char *buf, size_t len)
+{
+	struct parser x;
+	struct s_view rest, line;
+	struct entry e;
+	unsigned in_entry = 0;
+
+	x.c = c;
+	memset(&x.a, 0, sizeof x.a);
+	x.dir = s_arena_ndup(&x.a, file, strrchr(file, '/') + 1 - file);
+	x.default_args = NULL;
+	if(!x.dir) goto out;
+
+	rest.p = buf;
+	rest.len = len;
+	while(s_view_line(&rest, &line)) {
+		struct s_view key;
+
+		skip_blanks(&line);
+		while(line.len && strchr(" \t\r", line.p[line.len - 1])) --line.len;
+		if(!line.len || line.p[0] == '#') continue;
+
+		key.p = line.p;
+		for(key.len = 0; key.len < line.len && line.p[key.len] != ' ' && line.p[key.len] != '\t'; ++key.len);
+		line.p += key.len;
+		line.len -= key.len;
+		skip_blanks(&line);
+
+		if(key.len == 5 && !strncasecmp(key.p, "label", 5)) {
+			if(in_entry) report(&x, &e);
+			in_entry = 1;
+			e.title = s_arena_view(&x.a, line);
+			e.kernel = e.args = e.initrds = NULL;
+			e.is_kernel = e.has_args = 0;
+		}
+		else if(key.len == 4 && !strncasecmp(key.p, "menu", 4)) {
+			if(in_entry && line.len > 5 && !strncasecmp(line.p, "label", 5) && (line.p[5] == ' ' || line.p[5] == '\t')) {
+				line.p += 5;
+				line.len -= 5;
+				skip_blanks(&line);
+				e.title = label(&x, line);
+			}
+		}
+		else if(key.len == 6 && !strncasecmp(key.p, "append", 6)) {
+			char *args;
+			args = line.len == 1 && line.p[0] == '-' ? "" : s_arena_view(&x.a, line);
+			if(!in_entry) x.default_args = args;
+			else {
+				e.args = args;
+				e.has_args = 1;
+			}
+		}
+		else if(!in_entry) continue;
+		else if((key.len == 5 && !strncasecmp(key.p, "linux", 5)) || (key.len == 6 && !strncasecmp(key.p, "kernel", 6))) {
+			size_t n;
+			for(n = 0; n < line.len && line.p[n] != ' ' && line.p[n] != '\t'; ++n);
+			e.kernel = path(&x, line.p, n);
+			e.is_kernel = e.kernel && (key.len == 5 || is_linux(e.kernel));
+		}
+		else if(key.len == 6 && !strncasecmp(key.p, "initrd", 6)) e.initrds = s_arena_view(&x.a, line);
+		/* Anything else that boots. */
+		else if((key.len == 4 && !strncasecmp(key.p, "boot", 4)) || (key.len == 5 && !strncasecmp(key.p, "com32", 5)) || (key.len == 9 && !strncasecmp(key.p, "localboot", 9)) || (key.len == 6 && !strncasecmp(key.p, "config", 6))) {
+			e.is_kernel = 0;
+			e.kernel = NULL;
+		}
+	}
+	if(in_entry) report(&x, &e);
+
+	out: s_arena_free(&x.a);
+}
+
+static const char *const files[] = {
+	"/boot/extlinux/extlinux.conf",
+	"/extlinux/extlinux.conf",
+	"/extlinux.conf",
+	"/boot/syslinux/syslinux.cfg",
+	"/syslinux/syslinux.cfg",
+	"/syslinux.cfg",
+	"/isolinux/isolinux.cfg",
+	"/boot/isolinux/isolinux.cfg",
+	NULL
+};
+
+const struct config_scanner syslinux_scanner = {"syslinux", files, 2, scan};
@@ -0,0 +1,3 @@
+/* The scanner for SYSLINUX, EXTLINUX and ISOLINUX configs (see config.h). */
+struct config_scanner;
+extern const struct config_scanner syslinux_scanner;
@@ -0,0 +1,197 @@
+#define _GNU_SOURCE
+#include "table.h"
+#include "enumerate.h"
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* The pages are only backed once written to, so this is a limit more than
+ * a cost. It never changes, so readers never have to map it again. */
+#define TABLE_SIZE (1 << 20)
+
+#define TABLE_MAGIC 0x626c7462
+
+struct table {
+	int fd;
+	struct bootloader_table *map;
+	/* Entries there is room for in this version, and where its next
+	 * string goes. */
+	size_t n;
+	size_t pos;
+};
+
+static int table_newfree(struct table *t, struct table **out)
+{
+	if(t) goto freeing;
+
+	t = malloc(sizeof *t);
+	if(!t) goto err0;
+	t->fd = memfd_create("bootloader-targets", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if(t->fd < 0) goto err1;
+	if(ftruncate(t->fd, TABLE_SIZE) < 0) goto err2;
+	/* Readers can count on the size. */
+	if(fcntl(t->fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0) goto err2;
+	t->map = mmap(NULL, TABLE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, t->fd, 0);
+	if(t->map == MAP_FAILED) goto err2;
+	t->map->magic = TABLE_MAGIC;
+	t->map->size = TABLE_SIZE;
+	t->map->seq = 0;
+	t->map->generation = 0;
+	t->map->n_entries = 0;
+	t->map->truncated = 0;
+
+	*out = t;
+	return 0;
+
+	freeing: munmap(t->map, TABLE_SIZE);
+	err2: close(t->fd);
+	err1: free(t);
+	err0: return -1;
+}
+
+int table_new(struct table **out)
+{
+	return table_newfree(NULL, out);
+}
+
+void table_free(struct table *t)
+{
+	table_newfree(t, NULL);
+}
+
+int table_get_fd(struct table *t)
+{
+	return t->fd;
+}
+
+/* The last byte is never written, so that a string a reader finds at any
+ * offset, torn or not, ends inside the table. */
+#define LIMIT (TABLE_SIZE - 1)
+#define MAX_ENTRIES ((LIMIT - sizeof(struct bootloader_table)) / sizeof(struct bootloader_table_entry))
+
+void table_begin(struct table *t, size_t n, unsigned long long generation)
+{
+	__atomic_store_n(&t->map->seq, t->map->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	t->map->generation = generation;
+	t->map->n_entries = 0;
+	t->map->truncated = n > MAX_ENTRIES;
+	t->n = n > MAX_ENTRIES ? MAX_ENTRIES : n;
+	t->pos = sizeof *t->map + t->n * sizeof t->map->entries[0];
+}
+
+/* Returns the offset, 0 if it didn't fit. */
+static size_t put(struct table *t, const char *s)
+{
+	size_t len, offset;
+	len = strlen(s) + 1;
+	if(len > LIMIT - t->pos) return 0;
+	offset = t->pos;
+	memcpy((char *)t->map + offset, s, len);
+	t->pos += len;
+	return offset;
+}
+
+void table_add(struct table *t, const char *cmd, const char *display_name, const char *syspath, unsigned flags)
+{
+	struct bootloader_table_entry *entry;
+	size_t pos;
+
+	if(t->map->n_entries == t->n) goto truncated;
+	pos = t->pos;
+	entry = &t->map->entries[t->map->n_entries];
+	entry->cmd = put(t, cmd);
+	entry->display_name = put(t, display_name);
+	entry->syspath = syspath ? put(t, syspath) : 0;
+	if(!entry->cmd || !entry->display_name || (syspath && !entry->syspath)) {
+		t->pos = pos;
+		goto truncated;
+	}
+	entry->flags = flags;
+	++t->map->n_entries;
+	return;
+
+	truncated: t->map->truncated = 1;
+}
+
+void table_end(struct table *t)
+{
+	__atomic_store_n(&t->map->seq, t->map->seq + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Readers
+ */
+
+const struct bootloader_table *bootloader_table_map(int fd)
+{
+	struct bootloader_table *t;
+	struct stat st;
+	if(fstat(fd, &st) < 0 || st.st_size != TABLE_SIZE) return NULL;
+	t = mmap(NULL, TABLE_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+	if(t == MAP_FAILED) return NULL;
+	if(t->magic != TABLE_MAGIC || t->size != TABLE_SIZE) {
+		munmap(t, TABLE_SIZE);
+		return NULL;
+	}
+	return t;
+}
+
+void bootloader_table_unmap(const struct bootloader_table *t)
+{
+	munmap((void *)t, t->size);
+}
+
+/* A write takes microseconds, unless the writer is preempted, so spin a
+ * little, then sleep a little. One that takes longer than this has probably
+ * died halfway. */
+#define SPINS 1000
+#define BUSY_MS 50
+
+static unsigned long long now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+int bootloader_table_read_begin(const struct bootloader_table *t, uint64_t *seq_out)
+{
+	struct timespec pause = { 0, 100000 };
+	unsigned long long start = 0;
+	unsigned i;
+	for(i = 0; ; ++i) {
+		*seq_out = __atomic_load_n(&t->seq, __ATOMIC_ACQUIRE);
+		if(!(*seq_out & 1)) return 0;
+		if(i < SPINS) continue;
+		if(!start) start = now_ms();
+		else if(now_ms() - start > BUSY_MS) return -1;
+		/* Let the writer run, if it's waiting for the CPU we have.
+		 * sched_yield() doesn't always. */
+		nanosleep(&pause, NULL);
+	}
+}
+
+int bootloader_table_read_retry(const struct bootloader_table *t, uint64_t seq)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	/* Also after bootloader_table_read_begin() gave up. */
+	return (seq & 1) || __atomic_load_n(&t->seq, __ATOMIC_RELAXED) != seq;
+}
+
+size_t bootloader_table_count(const struct bootloader_table *t)
+{
+	size_t n;
+	n = t->n_entries;
+	return n > MAX_ENTRIES ? MAX_ENTRIES : n;
+}
+
+const char *bootloader_table_string(const struct bootloader_table *t, uint32_t offset)
+{
+	if(!offset) return NULL;
+	return offset < TABLE_SIZE ? (const char *)t + offset : "";
+}
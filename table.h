@@ -0,0 +1,22 @@
+/* The writer side of the shared target table (struct bootloader_table in
+ * enumerate.h): a memfd that readers map and read under a seqlock, without
+ * syscalls or copies. The whole table is rewritten for every change, which
+ * costs little next to what the change took to find.
+ *
+ * Only one thread may write at a time. */
+#include <stddef.h>
+
+struct table;
+
+int table_new(struct table **out);
+void table_free(struct table *t);
+
+int table_get_fd(struct table *t);
+
+/* Rewrite the table with @n entries, then call table_add() for each and
+ * table_end(). Readers retry until table_end(). */
+void table_begin(struct table *t, size_t n, unsigned long long generation);
+/* @syspath may be NULL. What doesn't fit is left out, and the table is marked
+ * truncated. */
+void table_add(struct table *t, const char *cmd, const char *display_name, const char *syspath, unsigned flags);
+void table_end(struct table *t);
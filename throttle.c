@@ -0,0 +1,205 @@
+#define _GNU_SOURCE
+#include "throttle.h"
+#include "enumerate.h"
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+
+/* From linux/ioprio.h, which not every libc has. */
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_WHO_PROCESS 1
+
+/* A token bucket holding up to a second's worth. It may go into debt, so
+ * that a read bigger than that still goes through, and whoever comes next
+ * pays for it. */
+struct bucket {
+	double rate, tokens;
+	unsigned long long last_ns;
+};
+
+struct throttle {
+	pthread_mutex_t lock;
+	/* Wakes up the waits when lifted. */
+	pthread_cond_t cond;
+
+	struct bootloader_scan_policy policy;
+	struct bucket bytes, mounts;
+	unsigned lifted;
+	/* Changes with lifted, so threads know to apply their priorities
+	 * again. */
+	unsigned epoch;
+};
+
+/* What the calling thread works for, and what it has applied of it. Its
+ * priorities from before it did, to go back to when lifted. */
+static __thread struct throttle *current;
+static __thread unsigned current_epoch;
+static __thread int saved_nice, saved_ioprio;
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void bucket_init(struct bucket *b, double rate)
+{
+	b->rate = rate;
+	b->tokens = rate;
+	b->last_ns = now_ns();
+}
+
+static void refill(struct bucket *b)
+{
+	unsigned long long now;
+	now = now_ns();
+	b->tokens += (now - b->last_ns) * b->rate / 1e9;
+	if(b->tokens > b->rate) b->tokens = b->rate;
+	b->last_ns = now;
+}
+
+static int throttle_newfree(struct throttle *t, struct throttle **out, const struct bootloader_scan_policy *policy)
+{
+	pthread_condattr_t attr;
+	int err;
+
+	if(t) goto freeing;
+
+	t = malloc(sizeof *t);
+	if(!t) goto err0;
+	t->policy = *policy;
+	bucket_init(&t->bytes, policy->bytes_per_sec);
+	bucket_init(&t->mounts, policy->mounts_per_sec);
+	t->lifted = 0;
+	t->epoch = 0;
+
+	if(pthread_mutex_init(&t->lock, NULL) != 0) goto err1;
+	/* Waits end on the monotonic clock. */
+	if(pthread_condattr_init(&attr) != 0) goto err2;
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	err = pthread_cond_init(&t->cond, &attr);
+	pthread_condattr_destroy(&attr);
+	if(err != 0) goto err2;
+
+	*out = t;
+	return 0;
+
+	freeing: pthread_cond_destroy(&t->cond);
+	err2: pthread_mutex_destroy(&t->lock);
+	err1: free(t);
+	err0: return -1;
+}
+
+int throttle_new(struct throttle **out, const struct bootloader_scan_policy *policy)
+{
+	return throttle_newfree(NULL, out, policy);
+}
+
+void throttle_free(struct throttle *t)
+{
+	throttle_newfree(t, NULL, NULL);
+}
+
+/* Both are per thread on Linux, the calling one with 0. setpriority() needs
+ * the thread id. Going back up from a nice level takes CAP_SYS_NICE, or a
+ * high enough RLIMIT_NICE; without either, a lifted thread stays nice. */
+static void apply(struct throttle *t, unsigned lifted)
+{
+	pid_t tid;
+	tid = syscall(SYS_gettid);
+	if(lifted) {
+		syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, saved_ioprio);
+		setpriority(PRIO_PROCESS, tid, saved_nice);
+		return;
+	}
+	if(t->policy.idle_io) syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT);
+	if(t->policy.nice > saved_nice) setpriority(PRIO_PROCESS, tid, t->policy.nice);
+}
+
+void throttle_thread(struct throttle *t)
+{
+	unsigned epoch, lifted;
+
+	if(current != t) {
+		pid_t tid;
+		tid = syscall(SYS_gettid);
+		if(!current) {
+			saved_ioprio = syscall(SYS_ioprio_get, IOPRIO_WHO_PROCESS, 0);
+			if(saved_ioprio < 0) saved_ioprio = 0;
+			saved_nice = getpriority(PRIO_PROCESS, tid);
+		}
+		current = t;
+		current_epoch = ~0U;
+		if(t->policy.thread_hook) t->policy.thread_hook(t->policy.hook_user);
+	}
+
+	epoch = __atomic_load_n(&t->epoch, __ATOMIC_ACQUIRE);
+	if(epoch == current_epoch) return;
+	pthread_mutex_lock(&t->lock);
+	epoch = t->epoch;
+	lifted = t->lifted;
+	pthread_mutex_unlock(&t->lock);
+	apply(t, lifted);
+	current_epoch = epoch;
+}
+
+void throttle_lift(struct throttle *t, unsigned lift)
+{
+	pthread_mutex_lock(&t->lock);
+	lift = lift != 0;
+	if(t->lifted != lift) {
+		t->lifted = lift;
+		__atomic_store_n(&t->epoch, t->epoch + 1, __ATOMIC_RELEASE);
+		/* What was read meanwhile isn't held against what comes
+		 * after. */
+		if(!lift) {
+			bucket_init(&t->bytes, t->policy.bytes_per_sec);
+			bucket_init(&t->mounts, t->policy.mounts_per_sec);
+		}
+		pthread_cond_broadcast(&t->cond);
+	}
+	pthread_mutex_unlock(&t->lock);
+}
+
+static void take(struct bucket *b, double n)
+{
+	struct throttle *t;
+	t = current;
+	if(!b->rate) return;
+
+	pthread_mutex_lock(&t->lock);
+	if(t->lifted) goto out;
+	refill(b);
+	b->tokens -= n;
+	while(!t->lifted && b->tokens < 0) {
+		struct timespec ts;
+		unsigned long long until;
+		until = now_ns() + (unsigned long long)(-b->tokens / b->rate * 1e9) + 1;
+		ts.tv_sec = until / 1000000000ULL;
+		ts.tv_nsec = until % 1000000000ULL;
+		pthread_cond_timedwait(&t->cond, &t->lock, &ts);
+		refill(b);
+	}
+	out: pthread_mutex_unlock(&t->lock);
+}
+
+/* A scan may take a while, so its priorities keep up with throttle_lift()
+ * here rather than only when it starts. */
+void throttle_read(size_t bytes)
+{
+	if(!current) return;
+	throttle_thread(current);
+	take(&current->bytes, bytes);
+}
+
+void throttle_mount(void)
+{
+	if(!current) return;
+	throttle_thread(current);
+	take(&current->mounts, 1);
+}
@@ -0,0 +1,30 @@
+/* Keeps the background work of an enumeration out of the way of the rest of
+ * the system. The threads working for it (see throttle_thread()) run at the
+ * I/O priority and nice level of its policy, and what they read from devices
+ * and mount comes out of a budget: once it's spent, they wait until it
+ * refills.
+ *
+ * The readers and smount don't know who they work for. They call
+ * throttle_read() and throttle_mount(), which only do something in a thread
+ * working for a throttle, so that loading a target to boot isn't held back. */
+#include <stddef.h>
+
+struct throttle;
+struct bootloader_scan_policy;
+
+int throttle_new(struct throttle **out, const struct bootloader_scan_policy *policy);
+/* The threads working for it must be done with it. */
+void throttle_free(struct throttle *t);
+
+/* Make the calling thread work for @t. Cheap if it already does, so call it
+ * whenever there's work to do, and the priorities keep up with
+ * throttle_lift(). */
+void throttle_thread(struct throttle *t);
+
+/* Lift the limits and priorities, or put them back. Waits in progress end. */
+void throttle_lift(struct throttle *t, unsigned lift);
+
+/* Count @bytes read from a device, or a mount, against the budget of the
+ * calling thread's throttle, and wait if it's spent. */
+void throttle_read(size_t bytes);
+void throttle_mount(void);